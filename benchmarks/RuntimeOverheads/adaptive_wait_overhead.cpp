@@ -0,0 +1,138 @@
+// RUN: %hc %s -I%S/../../lib/hsa -lpthread -o %t.out && %t.out
+
+// Measures the host side of waiting for an op to complete with each wait
+// strategy of Kalmar::waitSignal (lib/hsa/adaptive_wait.h): blocking (the
+// kernel default before), spinning (the copy default before) and spinning for
+// a learned time before blocking (hcWaitModeAdaptive).  A mock signal, fired
+// by another thread a fixed time after the wait starts, stands in for the
+// completion signal of an op, so no HSA runtime is needed.  Reports the
+// wakeup latency (signal fired to waiter running again) and the CPU time the
+// waiter burns per wait, for short and long ops.  Also checks timed waits.
+
+#include "adaptive_wait.h"
+
+#include <time.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#define WAITS (200)
+
+typedef std::chrono::steady_clock Clock;
+
+// Completion signal with a blocking wait, like an HSA signal backed by an
+// interrupt event.
+struct MockSignal {
+  std::atomic<int> value;
+  std::atomic<int64_t> firedAt;  // ns since the clock epoch
+  std::mutex mutex;
+  std::condition_variable cv;
+
+  MockSignal() : value(1), firedAt(0) {}
+
+  void fire() {
+    firedAt = Clock::now().time_since_epoch().count();
+    {
+      std::lock_guard<std::mutex> lk(mutex);
+      value.store(0, std::memory_order_release);
+    }
+    cv.notify_all();
+  }
+
+  bool done() { return value.load(std::memory_order_acquire) < 1; }
+
+  bool wait(bool active, uint64_t timeoutNs) {
+    const Clock::time_point deadline = (timeoutNs == Kalmar::WAIT_FOREVER)
+                                           ? Clock::time_point::max()
+                                           : Clock::now() + std::chrono::nanoseconds(timeoutNs);
+    if (active) {
+      while (!done()) {
+        if (Clock::now() >= deadline) return false;
+        Kalmar::cpuRelax();
+      }
+      return true;
+    }
+    std::unique_lock<std::mutex> lk(mutex);
+    if (timeoutNs == Kalmar::WAIT_FOREVER) {
+      cv.wait(lk, [this] { return done(); });
+      return true;
+    }
+    return cv.wait_until(lk, deadline, [this] { return done(); });
+  }
+};
+
+static double threadCpuNs() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// fires the signal latency after the wait starts, spinning for precise timing
+void completeAfter(MockSignal* signal, Clock::time_point start, std::chrono::microseconds latency) {
+  while (Clock::now() < start + latency) {}
+  signal->fire();
+}
+
+void run(const char* name, Kalmar::WaitStrategy strategy, std::chrono::microseconds latency) {
+  Kalmar::AdaptiveSpin spin;
+  double wakeupNs = 0;
+  double cpuNs = 0;
+  for (int i = 0; i < WAITS; ++i) {
+    MockSignal signal;
+    Clock::time_point start = Clock::now();
+    std::thread device(completeAfter, &signal, start, latency);
+
+    double cpuBegin = threadCpuNs();
+    Kalmar::waitSignal(signal, strategy, &spin);
+    int64_t awake = Clock::now().time_since_epoch().count();
+    cpuNs += threadCpuNs() - cpuBegin;
+    wakeupNs += awake - signal.firedAt.load();
+
+    device.join();
+  }
+  std::cout << "  " << name << ": wakeup latency " << (wakeupNs / WAITS / 1000) << "us, waiter CPU "
+            << (cpuNs / WAITS / 1000) << "us per wait\n";
+}
+
+int main() {
+  bool ret = true;
+
+  const std::chrono::microseconds latencies[] = {
+    std::chrono::microseconds(20), std::chrono::microseconds(2000)
+  };
+  for (auto latency : latencies) {
+    std::cout << "ops taking " << latency.count() << "us:\n";
+    run("blocked ", Kalmar::WaitStrategy::Block, latency);
+    run("active  ", Kalmar::WaitStrategy::Spin, latency);
+    run("adaptive", Kalmar::WaitStrategy::SpinThenBlock, latency);
+  }
+
+  // short ops are spun for, long ops get the minimum spin
+  Kalmar::AdaptiveSpin spin(200 * 1000, 2 * 1000);
+  for (int i = 0; i < 32; ++i) spin.record(10 * 1000);
+  ret &= (spin.spinNs() >= 10 * 1000 && spin.spinNs() <= 200 * 1000);
+  for (int i = 0; i < 32; ++i) spin.record(5 * 1000 * 1000);
+  ret &= (spin.spinNs() == 2 * 1000);
+
+  // timed waits time out, and see a signal fired before the timeout
+  const Kalmar::WaitStrategy strategies[] = {
+    Kalmar::WaitStrategy::Block, Kalmar::WaitStrategy::Spin, Kalmar::WaitStrategy::SpinThenBlock
+  };
+  for (auto strategy : strategies) {
+    MockSignal never;
+    Clock::time_point start = Clock::now();
+    ret &= !Kalmar::waitSignal(never, strategy, &spin, 1000 * 1000);
+    ret &= (Clock::now() - start >= std::chrono::milliseconds(1));
+
+    MockSignal soon;
+    std::thread device(completeAfter, &soon, Clock::now(), std::chrono::microseconds(500));
+    ret &= Kalmar::waitSignal(soon, strategy, &spin, 1000 * 1000 * 1000);
+    device.join();
+  }
+
+  return !(ret == true);
+}
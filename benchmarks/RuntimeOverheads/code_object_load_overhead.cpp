@@ -0,0 +1,124 @@
+// RUN: %hc %s -I%S/../../lib/hsa -I%S/../../hc2/external/elfio -o %t.out && %t.out
+
+// Measures the host work done per embedded code object when a device loads the
+// program at startup: deciding whether the code object matches the agent,
+// keying the executable and handing the bytes to the ELF reader.  Compares a
+// replica of the previous path (copies of the blob, a full ELF parse to get
+// e_flags and a byte-wise FNV-1a hash, computed twice) with the in-place
+// helpers of lib/hsa/code_object.h, over synthetic bundles of code objects.
+
+#include "code_object.h"
+#include "elfio.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define CODE_OBJECTS (16)
+#define REPEAT (4)
+
+// a little endian ELF64 header for gfx900 followed by `size' bytes of payload
+std::vector<char> make_code_object(size_t size, unsigned seed) {
+  std::vector<char> image(64 + size);
+  unsigned char* p = reinterpret_cast<unsigned char*>(image.data());
+  const unsigned char ident[] = { 0x7f, 'E', 'L', 'F', 2, 1, 1 };
+  memcpy(p, ident, sizeof(ident));
+  uint16_t type = 3, machine = 224;
+  uint32_t version = 1, flags = 0x2c;
+  uint16_t ehsize = 64;
+  memcpy(p + 16, &type, sizeof(type));
+  memcpy(p + 18, &machine, sizeof(machine));
+  memcpy(p + 20, &version, sizeof(version));
+  memcpy(p + 48, &flags, sizeof(flags));
+  memcpy(p + 52, &ehsize, sizeof(ehsize));
+  for (size_t i = 64; i < image.size(); ++i) {
+    seed = seed * 1103515245 + 12345;
+    image[i] = char(seed >> 16);
+  }
+  return image;
+}
+
+uint64_t legacy_checksum(size_t size, const void* source) {
+  const uint64_t FNV_prime = 0x100000001b3;
+  uint64_t hash = 0xcbf29ce484222325;
+  const char* str = static_cast<const char*>(source);
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= *str++;
+    hash *= FNV_prime;
+  }
+  return hash;
+}
+
+// IsCompatibleKernel, BuildProgram and BuildOfflineFinalizedProgramImpl before
+uint64_t legacy_load(const std::vector<char>& co) {
+  size_t size = co.size();
+  char* copy = (char*)malloc(size + 1);
+  memcpy(copy, co.data(), size);
+  copy[size] = '\0';
+  ELFIO::elfio reader;
+  std::istringstream stream{std::string{copy, copy + size}};
+  reader.load(stream);
+  uint64_t result = reader.get_flags();
+  free(copy);
+
+  result ^= legacy_checksum(size, co.data());
+  copy = (char*)malloc(size + 1);
+  memcpy(copy, co.data(), size);
+  copy[size] = '\0';
+  result ^= legacy_checksum(size, copy);
+  ELFIO::elfio builder;
+  std::istringstream build_stream{std::string{copy, copy + size}};
+  builder.load(build_stream);
+  free(copy);
+  return result;
+}
+
+uint64_t load(const std::vector<char>& co) {
+  uint32_t flags = 0;
+  Kalmar::code_object_elf_flags(co.data(), co.size(), &flags);
+  uint64_t result = flags ^ Kalmar::code_object_checksum(co.data(), co.size());
+  ELFIO::elfio builder;
+  Kalmar::MemoryStreamBuf buf{co.data(), co.size()};
+  std::istream build_stream{&buf};
+  builder.load(build_stream);
+  return result;
+}
+
+template <typename Load>
+double run(const std::vector<std::vector<char>>& bundle, Load load) {
+  volatile uint64_t sink = 0;
+  auto begin = std::chrono::steady_clock::now();
+  for (int r = 0; r < REPEAT; ++r) {
+    for (auto& co : bundle) {
+      sink = sink + load(co);
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - begin).count() / REPEAT;
+}
+
+int main() {
+  for (size_t size = 64 * 1024; size <= 16 * 1024 * 1024; size *= 4) {
+    std::vector<std::vector<char>> bundle;
+    for (int i = 0; i < CODE_OBJECTS; ++i) {
+      bundle.push_back(make_code_object(size, i));
+    }
+    double legacyMs = run(bundle, legacy_load);
+    double newMs = run(bundle, load);
+    std::cout << CODE_OBJECTS << " code objects of " << (size / 1024) << "KB: load time: legacy "
+              << legacyMs << "ms, in place " << newMs << "ms\n";
+  }
+
+  // the checksum must still tell code objects apart
+  std::vector<char> a = make_code_object(4096, 1);
+  std::vector<char> b = a;
+  b[b.size() - 1] ^= 1;
+  bool ret = Kalmar::code_object_checksum(a.data(), a.size()) !=
+             Kalmar::code_object_checksum(b.data(), b.size());
+
+  return !(ret == true);
+}
@@ -0,0 +1,99 @@
+// RUN: %hc %s -lhc_am -o %t.out && %t.out
+
+#include <hc.hpp>
+#include <hc_am.hpp>
+
+#include <iostream>
+
+#include <time.h>
+
+#define ITERATIONS (64)
+
+// A sequence of small kernels with a few captured pointers and scalars, as
+// issued by one step of an iterative solver.
+void enqueueStep(hc::accelerator_view& av, int* a, int* b, int nodes) {
+  for (int k = 0; k < nodes; ++k) {
+    hc::parallel_for_each(
+      av,
+      hc::extent<1>(64),
+      [=](hc::index<1> idx) [[hc]] {
+        if (idx[0] == 0) a[k] += b[k] + k;
+    });
+  }
+}
+
+long elapsed(const struct timespec& begin, const struct timespec& end) {
+  return ((end.tv_sec - begin.tv_sec) * 1000 * 1000) + ((end.tv_nsec - begin.tv_nsec) / 1000);
+}
+
+// A test which measures host time spent enqueuing the same sequence of
+// kernels, submitted one by one or by replaying a command_graph captured once,
+// patching one pointer argument of every kernel before each replay.
+bool test(hc::accelerator_view& av, int* a, int* b, int* c, int nodes) {
+  bool ret = true;
+
+  struct timespec begin;
+  struct timespec end;
+
+  long submit_time = 0;
+  for (int i = 0; i < ITERATIONS; ++i) {
+    clock_gettime(CLOCK_REALTIME, &begin);
+    enqueueStep(av, a, (i % 2) ? c : b, nodes);
+    clock_gettime(CLOCK_REALTIME, &end);
+    submit_time += elapsed(begin, end);
+    av.wait();
+  }
+
+  av.begin_capture();
+  enqueueStep(av, a, b, nodes);
+  hc::command_graph graph = av.end_capture();
+  ret &= (graph.size() == (size_t)nodes);
+
+  long replay_time = 0;
+  int* current = b;
+  for (int i = 0; i < ITERATIONS; ++i) {
+    clock_gettime(CLOCK_REALTIME, &begin);
+    int* next = (i % 2) ? c : b;
+    if (next != current) {
+      for (int k = 0; k < nodes; ++k) {
+        ret &= (graph.replace_kernel_arg(k, current, next) == 1);
+      }
+      current = next;
+    }
+    av.replay(graph);
+    clock_gettime(CLOCK_REALTIME, &end);
+    replay_time += elapsed(begin, end);
+    av.wait();
+  }
+
+  std::cout << nodes << " kernels: average enqueue time per kernel: submit "
+            << ((double)submit_time / (ITERATIONS * nodes)) << "us, replay "
+            << ((double)replay_time / (ITERATIONS * nodes)) << "us\n";
+
+  return ret;
+}
+
+int main() {
+  bool ret = true;
+
+  hc::accelerator acc;
+  hc::accelerator_view av = acc.get_default_view();
+
+  int* a = (int*) hc::am_alloc(sizeof(int) * 512, acc, 0);
+  int* b = (int*) hc::am_alloc(sizeof(int) * 512, acc, 0);
+  int* c = (int*) hc::am_alloc(sizeof(int) * 512, acc, 0);
+
+  // launch the kernels once to initialize everything
+  enqueueStep(av, a, b, 1);
+  av.wait();
+
+  for (int nodes = 8; nodes <= 512; nodes *= 4) {
+    ret &= test(av, a, b, c, nodes);
+  }
+
+  hc::am_free(a);
+  hc::am_free(b);
+  hc::am_free(c);
+
+  return !(ret == true);
+}
@@ -0,0 +1,80 @@
+// RUN: %hc %s -lhc_am -o %t.out && %t.out
+
+#include <hc.hpp>
+#include <hc_am.hpp>
+
+#include <iostream>
+
+#include <time.h>
+
+#define DISPATCH_COUNT (1000)
+
+// 64 scalars to capture, in 8 groups of 8
+#define DECLARE8(p) int p##0 = 1, p##1 = 1, p##2 = 1, p##3 = 1, p##4 = 1, p##5 = 1, p##6 = 1, p##7 = 1
+#define SUM8(p) (p##0 + p##1 + p##2 + p##3 + p##4 + p##5 + p##6 + p##7)
+
+long elapsed(const struct timespec& begin, const struct timespec& end) {
+  return ((end.tv_sec - begin.tv_sec) * 1000 * 1000) + ((end.tv_nsec - begin.tv_nsec) / 1000);
+}
+
+// A test which measures host time spent enqueuing a kernel whose functor
+// captures `captures' scalars besides the output pointer, and checks the
+// kernel sees all of them.
+template <typename Launch>
+bool run(hc::accelerator_view& av, int* out, int captures, Launch launch) {
+  bool ret = true;
+
+  long time_spent = 0;
+  struct timespec begin;
+  struct timespec end;
+  for (int i = 0; i < DISPATCH_COUNT; ++i) {
+    clock_gettime(CLOCK_REALTIME, &begin);
+    hc::completion_future fut = launch();
+    clock_gettime(CLOCK_REALTIME, &end);
+    time_spent += elapsed(begin, end);
+    fut.wait();
+  }
+
+  int result = 0;
+  av.copy(out, &result, sizeof(int));
+  ret &= (result == captures);
+
+  std::cout << captures << " captured scalars: average time per kernel: "
+            << ((double)time_spent / DISPATCH_COUNT) << "us\n";
+
+  return ret;
+}
+
+int main() {
+  bool ret = true;
+
+  hc::accelerator acc;
+  hc::accelerator_view av = acc.get_default_view();
+  int* out = (int*) hc::am_alloc(sizeof(int), acc, 0);
+
+  DECLARE8(a0); DECLARE8(a1); DECLARE8(a2); DECLARE8(a3);
+  DECLARE8(a4); DECLARE8(a5); DECLARE8(a6); DECLARE8(a7);
+
+  hc::extent<1> e(64);
+
+#define LAUNCH(SUM) [&]() {                                        \
+    return hc::parallel_for_each(av, e, [=](hc::index<1> idx) [[hc]] { \
+      if (idx[0] == 0) *out = SUM;                                 \
+    });                                                            \
+  }
+
+  ret &= run(av, out, 1, LAUNCH(a00));
+  ret &= run(av, out, 2, LAUNCH(a00 + a01));
+  ret &= run(av, out, 4, LAUNCH(a00 + a01 + a02 + a03));
+  ret &= run(av, out, 8, LAUNCH(SUM8(a0)));
+  ret &= run(av, out, 16, LAUNCH(SUM8(a0) + SUM8(a1)));
+  ret &= run(av, out, 32, LAUNCH(SUM8(a0) + SUM8(a1) + SUM8(a2) + SUM8(a3)));
+  ret &= run(av, out, 64, LAUNCH(SUM8(a0) + SUM8(a1) + SUM8(a2) + SUM8(a3) +
+                                 SUM8(a4) + SUM8(a5) + SUM8(a6) + SUM8(a7)));
+
+#undef LAUNCH
+
+  hc::am_free(out);
+
+  return !(ret == true);
+}
@@ -0,0 +1,76 @@
+// RUN: %hc %s -o %t.out && %t.out
+
+#include <hc.hpp>
+
+#include <iostream>
+
+#include <time.h>
+
+#define DISPATCH_COUNT (2048)
+
+// A test which measures host time spent enqueuing empty kernels, submitted
+// one by one or in dispatch batches of increasing size
+bool test(hc::accelerator_view& av, int batchSize) {
+  bool ret = true;
+
+  long time_spent = 0;
+  struct timespec begin;
+  struct timespec end;
+  hc::completion_future fut;
+  for (int i = 0; i < DISPATCH_COUNT; i += batchSize) {
+    clock_gettime(CLOCK_REALTIME, &begin);
+    if (batchSize > 1) {
+      hc::dispatch_batch batch(av);
+      for (int j = 0; j < batchSize; ++j) {
+        fut = hc::parallel_for_each(
+          av,
+          hc::extent<1>(64),
+          [=](hc::index<1> idx) [[hc]] {
+        });
+      }
+    } else {
+      fut = hc::parallel_for_each(
+        av,
+        hc::extent<1>(64),
+        [=](hc::index<1> idx) [[hc]] {
+      });
+    }
+    clock_gettime(CLOCK_REALTIME, &end);
+    time_spent += ((end.tv_sec - begin.tv_sec) * 1000 * 1000) + ((end.tv_nsec - begin.tv_nsec) / 1000);
+
+    // keep the queue from filling up
+    if ((i / batchSize) % 4 == 3) {
+      av.wait();
+    }
+  }
+  av.wait();
+  ret &= (fut.is_ready() == true);
+
+  std::cout << "batch size " << batchSize << ": average enqueue time per kernel: "
+            << ((double)time_spent / DISPATCH_COUNT) << "us\n";
+
+  return ret;
+}
+
+void init(hc::accelerator_view& av) {
+    // launch an empty kernel to initialize everything
+    hc::completion_future fut = hc::parallel_for_each(
+      av,
+      hc::extent<1>(64),
+      [=](hc::index<1> idx) [[hc]] {
+    });
+    fut.wait();
+}
+
+int main() {
+  bool ret = true;
+
+  hc::accelerator_view av = hc::accelerator().get_default_view();
+
+  init(av);
+  for (int batchSize = 1; batchSize <= 256; batchSize *= 2) {
+    ret &= test(av, batchSize);
+  }
+
+  return !(ret == true);
+}
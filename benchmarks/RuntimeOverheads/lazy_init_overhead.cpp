@@ -0,0 +1,120 @@
+// RUN: %hc %s -I%S/../../lib/hsa -lpthread -o %t.out && %t.out
+
+// Measures startup time and resident bytes of the per-device resources of the
+// runtime (kernarg pool and copy engine staging buffers) when every device
+// creates them at startup, as HSADevice did before, against creating them on
+// first use with Kalmar::LazyInit (lib/hsa/lazy_init.h) in a process which
+// only uses one device.  Also measures the steady-state cost of reaching a
+// resource through LazyInit and checks racing first users create it once.
+// Host memory stands in for pinned memory, so no HSA runtime is needed.
+
+#include "lazy_init.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#define DEVICES (8)
+#define KERNARG_POOL_BYTES (1024 * 512)
+#define STAGING_BYTES (4 * 1024 * 1024)
+#define ITERATIONS (10000000)
+#define THREADS (8)
+
+std::atomic<size_t> resident_bytes(0);
+std::atomic<int> created(0);
+
+struct Buffer {
+  size_t size;
+  char* p;
+  explicit Buffer(size_t sz) : size(sz), p(static_cast<char*>(malloc(sz))) {
+    memset(p, 1, size);  // pinning makes every page resident
+    resident_bytes += size;
+    ++created;
+  }
+  ~Buffer() {
+    free(p);
+    resident_bytes -= size;
+  }
+};
+
+// a copy engine owns two staging buffers
+struct Engine {
+  Buffer staging[2];
+  Engine() : staging{Buffer(STAGING_BYTES), Buffer(STAGING_BYTES)} {}
+};
+
+struct EagerDevice {
+  Buffer kernargPool{KERNARG_POOL_BYTES};
+  Engine engine[2];
+  Engine* getCopyEngine(int direction) { return &engine[direction]; }
+};
+
+// the kernarg pool is only created by the first kernel launch, which the
+// process never does
+struct LazyDevice {
+  Kalmar::LazyInit<Engine> engine[2];
+  Engine* getCopyEngine(int direction) {
+    return engine[direction].get([] { return new Engine; });
+  }
+};
+
+template <typename Device>
+bool startup(const char* name) {
+  auto begin = std::chrono::steady_clock::now();
+  std::vector<Device*> devices;
+  for (int i = 0; i < DEVICES; ++i) devices.push_back(new Device);
+  auto end = std::chrono::steady_clock::now();
+
+  // the process copies to and from its default device only
+  bool ret = (devices[0]->getCopyEngine(0)->staging[0].p[0] == 1);
+  ret &= (devices[0]->getCopyEngine(1)->staging[0].p[0] == 1);
+
+  std::cout << name << ": " << DEVICES << " devices started in "
+            << std::chrono::duration<double, std::milli>(end - begin).count() << "ms, "
+            << (resident_bytes.load() >> 20) << "MB resident\n";
+
+  for (auto d : devices) delete d;
+  return ret;
+}
+
+int main() {
+  bool ret = true;
+
+  ret &= startup<EagerDevice>("eager");
+  ret &= startup<LazyDevice>("lazy");
+  ret &= (resident_bytes.load() == 0);
+
+  // steady state: the resource exists, get() is one load
+  LazyDevice device;
+  Engine* first = device.getCopyEngine(0);
+  auto begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < ITERATIONS; ++i) {
+    ret &= (device.getCopyEngine(0) == first);
+  }
+  auto end = std::chrono::steady_clock::now();
+  std::cout << "steady-state getCopyEngine: "
+            << std::chrono::duration<double, std::nano>(end - begin).count() / ITERATIONS << "ns\n";
+
+  // racing first users create the engine once
+  created = 0;
+  LazyDevice raced;
+  std::atomic<bool> go(false);
+  std::vector<Engine*> seen(THREADS);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < THREADS; ++t) {
+    threads.emplace_back([&, t] {
+      while (!go.load()) {}
+      seen[t] = raced.getCopyEngine(1);
+    });
+  }
+  go = true;
+  for (auto& t : threads) t.join();
+  for (auto e : seen) ret &= (e == seen[0]);
+  ret &= (created.load() == 2);  // one engine, two staging buffers
+
+  return !(ret == true);
+}
@@ -0,0 +1,115 @@
+// RUN: %hc %s -lhc_am -lpthread -o %t.out && %t.out
+
+// Measures am_memtracker_getinfo from several threads with 100K tracked
+// allocations, against a replica of the previous tracker (one std::map behind
+// a std::mutex).  Each thread either looks up the same source and destination
+// buffers over and over, as copies do, or random buffers.
+
+#include <hc.hpp>
+#include <hc_am.hpp>
+
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#define ALLOCATIONS (100 * 1000)
+#define ALLOCATION_SIZE (4096)
+#define LOOKUPS (200 * 1000)
+
+// Replica of the tracker used before the reader-writer lock and per-thread cache.
+class LegacyTracker {
+  struct Range {
+    const char* base;
+    const char* end;
+  };
+  struct RangeCompare {
+    bool operator()(const Range& lhs, const Range& rhs) const { return lhs.end < rhs.base; }
+  };
+  std::map<Range, hc::AmPointerInfo, RangeCompare> tracker;
+  std::mutex mutex;
+
+public:
+  void insert(const char* p, const hc::AmPointerInfo& info) {
+    std::lock_guard<std::mutex> l(mutex);
+    tracker.insert(std::make_pair(Range{p, p + info._sizeBytes - 1}, info));
+  }
+  bool find(const char* p, hc::AmPointerInfo* info) {
+    std::lock_guard<std::mutex> l(mutex);
+    auto iter = tracker.find(Range{p, p});
+    if (iter == tracker.end()) return false;
+    *info = iter->second;
+    return true;
+  }
+};
+
+// nanoseconds per lookup with `threads' threads looking up pointers into `base'
+template <typename Find>
+double run(int threads, bool random, const char* base, Find find) {
+  std::vector<std::thread> workers;
+  auto begin = std::chrono::steady_clock::now();
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([=] {
+      std::mt19937 gen(t);
+      std::uniform_int_distribution<int> dist(0, ALLOCATIONS - 1);
+      const char* src = base + size_t(dist(gen)) * ALLOCATION_SIZE;
+      const char* dst = base + size_t(dist(gen)) * ALLOCATION_SIZE;
+      hc::AmPointerInfo info;
+      for (int i = 0; i < LOOKUPS; ++i) {
+        const char* p;
+        if (random) {
+          p = base + size_t(dist(gen)) * ALLOCATION_SIZE + (i % ALLOCATION_SIZE);
+        } else {
+          p = (i % 2 ? src : dst) + (i % ALLOCATION_SIZE);
+        }
+        if (!find(p, &info)) {
+          std::cerr << "lookup failed\n";
+          exit(1);
+        }
+      }
+    });
+  }
+  for (auto& w : workers) {
+    w.join();
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - begin).count() / LOOKUPS;
+}
+
+int main() {
+  hc::accelerator acc;
+
+  // the trackers never touch the memory, so the allocations are made up
+  const char* base = reinterpret_cast<const char*>(0x100000000000ull);
+
+  LegacyTracker legacy;
+  for (int i = 0; i < ALLOCATIONS; ++i) {
+    char* p = const_cast<char*>(base) + size_t(i) * ALLOCATION_SIZE;
+    hc::AmPointerInfo info(p, p, p, ALLOCATION_SIZE, acc, false, false);
+    hc::am_memtracker_add(p, info);
+    legacy.insert(p, info);
+  }
+
+  for (int random = 0; random <= 1; ++random) {
+    for (int threads = 1; threads <= 8; threads *= 2) {
+      double legacyNs = run(threads, random, base, [&](const char* p, hc::AmPointerInfo* info) {
+        return legacy.find(p, info);
+      });
+      double trackerNs = run(threads, random, base, [](const char* p, hc::AmPointerInfo* info) {
+        return hc::am_memtracker_getinfo(info, p) == AM_SUCCESS;
+      });
+      std::cout << (random ? "random" : "repeated") << " lookups, " << threads
+                << " threads: wall time per lookup: legacy " << legacyNs
+                << "ns, am_memtracker_getinfo " << trackerNs << "ns\n";
+    }
+  }
+
+  for (int i = 0; i < ALLOCATIONS; ++i) {
+    hc::am_memtracker_remove(const_cast<char*>(base) + size_t(i) * ALLOCATION_SIZE);
+  }
+
+  return 0;
+}
@@ -0,0 +1,110 @@
+// RUN: %hc %s -o %t.out && %t.out
+
+// Measures the host time spent writing out the records of a printf buffer,
+// synthesized with hc::printf on the host.  Compares a replica of the previous
+// processing (std::regex over every format string, std::printf per piece) with
+// hc::PrintfDrainer (cached hand-written parse, buffered fwrite).  The output
+// goes to /dev/null.
+
+#include <hc_printf.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <regex>
+#include <string>
+#include <vector>
+
+#define RECORDS (20000)
+
+static const std::regex specifierPattern("(%){1}[-+#0]*[0-9]*((.)[0-9]+){0,1}([hl]*)([diuoxXfFeEgGaAcsp]){1}");
+static const std::regex signedIntegerPattern("(%){1}[-+#0]*[0-9]*((.)[0-9]+){0,1}([hl]*)([cdi]){1}");
+static const std::regex unsignedIntegerPattern("(%){1}[-+#0]*[0-9]*((.)[0-9]+){0,1}([hl]*)([uoxX]){1}");
+static const std::regex floatPattern("(%){1}[-+#0]*[0-9]*((.)[0-9]+){0,1}([fFeEgGaA]){1}");
+static const std::regex pointerPattern("(%){1}[ps]");
+static const std::regex doubleAmpersandPattern("(%){2}");
+static const std::string ampersand("%");
+
+// hc::processPrintfPackets before
+void legacy_process(hc::PrintfPacket* packets, const unsigned int numPackets) {
+  for (unsigned int i = 0; i < numPackets; ) {
+    unsigned int numPrintfArgs = packets[i++].data.ui;
+    if (numPrintfArgs == 0)
+      continue;
+    unsigned int formatStringIndex = i++;
+    std::string formatString((const char*)packets[formatStringIndex].data.cptr);
+    std::smatch specifierMatches;
+    for (unsigned int j = 1; j < numPrintfArgs; ++j, ++i) {
+      if (!std::regex_search(formatString, specifierMatches, specifierPattern)) {
+        i+=(numPrintfArgs - j);
+        break;
+      }
+      std::string specifier = specifierMatches.str();
+      std::string prefix = specifierMatches.prefix();
+      prefix = std::regex_replace(prefix,doubleAmpersandPattern,ampersand);
+      std::printf("%s",prefix.c_str());
+      std::smatch specifierTypeMatch;
+      if (std::regex_search(specifier, specifierTypeMatch, unsignedIntegerPattern)) {
+        std::printf(specifier.c_str(), packets[i].data.ui);
+      } else if (std::regex_search(specifier, specifierTypeMatch, signedIntegerPattern)) {
+        std::printf(specifier.c_str(), packets[i].data.i);
+      } else if (std::regex_search(specifier, specifierTypeMatch, floatPattern)) {
+        if (packets[i].type == hc::PRINTF_FLOAT)
+          std::printf(specifier.c_str(), packets[i].data.f);
+        else
+          std::printf(specifier.c_str(), packets[i].data.d);
+      } else if (std::regex_search(specifier, specifierTypeMatch, pointerPattern)) {
+        std::printf(specifier.c_str(), packets[i].data.cptr);
+      }
+      formatString = specifierMatches.suffix();
+    }
+    formatString = std::regex_replace(formatString,doubleAmpersandPattern,ampersand);
+    std::printf("%s",formatString.c_str());
+  }
+  std::flush(std::cout);
+}
+
+struct Buffer {
+  std::vector<hc::PrintfPacket> packets;
+  std::vector<char> strings;
+  Buffer(unsigned int size) : packets(size), strings(size * 12) {
+    hc::setupPrintfBuffer(packets.data(), size, strings.data(), strings.size());
+    for (int i = 0; i < RECORDS; ++i) {
+      hc::printf(packets.data(), "thread %03d: value %d, %2.2f (%s)\n", i, i * 7, i * 0.5, "id");
+    }
+  }
+  hc::PrintfPacket* data() { return packets.data(); }
+  unsigned int used() { return packets[hc::PRINTF_OFFSETS].data.uia[0] - hc::PRINTF_HEADER_SIZE; }
+};
+
+template <typename Process>
+double run(Process process) {
+  auto begin = std::chrono::steady_clock::now();
+  process();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - begin).count();
+}
+
+int main() {
+  bool ret = true;
+
+  Buffer legacyBuffer(RECORDS * 6 + hc::PRINTF_HEADER_SIZE);
+  Buffer buffer(RECORDS * 6 + hc::PRINTF_HEADER_SIZE);
+
+  FILE* devnull = std::fopen("/dev/null", "w");
+  ret &= (devnull != nullptr && std::freopen("/dev/null", "w", stdout) != nullptr);
+
+  double legacyMs = run([&] {
+    legacy_process(legacyBuffer.data() + hc::PRINTF_HEADER_SIZE, legacyBuffer.used());
+  });
+  unsigned int written = 0;
+  hc::PrintfDrainer drainer(devnull);
+  double drainMs = run([&] { written = drainer.drain(buffer.data()); });
+  ret &= (written == RECORDS);
+
+  std::cerr << RECORDS << " printf records: processing time: legacy " << legacyMs
+            << "ms, drainer " << drainMs << "ms\n";
+
+  std::fclose(devnull);
+  return !(ret == true);
+}
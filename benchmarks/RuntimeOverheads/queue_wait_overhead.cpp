@@ -0,0 +1,57 @@
+// RUN: %hc %s -o %t.out && %t.out
+
+#include <hc.hpp>
+
+#include <iostream>
+
+#include <time.h>
+
+#define ITERATIONS (16)
+
+// A test which measures host time spent in accelerator_view::wait() once the
+// queue has drained, with an increasing number of completed kernels still
+// tracked by the queue.  The cost is expected to stay flat with the depth.
+bool test(hc::accelerator_view& av, int depth) {
+  bool ret = true;
+
+  long time_spent = 0;
+  struct timespec begin;
+  struct timespec end;
+  hc::completion_future fut;
+  for (int i = 0; i < ITERATIONS; ++i) {
+    for (int j = 0; j < depth; ++j) {
+      fut = hc::parallel_for_each(
+        av,
+        hc::extent<1>(64),
+        [=](hc::index<1> idx) [[hc]] {
+      });
+    }
+    // let the device finish so only the host side of wait() is timed
+    while (!fut.is_ready());
+
+    clock_gettime(CLOCK_REALTIME, &begin);
+    av.wait();
+    clock_gettime(CLOCK_REALTIME, &end);
+    time_spent += ((end.tv_sec - begin.tv_sec) * 1000 * 1000) + ((end.tv_nsec - begin.tv_nsec) / 1000);
+  }
+  ret &= (fut.is_ready() == true);
+
+  std::cout << "queue depth " << depth << ": average wait time: "
+            << ((double)time_spent / ITERATIONS) << "us\n";
+
+  return ret;
+}
+
+int main() {
+  bool ret = true;
+
+  hc::accelerator_view av = hc::accelerator().get_default_view();
+
+  // launch an empty kernel to initialize everything
+  test(av, 1);
+  for (int depth = 1; depth <= 8192; depth *= 4) {
+    ret &= test(av, depth);
+  }
+
+  return !(ret == true);
+}
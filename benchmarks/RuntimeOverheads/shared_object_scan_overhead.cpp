@@ -0,0 +1,130 @@
+// RUN: %hc %s -I%S/../../hc2/external/elfio -o %t.out && %t.out
+
+// Measures finding the .kernel sections of the shared objects loaded in a
+// process, as hc2::Program_state does on the first kernel launch, over a
+// synthetic set of shared objects written to a temporary directory.  Compares
+// a replica of the previous scan (ELFIO loading every object whole) with
+// hc2::Section_scanner, without and with its cache file.
+
+#include "../../hc2/headers/types/shared_object_scanner.hpp"
+#include "elfio.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#define OBJECTS (64)
+#define OBJECTS_WITH_KERNELS (4)
+#define TEXT_SIZE (2 * 1024 * 1024)
+#define KERNEL_SIZE (64 * 1024)
+
+void write_object(const std::string& path, bool with_kernels, unsigned seed) {
+  ELFIO::elfio writer;
+  writer.create(ELFCLASS64, ELFDATA2LSB);
+  writer.set_os_abi(ELFOSABI_LINUX);
+  writer.set_type(ET_DYN);
+  writer.set_machine(EM_X86_64);
+
+  std::vector<char> text(TEXT_SIZE);
+  for (auto& c : text) {
+    seed = seed * 1103515245 + 12345;
+    c = char(seed >> 16);
+  }
+  ELFIO::section* sec = writer.sections.add(".text");
+  sec->set_type(SHT_PROGBITS);
+  sec->set_flags(SHF_ALLOC | SHF_EXECINSTR);
+  sec->set_data(text.data(), text.size());
+
+  sec = writer.sections.add(".rodata");
+  sec->set_type(SHT_PROGBITS);
+  sec->set_flags(SHF_ALLOC);
+  sec->set_data(text.data(), text.size() / 4);
+
+  if (with_kernels) {
+    std::vector<char> kernels(KERNEL_SIZE, char(seed));
+    sec = writer.sections.add(".kernel");
+    sec->set_type(SHT_PROGBITS);
+    sec->set_data(kernels.data(), kernels.size());
+  }
+
+  writer.save(path);
+}
+
+// the scan done by hc2::Program_state before
+std::vector<std::vector<char>> legacy_scan(const std::vector<std::string>& paths) {
+  std::vector<std::vector<char>> out;
+  for (auto& path : paths) {
+    ELFIO::elfio tmp;
+    if (tmp.load(path)) {
+      for (auto&& y : tmp.sections) {
+        if (y->get_name() == ".kernel") {
+          out.emplace_back(y->get_data(), y->get_data() + y->get_size());
+        }
+      }
+    }
+  }
+  return out;
+}
+
+template <typename Scan>
+double run(Scan scan) {
+  auto begin = std::chrono::steady_clock::now();
+  scan();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - begin).count();
+}
+
+int main() {
+  bool ret = true;
+
+  char dir[] = "/tmp/hcc_scan_XXXXXX";
+  if (!mkdtemp(dir)) {
+    return 1;
+  }
+  std::vector<std::string> paths;
+  for (int i = 0; i < OBJECTS; ++i) {
+    paths.push_back(std::string(dir) + "/lib" + std::to_string(i) + ".so");
+    write_object(paths.back(), i % (OBJECTS / OBJECTS_WITH_KERNELS) == 0, i);
+  }
+  std::string cache = std::string(dir) + "/scan.cache";
+
+  std::vector<std::vector<char>> expected;
+  double legacyMs = run([&] { expected = legacy_scan(paths); });
+
+  size_t found = 0;
+  double scanMs = run([&] {
+    hc2::Section_scanner scanner{".kernel"};
+    for (auto& path : paths) scanner.scan(path.c_str());
+    ret &= (scanner.sections() == expected);
+    found = scanner.sections().size();
+  });
+
+  // the first run with a cache file fills it, the second one uses it
+  run([&] {
+    hc2::Section_scanner scanner{".kernel", cache.c_str()};
+    for (auto& path : paths) scanner.scan(path.c_str());
+  });
+  size_t skipped = 0;
+  double cachedMs = run([&] {
+    hc2::Section_scanner scanner{".kernel", cache.c_str()};
+    for (auto& path : paths) scanner.scan(path.c_str());
+    ret &= (scanner.sections() == expected);
+    skipped = scanner.stats.skipped;
+  });
+  ret &= (found == OBJECTS_WITH_KERNELS);
+  ret &= (skipped == OBJECTS - OBJECTS_WITH_KERNELS);
+
+  std::cout << OBJECTS << " shared objects, " << found << " with kernels: scan time: legacy "
+            << legacyMs << "ms, section scan " << scanMs << "ms, with cache " << cachedMs << "ms\n";
+
+  for (auto& path : paths) {
+    std::remove(path.c_str());
+  }
+  std::remove(cache.c_str());
+  rmdir(dir);
+
+  return !(ret == true);
+}
@@ -0,0 +1,133 @@
+// RUN: %hc %s -I%S/../../lib/hsa -lpthread -o %t.out && %t.out
+
+// Measures the host cost of acquiring and releasing completion signals from
+// the runtime signal pool (lib/hsa/signal_pool.h) against the previous
+// mutex + linear scan pool, using a stub signal so no HSA runtime is needed.
+
+#include "signal_pool.h"
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#define ITERATIONS (200000)
+
+// number of signals each thread holds in flight before releasing them
+#define INFLIGHT (8)
+
+#define POOL_SIZE (512)
+
+struct StubSignal {
+  std::atomic<int64_t>* value;
+};
+
+struct StubSignalTraits {
+  typedef StubSignal signal_type;
+  static void create(StubSignal* s) { s->value = new std::atomic<int64_t>(1); }
+  static void destroy(StubSignal s) { delete s.value; }
+  static void reset(StubSignal s) { s.value->store(1, std::memory_order_release); }
+};
+
+// Replica of the pool HSAContext used before signal_pool.h.
+class LegacyPool {
+  std::vector<StubSignal> signalPool;
+  std::vector<bool> signalPoolFlag;
+  int signalCursor = 0;
+  std::mutex signalPoolMutex;
+
+  void grow() {
+    for (int i = 0; i < POOL_SIZE; ++i) {
+      StubSignal s;
+      StubSignalTraits::create(&s);
+      signalPool.push_back(s);
+      signalPoolFlag.push_back(false);
+    }
+  }
+
+public:
+  LegacyPool() { grow(); }
+  ~LegacyPool() {
+    for (auto& s : signalPool) StubSignalTraits::destroy(s);
+  }
+
+  std::pair<StubSignal, int> acquire() {
+    std::lock_guard<std::mutex> l(signalPoolMutex);
+    int cursor = signalCursor;
+    int start = cursor;
+    while (signalPoolFlag[cursor]) {
+      ++cursor;
+      if (cursor == (int)signalPool.size()) cursor = 0;
+      if (cursor == start) {
+        cursor = signalPool.size();
+        grow();
+        break;
+      }
+    }
+    signalPoolFlag[cursor] = true;
+    signalCursor = cursor + 1;
+    if (signalCursor == (int)signalPool.size()) signalCursor = 0;
+    return std::make_pair(signalPool[cursor], cursor);
+  }
+
+  void release(StubSignal s, int index) {
+    std::lock_guard<std::mutex> l(signalPoolMutex);
+    StubSignalTraits::reset(s);
+    signalPoolFlag[index] = false;
+  }
+};
+
+template <typename Pool>
+double run(Pool& pool, int threads) {
+  std::vector<std::thread> workers;
+  auto begin = std::chrono::steady_clock::now();
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([&pool]() {
+      std::pair<StubSignal, int> held[INFLIGHT];
+      for (int i = 0; i < ITERATIONS; i += INFLIGHT) {
+        for (int j = 0; j < INFLIGHT; ++j) {
+          held[j] = pool.acquire();
+          held[j].first.value->store(0, std::memory_order_relaxed);
+        }
+        for (int j = 0; j < INFLIGHT; ++j) {
+          pool.release(held[j].first, held[j].second);
+        }
+      }
+    });
+  }
+  for (auto& w : workers) w.join();
+  auto end = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(end - begin).count();
+  return ns / ((double)ITERATIONS * threads);
+}
+
+int main() {
+  bool ret = true;
+
+  unsigned maxThreads = std::thread::hardware_concurrency();
+  if (maxThreads == 0) maxThreads = 1;
+  if (maxThreads > 16) maxThreads = 16;
+
+  for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+    LegacyPool legacy;
+    double legacyNs = run(legacy, threads);
+
+    SignalPool<StubSignalTraits> pool;
+    pool.init(POOL_SIZE);
+    double poolNs = run(pool, threads);
+
+    auto stats = pool.getStats();
+    std::cout << threads << " threads: legacy " << legacyNs << " ns/op, magazine "
+              << poolNs << " ns/op (hits=" << stats.hits << " misses=" << stats.misses
+              << " grows=" << stats.grows << " size=" << stats.size << ")\n";
+
+    // every acquire is accounted for once the worker threads have exited
+    ret &= (stats.hits + stats.misses == (uint64_t)ITERATIONS * threads);
+  }
+
+  return !(ret == true);
+}
@@ -10,6 +10,7 @@
 #include "../functions/integer_computational_basis.hpp"
 #include "../functions/hsa_interfaces.hpp"
 #include "../types/code_object_bundle.hpp"
+#include "../types/shared_object_scanner.hpp"
 
 #include <hc.hpp>
 
@@ -20,6 +21,7 @@
 #include <link.h>
 
 #include <cstddef>
+#include <cstdlib>
 #include <iterator>
 #include <mutex>
 #include <ostream>
@@ -123,22 +125,12 @@ namespace hc2
 
         std::vector<hc::accelerator> acc_;
 
-        template<typename T = std::vector<std::vector<char>>>
         static
-        int copy_kernel_sections_(dl_phdr_info* x, size_t, void* kernels)
+        int copy_kernel_sections_(dl_phdr_info* x, size_t, void* scanner)
         {
-            static constexpr const char kernel[] = ".kernel";
-
-            auto out = static_cast<T*>(kernels);
-
-            ELFIO::elfio tmp;
-            if (tmp.load(x->dlpi_name)) {
-                for (auto&& y : tmp.sections) {
-                    if (y->get_name() == kernel) {
-                        out->emplace_back(
-                            y->get_data(), y->get_data() + y->get_size());
-                    }
-                }
+            // the main program has no name, its kernels are bundled apart
+            if (x->dlpi_name && *x->dlpi_name) {
+                static_cast<Section_scanner*>(scanner)->scan(x->dlpi_name);
             }
 
             return 0;
@@ -151,9 +143,12 @@ namespace hc2
 
             static std::once_flag f;
             std::call_once(f, []() {
-                std::vector<std::vector<char>> ks;
-                dl_iterate_phdr(copy_kernel_sections_<>, &ks);
-                for (auto&& x : ks) {
+                // HCC_KERNEL_SCAN_CACHE names a file remembering which shared
+                // objects have no kernels, across runs
+                Section_scanner scanner{
+                    ".kernel", std::getenv("HCC_KERNEL_SCAN_CACHE")};
+                dl_iterate_phdr(copy_kernel_sections_, &scanner);
+                for (auto&& x : scanner.sections()) {
                     size_t offset = 0;
                     while(offset < x.size()) {
                         Bundled_code_header tmp{x.cbegin()+offset,
@@ -0,0 +1,272 @@
+//===----------------------------------------------------------------------===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include "../../external/elfio/elf_types.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace hc2
+{
+    // Read-only mapping of a whole file. Pages are only read once touched, so
+    // looking up a section reads little more than the section header table,
+    // the section name table and the section itself.
+    class Mapped_file {
+        const char* p_ = nullptr;
+        std::size_t n_ = 0;
+    public:
+        explicit
+        Mapped_file(const char* path)
+        {
+            const int fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (fd < 0) return;
+
+            struct stat st;
+            if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+                void* p = mmap(
+                    nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    madvise(p, st.st_size, MADV_RANDOM);
+                    p_ = static_cast<const char*>(p);
+                    n_ = st.st_size;
+                }
+            }
+            close(fd);
+        }
+
+        Mapped_file(const Mapped_file&) = delete;
+        Mapped_file& operator=(const Mapped_file&) = delete;
+
+        ~Mapped_file()
+        {
+            if (p_) munmap(const_cast<char*>(p_), n_);
+        }
+
+        const char* data() const { return p_; }
+        std::size_t size() const { return n_; }
+    };
+
+    // Append the contents of the sections called name in the 64-bit little
+    // endian ELF object of n bytes at p to out. Objects of any other kind, or
+    // with tables out of bounds, have no sections. Returns the number found.
+    inline
+    std::size_t copy_elf_sections(
+        const char* p,
+        std::size_t n,
+        const char* name,
+        std::vector<std::vector<char>>& out)
+    {
+        using namespace ELFIO;
+
+        Elf64_Ehdr eh;
+        if (!p || n < sizeof(eh)) return 0;
+        std::memcpy(&eh, p, sizeof(eh));
+
+        if (eh.e_ident[EI_MAG0] != ELFMAG0 || eh.e_ident[EI_MAG1] != ELFMAG1 ||
+            eh.e_ident[EI_MAG2] != ELFMAG2 || eh.e_ident[EI_MAG3] != ELFMAG3 ||
+            eh.e_ident[EI_CLASS] != ELFCLASS64 ||
+            eh.e_ident[EI_DATA] != ELFDATA2LSB ||
+            eh.e_shoff == 0 || eh.e_shoff >= n ||
+            eh.e_shentsize < sizeof(Elf64_Shdr)) {
+            return 0;
+        }
+
+        const auto section_header = [&](std::size_t i, Elf64_Shdr& sh) {
+            const std::size_t off = eh.e_shoff + i * eh.e_shentsize;
+            if (off > n || n - off < sizeof(sh)) return false;
+            std::memcpy(&sh, p + off, sizeof(sh));
+            return true;
+        };
+        const auto in_bounds = [&](const Elf64_Shdr& sh) {
+            return sh.sh_offset <= n && n - sh.sh_offset >= sh.sh_size;
+        };
+
+        // large counts and indices live in the first section header
+        Elf64_Shdr first;
+        if (!section_header(0, first)) return 0;
+        const std::size_t shnum = eh.e_shnum ? eh.e_shnum : first.sh_size;
+        const std::size_t shstrndx =
+            eh.e_shstrndx == SHN_XINDEX ? first.sh_link : eh.e_shstrndx;
+        if (shnum > (n - eh.e_shoff) / eh.e_shentsize) return 0;
+
+        Elf64_Shdr strtab;
+        if (shstrndx >= shnum || !section_header(shstrndx, strtab) ||
+            strtab.sh_type == SHT_NOBITS || !in_bounds(strtab)) {
+            return 0;
+        }
+        const char* names = p + strtab.sh_offset;
+        const std::size_t name_sz = std::strlen(name) + 1;
+
+        std::size_t found = 0;
+        for (std::size_t i = 0; i != shnum; ++i) {
+            Elf64_Shdr sh;
+            section_header(i, sh);
+            if (sh.sh_name >= strtab.sh_size ||
+                strtab.sh_size - sh.sh_name < name_sz ||
+                std::memcmp(names + sh.sh_name, name, name_sz) != 0) {
+                continue;
+            }
+            if (sh.sh_type == SHT_NOBITS || !in_bounds(sh)) continue;
+
+            out.emplace_back(
+                p + sh.sh_offset, p + sh.sh_offset + sh.sh_size);
+            ++found;
+        }
+
+        return found;
+    }
+
+    // Collects the sections called name from a set of ELF objects on disk.
+    //
+    // Each object is mapped and only its section tables are read. Given a
+    // cache file, objects without the section are remembered by (device,
+    // inode, mtime) and skipped on later runs without being opened; the cache
+    // is rewritten when new objects were scanned.
+    class Section_scanner {
+        struct File_id {
+            dev_t dev;
+            ino_t ino;
+            long mtime_sec;
+            long mtime_nsec;
+
+            friend
+            bool operator==(const File_id& x, const File_id& y)
+            {
+                return x.dev == y.dev && x.ino == y.ino &&
+                    x.mtime_sec == y.mtime_sec && x.mtime_nsec == y.mtime_nsec;
+            }
+        };
+        struct File_id_hash {
+            std::size_t operator()(const File_id& x) const
+            {
+                std::size_t r = std::hash<unsigned long long>{}(x.ino);
+                r ^= std::hash<unsigned long long>{}(x.dev) + 0x9e3779b9 +
+                    (r << 6) + (r >> 2);
+                r ^= std::hash<long>{}(x.mtime_nsec ^ x.mtime_sec) +
+                    0x9e3779b9 + (r << 6) + (r >> 2);
+                return r;
+            }
+        };
+
+        std::string name_;
+        std::string cache_path_;
+        std::unordered_map<File_id, bool, File_id_hash> cache_;
+        bool cache_dirty_ = false;
+        std::vector<std::vector<char>> sections_;
+
+        void load_cache_()
+        {
+            std::ifstream in{cache_path_};
+            std::string section;
+            if (!(in >> section) || section != name_) return;
+
+            File_id id;
+            unsigned long long dev, ino;
+            bool has_section;
+            while (in >> dev >> ino >> id.mtime_sec >> id.mtime_nsec >>
+                   has_section) {
+                id.dev = dev;
+                id.ino = ino;
+                cache_[id] = has_section;
+            }
+        }
+
+        void save_cache_() const
+        {
+            const std::string tmp = cache_path_ + ".tmp" +
+                std::to_string(getpid());
+            {
+                std::ofstream out{tmp, std::ios::trunc};
+                out << name_ << '\n';
+                for (auto&& x : cache_) {
+                    out << static_cast<unsigned long long>(x.first.dev) << ' '
+                        << static_cast<unsigned long long>(x.first.ino) << ' '
+                        << x.first.mtime_sec << ' ' << x.first.mtime_nsec << ' '
+                        << x.second << '\n';
+                }
+                if (!out) {
+                    std::remove(tmp.c_str());
+                    return;
+                }
+            }
+            std::rename(tmp.c_str(), cache_path_.c_str());
+        }
+    public:
+        struct Stats {
+            std::size_t scanned;    // objects mapped and scanned
+            std::size_t skipped;    // objects the cache says lack the section
+        } stats{0, 0};
+
+        explicit
+        Section_scanner(std::string name, const char* cache_path = nullptr)
+            : name_{std::move(name)}, cache_path_{cache_path ? cache_path : ""}
+        {
+            if (!cache_path_.empty()) load_cache_();
+        }
+
+        Section_scanner(const Section_scanner&) = delete;
+        Section_scanner& operator=(const Section_scanner&) = delete;
+
+        ~Section_scanner()
+        {
+            if (cache_dirty_) save_cache_();
+        }
+
+        void scan(const char* path)
+        {
+            File_id id{};
+            const bool use_cache = !cache_path_.empty();
+            if (use_cache) {
+                struct stat st;
+                if (stat(path, &st) != 0) return;
+                id = File_id{
+                    st.st_dev, st.st_ino, st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+
+                const auto it = cache_.find(id);
+                if (it != cache_.cend() && !it->second) {
+                    ++stats.skipped;
+                    return;
+                }
+            }
+
+            const Mapped_file f{path};
+            if (!f.data()) return;
+            ++stats.scanned;
+
+            const bool has_section =
+                copy_elf_sections(f.data(), f.size(), name_.c_str(), sections_);
+
+            if (use_cache) {
+                const auto it = cache_.find(id);
+                if (it == cache_.cend() || it->second != has_section) {
+                    cache_[id] = has_section;
+                    cache_dirty_ = true;
+                }
+            }
+        }
+
+        const std::vector<std::vector<char>>& sections() const
+        {
+            return sections_;
+        }
+
+        std::vector<std::vector<char>>& sections() { return sections_; }
+    };
+}
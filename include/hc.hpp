@@ -55,6 +55,7 @@ using namespace Kalmar::CLAMP;
 class accelerator;
 class accelerator_view;
 class completion_future;
+class command_graph;
 template <int N> class extent;
 template <int N> class tiled_extent;
 template <typename T, int N> class array_view;
@@ -104,6 +105,22 @@ inline uint64_t get_tick_frequency() {
     return Kalmar::getContext()->getSystemTickFrequency();
 }
 
+/**
+ * Statistics of the completion callbacks (see completion_future::then) run so
+ * far.  Dispatch latency is the time from the completion of the asynchronous
+ * operation until its callback starts running on a callback worker.
+ */
+struct callback_stats {
+    uint64_t count;
+    uint64_t total_latency_ns;
+    uint64_t max_latency_ns;
+};
+
+inline callback_stats get_callback_stats() {
+    Kalmar::CallbackStats stats = Kalmar::CLAMP::GetCallbackStats();
+    return callback_stats{stats.callbacks, stats.totalLatencyNs, stats.maxLatencyNs};
+}
+
 #define GET_SYMBOL_ADDRESS(acc, symbol) \
     acc.get_symbol_address( #symbol );
 
@@ -206,15 +223,36 @@ public:
      * accelerator view prior to calling wait().
      *
      * @param waitMode[in] An optional parameter to specify the wait mode. By
-     *                     default it would be hcWaitModeBlocked.
+     *                     default it would be the default wait mode of the
+     *                     accelerator view, see set_default_wait_mode().
      *                     hcWaitModeActive would be used to reduce latency with
      *                     the expense of using one CPU core for active waiting.
+     *                     hcWaitModeAdaptive spins for about as long as recent
+     *                     commands took to complete, then blocks.
      */
-    void wait(hcWaitMode waitMode = hcWaitModeBlocked) { 
+    void wait() {
+      wait(pQueue->getDefaultWaitMode());
+    }
+
+    void wait(hcWaitMode waitMode) {
       pQueue->wait(waitMode); 
       Kalmar::getContext()->flushPrintfBuffer();
     }
 
+    /**
+     * Sets the wait mode of waits which do not name one: wait() on this
+     * accelerator view, and completion_future::wait() on commands submitted to
+     * it from now on.  The initial mode comes from HCC_WAIT_MODE and is
+     * hcWaitModeAdaptive unless set.
+     */
+    void set_default_wait_mode(hcWaitMode waitMode) { pQueue->setDefaultWaitMode(waitMode); }
+
+    /**
+     * Returns the wait mode of waits which do not name one, see
+     * set_default_wait_mode().
+     */
+    hcWaitMode get_default_wait_mode() const { return pQueue->getDefaultWaitMode(); }
+
     /**
      * Sends the queued up commands in the accelerator_view to the device for
      * execution.
@@ -245,6 +283,66 @@ public:
      */
     void flush() { pQueue->flush(); }
 
+    /**
+     * Opens a dispatch batch on this accelerator_view.
+     *
+     * Kernels (parallel_for_each, dispatch_hsa_kernel) and markers enqueued
+     * while a batch is open are written into the device queue but are only
+     * made visible to the device when the batch is closed: the packets are
+     * published in order with a single update of the queue write index and a
+     * single doorbell.  This amortizes the per-command submission cost for
+     * bursts of small kernels.
+     *
+     * Batches may be nested; commands are submitted when the outermost batch
+     * is closed.  Calling flush(), wait(), or waiting on any command of the
+     * batch submits the pending commands early.  Commands enqueued from other
+     * threads while the batch is open are held back as well.
+     *
+     * See also hc::dispatch_batch for a scoped version.
+     */
+    void begin_dispatch_batch() { pQueue->beginDispatchBatch(); }
+
+    /**
+     * Closes a dispatch batch opened with begin_dispatch_batch().
+     */
+    void end_dispatch_batch() { pQueue->endDispatchBatch(); }
+
+    /**
+     * Starts recording commands on this accelerator_view into a command_graph.
+     *
+     * Until end_capture() is called, kernels (parallel_for_each,
+     * dispatch_hsa_kernel), asynchronous copies and markers enqueued on this
+     * accelerator_view are not executed.  They are recorded, with their
+     * kernel objects, launch configuration and kernel arguments resolved, and
+     * the completion_future each of them returns is already ready.
+     *
+     * Kernels taking writable array or array_view arguments, 2D copies and
+     * commands which synchronize with the host (synchronous copies, wait())
+     * can not be recorded and throw.  Read-only array_view arguments are
+     * copied to the accelerator on capture and must be alive whenever the
+     * graph is replayed; dropping them while replayed kernels are in flight
+     * releases their data once those kernels completed.
+     */
+    void begin_capture() { pQueue->beginCapture(); }
+
+    /**
+     * Stops recording commands started by begin_capture().
+     *
+     * @return The recorded commands, see replay().
+     */
+    command_graph end_capture();
+
+    /**
+     * Enqueues the commands recorded in graph on this accelerator_view, in
+     * capture order and with the dependencies between them found at capture
+     * time.  The graph can be replayed any number of times, and on any
+     * accelerator_view of the accelerator it was captured on.
+     *
+     * @return A future which is ready when the last command of the graph has
+     *         completed.
+     */
+    completion_future replay(const command_graph& graph);
+
     /**
      * This command inserts a marker event into the accelerator_view's command
      * queue. This marker is returned as a completion_future object. When all
@@ -338,6 +436,22 @@ public:
     template<typename InputIterator>
     completion_future create_blocking_marker(InputIterator first, InputIterator last, memory_scope scope) const;
 
+    /**
+     * This command inserts a marker event into the accelerator_view's command
+     * queue with an arbitrary number of dependent asynchronous events, the
+     * same as the initializer_list version.
+     *
+     * Dependencies which have already completed, and older commands of this
+     * accelerator_view when it is execute_in_order, are not passed to the
+     * device.  The other dependencies are spread over as many barrier packets
+     * as needed, so the join stays on the device.
+     *
+     * @return A future which can be waited on, and will block until the
+     *         current batch of commands, plus the dependent events have
+     *         been completed.
+     */
+    completion_future create_blocking_marker(std::vector<completion_future>& dependent_futures, memory_scope fence_scope=system_scope) const;
+
     /**
      * Copies size_bytes bytes from src to dst.  
      * Src and dst must not overlap.  
@@ -721,6 +835,164 @@ public:
     }
 };
 
+// ------------------------------------------------------------------------
+// dispatch_batch
+// ------------------------------------------------------------------------
+
+/**
+ * Scoped dispatch batch.  Opens a batch on the given accelerator_view on
+ * construction and closes it, submitting every command enqueued in between
+ * to the device at once, on destruction.
+ *
+ * @code
+ *   {
+ *     hc::dispatch_batch batch(av);
+ *     for (int i = 0; i < 100; ++i)
+ *       hc::parallel_for_each(av, ext, kernel);
+ *   } // all 100 kernels are submitted here
+ * @endcode
+ *
+ * @see accelerator_view::begin_dispatch_batch()
+ */
+class dispatch_batch {
+public:
+    explicit dispatch_batch(const accelerator_view& av) : av(av) { this->av.begin_dispatch_batch(); }
+    ~dispatch_batch() { av.end_dispatch_batch(); }
+
+    /**
+     * Submits the commands enqueued so far without closing the batch.
+     */
+    void flush() { av.flush(); }
+
+    dispatch_batch(const dispatch_batch&) = delete;
+    dispatch_batch& operator=(const dispatch_batch&) = delete;
+
+private:
+    accelerator_view av;
+};
+
+// ------------------------------------------------------------------------
+// command_graph
+// ------------------------------------------------------------------------
+
+/**
+ * Commands recorded on an accelerator_view with begin_capture() and
+ * end_capture(), which can be submitted again with a single call to
+ * accelerator_view::replay().  Nodes are numbered in capture order.
+ *
+ * The commands are fixed at capture time, except for the arguments of kernel
+ * nodes: those are kept as the packed argument block passed to the kernel,
+ * and can be patched between replays to point the kernels at other buffers
+ * or pass other scalar values.  Patching applies to the following replays
+ * only.
+ *
+ * Copy nodes keep their source and destination addresses.  Memory they use
+ * must stay allocated while the graph is replayed: replay() throws if memory
+ * allocated with am_alloc or pinned when the copy was captured has since been
+ * freed or unpinned.
+ *
+ * @code
+ *   av.begin_capture();
+ *   hc::parallel_for_each(av, ext, [=](hc::index<1> i) [[hc]] { out[i[0]] = in[i[0]] * 2; });
+ *   av.copy_async(out, host, bytes);
+ *   hc::command_graph graph = av.end_capture();
+ *
+ *   for (auto& batch : inputs) {
+ *       graph.replace_kernel_arg(0, in, batch);
+ *       in = batch;
+ *       av.replay(graph).wait();
+ *   }
+ * @endcode
+ */
+class command_graph {
+public:
+    /**
+     * Constructs an empty command_graph, with valid() == false.
+     */
+    command_graph() : __graph(nullptr) {}
+
+    bool valid() const { return __graph != nullptr; }
+
+    /**
+     * @return The number of recorded commands.
+     */
+    size_t size() const { return __graph ? __graph->size() : 0; }
+
+    /**
+     * @return The kind of the command recorded as node: hcCommandKernel,
+     *         hcCommandMarker or one of the copy kinds.
+     */
+    hcCommandKind get_node_kind(size_t node) const {
+        check_node(node);
+        return __graph->getNodeKind(node);
+    }
+
+    /**
+     * @return The size in bytes of the argument block of kernel node, 0 for
+     *         the other nodes.
+     */
+    size_t get_kernel_arg_size(size_t node) const {
+        size_t size = 0;
+        check_node(node);
+        __graph->getKernelArgs(node, &size);
+        return size;
+    }
+
+    /**
+     * Overwrites size bytes at offset in the argument block of kernel node.
+     */
+    void set_kernel_arg(size_t node, size_t offset, const void* value, size_t size) {
+        size_t argSize = 0;
+        check_node(node);
+        unsigned char* args = static_cast<unsigned char*>(__graph->getKernelArgs(node, &argSize));
+        if (args == nullptr || offset + size > argSize) {
+            throw runtime_exception("command_graph: kernel argument out of range", 0);
+        }
+        memcpy(args + offset, value, size);
+    }
+
+    template <typename T>
+    void set_kernel_arg(size_t node, size_t offset, const T& value) {
+        set_kernel_arg(node, offset, &value, sizeof(T));
+    }
+
+    /**
+     * Replaces every argument of kernel node equal to old_value by new_value.
+     * Arguments are looked up at the offsets a T argument can be packed at,
+     * which makes this suitable for pointers, whose values are unique; a
+     * scalar captured by a lambda is better patched with set_kernel_arg().
+     *
+     * @return The number of arguments replaced.
+     */
+    template <typename T>
+    int replace_kernel_arg(size_t node, const T& old_value, const T& new_value) {
+        size_t argSize = 0;
+        check_node(node);
+        unsigned char* args = static_cast<unsigned char*>(__graph->getKernelArgs(node, &argSize));
+        int count = 0;
+        for (size_t offset = 0; args && offset + sizeof(T) <= argSize; offset += alignof(T)) {
+            if (memcmp(args + offset, &old_value, sizeof(T)) == 0) {
+                memcpy(args + offset, &new_value, sizeof(T));
+                ++count;
+            }
+        }
+        return count;
+    }
+
+private:
+    command_graph(std::shared_ptr<Kalmar::KalmarGraph> graph) : __graph(graph) {}
+
+    void check_node(size_t node) const {
+        if (node >= size()) {
+            throw runtime_exception("command_graph: invalid node", 0);
+        }
+    }
+
+    std::shared_ptr<Kalmar::KalmarGraph> __graph;
+
+    friend class accelerator_view;
+};
+
 // ------------------------------------------------------------------------
 // accelerator
 // ------------------------------------------------------------------------
@@ -1168,7 +1440,7 @@ public:
      * object which does not refer to any asynchronous operation. Default
      * constructed completion_future objects have valid() == false
      */
-    completion_future() : __amp_future(), __thread_then(nullptr), __asyncOp(nullptr) {};
+    completion_future() : __amp_future(), __asyncOp(nullptr) {};
 
     /**
      * Copy constructor. Constructs a new completion_future object that referes
@@ -1178,7 +1450,7 @@ public:
      *                  initialize this.
      */
     completion_future(const completion_future& other)
-        : __amp_future(other.__amp_future), __thread_then(other.__thread_then), __asyncOp(other.__asyncOp) {}
+        : __amp_future(other.__amp_future), __asyncOp(other.__asyncOp) {}
 
     /**
      * Move constructor. Move constructs a new completion_future object that
@@ -1190,7 +1462,7 @@ public:
      *                  completion_future
      */
     completion_future(completion_future&& other)
-        : __amp_future(std::move(other.__amp_future)), __thread_then(other.__thread_then), __asyncOp(other.__asyncOp) {}
+        : __amp_future(std::move(other.__amp_future)), __asyncOp(std::move(other.__asyncOp)) {}
 
     /**
      * Copy assignment. Copy assigns the contents of other to this. This method
@@ -1203,7 +1475,6 @@ public:
     completion_future& operator=(const completion_future& _Other) {
         if (this != &_Other) {
            __amp_future = _Other.__amp_future;
-           __thread_then = _Other.__thread_then;
            __asyncOp = _Other.__asyncOp;
         }
         return (*this);
@@ -1221,8 +1492,7 @@ public:
     completion_future& operator=(completion_future&& _Other) {
         if (this != &_Other) {
             __amp_future = std::move(_Other.__amp_future);
-            __thread_then = _Other.__thread_then;
-           __asyncOp = _Other.__asyncOp;
+            __asyncOp = std::move(_Other.__asyncOp);
         }
         return (*this);
     }
@@ -1235,7 +1505,11 @@ public:
      * operation, this method throws that stored exception.
      */
     void get() const {
-        __amp_future.get();
+        if (__amp_future.valid()) {
+            __amp_future.get();
+        } else if (__asyncOp != nullptr) {
+            __asyncOp->wait();
+        }
     }
 
     /**
@@ -1244,7 +1518,7 @@ public:
      * completion_future is associated with an asynchronous operation.
      */
     bool valid() const {
-        return __amp_future.valid();
+        return __amp_future.valid() || (__asyncOp != nullptr);
     }
 
     /** @{ */
@@ -1261,17 +1535,36 @@ public:
      * std::shared_future<void> member methods with same names.
      *
      * @param waitMode[in] An optional parameter to specify the wait mode. By
-     *                     default it would be hcWaitModeBlocked.
+     *                     default it would be the default wait mode of the
+     *                     accelerator_view the operation was submitted to.
      *                     hcWaitModeActive would be used to reduce latency with
      *                     the expense of using one CPU core for active waiting.
+     *                     hcWaitModeAdaptive spins for about as long as recent
+     *                     operations took to complete, then blocks.
+     *
+     * wait_for and wait_until return std::future_status::timeout if the
+     * operation has not completed in time.
      */
-    void wait(hcWaitMode mode = hcWaitModeBlocked) const {
+    void wait() const {
         if (this->valid()) {
-            if (__asyncOp != nullptr) {
-                __asyncOp->setWaitMode(mode);
-            }   
             //TODO-ASYNC - need to reclaim older AsyncOps here.
-            __amp_future.wait();
+            if (__amp_future.valid()) {
+                __amp_future.wait();
+            } else {
+                __asyncOp->wait();
+            }
+        }
+
+        Kalmar::getContext()->flushPrintfBuffer();
+    }
+
+    void wait(hcWaitMode mode) const {
+        if (this->valid()) {
+            if (__amp_future.valid()) {
+                __amp_future.wait();
+            } else {
+                __asyncOp->wait(mode);
+            }
         }
 
         Kalmar::getContext()->flushPrintfBuffer();
@@ -1279,12 +1572,25 @@ public:
 
     template <class _Rep, class _Period>
     std::future_status wait_for(const std::chrono::duration<_Rep, _Period>& _Rel_time) const {
-        return __amp_future.wait_for(_Rel_time);
+        if (__amp_future.valid()) {
+            return __amp_future.wait_for(_Rel_time);
+        }
+        if (__asyncOp == nullptr) {
+            return std::future_status::deferred;
+        }
+        if (!__asyncOp->waitFor(__timeout(_Rel_time))) {
+            return std::future_status::timeout;
+        }
+        Kalmar::getContext()->flushPrintfBuffer();
+        return std::future_status::ready;
     }
 
     template <class _Clock, class _Duration>
     std::future_status wait_until(const std::chrono::time_point<_Clock, _Duration>& _Abs_time) const {
-        return __amp_future.wait_until(_Abs_time);
+        if (__amp_future.valid()) {
+            return __amp_future.wait_until(_Abs_time);
+        }
+        return wait_for(_Abs_time - _Clock::now());
     }
 
     /** @} */
@@ -1295,6 +1601,10 @@ public:
      * object and refers to the same asynchronous operation.
      */
     operator std::shared_future<void>() const {
+        if (!__amp_future.valid() && __asyncOp != nullptr) {
+            std::shared_ptr<Kalmar::KalmarAsyncOp> op = __asyncOp;
+            return std::async(std::launch::deferred, [op]() { op->wait(); }).share();
+        }
         return __amp_future;
     }
 
@@ -1303,26 +1613,71 @@ public:
      * executed upon completion of the asynchronous operation associated with
      * this completion_future object. The completion callback func should have
      * an operator() that is valid when invoked with non arguments, i.e., "func()".
+     *
+     * func is copied and runs on one of a bounded pool of runtime callback
+     * workers (HCC_CALLBACK_THREADS), so it should not block waiting for
+     * another callback.  Several callbacks may be attached to the same
+     * completion_future.
+     *
+     * @return A completion_future which is ready once func has returned, so
+     *         continuations can be chained.  If this completion_future is not
+     *         valid, func is not run and an invalid completion_future is returned.
      */
-    // FIXME: notice we removed const from the signature here
-    //        the original signature in the specification should be
-    //        template<typename functor>
-    //        void then(const functor& func) const;
     template<typename functor>
-    void then(const functor & func) {
+    completion_future then(const functor & func) const {
 #if __KALMAR_ACCELERATOR__ != 1
-      // could only assign once
-      if (__thread_then == nullptr) {
-        // spawn a new thread to wait on the future and then execute the callback functor
-        __thread_then = new std::thread([&]() __CPU__ {
-          this->wait();
-          if(this->valid())
-            func();
+      if (!valid()) {
+        return completion_future();
+      }
+
+      auto next = std::make_shared<Kalmar::KalmarHostOp>();
+      // the callback keeps the op (and its completion signal) alive until it has run
+      std::shared_ptr<Kalmar::KalmarAsyncOp> op = __asyncOp;
+      std::function<void()> callback = [op, next, func]() {
+        func();
+        next->complete();
+      };
+
+      if (__asyncOp != nullptr) {
+        __asyncOp->setCallback(std::move(callback));
+      } else {
+        std::shared_future<void> future = __amp_future;
+        Kalmar::CLAMP::EnqueueCallback([future, callback]() {
+          future.wait();
+          callback();
         });
       }
+      return completion_future(std::shared_ptr<Kalmar::KalmarAsyncOp>(std::move(next)));
+#else
+      return completion_future();
 #endif
     }
 
+    /**
+     * Get a file descriptor which becomes readable once the associated
+     * asynchronous operation has completed, so that event loops can wait for
+     * kernels, copies and markers (see accelerator_view::create_marker) along
+     * with other file descriptors through poll, select or epoll, without a
+     * thread blocked in wait().
+     *
+     * The descriptor is an eventfd shared by all the completion_future objects
+     * which refer to the operation.  It is owned by the runtime: it must not be
+     * closed, and it is only valid as long as one of those completion_future
+     * objects is.  Reading it resets it, and it does not become readable again.
+     * Call wait() once it is readable; it then returns without blocking.
+     *
+     * @return The file descriptor, or -1 if this completion_future does not
+     *         refer to an operation of the runtime or the descriptor could not
+     *         be created.
+     */
+    int get_completion_fd() const {
+      if (__asyncOp != nullptr) {
+        return Kalmar::KalmarAsyncOp::getCompletionFd(__asyncOp);
+      } else {
+        return -1;
+      }
+    }
+
     /**
      * Get the native handle for the asynchronous operation encapsulated in
      * this completion_future object. The method is mostly used for debugging
@@ -1396,12 +1751,6 @@ public:
     }
 
     ~completion_future() {
-      if (__thread_then != nullptr) {
-        __thread_then->join();
-      }
-      delete __thread_then;
-      __thread_then = nullptr;
-      
       if (__asyncOp != nullptr) {
         __asyncOp = nullptr;
       }
@@ -1415,13 +1764,29 @@ public:
 
 private:
     std::shared_future<void> __amp_future;
-    std::thread* __thread_then = nullptr;
     std::shared_ptr<Kalmar::KalmarAsyncOp> __asyncOp;
 
-    completion_future(std::shared_ptr<Kalmar::KalmarAsyncOp> event) : __amp_future(*(event->getFuture())), __asyncOp(event) {}
+    // Ops from the HSA runtime are waited through KalmarAsyncOp::wait() and carry no future.
+    completion_future(std::shared_ptr<Kalmar::KalmarAsyncOp> event)
+        : __amp_future(event->getFuture() ? *(event->getFuture()) : std::shared_future<void>()),
+          __asyncOp(std::move(event)) {}
 
     completion_future(const std::shared_future<void> &__future)
-        : __amp_future(__future), __thread_then(nullptr), __asyncOp(nullptr) {}
+        : __amp_future(__future), __asyncOp(nullptr) {}
+
+    // timeout for KalmarAsyncOp::waitFor, saturated so that durations which do
+    // not fit in nanoseconds wait without limit
+    template <class _Rep, class _Period>
+    static std::chrono::nanoseconds __timeout(const std::chrono::duration<_Rep, _Period>& _Rel_time) {
+        const double ns = std::chrono::duration<double, std::nano>(_Rel_time).count();
+        if (ns <= 0) {
+            return std::chrono::nanoseconds::zero();
+        }
+        if (ns >= double(std::chrono::nanoseconds::max().count())) {
+            return std::chrono::nanoseconds::max();
+        }
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(_Rel_time);
+    }
 
     friend class Kalmar::HSAQueue;
     
@@ -1532,39 +1897,28 @@ inline completion_future accelerator_view::create_blocking_marker(completion_fut
 template<typename InputIterator>
 inline completion_future
 accelerator_view::create_blocking_marker(InputIterator first, InputIterator last, memory_scope scope) const {
-    std::shared_ptr<Kalmar::KalmarAsyncOp> deps[5]; // array of 5 pointers to the native handle of async ops. 5 is the max supported by barrier packet
-    hc::completion_future lastMarker;
-
+    std::vector<std::shared_ptr<Kalmar::KalmarAsyncOp>> deps;
 
     // If necessary create an explicit dependency on previous command
     // This is necessary for example if copy command is followed by marker - we need the marker to wait for the copy to complete.
     std::shared_ptr<Kalmar::KalmarAsyncOp> depOp = pQueue->detectStreamDeps(hcCommandMarker, nullptr);
-
-    int cnt = 0;
     if (depOp) {
-        deps[cnt++] = depOp; // retrieve async op associated with completion_future
+        deps.push_back(depOp);
     }
 
-
-    // loop through signals and group into sections of 5
-    // every 5 signals goes into one barrier packet
-    // since HC sets the barrier bit in each AND barrier packet, we know
-    // the barriers will execute in-order
     for (auto iter = first; iter != last; ++iter) {
         if (iter->__asyncOp) {
-            deps[cnt++] = iter->__asyncOp; // retrieve async op associated with completion_future
-            if (cnt == 5) {
-                lastMarker = completion_future(pQueue->EnqueueMarkerWithDependency(cnt, deps, hc::no_scope));
-                cnt = 0;
-            }
+            deps.push_back(iter->__asyncOp); // retrieve async op associated with completion_future
         }
     }
 
-    if (cnt) {
-        lastMarker = completion_future(pQueue->EnqueueMarkerWithDependency(cnt, deps, scope));
-    }
+    // the runtime spreads dependencies over as many barrier packets as needed
+    return completion_future(pQueue->EnqueueMarkerWithDependency(deps.size(), deps.data(), scope));
+}
 
-    return lastMarker;
+inline completion_future
+accelerator_view::create_blocking_marker(std::vector<completion_future>& dependent_futures, memory_scope scope) const {
+    return create_blocking_marker(dependent_futures.begin(), dependent_futures.end(), scope);
 }
 
 inline completion_future
@@ -1573,6 +1927,19 @@ accelerator_view::create_blocking_marker(std::initializer_list<completion_future
 }
 
 
+inline command_graph
+accelerator_view::end_capture() {
+    return command_graph(pQueue->endCapture());
+}
+
+inline completion_future
+accelerator_view::replay(const command_graph& graph) {
+    if (!graph.valid()) {
+        throw runtime_exception("replay of an invalid command_graph", 0);
+    }
+    return completion_future(pQueue->replayGraph(graph.__graph));
+}
+
 inline void accelerator_view::copy_ext(const void *src, void *dst, size_t size_bytes, hcCommandKind copyDir, const hc::AmPointerInfo &srcInfo, const hc::AmPointerInfo &dstInfo, const hc::accelerator *copyAcc, bool forceUnpinnedCopy) {
     pQueue->copy_ext(src, dst, size_bytes, copyDir, srcInfo, dstInfo, copyAcc ? copyAcc->pDev : nullptr, forceUnpinnedCopy);
 };
@@ -4053,14 +4420,14 @@ struct projection_helper<T, 1>
     typedef T& result_type;
     static result_type project(array_view<T, 1>& now, int i) __CPU__ __HC__ {
 #if __KALMAR_ACCELERATOR__ != 1
-        now.cache.get_cpu_access(true);
+        now.section_cpu_access(true);
 #endif
         T *ptr = reinterpret_cast<T *>(now.cache.get() + i + now.offset + now.index_base[0]);
         return *ptr;
     }
     static result_type project(const array_view<T, 1>& now, int i) __CPU__ __HC__ {
 #if __KALMAR_ACCELERATOR__ != 1
-        now.cache.get_cpu_access(true);
+        now.section_cpu_access(true);
 #endif
         T *ptr = reinterpret_cast<T *>(now.cache.get() + i + now.offset + now.index_base[0]);
         return *ptr;
@@ -4114,14 +4481,14 @@ struct projection_helper<const T, 1>
     typedef const T& const_result_type;
     static const_result_type project(array_view<const T, 1>& now, int i) __CPU__ __HC__ {
 #if __KALMAR_ACCELERATOR__ != 1
-        now.cache.get_cpu_access();
+        now.section_cpu_access(false);
 #endif
         const T *ptr = reinterpret_cast<const T *>(now.cache.get() + i + now.offset + now.index_base[0]);
         return *ptr;
     }
     static const_result_type project(const array_view<const T, 1>& now, int i) __CPU__ __HC__ {
 #if __KALMAR_ACCELERATOR__ != 1
-        now.cache.get_cpu_access();
+        now.section_cpu_access(false);
 #endif
         const T *ptr = reinterpret_cast<const T *>(now.cache.get() + i + now.offset + now.index_base[0]);
         return *ptr;
@@ -5445,7 +5812,7 @@ public:
     T* data() const __CPU__ __HC__ {
 
 #if __KALMAR_ACCELERATOR__ != 1
-        cache.get_cpu_access(true);
+        section_cpu_access(true);
 #endif
         static_assert(N == 1, "data() is only permissible on array views of rank 1");
         return reinterpret_cast<T*>(cache.get() + offset + index_base[0]);
@@ -5502,7 +5869,7 @@ public:
      *                 synchronized for.
      */
     // FIXME: type parameter is not implemented
-    void synchronize() const { cache.get_cpu_access(); }
+    void synchronize() const { section_cpu_access(false); }
 
     /**
      * An asynchronous version of synchronize, which returns a completion
@@ -5516,7 +5883,9 @@ public:
      */
     // FIXME: type parameter is not implemented
     completion_future synchronize_async() const {
-        std::future<void> fut = std::async([&]() mutable { synchronize(); });
+        // the view is copied, since it may be gone before the task runs
+        array_view self(*this);
+        std::future<void> fut = std::async([self]() { self.synchronize(); });
         return completion_future(fut.share());
     }
 
@@ -5556,7 +5925,9 @@ public:
     // FIXME: type parameter is not implemented
     void synchronize_to(const accelerator_view& av) const {
 #if __KALMAR_ACCELERATOR__ != 1
-        cache.sync_to(av.pQueue);
+        size_t cnt, off;
+        if (get_section_range(cnt, off))
+            cache.sync_to(av.pQueue, cnt, off);
 #endif
     }
 
@@ -5601,7 +5972,7 @@ public:
      */
     T& operator[] (const index<N>& idx) const __CPU__ __HC__ {
 #if __KALMAR_ACCELERATOR__ != 1
-        cache.get_cpu_access(true);
+        section_cpu_access(true);
 #endif
         T *ptr = reinterpret_cast<T*>(cache.get() + offset);
         return ptr[Kalmar::amp_helper<N, index<N>, hc::extent<N>>::flatten(idx + index_base, extent_base)];
@@ -5833,6 +6204,26 @@ private:
         : cache(cache), extent(ext_now), extent_base(ext_b), index_base(idx_b),
         offset(off) {}
   
+    // Host access and synchronization only make the elements from the first to
+    // the last one of this view coherent, rather than the whole underlying
+    // buffer.  Returns false for an empty view, which spans none.
+    bool get_section_range(size_t& cnt, size_t& off) const {
+        if (extent.size() == 0)
+            return false;
+        index<N> last;
+        for (int i = 0; i < N; ++i)
+            last[i] = index_base[i] + extent[i] - 1;
+        off = offset + Kalmar::amp_helper<N, index<N>, hc::extent<N>>::flatten(index_base, extent_base);
+        cnt = offset + Kalmar::amp_helper<N, index<N>, hc::extent<N>>::flatten(last, extent_base) + 1 - off;
+        return true;
+    }
+
+    void section_cpu_access(bool modify) const {
+        size_t cnt, off;
+        if (get_section_range(cnt, off))
+            cache.get_cpu_access(modify, cnt, off);
+    }
+
     acc_buffer_t cache;
     hc::extent<N> extent;
     hc::extent<N> extent_base;
@@ -6066,7 +6457,7 @@ public:
      */
     const T* data() const __CPU__ __HC__ {
 #if __KALMAR_ACCELERATOR__ != 1
-        cache.get_cpu_access();
+        section_cpu_access(false);
 #endif
         static_assert(N == 1, "data() is only permissible on array views of rank 1");
         return reinterpret_cast<const T*>(cache.get() + offset + index_base[0]);
@@ -6118,7 +6509,7 @@ public:
      * the source location, which is unnecessary if the contents are intended
      * to be overwritten without reading.
      */
-    void synchronize() const { cache.get_cpu_access(); }
+    void synchronize() const { section_cpu_access(false); }
 
     /**
      * An asynchronous version of synchronize, which returns a completion
@@ -6131,7 +6522,9 @@ public:
      *         completion of the asynchronous operation.
      */
     completion_future synchronize_async() const {
-        std::future<void> fut = std::async([&]() mutable { synchronize(); });
+        // the view is copied, since it may be gone before the task runs
+        array_view self(*this);
+        std::future<void> fut = std::async([self]() { self.synchronize(); });
         return completion_future(fut.share());
     }
 
@@ -6148,7 +6541,9 @@ public:
      */
     void synchronize_to(const accelerator_view& av) const {
 #if __KALMAR_ACCELERATOR__ != 1
-        cache.sync_to(av.pQueue);
+        size_t cnt, off;
+        if (get_section_range(cnt, off))
+            cache.sync_to(av.pQueue, cnt, off);
 #endif
     }
 
@@ -6180,7 +6575,7 @@ public:
      */
     const T& operator[](const index<N>& idx) const __CPU__ __HC__ {
 #if __KALMAR_ACCELERATOR__ != 1
-        cache.get_cpu_access();
+        section_cpu_access(false);
 #endif
         const T *ptr = reinterpret_cast<const T*>(cache.get() + offset);
         return ptr[Kalmar::amp_helper<N, index<N>, hc::extent<N>>::flatten(idx + index_base, extent_base)];
@@ -6412,6 +6807,26 @@ private:
         : cache(cache), extent(ext_now), extent_base(ext_b), index_base(idx_b),
         offset(off) {}
   
+    // Host access and synchronization only make the elements from the first to
+    // the last one of this view coherent, rather than the whole underlying
+    // buffer.  Returns false for an empty view, which spans none.
+    bool get_section_range(size_t& cnt, size_t& off) const {
+        if (extent.size() == 0)
+            return false;
+        index<N> last;
+        for (int i = 0; i < N; ++i)
+            last[i] = index_base[i] + extent[i] - 1;
+        off = offset + Kalmar::amp_helper<N, index<N>, hc::extent<N>>::flatten(index_base, extent_base);
+        cnt = offset + Kalmar::amp_helper<N, index<N>, hc::extent<N>>::flatten(last, extent_base) + 1 - off;
+        return true;
+    }
+
+    void section_cpu_access(bool modify) const {
+        size_t cnt, off;
+        if (get_section_range(cnt, off))
+            cache.get_cpu_access(modify, cnt, off);
+    }
+
     acc_buffer_t cache;
     hc::extent<N> extent;
     hc::extent<N> extent_base;
@@ -7683,7 +8098,7 @@ __attribute__((noinline,used)) completion_future parallel_for_each(
         return launch_cpu_task_async(av.pQueue, f, compute_domain);
     }
 #endif
-    if (av.get_accelerator().get_device_path() == L"cpu") {
+    if (Kalmar::is_cpu_queue(av.pQueue)) {
       throw runtime_exception(Kalmar::__errorMsg_UnsupportedAccelerator, E_FAIL);
     }
     const pfe_wrapper<N, Kernel> _pf(compute_domain, f);
@@ -7721,7 +8136,7 @@ __attribute__((noinline,used)) completion_future parallel_for_each(
     }
 #endif
   size_t ext = compute_domain[0];
-  if (av.get_accelerator().get_device_path() == L"cpu") {
+  if (Kalmar::is_cpu_queue(av.pQueue)) {
     throw runtime_exception(Kalmar::__errorMsg_UnsupportedAccelerator, E_FAIL);
   }
   return completion_future(Kalmar::mcw_cxxamp_launch_kernel_async<Kernel, 1>(av.pQueue, &ext, NULL, f));
@@ -7759,7 +8174,7 @@ __attribute__((noinline,used)) completion_future parallel_for_each(
 #endif
   size_t ext[2] = {static_cast<size_t>(compute_domain[1]),
                    static_cast<size_t>(compute_domain[0])};
-  if (av.get_accelerator().get_device_path() == L"cpu") {
+  if (Kalmar::is_cpu_queue(av.pQueue)) {
     throw runtime_exception(Kalmar::__errorMsg_UnsupportedAccelerator, E_FAIL);
   }
   return completion_future(Kalmar::mcw_cxxamp_launch_kernel_async<Kernel, 2>(av.pQueue, ext, NULL, f));
@@ -7800,7 +8215,7 @@ __attribute__((noinline,used)) completion_future parallel_for_each(
   size_t ext[3] = {static_cast<size_t>(compute_domain[2]),
                    static_cast<size_t>(compute_domain[1]),
                    static_cast<size_t>(compute_domain[0])};
-  if (av.get_accelerator().get_device_path() == L"cpu") {
+  if (Kalmar::is_cpu_queue(av.pQueue)) {
     throw runtime_exception(Kalmar::__errorMsg_UnsupportedAccelerator, E_FAIL);
   }
   return completion_future(Kalmar::mcw_cxxamp_launch_kernel_async<Kernel, 3>(av.pQueue, ext, NULL, f));
@@ -7836,7 +8251,7 @@ __attribute__((noinline,used)) completion_future parallel_for_each(
       return launch_cpu_task_async(av.pQueue, f, compute_domain);
   } else
 #endif
-  if (av.get_accelerator().get_device_path() == L"cpu") {
+  if (Kalmar::is_cpu_queue(av.pQueue)) {
     throw runtime_exception(Kalmar::__errorMsg_UnsupportedAccelerator, E_FAIL);
   }
   void *kernel = Kalmar::mcw_cxxamp_get_kernel<Kernel>(av.pQueue, f);
@@ -7878,7 +8293,7 @@ __attribute__((noinline,used)) completion_future parallel_for_each(
       return launch_cpu_task_async(av.pQueue, f, compute_domain);
   } else
 #endif
-  if (av.get_accelerator().get_device_path() == L"cpu") {
+  if (Kalmar::is_cpu_queue(av.pQueue)) {
     throw runtime_exception(Kalmar::__errorMsg_UnsupportedAccelerator, E_FAIL);
   }
   void *kernel = Kalmar::mcw_cxxamp_get_kernel<Kernel>(av.pQueue, f);
@@ -7924,7 +8339,7 @@ __attribute__((noinline,used)) completion_future parallel_for_each(
       return launch_cpu_task_async(av.pQueue, f, compute_domain);
   } else
 #endif
-  if (av.get_accelerator().get_device_path() == L"cpu") {
+  if (Kalmar::is_cpu_queue(av.pQueue)) {
     throw runtime_exception(Kalmar::__errorMsg_UnsupportedAccelerator, E_FAIL);
   }
   void *kernel = Kalmar::mcw_cxxamp_get_kernel<Kernel>(av.pQueue, f);
@@ -62,6 +62,17 @@ public:
     AmPointerInfo & operator= (const AmPointerInfo &other);
 
 };
+
+// Statistics of the device memory cache, see am_cache_get_stats:
+struct AmCacheStats {
+    std::size_t _reservedBytes;    ///< Bytes allocated from the device memory pool.
+    std::size_t _allocatedBytes;   ///< Bytes handed out, rounded up to the cache block sizes.
+    std::size_t _requestedBytes;   ///< Bytes requested by the live allocations.  _allocatedBytes - _requestedBytes is lost to rounding.
+    std::size_t _cachedBytes;      ///< Bytes kept once freed which can be returned to the pool by am_cache_trim.
+    std::size_t _largestFreeBlock; ///< Largest allocation which can be serviced without the pool.
+    uint64_t    _hits;             ///< Allocations serviced by the cache.
+    uint64_t    _misses;           ///< Allocations which had to allocate from the pool.
+};
 }
 
 
@@ -121,6 +132,89 @@ auto_voidp am_alloc(std::size_t size, hc::accelerator &acc, unsigned flags);
 am_status_t am_free(void*  ptr);
 
 
+/**
+ * Allocate a block of at least @p size bytes of memory on the accelerator of
+ * @p av, ordered with the commands enqueued on @p av.
+ *
+ * Blocks released with am_free_async are cached and handed out again: device
+ * memory right away to later am_alloc_async calls on the same
+ * accelerator_view, if it is execute_in_order, and any block once the
+ * commands enqueued before the free have completed.  Only when no cached block fits is memory
+ * allocated with am_alloc.
+ *
+ * @p flags are the same as for am_alloc.  The block may be larger than
+ * requested; the memory tracker reports its full size.
+ *
+ * @return : On success, pointer to the block, 0 if @p size == 0 or the memory
+ * could not be allocated.
+ *
+ * @see am_free_async, am_alloc
+ */
+auto_voidp am_alloc_async(std::size_t size, hc::accelerator_view &av, unsigned flags = 0);
+
+/**
+ * Free a block of memory after the commands enqueued on @p av so far have
+ * completed, without waiting for them.
+ *
+ * Blocks from am_alloc_async go back to the cache of their accelerator, see
+ * am_alloc_async.  Other blocks allocated with am_alloc are released with
+ * am_free once the commands have completed.
+ *
+ * @return AM_SUCCESS, or AM_ERROR_MISC if @p ptr was not allocated with am_alloc.
+ * @see am_alloc_async, am_free
+ */
+am_status_t am_free_async(void* ptr, hc::accelerator_view &av);
+
+/**
+ * Set how many bytes of freed blocks the am_alloc_async cache of @p acc keeps.
+ * Blocks over the threshold are released as soon as they are no longer in use.
+ *
+ * The default is no limit, or the HCC_AM_POOL_RELEASE_THRESHOLD environment
+ * variable, in MB.  Cached blocks are also released when an allocation on
+ * @p acc runs out of memory.
+ */
+void am_pool_set_release_threshold(const hc::accelerator &acc, std::size_t bytes);
+
+/**
+ * Release cached blocks of @p acc which are no longer in use, until at most
+ * @p keepBytes are cached.
+ *
+ * @return Number of bytes released.
+ */
+std::size_t am_pool_trim(const hc::accelerator &acc, std::size_t keepBytes = 0);
+
+/**
+ * @return Number of bytes cached for am_alloc_async on @p acc.
+ */
+std::size_t am_pool_get_cached_size(const hc::accelerator &acc);
+
+/**
+ * Device memory of hc::array is sub-allocated from a per-device cache, which
+ * keeps memory once it is freed to service later allocations without going to
+ * the device memory pool.  Set HCC_DEVICE_MEMORY_CACHE=0 to disable it.
+ * am_alloc memory is never taken from the cache, so each am_alloc pointer is
+ * its own pool allocation for peer access and IPC.
+ *
+ * Release memory cached for @p acc until at most @p keepBytes are cached.
+ *
+ * @return Number of bytes released.
+ */
+std::size_t am_cache_trim(const hc::accelerator &acc, std::size_t keepBytes = 0);
+
+/**
+ * Set the max number of bytes the device memory cache of @p acc keeps once
+ * freed (HCC_DEVICE_MEMORY_CACHE_LIMIT MB by default).
+ */
+void am_cache_set_limit(const hc::accelerator &acc, std::size_t bytes);
+
+/**
+ * Fill @p stats with statistics of the device memory cache of @p acc.
+ *
+ * @return AM_SUCCESS, or AM_ERROR_MISC if @p acc has no device memory cache.
+ */
+am_status_t am_cache_get_stats(const hc::accelerator &acc, AmCacheStats *stats);
+
+
 /**
  * Copy @p size bytes of memory from @p src to @ dst.  The memory areas (src+size and dst+size) must not overlap.
  *
@@ -3,15 +3,22 @@
 #include <type_traits>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 #include <cassert>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <string>
-#include <regex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include <iostream>
 #include <algorithm>
 
 #include "hc_am_internal.hpp"
 #include "hsa_atomic.h"
+#include "kalmar_runtime.h"
 
 // The printf on the accelerator is only enabled when
 // The HCC_ENABLE_ACCELERATOR_PRINTF is defined
@@ -88,6 +95,12 @@ enum PrintfPacketDataType {
   ,PRINTF_CONST_VOID_PTR
   ,PRINTF_CHAR_PTR
   ,PRINTF_CONST_CHAR_PTR
+
+  // Record header types, which argument packets never have: a
+  // published printf call, and a printf call which reserved space
+  // in the buffer but could not write its arguments
+  ,PRINTF_RECORD
+  ,PRINTF_DROPPED
 };
 
 class PrintfPacket {
@@ -122,26 +135,38 @@ enum PrintfError {
   ,PRINTF_BUFFER_NULLPTR = 4
 };
 
+// Initialize the header of a printf buffer of numElements packets whose
+// char* arguments are copied to stringBuffer
+static inline void setupPrintfBuffer(PrintfPacket* printfBuffer, const unsigned int numElements,
+                                     char* stringBuffer, const unsigned int stringBufferSize) {
+  // Initialize the Header elements of the Printf Buffer
+  printfBuffer[PRINTF_BUFFER_SIZE].type = PRINTF_BUFFER_SIZE;
+  printfBuffer[PRINTF_BUFFER_SIZE].data.ui = numElements;
+
+  // Header includes a helper string buffer which holds all char* args
+  printfBuffer[PRINTF_STRING_BUFFER].type = PRINTF_STRING_BUFFER;
+  printfBuffer[PRINTF_STRING_BUFFER].data.ptr = stringBuffer;
+  printfBuffer[PRINTF_STRING_BUFFER_SIZE].type = PRINTF_STRING_BUFFER_SIZE;
+  printfBuffer[PRINTF_STRING_BUFFER_SIZE].data.ui = stringBufferSize;
+
+  // Using one atomic offset to maintain order and atomicity
+  printfBuffer[PRINTF_OFFSETS].type = PRINTF_OFFSETS;
+  printfBuffer[PRINTF_OFFSETS].data.uia[0] = PRINTF_HEADER_SIZE;
+  printfBuffer[PRINTF_OFFSETS].data.uia[1] = 0;
+
+  // No record has been published yet
+  for (unsigned int i = PRINTF_HEADER_SIZE; i < numElements; ++i)
+    printfBuffer[i].clear();
+}
+
 static inline PrintfPacket* createPrintfBuffer(const unsigned int numElements) {
   PrintfPacket* printfBuffer = NULL;
   if (numElements > PRINTF_MIN_SIZE) {
     printfBuffer = hc::internal::am_alloc_host_coherent(sizeof(PrintfPacket) * numElements);
 
-    // Initialize the Header elements of the Printf Buffer
-    printfBuffer[PRINTF_BUFFER_SIZE].type = PRINTF_BUFFER_SIZE;
-    printfBuffer[PRINTF_BUFFER_SIZE].data.ui = numElements;
-
-    // Header includes a helper string buffer which holds all char* args
     // PrintfPacket is 12 bytes, equivalent string buffer size used
-    printfBuffer[PRINTF_STRING_BUFFER].type = PRINTF_STRING_BUFFER;
-    printfBuffer[PRINTF_STRING_BUFFER].data.ptr = hc::internal::am_alloc_host_coherent(sizeof(char) * numElements * 12);
-    printfBuffer[PRINTF_STRING_BUFFER_SIZE].type = PRINTF_STRING_BUFFER_SIZE;
-    printfBuffer[PRINTF_STRING_BUFFER_SIZE].data.ui = numElements * 12;
-
-    // Using one atomic offset to maintain order and atomicity
-    printfBuffer[PRINTF_OFFSETS].type = PRINTF_OFFSETS;
-    printfBuffer[PRINTF_OFFSETS].data.uia[0] = PRINTF_HEADER_SIZE;
-    printfBuffer[PRINTF_OFFSETS].data.uia[1] = 0;
+    char* stringBuffer = (char*) hc::internal::am_alloc_host_coherent(sizeof(char) * numElements * 12);
+    setupPrintfBuffer(printfBuffer, numElements, stringBuffer, numElements * 12);
   }
   return printfBuffer;
 }
@@ -253,12 +278,16 @@ static inline PrintfError printf(PrintfPacket* queue, All... all) [[hc,cpu]] {
   PrintfPacketData old_off, try_off;
 
   if (!queue) {
-    error = PRINTF_BUFFER_NULLPTR;
+    return PRINTF_BUFFER_NULLPTR;
   }
-  else if (count_arg + 1 + queue[PRINTF_OFFSETS].data.uia[0] > queue[PRINTF_BUFFER_SIZE].data.ui) {
+
+  // the host may rewind the offsets concurrently
+  old_off.uli = queue[PRINTF_OFFSETS].data.ali.load();
+
+  if (count_arg + 1 + old_off.uia[0] > queue[PRINTF_BUFFER_SIZE].data.ui) {
     error = PRINTF_BUFFER_OVERFLOW;
   }
-  else if (!queue[PRINTF_STRING_BUFFER].data.ptr || count_char + queue[PRINTF_OFFSETS].data.uia[1] > queue[PRINTF_STRING_BUFFER_SIZE].data.ui){
+  else if (!queue[PRINTF_STRING_BUFFER].data.ptr || count_char + old_off.uia[1] > queue[PRINTF_STRING_BUFFER_SIZE].data.ui){
     error = PRINTF_STRING_BUFFER_OVERFLOW;
   }
   else {
@@ -274,6 +303,7 @@ static inline PrintfError printf(PrintfPacket* queue, All... all) [[hc,cpu]] {
 
     unsigned int poffset = (unsigned int)old_off.uia[0];
     unsigned int soffset = (unsigned int)old_off.uia[1];
+    PrintfPacketDataType header = PRINTF_DROPPED;
 
     if (poffset + count_arg + 1 > queue[PRINTF_BUFFER_SIZE].data.ui) {
       error = PRINTF_BUFFER_OVERFLOW;
@@ -282,8 +312,18 @@ static inline PrintfError printf(PrintfPacket* queue, All... all) [[hc,cpu]] {
       error = PRINTF_STRING_BUFFER_OVERFLOW;
     }
     else {
-      if (set_batch(queue, poffset, soffset, count_arg, all...) != PRINTF_SUCCESS)
+      if (set_batch(queue, poffset + 1, soffset, all...) != PRINTF_SUCCESS)
         error = PRINTF_STRING_BUFFER_OVERFLOW;
+      else
+        header = PRINTF_RECORD;
+    }
+
+    // Publish the record by writing its header last, so that the host may
+    // drain the buffer while kernels are still writing to it.  A record
+    // which could not be written is published as dropped.
+    if (poffset < queue[PRINTF_BUFFER_SIZE].data.ui) {
+      queue[poffset].data.ui = count_arg;
+      __atomic_store_n(&queue[poffset].type, header, __ATOMIC_RELEASE);
     }
   }
 
@@ -311,100 +351,459 @@ static inline PrintfError printf(const char* format_string, All... all) [[hc,cpu
 
 #endif
 
-// regex for finding format string specifiers
-static const std::regex specifierPattern("(%){1}[-+#0]*[0-9]*((.)[0-9]+){0,1}([hl]*)([diuoxXfFeEgGaAcsp]){1}");
-static const std::regex signedIntegerPattern("(%){1}[-+#0]*[0-9]*((.)[0-9]+){0,1}([hl]*)([cdi]){1}");
-static const std::regex unsignedIntegerPattern("(%){1}[-+#0]*[0-9]*((.)[0-9]+){0,1}([hl]*)([uoxX]){1}");
-static const std::regex floatPattern("(%){1}[-+#0]*[0-9]*((.)[0-9]+){0,1}([fFeEgGaA]){1}");
-static const std::regex pointerPattern("(%){1}[ps]");
-static const std::regex doubleAmpersandPattern("(%){2}");
-static const std::string ampersand("%");
+//-------------------------------------------------------------------------------------------------
+// Host side processing of the printf buffer
+//
+// Each printf call is a record of packets: a header holding the number of
+// arguments (format string included), the format string and the arguments.
+// The format strings are parsed once into a list of specifiers which is cached
+// by address, and the records are formatted into a buffer written out with
+// fwrite.  A PrintfDrainer consumes the published records of a buffer and
+// rewinds it once they are all consumed, either when the host flushes it or,
+// if started, from a background thread while kernels run.
+
+// A conversion specification of a format string, and the text preceding it
+struct PrintfSpecifier {
+  std::string literal;     // text before the specifier, with "%%" collapsed
+  std::string raw;         // the specifier as written, e.g. "%-8.3lu"
+  std::string spec;        // the specifier without length modifier, e.g. "%-8.3u"
+  std::string spec32;      // for 32-bit arguments, keeping h and hh
+  std::string spec64;      // for 64-bit arguments, e.g. "%-8.3llu"
+  char conversion;
+};
 
-static inline void processPrintfPackets(PrintfPacket* packets, const unsigned int numPackets) {
+struct PrintfFormat {
+  std::vector<PrintfSpecifier> specifiers;
+  std::string tail;        // text after the last specifier
+};
+
+// Parse the specifiers [%][flags][width][.precision][length]conversion of a
+// format string.  A '%' which does not start a supported specifier is
+// printed as is.
+static inline void parsePrintfFormat(const char* format, PrintfFormat& parsed) {
+  static const char* const conversions = "diouxXcfFeEgGaAsp";
+
+  parsed.specifiers.clear();
+  std::string literal;
+  const char* p = format;
+  while (*p != '\0') {
+    const char* percent = std::strchr(p, '%');
+    if (percent == nullptr) {
+      literal.append(p);
+      break;
+    }
+    literal.append(p, percent);
+    if (percent[1] == '%') {
+      literal.push_back('%');
+      p = percent + 2;
+      continue;
+    }
 
-  for (unsigned int i = 0; i < numPackets; ) {
+    const char* s = percent + 1;
+    s += std::strspn(s, "-+ #0");
+    while (*s >= '0' && *s <= '9') ++s;
+    if (*s == '.') {
+      ++s;
+      while (*s >= '0' && *s <= '9') ++s;
+    }
+    const char* length = s;
+    s += std::strspn(s, "hlLjzt");
 
-    unsigned int numPrintfArgs = packets[i++].data.ui;
-    if (numPrintfArgs == 0)
+    if (*s == '\0' || std::strchr(conversions, *s) == nullptr) {
+      literal.push_back('%');
+      p = percent + 1;
       continue;
+    }
 
-    // get the format
-    unsigned int formatStringIndex = i++;
-    assert(packets[formatStringIndex].type == PRINTF_CHAR_PTR
-           || packets[formatStringIndex].type == PRINTF_CONST_CHAR_PTR);
-    std::string formatString((const char*)packets[formatStringIndex].data.cptr);
-    std::smatch specifierMatches;
+    PrintfSpecifier specifier;
+    specifier.literal.swap(literal);
+    specifier.raw.assign(percent, s + 1);
+    specifier.spec.assign(percent, length);
+    specifier.spec32 = specifier.spec;
+    specifier.spec64 = specifier.spec;
+    std::string lengthModifier(length, s);
+    if (lengthModifier == "h" || lengthModifier == "hh")
+      specifier.spec32 += lengthModifier;
+    specifier.spec64 += "ll";
+    specifier.spec.push_back(*s);
+    specifier.spec32.push_back(*s);
+    specifier.spec64.push_back(*s);
+    specifier.conversion = *s;
+    parsed.specifiers.push_back(std::move(specifier));
+    p = s + 1;
+  }
+  parsed.tail.swap(literal);
+}
 
-#if HC_PRINTF_DEBUG
-    std::printf("%s:%d \t number of matches = %d\n", __FUNCTION__, __LINE__, (int)specifierMatches.size());
-#endif
+// Parsed format strings keyed by address.  Format strings are copied to the
+// string buffer of the printf buffer, so the same format usually shows up at
+// a new address until the buffer is rewound; lookups by address which miss,
+// or whose text no longer matches, fall back to a lookup by contents.  Only
+// format strings not seen before are parsed.
+class PrintfFormatCache {
+public:
+  explicit PrintfFormatCache(size_t capacity = 4096) : capacity(capacity), hits(0), misses(0) {}
 
-    for (unsigned int j = 1; j < numPrintfArgs; ++j, ++i) {
+  const PrintfFormat& lookup(const char* format) {
+    auto it = byAddress.find(format);
+    if (it != byAddress.end() && it->second->text == format) {
+      ++hits;
+      return it->second->format;
+    }
 
-      if (!std::regex_search(formatString, specifierMatches, specifierPattern)) {
-        // More printf argument than format specifier??
-        // Just skip to the next printf request
-        i+=(numPrintfArgs - j);
-        break;
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325;
+    for (const char* p = format; *p != '\0'; ++p) {
+      hash ^= static_cast<unsigned char>(*p);
+      hash *= 0x100000001b3;
+    }
+    auto found = byContents.find(hash);
+    if (found != byContents.end() && found->second.text == format) {
+      ++hits;
+    } else {
+      ++misses;
+      if (found == byContents.end() && byContents.size() >= capacity) {
+        byAddress.clear();
+        byContents.clear();
       }
+      Entry& entry = byContents[hash];
+      entry.text = format;
+      parsePrintfFormat(format, entry.format);
+      found = byContents.find(hash);
+    }
+    byAddress[format] = &found->second;
+    return found->second.format;
+  }
 
-      std::string specifier = specifierMatches.str();
-#if HC_PRINTF_DEBUG
-      std::cout << " (specifier found: " << specifier << ") ";
-#endif
+  size_t size() const { return byContents.size(); }
+
+  size_t capacity;
+  uint64_t hits;
+  uint64_t misses;
 
-      // print the substring before the specifier
-      // clean up all the double ampersands
-      std::string prefix = specifierMatches.prefix();
-      prefix = std::regex_replace(prefix,doubleAmpersandPattern,ampersand);
-      std::printf("%s",prefix.c_str());
-
-      std::smatch specifierTypeMatch;
-      if (std::regex_search(specifier, specifierTypeMatch, unsignedIntegerPattern)) {
-        std::printf(specifier.c_str(), packets[i].data.ui);
-      } else if (std::regex_search(specifier, specifierTypeMatch, signedIntegerPattern)) {
-        std::printf(specifier.c_str(), packets[i].data.i);
-      } else if (std::regex_search(specifier, specifierTypeMatch, floatPattern)) {
-        if (packets[i].type == PRINTF_HALF)
-          std::cout << static_cast<float>(packets[i].data.h);
-        else if (packets[i].type == PRINTF_FLOAT)
-          std::printf(specifier.c_str(), packets[i].data.f);
-        else
-          std::printf(specifier.c_str(), packets[i].data.d);
-      } else if (std::regex_search(specifier, specifierTypeMatch, pointerPattern)) {
-        std::printf(specifier.c_str(), packets[i].data.cptr);
+private:
+  struct Entry {
+    std::string text;
+    PrintfFormat format;
+  };
+  std::unordered_map<uint64_t, Entry> byContents;
+  std::unordered_map<const char*, Entry*> byAddress;
+};
+
+// Buffered output to a FILE
+class PrintfWriter {
+public:
+  explicit PrintfWriter(FILE* out) : out(out), used(0) {}
+  PrintfWriter(const PrintfWriter&) = delete;
+  PrintfWriter& operator=(const PrintfWriter&) = delete;
+  ~PrintfWriter() { flush(); }
+
+  void write(const char* s, size_t n) {
+    if (n > sizeof(buffer) - used) {
+      flush();
+      if (n > sizeof(buffer)) {
+        std::fwrite(s, 1, n, out);
+        return;
       }
-      else {
-        assert(false);
+    }
+    std::memcpy(buffer + used, s, n);
+    used += n;
+  }
+
+  void write(const std::string& s) { write(s.data(), s.size()); }
+
+  template <typename T>
+  void format(const std::string& spec, T value) {
+    int n = std::snprintf(buffer + used, sizeof(buffer) - used, spec.c_str(), value);
+    if (n < 0)
+      return;
+    if (size_t(n) >= sizeof(buffer) - used) {
+      flush();
+      if (size_t(n) >= sizeof(buffer)) {
+        std::vector<char> large(n + 1);
+        std::snprintf(large.data(), large.size(), spec.c_str(), value);
+        std::fwrite(large.data(), 1, n, out);
+        return;
       }
-      formatString = specifierMatches.suffix();
+      std::snprintf(buffer, sizeof(buffer), spec.c_str(), value);
     }
-    // print the substring after the last specifier
-    // clean up all the double ampersands before printing
-    formatString = std::regex_replace(formatString,doubleAmpersandPattern,ampersand);
-    std::printf("%s",formatString.c_str());
+    used += n;
+  }
+
+  void flush() {
+    if (used > 0)
+      std::fwrite(buffer, 1, used, out);
+    used = 0;
   }
-  std::flush(std::cout);
+
+private:
+  FILE* out;
+  size_t used;
+  char buffer[16 * 1024];
+};
+
+static inline bool isPrintfString(const PrintfPacket& arg) {
+  return arg.type == PRINTF_CHAR_PTR || arg.type == PRINTF_CONST_CHAR_PTR;
 }
 
-static inline void processPrintfBuffer(PrintfPacket* gpuBuffer) {
+// Print one argument.  The specifier decides how the argument is printed,
+// its packet type how it is read.
+static inline void writePrintfArg(PrintfWriter& writer, const PrintfSpecifier& specifier,
+                                  const PrintfPacket& arg) {
+  bool is64 = false;
+  int64_t integer = 0;
+  double real = 0;
+  switch (arg.type) {
+    case PRINTF_UINT32_T: integer = arg.data.ui;  real = arg.data.ui; break;
+    case PRINTF_INT32_T:  integer = arg.data.i;   real = arg.data.i; break;
+    case PRINTF_UINT64_T: integer = arg.data.uli; real = arg.data.uli; is64 = true; break;
+    case PRINTF_INT64_T:  integer = arg.data.li;  real = arg.data.li; is64 = true; break;
+    case PRINTF_HALF:     real = static_cast<float>(arg.data.h); break;
+    case PRINTF_FLOAT:    real = arg.data.f; break;
+    case PRINTF_DOUBLE:   real = arg.data.d; break;
+    default:              integer = (int64_t)(uintptr_t)arg.data.cptr; is64 = true; break;
+  }
+  if (arg.type == PRINTF_HALF || arg.type == PRINTF_FLOAT || arg.type == PRINTF_DOUBLE) {
+    // a floating point argument printed as an integer is truncated
+    if (real > -9.2e18 && real < 9.2e18)
+      integer = (int64_t)real;
+    is64 = true;
+  }
 
-  if (gpuBuffer == nullptr) return;
+  switch (specifier.conversion) {
+    case 'd': case 'i':
+      if (is64)
+        writer.format(specifier.spec64, (long long)integer);
+      else
+        writer.format(specifier.spec32, (int)integer);
+      break;
+    case 'o': case 'u': case 'x': case 'X':
+      if (is64)
+        writer.format(specifier.spec64, (unsigned long long)integer);
+      else
+        writer.format(specifier.spec32, (unsigned int)integer);
+      break;
+    case 'c':
+      writer.format(specifier.spec, (int)integer);
+      break;
+    case 's':
+      if (isPrintfString(arg)) {
+        writer.format(specifier.spec, arg.data.cptr ? (const char*)arg.data.cptr : "(null)");
+        break;
+      }
+      writer.format(std::string("%p"), arg.data.cptr);
+      break;
+    case 'p':
+      writer.format(specifier.spec, arg.data.cptr);
+      break;
+    default:
+      writer.format(specifier.spec, real);
+      break;
+  }
+}
 
-  unsigned int cursor = gpuBuffer[PRINTF_OFFSETS].data.uia[0];
+// Print a record whose format string has been parsed.  Arguments without a
+// specifier are ignored, specifiers without an argument are printed as is.
+static inline void writePrintfRecord(PrintfWriter& writer, const PrintfFormat& format,
+                                     const PrintfPacket* args, unsigned int numArgs) {
+  for (size_t k = 0; k < format.specifiers.size(); ++k) {
+    const PrintfSpecifier& specifier = format.specifiers[k];
+    writer.write(specifier.literal);
+    if (k < numArgs)
+      writePrintfArg(writer, specifier, args[k]);
+    else
+      writer.write(specifier.raw);
+  }
+  writer.write(format.tail);
+}
 
-  // check whether the printf buffer is non-empty
-  if (cursor !=  PRINTF_HEADER_SIZE) {
-    unsigned int bufferSize = gpuBuffer[PRINTF_BUFFER_SIZE].data.ui;
-    unsigned int numPackets = ((bufferSize<cursor)?bufferSize:cursor) - PRINTF_HEADER_SIZE;
+// Consumes the records of a printf buffer as they are published and rewinds
+// the buffer once every record reserved in it has been consumed.
+//
+// drain() may be called by any thread; calls are serialized.  start() runs
+// drain() on a background thread every interval until stop(), so that long
+// running kernels do not overflow the buffer.
+class PrintfDrainer {
+public:
+  struct Stats {
+    uint64_t records;      // records written
+    uint64_t dropped;      // records the kernels could not write
+    uint64_t rewinds;      // times the buffer was rewound
+    uint64_t formatHits;   // format string cache hits
+    uint64_t formatMisses;
+  };
+
+  explicit PrintfDrainer(FILE* out = stdout)
+    : out(out), buffer(nullptr), next(PRINTF_HEADER_SIZE), stats{},
+      drainBuffer(nullptr), stopping(false) {}
+
+  PrintfDrainer(const PrintfDrainer&) = delete;
+  PrintfDrainer& operator=(const PrintfDrainer&) = delete;
+
+  ~PrintfDrainer() { stop(); }
+
+  // Write out the records of printfBuffer published so far.  Returns the
+  // number of records written.
+  unsigned int drain(PrintfPacket* printfBuffer) {
+    if (printfBuffer == nullptr)
+      return 0;
+
+    std::lock_guard<std::mutex> l(drainMutex);
+    if (printfBuffer != buffer) {
+      buffer = printfBuffer;
+      next = PRINTF_HEADER_SIZE;
+    }
 
-    processPrintfPackets(gpuBuffer+PRINTF_HEADER_SIZE, numPackets);
+    PrintfWriter writer(out);
+    const unsigned int size = buffer[PRINTF_BUFFER_SIZE].data.ui;
+    unsigned int written = 0;
+    for (;;) {
+      PrintfPacketData offsets;
+      offsets.uli = buffer[PRINTF_OFFSETS].data.ali.load(std::memory_order_acquire);
+      const unsigned int cursor = offsets.uia[0];
+      if (cursor < next) {
+        // rewound by someone else
+        next = PRINTF_HEADER_SIZE;
+      }
 
-    // reset the printf buffer and string buffer
-    gpuBuffer[PRINTF_OFFSETS].data.uia[0] = PRINTF_HEADER_SIZE;
-    gpuBuffer[PRINTF_OFFSETS].data.uia[1] = 0;
+      const unsigned int end = std::min(cursor, size);
+      while (next < end) {
+        PrintfPacket& header = buffer[next];
+        PrintfPacketDataType type = __atomic_load_n(&header.type, __ATOMIC_ACQUIRE);
+        if (type != PRINTF_RECORD && type != PRINTF_DROPPED)
+          break;   // the record is still being written
+
+        const unsigned int numPrintfArgs = header.data.ui;
+        const unsigned int recordEnd = (numPrintfArgs > size - next - 1) ? size : next + 1 + numPrintfArgs;
+        if (type == PRINTF_DROPPED) {
+          ++stats.dropped;
+        } else if (numPrintfArgs > 0 && recordEnd == next + 1 + numPrintfArgs &&
+                   isPrintfString(buffer[next + 1])) {
+          writePrintfRecord(writer, cache.lookup((const char*)buffer[next + 1].data.cptr),
+                            buffer + next + 2, numPrintfArgs - 1);
+          ++written;
+        }
+        // Clear the arguments as well: after a rewind, a record may reserve
+        // its header where an argument of a consumed record was
+        for (unsigned int i = next + 1; i < recordEnd; ++i)
+          buffer[i].type = PRINTF_UNUSED;
+        __atomic_store_n(&header.type, PRINTF_UNUSED, __ATOMIC_RELAXED);
+        next = recordEnd;
+      }
+
+      if (next < end || cursor == PRINTF_HEADER_SIZE)
+        break;
+
+      // Every record reserved so far is consumed: rewind, unless more were
+      // reserved in the meantime
+      PrintfPacketData rewound;
+      rewound.uia[0] = PRINTF_HEADER_SIZE;
+      rewound.uia[1] = 0;
+      if (buffer[PRINTF_OFFSETS].data.ali.compare_exchange_strong(offsets.uli, rewound.uli)) {
+        next = PRINTF_HEADER_SIZE;
+        ++stats.rewinds;
+        break;
+      }
+    }
+
+    writer.flush();
+    if (written > 0)
+      std::fflush(out);
+    stats.records += written;
+    return written;
   }
+
+  // Drain printfBuffer every interval on a background thread
+  void start(PrintfPacket* printfBuffer, std::chrono::microseconds interval) {
+    stop();
+    std::lock_guard<std::mutex> l(threadMutex);
+    stopping = false;
+    drainBuffer = printfBuffer;
+    drainThread = std::thread([this, interval] {
+      std::unique_lock<std::mutex> lock(threadMutex);
+      while (!cv.wait_for(lock, interval, [this] { return stopping; })) {
+        PrintfPacket* b = drainBuffer;
+        lock.unlock();
+        drain(b);
+        lock.lock();
+      }
+    });
+  }
+
+  // Stop the background thread, if any.  Records published since its last
+  // round are left for the next drain().
+  void stop() {
+    {
+      std::lock_guard<std::mutex> l(threadMutex);
+      if (!drainThread.joinable())
+        return;
+      stopping = true;
+    }
+    cv.notify_all();
+    drainThread.join();
+  }
+
+  // Write out numPackets packets laid out as the records of a printf buffer,
+  // without consuming any buffer.  Serialized with drain().
+  void write(const PrintfPacket* packets, const unsigned int numPackets) {
+    std::lock_guard<std::mutex> l(drainMutex);
+    PrintfWriter writer(out);
+
+    for (unsigned int i = 0; i < numPackets; ) {
+
+      unsigned int numPrintfArgs = packets[i++].data.ui;
+      if (numPrintfArgs == 0)
+        continue;
+
+      // get the format
+      unsigned int formatStringIndex = i;
+      i += numPrintfArgs;
+      if (i > numPackets || !isPrintfString(packets[formatStringIndex]))
+        break;
+
+      writePrintfRecord(writer, cache.lookup((const char*)packets[formatStringIndex].data.cptr),
+                        packets + formatStringIndex + 1, numPrintfArgs - 1);
+      ++stats.records;
+    }
+    writer.flush();
+    std::fflush(out);
+  }
+
+  Stats getStats() {
+    std::lock_guard<std::mutex> l(drainMutex);
+    Stats s = stats;
+    s.formatHits = cache.hits;
+    s.formatMisses = cache.misses;
+    return s;
+  }
+
+private:
+  FILE* out;
+
+  // guarded by drainMutex
+  std::mutex drainMutex;
+  PrintfPacket* buffer;
+  unsigned int next;       // header of the next record to consume
+  PrintfFormatCache cache;
+  Stats stats;
+
+  // background thread, guarded by threadMutex
+  std::mutex threadMutex;
+  std::condition_variable cv;
+  std::thread drainThread;
+  PrintfPacket* drainBuffer;
+  bool stopping;
+};
+
+// Both are written out by the drainer of the runtime context, which every
+// translation unit shares, with its position in hc::printf_buffer and its
+// format cache.
+static inline void processPrintfPackets(PrintfPacket* packets, const unsigned int numPackets) {
+  Kalmar::getContext()->processPrintfPackets(packets, numPackets);
 }
 
+static inline void processPrintfBuffer(PrintfPacket* gpuBuffer) {
+  Kalmar::getContext()->processPrintfBuffer(gpuBuffer);
+}
 
 } // namespace hc
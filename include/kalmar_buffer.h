@@ -36,7 +36,7 @@ public:
     T* map_ptr(bool modify, size_t count, size_t offset) const { return nullptr; }
     void unmap_ptr(const void* addr, bool modify, size_t count, size_t offset) const {}
     void synchronize(bool modify = false) const {}
-    void get_cpu_access(bool modify = false) const {}
+    void get_cpu_access(bool modify = false, size_t count = 0, size_t offset = 0) const {}
     void copy(_data<T> other, int, int, int) const {}
     void write(const T*, int , int offset = 0, bool blocking = false) const {}
     void read(T*, int , int offset = 0) const {}
@@ -79,7 +79,9 @@ public:
     void refresh() const {}
     size_t size() const { return mm->count; }
     void reset() const { mm.reset(); }
-    void get_cpu_access(bool modify = false) const { mm->get_cpu_access(modify); }
+    void get_cpu_access(bool modify = false, size_t count = 0, size_t offset = 0) const {
+        mm->get_cpu_access(modify, count * sizeof(T), offset * sizeof(T));
+    }
     std::shared_ptr<KalmarQueue> get_av() const { return mm->master; }
     std::shared_ptr<KalmarQueue> get_stage() const { return mm->stage; }
     access_type get_access() const { return mm->mode; }
@@ -96,7 +98,9 @@ public:
         return (T*)mm->map(count * sizeof(T), offset * sizeof(T), modify);
     }
     void unmap_ptr(const void* addr, bool modify, size_t count, size_t offset) const { return mm->unmap(const_cast<void*>(addr), count * sizeof(T), offset * sizeof(T), modify); }
-    void sync_to(std::shared_ptr<KalmarQueue> pQueue) const { mm->sync(pQueue, false); }
+    void sync_to(std::shared_ptr<KalmarQueue> pQueue, size_t count = 0, size_t offset = 0) const {
+        mm->sync(pQueue, false, true, count * sizeof(T), offset * sizeof(T));
+    }
 
     __attribute__((annotate("serialize")))
         void __cxxamp_serialize(Serialize& s) const {
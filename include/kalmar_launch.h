@@ -20,6 +20,7 @@ static void append_kernel(const std::shared_ptr<KalmarQueue>& pQueue, const Kern
   Kalmar::BufferArgumentsAppender vis(pQueue, kernel);
   Kalmar::Serialize s(&vis);
   f.__cxxamp_serialize(s);
+  vis.flush();
 }
 
 template <typename Kernel>
@@ -46,11 +47,7 @@ mcw_cxxamp_launch_kernel_async(const std::shared_ptr<KalmarQueue>& pQueue, size_
   //this triggers the trampoline code being emitted
   // FIXME: implicitly casting to avoid pointer to int error
   int* foo = reinterpret_cast<int*>(&Kernel::__cxxamp_trampoline);
-  void *kernel = NULL;
-  {
-      std::string kernel_name(f.__cxxamp_trampoline_name());
-      kernel = CLAMP::CreateKernel(kernel_name, pQueue.get());
-  }
+  void *kernel = CLAMP::CreateKernel(f.__cxxamp_trampoline_name(), pQueue.get());
   append_kernel(pQueue, f, kernel);
   return pQueue->LaunchKernelAsync(kernel, dim_ext, ext, local_size);
 #endif
@@ -69,11 +66,7 @@ void mcw_cxxamp_launch_kernel(const std::shared_ptr<KalmarQueue>& pQueue, size_t
   //this triggers the trampoline code being emitted
   // FIXME: implicitly casting to avoid pointer to int error
   int* foo = reinterpret_cast<int*>(&Kernel::__cxxamp_trampoline);
-  void *kernel = NULL;
-  {
-      std::string kernel_name(f.__cxxamp_trampoline_name());
-      kernel = CLAMP::CreateKernel(kernel_name, pQueue.get());
-  }
+  void *kernel = CLAMP::CreateKernel(f.__cxxamp_trampoline_name(), pQueue.get());
   append_kernel(pQueue, f, kernel);
   pQueue->LaunchKernel(kernel, dim_ext, ext, local_size);
 #endif // __KALMAR_ACCELERATOR__
@@ -90,9 +83,7 @@ inline void* mcw_cxxamp_get_kernel(const std::shared_ptr<KalmarQueue>& pQueue, c
   //this triggers the trampoline code being emitted
   // FIXME: implicitly casting to avoid pointer to int error
   int* foo = reinterpret_cast<int*>(&Kernel::__cxxamp_trampoline);
-  void *kernel = NULL;
-  std::string kernel_name (f.__cxxamp_trampoline_name());
-  kernel = CLAMP::CreateKernel(kernel_name, pQueue.get());
+  void *kernel = CLAMP::CreateKernel(f.__cxxamp_trampoline_name(), pQueue.get());
   return kernel;
 #else
   return NULL;
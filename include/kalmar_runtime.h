@@ -6,7 +6,9 @@
 
 namespace hc {
 class AmPointerInfo;
+struct AmCacheStats;
 class completion_future;
+class PrintfPacket;
 }; // end namespace hc
 
 typedef struct hsa_kernel_dispatch_packet_s hsa_kernel_dispatch_packet_t;
@@ -104,7 +106,8 @@ static inline bool isComputeQueueCommand(hcCommandKind k) {
 
 enum hcWaitMode {
     hcWaitModeBlocked = 0,
-    hcWaitModeActive = 1
+    hcWaitModeActive = 1,
+    hcWaitModeAdaptive = 2   // spin for about as long as recent ops took, then block
 };
 
 enum hcAgentProfile {
@@ -127,6 +130,27 @@ class KalmarDevice;
 class KalmarQueue;
 struct rw_info;
 
+/// CompletionFd
+///
+/// eventfd made readable once an async operation has completed, see
+/// KalmarAsyncOp::getCompletionFd.  Closed once the operation and the pending
+/// notification have both released it.
+class CompletionFd {
+public:
+  explicit CompletionFd(int fd) : fd(fd) {}
+  CompletionFd(const CompletionFd&) = delete;
+  CompletionFd& operator=(const CompletionFd&) = delete;
+  ~CompletionFd();
+
+  int get() const { return fd; }
+
+  /// make the descriptor readable; safe to call from a signal handler thread
+  void signal();
+
+private:
+  int fd;
+};
+
 /// KalmarAsyncOp
 ///
 /// This is an abstraction of all asynchronous operations within Kalmar
@@ -136,6 +160,30 @@ public:
 
   virtual ~KalmarAsyncOp() {} 
   virtual std::shared_future<void>* getFuture() { return nullptr; }
+
+  /**
+   * Wait for the async operation to complete.  Used by completion_future for
+   * operations which do not provide a future through getFuture().  Only the
+   * first call waits; later calls return immediately.
+   */
+  virtual void wait() {}
+
+  /**
+   * Same as wait(), but waits in \p mode instead of the wait mode of the
+   * async operation.  Does not change the wait mode of the operation, which
+   * may be shared with other waiters.
+   */
+  virtual void wait(hcWaitMode mode) { wait(); }
+
+  /**
+   * Wait for the async operation to complete, for at most timeout.
+   * nanoseconds::max() waits as long as wait().  The default implementation
+   * polls isReady().
+   *
+   * @return True if the async operation has completed.
+   */
+  virtual bool waitFor(std::chrono::nanoseconds timeout);
+
   virtual void* getNativeHandle() { return nullptr;}
 
   /**
@@ -167,12 +215,32 @@ public:
   virtual bool isReady() { return false; }
 
   /**
-   * Set the wait mode of the async operation.
+   * Set the wait mode of the async operation.  Operations start with the
+   * default wait mode of their queue.
    *
    * @param mode[in] wait mode, must be one of the value in hcWaitMode enum.
    */
   virtual void setWaitMode(hcWaitMode mode) {}
 
+  /**
+   * Run callback on the runtime callback workers (see CLAMP::EnqueueCallback)
+   * once the async operation has completed.  The default implementation
+   * occupies a worker in wait(); runtimes which get notified of completion
+   * override it.
+   *
+   * @param callback[in] functor to run, it should keep alive whatever it needs.
+   */
+  virtual void setCallback(std::function<void()> callback);
+
+  /**
+   * Get a file descriptor which becomes readable once the async operation op
+   * has completed, for poll, select or epoll.  It is an eventfd created on the
+   * first call and closed when op is destroyed.
+   *
+   * @return The file descriptor, or -1 if it could not be created.
+   */
+  static int getCompletionFd(const std::shared_ptr<KalmarAsyncOp>& op);
+
   void setSeqNumFromQueue();
   uint64_t getSeqNum () const { return seqNum;};
 
@@ -181,6 +249,16 @@ public:
 
   KalmarQueue  *getQueue() const { return queue; };
 
+protected:
+  /**
+   * Signal fd once the async operation has completed.  The default
+   * implementation does it from the callback workers through setCallback(),
+   * keeping self alive until then; runtimes which get notified of completion
+   * may signal it directly.
+   */
+  virtual void notifyOnCompletion(const std::shared_ptr<CompletionFd>& fd,
+                                  const std::shared_ptr<KalmarAsyncOp>& self);
+
 private:
   KalmarQueue    *queue;
 
@@ -191,6 +269,28 @@ private:
   // Sequence number of this op in the queue it is dispatched into.
   uint64_t       seqNum;
 
+  // created by the first getCompletionFd()
+  std::once_flag                completionFdOnce;
+  std::shared_ptr<CompletionFd> completionFd;
+
+};
+
+/// KalmarGraph
+/// Commands recorded on a KalmarQueue between beginCapture and endCapture,
+/// numbered in capture order.  See hc::command_graph.
+class KalmarGraph {
+public:
+  virtual ~KalmarGraph() {}
+
+  /// number of recorded commands
+  virtual size_t size() const = 0;
+
+  /// kind of the command recorded as node
+  virtual hcCommandKind getNodeKind(size_t node) const = 0;
+
+  /// host copy of the arguments of a kernel node, patched in place between
+  /// replays.  Returns nullptr, and sets *size to 0, for other nodes.
+  virtual void* getKernelArgs(size_t node, size_t *size) = 0;
 };
 
 /// KalmarQueue
@@ -201,13 +301,31 @@ class KalmarQueue
 public:
 
   KalmarQueue(KalmarDevice* pDev, queuing_mode mode = queuing_mode_automatic, execute_order order = execute_in_order, queue_priority priority = priority_normal)
-      : pDev(pDev), mode(mode), order(order), priority(priority), opSeqNums(0) {}
+      : pDev(pDev), mode(mode), order(order), priority(priority), opSeqNums(0), defaultWaitMode(hcWaitModeBlocked) {}
 
   virtual ~KalmarQueue() {}
 
   virtual void flush() {}
   virtual void wait(hcWaitMode mode = hcWaitModeBlocked) {}
 
+  /// wait mode of ops enqueued from now on, and of waits on the
+  /// accelerator_view which do not name one
+  hcWaitMode getDefaultWaitMode() const { return defaultWaitMode.load(std::memory_order_relaxed); }
+  void setDefaultWaitMode(hcWaitMode waitMode) { defaultWaitMode.store(waitMode, std::memory_order_relaxed); }
+
+  /// open / close a dispatch batch.  Commands enqueued while a batch is open are
+  /// submitted to the device together when the outermost batch is closed, or
+  /// earlier on flush() or any wait.  Batches nest.
+  virtual void beginDispatchBatch() {}
+  virtual void endDispatchBatch() {}
+
+  /// record commands into a graph instead of submitting them, until endCapture
+  /// returns the graph.  replayGraph submits the recorded commands again and
+  /// returns the op of the last one.
+  virtual void beginCapture() {}
+  virtual std::shared_ptr<KalmarGraph> endCapture() { return nullptr; }
+  virtual std::shared_ptr<KalmarAsyncOp> replayGraph(const std::shared_ptr<KalmarGraph>& graph) { return nullptr; }
+
   // sync kernel launch with dynamic group memory
   virtual void LaunchKernelWithDynamicGroupMemory(void *kernel, size_t dim_ext, size_t *ext, size_t *local_size, size_t dynamic_group_size) {}
 
@@ -237,7 +355,8 @@ public:
   /// unmap host accessible pointer
   virtual void unmap(void* device, void* addr, size_t count, size_t offset, bool modify) = 0;
 
-  /// push device pointer to kernel argument list
+  /// register device pointer \p device used by kernel argument \p idx; the
+  /// pointer itself is part of the kernarg image passed to CLAMP::PushArgs
   virtual void Push(void *kernel, int idx, void* device, bool modify) = 0;
 
   virtual uint32_t GetGroupSegmentSize(void *kernel) { return 0; }
@@ -327,6 +446,8 @@ private:
   queue_priority priority;
 
   uint64_t      opSeqNums; // last seqnum assigned to an op in this queue
+
+  std::atomic<hcWaitMode> defaultWaitMode;
 };
 
 /// KalmarDevice
@@ -378,6 +499,9 @@ public:
     virtual bool is_emulated() const = 0;
     virtual uint32_t get_version() const = 0;
 
+    /// true for the cpu device; same as get_path() == L"cpu" without building a string
+    virtual bool is_cpu_device() const { return false; }
+
     /// create buffer
     /// @key on device that supports shared memory
     //       key can used to avoid duplicate allocation
@@ -387,6 +511,15 @@ public:
     /// @key: used to avoid duplicate release
     virtual void release(void* ptr, struct rw_info* key) = 0;
 
+    /// release buffer once the commands already enqueued which use it have
+    /// completed, without waiting for them
+    /// Devices which do not track buffer uses drain their queues first.
+    virtual void releaseDeferred(void* ptr, struct rw_info* key) {
+        for (auto& queue : get_all_queues())
+            queue->wait();
+        release(ptr, key);
+    }
+
     /// build program
     virtual void BuildProgram(void* size, void* source) {}
 
@@ -396,6 +529,9 @@ public:
     /// check if a given kernel is compatible with the device
     virtual bool IsCompatibleKernel(void* size, void* source) { return true; }
 
+    /// report the time taken to load the embedded programs on the device
+    virtual void ReportProgramLoad(uint64_t durationNs, size_t codeObjects) {}
+
     /// check the dimension information is correct
     virtual bool check(size_t* size, size_t dim_ext) { return true; }
 
@@ -449,6 +585,19 @@ public:
 
     virtual bool has_cpu_accessible_am() {return false;}
 
+    /// start of the memory pool allocation holding ptr, ptr if it is not cached memory
+    virtual void* cacheAllocationBase(void* ptr) { return ptr; }
+
+    /// return cached memory to the pool until at most @p keepBytes are cached
+    /// return the number of bytes released
+    virtual size_t cacheTrim(size_t keepBytes) { return 0; }
+
+    /// set the max bytes the cache keeps once freed
+    virtual void cacheSetLimit(size_t bytes) {}
+
+    /// fill @p stats with statistics of the device memory cache, false if the device has no cache
+    virtual bool getCacheStats(hc::AmCacheStats* stats) { return false; }
+
 };
 
 class CPUQueue final : public KalmarQueue
@@ -493,6 +642,7 @@ public:
     bool is_unified() const override { return true; }
     bool is_emulated() const override { return true; }
     uint32_t get_version() const override { return 0; }
+    bool is_cpu_device() const override { return true; }
 
     std::shared_ptr<KalmarQueue> createQueue(execute_order order = execute_in_order, queue_priority priority = priority_normal) override { return std::shared_ptr<KalmarQueue>(new CPUQueue(this)); }
     void* create(size_t count, struct rw_info* /* not used */ ) override { return kalmar_aligned_alloc(0x1000, count); }
@@ -575,12 +725,68 @@ public:
     // flush the device printf buffer
     virtual void flushPrintfBuffer() {};
 
+    // write out the records published so far in a printf buffer
+    virtual void processPrintfBuffer(hc::PrintfPacket* buffer) {};
+
+    // write out numPackets packets laid out as the records of a printf buffer
+    virtual void processPrintfPackets(hc::PrintfPacket* packets, unsigned int numPackets) {};
+
     // get the locked printf buffer VA
     virtual void* getPrintfBufferPointerVA() { return nullptr; };
 };
 
 KalmarContext *getContext();
 
+/// Statistics of the callbacks run by the callback workers.  Dispatch latency
+/// is the time from a callback being handed to the workers (normally when the
+/// operation it waits for completes) until it starts running.
+struct CallbackStats {
+    uint64_t callbacks;
+    uint64_t totalLatencyNs;
+    uint64_t maxLatencyNs;
+};
+
+/// KalmarHostOp
+///
+/// An async operation completed by the host, used for the continuations
+/// returned by completion_future::then.  It has no queue and no native handle.
+class KalmarHostOp final : public KalmarAsyncOp {
+public:
+  KalmarHostOp() : KalmarAsyncOp(nullptr, hcCommandMarker), done(false) {}
+
+  using KalmarAsyncOp::wait;
+
+  void wait() override {
+    std::unique_lock<std::mutex> lk(mutex);
+    cv.wait(lk, [this] { return done; });
+  }
+
+  bool waitFor(std::chrono::nanoseconds timeout) override {
+    if (timeout == std::chrono::nanoseconds::max()) {
+      wait();
+      return true;
+    }
+    std::unique_lock<std::mutex> lk(mutex);
+    return cv.wait_for(lk, timeout, [this] { return done; });
+  }
+
+  bool isReady() override {
+    std::lock_guard<std::mutex> lk(mutex);
+    return done;
+  }
+
+  void setCallback(std::function<void()> callback) override;
+
+  /// Mark the operation complete and hand the registered callbacks to the workers.
+  void complete();
+
+private:
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool done;
+  std::vector<std::function<void()>> callbacks;
+};
+
 namespace CLAMP {
 // used in parallel_for_each.h
 #if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
@@ -591,9 +797,17 @@ extern void leave_kernel();
 #endif
 
 extern void *CreateKernel(std::string, KalmarQueue*);
+extern void *CreateKernel(const char*, KalmarQueue*);
 
-extern void PushArg(void *, int, size_t, const void *);
+extern void PushArg(void *, int, size_t, size_t, const void *);
 extern void PushArgPtr(void *, int, size_t, const void *);
+// Hand the whole kernarg image built by BufferArgumentsAppender to the kernel.
+extern void PushArgs(void *, const void *, size_t);
+
+// Run func on the bounded pool of callback workers (HCC_CALLBACK_THREADS).
+// Callbacks should not block on each other since the pool does not grow.
+extern void EnqueueCallback(std::function<void()> func);
+extern CallbackStats GetCallbackStats();
 
 } // namespace CLAMP
 
@@ -603,7 +817,7 @@ static inline const std::shared_ptr<KalmarQueue> get_cpu_queue() {
 }
 
 static inline bool is_cpu_queue(const std::shared_ptr<KalmarQueue>& Queue) {
-    return Queue->getDev()->get_path() == L"cpu";
+    return Queue->getDev()->is_cpu_device();
 }
 
 static inline void copy_helper(std::shared_ptr<KalmarQueue>& srcQueue, void* src,
@@ -618,15 +832,22 @@ static inline void copy_helper(std::shared_ptr<KalmarQueue>& srcQueue, void* src
     /// For example, if src is on cpu and dst is on device,
     /// in OpenCL, clEnqueueWrtieBuffer to write data from src to device
     
+    /// Only data from the cpu can be written without blocking, the queue
+    /// stages it before returning
     if (is_cpu_queue(dstQueue))
         srcQueue->read(src, (char*)dst + dst_offset, cnt, src_offset);
     else
-        dstQueue->write(dst, (char*)src + src_offset, cnt, dst_offset, block);
+        dstQueue->write(dst, (char*)src + src_offset, cnt, dst_offset, block || !is_cpu_queue(srcQueue));
 }
 
 /// software MSI protocol
 /// https://en.wikipedia.org/wiki/MSI_protocol
 /// Used to avoid unnecessary copy when array_view<const, T> is used
+///
+/// The state is kept per byte range: a range valid on one device only is
+/// modified there, valid on several devices it is shared, and it is invalid
+/// on the devices it is not valid on.  The states are used to describe the
+/// initial contents of a device buffer.
 enum states
 {
     /// exclusive owned data, safe to read and wrtie
@@ -637,16 +858,126 @@ enum states
     invalid
 };
 
+/// set of disjoint byte ranges [begin, end) of a buffer
+/// Adjacent and overlapping ranges are merged, so a buffer which is used as a
+/// whole is a single range.
+class range_set
+{
+    /// begin -> end
+    std::map<size_t, size_t> ranges;
+
+public:
+    typedef std::vector<std::pair<size_t, size_t>> range_list;
+
+    bool empty() const { return ranges.empty(); }
+
+    void clear() { ranges.clear(); }
+
+    /// add [begin, end) to the set
+    void add(size_t begin, size_t end) {
+        if (begin >= end)
+            return;
+        auto it = ranges.upper_bound(begin);
+        if (it != ranges.begin()) {
+            auto prev = it;
+            --prev;
+            if (prev->second >= begin) {
+                begin = prev->first;
+                it = prev;
+            }
+        }
+        while (it != ranges.end() && it->first <= end) {
+            end = std::max(end, it->second);
+            it = ranges.erase(it);
+        }
+        ranges[begin] = end;
+    }
+
+    /// remove [begin, end) from the set
+    void remove(size_t begin, size_t end) {
+        if (begin >= end)
+            return;
+        auto it = ranges.upper_bound(begin);
+        if (it != ranges.begin()) {
+            auto prev = it;
+            --prev;
+            if (prev->second > begin) {
+                /// [begin, end) falls in prev, keep what is around it
+                if (prev->second > end)
+                    ranges[end] = prev->second;
+                if (prev->first == begin)
+                    ranges.erase(prev);
+                else
+                    prev->second = begin;
+            }
+        }
+        while (it != ranges.end() && it->first < end) {
+            if (it->second > end) {
+                ranges[end] = it->second;
+                ranges.erase(it);
+                break;
+            }
+            it = ranges.erase(it);
+        }
+    }
+
+    /// true if all of [begin, end) is in the set
+    bool contains(size_t begin, size_t end) const {
+        if (begin >= end)
+            return true;
+        auto it = ranges.upper_bound(begin);
+        if (it == ranges.begin())
+            return false;
+        --it;
+        return it->second >= end;
+    }
+
+    /// the parts of [begin, end) which are in the set
+    range_list overlap(size_t begin, size_t end) const {
+        range_list parts;
+        auto it = ranges.upper_bound(begin);
+        if (it != ranges.begin())
+            --it;
+        for (; it != ranges.end() && it->first < end; ++it) {
+            size_t lo = std::max(begin, it->first);
+            size_t hi = std::min(end, it->second);
+            if (lo < hi)
+                parts.emplace_back(lo, hi);
+        }
+        return parts;
+    }
+
+    /// the parts of [begin, end) which are not in the set
+    range_list gaps(size_t begin, size_t end) const {
+        range_list parts;
+        size_t pos = begin;
+        for (const auto& part : overlap(begin, end)) {
+            if (part.first > pos)
+                parts.emplace_back(pos, part.first);
+            pos = part.second;
+        }
+        if (pos < end)
+            parts.emplace_back(pos, end);
+        return parts;
+    }
+};
+
 /// buffer information
 /// Used in rw_info, represent cached data for each device
 /// Whenever rw_info is going to be used on device, it will create a buffer at
 /// that device.
 /// @data: device data pointer
-/// @state: used to implement MSI protocol
+/// @valid: byte ranges of the buffer that are up to date on the device
 struct dev_info
 {
     void* data; /// pointer to device data
-    states state; /// state of the data on current device
+    range_set valid; /// ranges of the data which are up to date on current device
+
+    dev_info() : data(nullptr), valid() {}
+    dev_info(void* data, states state, size_t count) : data(data), valid() {
+        if (state != invalid)
+            valid.add(0, count);
+    }
 };
 
 /// rw_info is modeled as multiprocessor without shared cache
@@ -658,6 +989,10 @@ struct dev_info
 ///
 /// Whenever rw_info is going to be used on device, it will allocate memory on
 /// targeting device and do the computation
+///
+/// Coherence is tracked per byte range, so accessing a section of a buffer
+/// only copies the parts of that section which are stale on the accessing
+/// device.  Kernels always access the whole buffer.
 struct rw_info
 {
     /// host accessible pointer, it will be set if
@@ -687,6 +1022,14 @@ struct rw_info
     /// constructed with a given device pointer.
     bool toReleaseDevPointer;
 
+    /// The range last synchronized to curr, which needs no more work until
+    /// something else happens to this rw_info.  Saves the range lookups when
+    /// array_view elements are accessed one by one on the host.
+    bool lastValid;
+    bool lastModify;
+    size_t lastBegin;
+    size_t lastEnd;
+
 
     /// consruct array_view
     /// According to standard, array_view will be constructed by size, or size with
@@ -695,7 +1038,8 @@ struct rw_info
     /// device, set the HostPtr flag to prevent destructor to release it
     rw_info(const size_t count, void* ptr)
         : data(ptr), count(count), curr(nullptr), master(nullptr), stage(nullptr),
-        devs(), mode(access_type_none), HostPtr(ptr != nullptr), toReleaseDevPointer(true) {
+        devs(), mode(access_type_none), HostPtr(ptr != nullptr), toReleaseDevPointer(true),
+        lastValid(false), lastModify(false), lastBegin(0), lastEnd(0) {
 #if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
             /// if array_view is constructed in cpu path kernel
             /// allocate memory for it and do nothing
@@ -707,7 +1051,7 @@ struct rw_info
             if (ptr) {
                 mode = access_type_read_write;
                 curr = master = get_cpu_queue();
-                devs[curr->getDev()] = {ptr, modified};
+                devs[curr->getDev()] = dev_info(ptr, modified, count);
             }
         }
 
@@ -719,7 +1063,8 @@ struct rw_info
     ///    If it is not, ignore the stage one, fallback to case 1.
     rw_info(const std::shared_ptr<KalmarQueue>& Queue, const std::shared_ptr<KalmarQueue>& Stage,
             const size_t count, access_type mode_) : data(nullptr), count(count),
-    curr(Queue), master(Queue), stage(nullptr), devs(), mode(mode_), HostPtr(false), toReleaseDevPointer(true) {
+    curr(Queue), master(Queue), stage(nullptr), devs(), mode(mode_), HostPtr(false), toReleaseDevPointer(true),
+    lastValid(false), lastModify(false), lastBegin(0), lastEnd(0) {
 #if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
         if (CLAMP::in_cpu_kernel() && data == nullptr) {
             data = kalmar_aligned_alloc(0x1000, count);
@@ -728,7 +1073,7 @@ struct rw_info
 #endif
         if (mode == access_type_auto)
             mode = curr->getDev()->get_access();
-        devs[curr->getDev()] = {curr->getDev()->create(count, this), modified};
+        devs[curr->getDev()] = dev_info(curr->getDev()->create(count, this), modified, count);
 
         /// set data pointer, if it is accessible from cpu
         if (is_cpu_queue(curr) || (curr->getDev()->is_unified() && mode != access_type_none))
@@ -736,7 +1081,7 @@ struct rw_info
         if (is_cpu_queue(curr)) {
             stage = Stage;
             if (Stage != curr)
-                devs[stage->getDev()] = {stage->getDev()->create(count, this), invalid};
+                devs[stage->getDev()] = dev_info(stage->getDev()->create(count, this), invalid, count);
         } else
             /// if curr is not cpu, ignore the stage one
             stage = curr;
@@ -750,10 +1095,11 @@ struct rw_info
     rw_info(const std::shared_ptr<KalmarQueue>& Queue, const std::shared_ptr<KalmarQueue>& Stage,
             const size_t count,
             void* device_pointer,
-            access_type mode_) : data(nullptr), count(count), curr(Queue), master(Queue), stage(nullptr), devs(), mode(mode_), HostPtr(false), toReleaseDevPointer(false) {
+            access_type mode_) : data(nullptr), count(count), curr(Queue), master(Queue), stage(nullptr), devs(), mode(mode_), HostPtr(false), toReleaseDevPointer(false),
+            lastValid(false), lastModify(false), lastBegin(0), lastEnd(0) {
          if (mode == access_type_auto)
              mode = curr->getDev()->get_access();
-         devs[curr->getDev()] = { device_pointer, modified };
+         devs[curr->getDev()] = dev_info(device_pointer, modified, count);
 
          /// set data pointer, if it is accessible from cpu
          if (is_cpu_queue(curr) || (curr->getDev()->is_unified() && mode != access_type_none))
@@ -761,7 +1107,7 @@ struct rw_info
          if (is_cpu_queue(curr)) {
              stage = Stage;
              if (Stage != curr)
-                 devs[stage->getDev()] = {stage->getDev()->create(count, this), invalid};
+                 devs[stage->getDev()] = dev_info(stage->getDev()->create(count, this), invalid, count);
          } else
              /// if curr is not cpu, ignore the stage one
              stage = curr;
@@ -772,30 +1118,92 @@ struct rw_info
     }
 
     void construct(std::shared_ptr<KalmarQueue> pQueue) {
+        lastValid = false;
         curr = pQueue;
-        devs[pQueue->getDev()] = {pQueue->getDev()->create(count, this), invalid};
+        devs[pQueue->getDev()] = dev_info(pQueue->getDev()->create(count, this), invalid, count);
         if (is_cpu_queue(pQueue))
             data = devs[pQueue->getDev()].data;
     }
 
     void disc() {
+        lastValid = false;
         for (auto& it : devs)
-            it.second.state = invalid;
+            it.second.valid.clear();
     }
 
-    /// optimization: Before performing copy, if the state of cpu accelerator is
-    /// shared, it implies that the data on cpu is the same on device where
-    /// curr located, use data on cpu to perform the later operation
-    /// For example, if data on device a is going to be copied to device b
-    /// and the data on device a and cpu is the same, it is okay to copy data 
-    /// from cpu to device b
-    void try_switch_to_cpu() {
-        if (is_cpu_queue(curr))
-            return;
-        auto cpu_queue = get_cpu_queue();
-        if (devs.find(cpu_queue->getDev()) != std::end(devs))
-            if (devs[cpu_queue->getDev()].state == shared)
-                curr = cpu_queue;
+    /// buffer on the device pQueue belongs to, allocated if there is none yet
+    dev_info& get_dev_info(const std::shared_ptr<KalmarQueue>& pQueue) {
+        auto it = devs.find(pQueue->getDev());
+        if (it == std::end(devs)) {
+            it = devs.emplace(pQueue->getDev(),
+                              dev_info(pQueue->getDev()->create(count, this), invalid, count)).first;
+            if (is_cpu_queue(pQueue))
+                data = it->second.data;
+        }
+        return it->second;
+    }
+
+    /// queue used to copy out of the buffer on pDev
+    std::shared_ptr<KalmarQueue> get_queue(KalmarDevice* pDev) {
+        if (curr && curr->getDev() == pDev)
+            return curr;
+        return pDev->get_default_queue();
+    }
+
+    /// mark [begin, end) as stale on every device except pDev
+    void invalidate_others(KalmarDevice* pDev, size_t begin, size_t end) {
+        for (auto& it : devs)
+            if (it.first != pDev)
+                it.second.valid.remove(begin, end);
+    }
+
+    /// copy the parts of [begin, end) which are stale in dst, the buffer on the
+    /// device pQueue belongs to, from the devices they are valid on
+    /// optimization: the cpu is copied from first, then the device where curr
+    /// located.  For example, if data on device a is going to be copied to
+    /// device b and the data on device a and cpu is the same, it is okay to
+    /// copy data from cpu to device b
+    /// returns the parts which are not valid on any device
+    range_set::range_list fetch(std::shared_ptr<KalmarQueue> pQueue, dev_info& dst,
+                                size_t begin, size_t end, bool block) {
+        range_set::range_list missing = dst.valid.gaps(begin, end);
+        if (missing.empty())
+            return missing;
+
+        std::vector<KalmarDevice*> order;
+        KalmarDevice* cpu_dev = get_cpu_queue()->getDev();
+        if (devs.find(cpu_dev) != std::end(devs))
+            order.push_back(cpu_dev);
+        if (curr && curr->getDev() != cpu_dev)
+            order.push_back(curr->getDev());
+        for (const auto& it : devs)
+            if (std::find(order.begin(), order.end(), it.first) == order.end())
+                order.push_back(it.first);
+
+        for (KalmarDevice* pDev : order) {
+            if (pDev == pQueue->getDev())
+                continue;
+            dev_info& src = devs[pDev];
+            std::shared_ptr<KalmarQueue> srcQueue = get_queue(pDev);
+            range_set::range_list rest;
+            for (const auto& gap : missing) {
+                size_t pos = gap.first;
+                for (const auto& part : src.valid.overlap(gap.first, gap.second)) {
+                    if (part.first > pos)
+                        rest.emplace_back(pos, part.first);
+                    copy_helper(srcQueue, src.data, pQueue, dst.data,
+                                part.second - part.first, block, part.first, part.first);
+                    dst.valid.add(part.first, part.second);
+                    pos = part.second;
+                }
+                if (pos < gap.second)
+                    rest.emplace_back(pos, gap.second);
+            }
+            missing.swap(rest);
+            if (missing.empty())
+                break;
+        }
+        return missing;
     }
 
     /// synchronize data to device pQueue belongs to by using pQuquq
@@ -803,16 +1211,26 @@ struct rw_info
     /// @modify: the data will be modified or not
     /// @blcok: this call will be blocking or not
     ///         none blocking occurs in serialization stage
-    void sync(std::shared_ptr<KalmarQueue> pQueue, bool modify, bool block = true) {
+    /// @cnt, @offset: byte range that is going to be accessed, only the stale
+    ///         parts of it are copied. cnt == 0 means the whole buffer
+    void sync(std::shared_ptr<KalmarQueue> pQueue, bool modify, bool block = true,
+              size_t cnt = 0, size_t offset = 0) {
 #if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
         if (CLAMP::in_cpu_kernel())
             return;
 #endif
+        if (cnt == 0) {
+            cnt = count;
+            offset = 0;
+        }
+        size_t begin = offset;
+        size_t end = std::min(offset + cnt, count);
+
         if (!curr) {
             /// This can only happen if array_view is constructed with size and
             /// is not accessed before
-            dev_info dev = {pQueue->getDev()->create(count, this),
-                modify ? modified : shared};
+            dev_info dev(pQueue->getDev()->create(count, this),
+                modify ? modified : shared, count);
             devs[pQueue->getDev()] = dev;
             if (is_cpu_queue(pQueue))
                 data = dev.data;
@@ -820,44 +1238,26 @@ struct rw_info
             return;
         }
 
-        if (curr == pQueue)
+        if (lastValid && curr == pQueue && begin >= lastBegin && end <= lastEnd &&
+            (lastModify || !modify))
             return;
 
-        /// If both queues are from the same device, upadte state only
-        if (curr->getDev() == pQueue->getDev()) {
-            // curr->wait();
-            curr = pQueue;
-            if (modify) {
-                disc();
-                devs[curr->getDev()].state = modified;
-            }
-            return;
-        }
-
         /// If the buffer on device is not allocated, allocate space for it
-        if (devs.find(pQueue->getDev()) == std::end(devs)) {
-            dev_info dev = {pQueue->getDev()->create(count, this), invalid};
-            devs[pQueue->getDev()] = dev;
-            if (is_cpu_queue(pQueue))
-                data = dev.data;
-        }
+        /// If both queues are from the same device, there is nothing to copy
+        dev_info& dst = get_dev_info(pQueue);
+        fetch(pQueue, dst, begin, end, block);
+        dst.valid.add(begin, end);
 
-        try_switch_to_cpu();
-        dev_info& dst = devs[pQueue->getDev()];
-        dev_info& src = devs[curr->getDev()];
-        if (dst.state == invalid && src.state != invalid)
-            copy_helper(curr, src.data, pQueue, dst.data, count, block);
-        /// if the data on current device is going to be modified
-        /// changed the state of current device as modified
+        /// if the data on current device is going to be modified, the range
+        /// is only valid on current device
         curr = pQueue;
-        if (modify) {
-            disc();
-            dst.state = modified;
-        } else {
-            dst.state = shared;
-            if (src.state == modified)
-                src.state = shared;
-        }
+        if (modify)
+            invalidate_others(curr->getDev(), begin, end);
+
+        lastValid = true;
+        lastModify = modify;
+        lastBegin = begin;
+        lastEnd = end;
     }
 
     /// return a host accessible pointer from device
@@ -867,19 +1267,25 @@ struct rw_info
     void* map(size_t cnt, size_t offset, bool modify) {
         if (cnt == 0)
             cnt = count;
+        lastValid = false;
         /// This can only happen if this rw_info is constructed only with size
         /// and not accessed on any device
         if (!curr) {
             curr = getContext()->auto_select();
-            devs[curr->getDev()] = {curr->getDev()->create(count, this), modify ? modified : shared};
+            devs[curr->getDev()] = dev_info(curr->getDev()->create(count, this), modify ? modified : shared, count);
             return curr->map(data, cnt, offset, modify);
         }
-        try_switch_to_cpu();
+        /// map the cpu buffer if it holds the range, otherwise bring the range
+        /// up to date on current device
+        auto cpu_queue = get_cpu_queue();
+        auto cpu = devs.find(cpu_queue->getDev());
+        if (cpu != std::end(devs) && cpu->second.valid.contains(offset, offset + cnt))
+            curr = cpu_queue;
         dev_info& info = devs[curr->getDev()];
-        if (info.state == shared && modify) {
-            disc();
-            info.state = modified;
-        }
+        fetch(curr, info, offset, offset + cnt, true);
+        info.valid.add(offset, offset + cnt);
+        if (modify)
+            invalidate_others(curr->getDev(), offset, offset + cnt);
         return curr->map(info.data, cnt, offset, modify);
     }
 
@@ -892,22 +1298,26 @@ struct rw_info
 
     /// synchronize data to cpu accelerator
     /// used in array_view
-    void get_cpu_access(bool modify) { sync(get_cpu_queue(), modify); }
+    /// @cnt, @offset: byte range accessed on cpu, cnt == 0 means the whole buffer
+    void get_cpu_access(bool modify, size_t cnt = 0, size_t offset = 0) {
+        sync(get_cpu_queue(), modify, true, cnt, offset);
+    }
 
     /// Write data from host source pointer to device
-    /// Change state to modified, because the device has exclusive copy of data
+    /// The written range is only valid on the device now
     void write(const void* src, int cnt, int offset, bool blocking) {
-        curr->write(devs[curr->getDev()].data, src, cnt, offset, blocking);
+        lastValid = false;
         dev_info& dev = devs[curr->getDev()];
-        if (dev.state != modified) {
-            disc();
-            dev.state = modified;
-        }
+        curr->write(dev.data, src, cnt, offset, blocking);
+        dev.valid.add(offset, offset + cnt);
+        invalidate_others(curr->getDev(), offset, offset + cnt);
     }
 
     /// Read data to host pointer from device
     void read(void* dst, int cnt, int offset) {
-        curr->read(devs[curr->getDev()].data, dst, cnt, offset);
+        dev_info& dev = devs[curr->getDev()];
+        fetch(curr, dev, offset, offset + cnt, true);
+        curr->read(dev.data, dst, cnt, offset);
     }
 
     /// copy data from "this" to other
@@ -923,23 +1333,27 @@ struct rw_info
             if (!other->curr)
                 other->construct(curr);
         }
+        lastValid = false;
+        other->lastValid = false;
         dev_info& dst = other->devs[other->curr->getDev()];
         dev_info& src = devs[curr->getDev()];
-        /// If src.state is invalid, zero the data on it
-        if (src.state == invalid) {
-            src.state = shared;
+        /// Bring the source range up to date, and zero the parts of it which
+        /// are not valid anywhere
+        for (const auto& gap : fetch(curr, src, src_offset, src_offset + cnt, true)) {
+            size_t size = gap.second - gap.first;
             if (is_cpu_queue(curr))
-                memset((char*)src.data + src_offset, 0, cnt);
+                memset((char*)src.data + gap.first, 0, size);
             else {
-                void *ptr = kalmar_aligned_alloc(0x1000, cnt);
-                memset(ptr, 0, cnt);
-                curr->write(src.data, ptr, cnt, src_offset, true);
+                void *ptr = kalmar_aligned_alloc(0x1000, size);
+                memset(ptr, 0, size);
+                curr->write(src.data, ptr, size, gap.first, true);
                 kalmar_aligned_free(ptr);
             }
         }
+        src.valid.add(src_offset, src_offset + cnt);
         copy_helper(curr, src.data, other->curr, dst.data, cnt, true, src_offset, dst_offset);
-        other->disc();
-        dst.state = modified;
+        dst.valid.add(dst_offset, dst_offset + cnt);
+        other->invalidate_others(other->curr->getDev(), dst_offset, dst_offset + cnt);
     }
 
     ~rw_info() {
@@ -953,14 +1367,10 @@ struct rw_info
         /// If this rw_info is constructed by host pointer
         /// 1. synchronize latest data to host pointer
         /// 2. Because the data pointer cannot be released, erase itself from devs
-
+        /// The device buffers are released once the kernels using them have
+        /// completed, rather than draining the queue here
         if (HostPtr)
             synchronize(false);
-        if (curr) {
-            // Wait issues a system-scope release:
-            // Need to make sure we write-back cache contents before deallocating the memory those writes might eventually touch
-            curr->wait();
-        }
         auto cpu_dev = get_cpu_queue()->getDev();
         if (devs.find(cpu_dev) != std::end(devs)) {
             if (!HostPtr)
@@ -972,7 +1382,7 @@ struct rw_info
         for (const auto it : devs) {
             std::tie(pDev, info) = it;
             if (toReleaseDevPointer)
-                pDev->release(info.data, this);
+                pDev->releaseDeferred(info.data, this);
         }
     }
 };
@@ -983,6 +1393,61 @@ struct rw_info
 
 inline void KalmarAsyncOp::setSeqNumFromQueue()  { seqNum = queue->assign_op_seq_num(); };
 
+inline void KalmarAsyncOp::setCallback(std::function<void()> callback) {
+    if (isReady()) {
+        CLAMP::EnqueueCallback(std::move(callback));
+    } else {
+        // callback holds a reference to this op, see completion_future::then
+        CLAMP::EnqueueCallback([this, callback]() {
+            wait();
+            callback();
+        });
+    }
+}
+
+inline bool KalmarAsyncOp::waitFor(std::chrono::nanoseconds timeout) {
+    if (timeout == std::chrono::nanoseconds::max()) {
+        wait();
+        return true;
+    }
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    std::chrono::microseconds backoff(1);
+    while (!isReady()) {
+        const auto now = std::chrono::steady_clock::now();
+        if (now >= deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::min<std::chrono::nanoseconds>(backoff, deadline - now));
+        backoff = std::min(backoff * 2, std::chrono::microseconds(1000));
+    }
+    wait();
+    return true;
+}
+
+inline void KalmarHostOp::setCallback(std::function<void()> callback) {
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        if (!done) {
+            callbacks.push_back(std::move(callback));
+            return;
+        }
+    }
+    CLAMP::EnqueueCallback(std::move(callback));
+}
+
+inline void KalmarHostOp::complete() {
+    std::vector<std::function<void()>> ready;
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        done = true;
+        ready.swap(callbacks);
+    }
+    cv.notify_all();
+    for (auto& callback : ready) {
+        CLAMP::EnqueueCallback(std::move(callback));
+    }
+}
+
 } // namespace Kalmar
 
 /** \endcond */
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <cstring>
 #include <set>
+#include <vector>
 #include "kalmar_runtime.h"
 #include "kalmar_exception.h"
 
@@ -11,8 +13,8 @@ namespace Kalmar
 /// traverse all the buffers that are going to be used in kernel
 class FunctorBufferWalker {
 public:
-    virtual void Append(size_t sz, const void* s) {}
-    virtual void AppendPtr(size_t sz, const void* s) {}
+    virtual void Append(size_t sz, const void* s, size_t align) {}
+    virtual void AppendPtr(size_t sz, const void* s, size_t align) {}
     virtual void visit_buffer(struct rw_info* rw, bool modify, bool isArray) = 0;
 };
 
@@ -21,11 +23,25 @@ class Serialize {
     FunctorBufferWalker* vis;
 public:
     Serialize(FunctorBufferWalker* vis) : vis(vis) {}
-    void Append(size_t sz, const void* s) { vis->Append(sz, s); }
-    void AppendPtr(size_t sz, const void* s) { vis->AppendPtr(sz, s); }
+    /// append the kernel argument *s of sz bytes, aligned as its type
+    template <typename T>
+    void Append(size_t sz, const T* s) { vis->Append(sz, s, alignof(T)); }
+    template <typename T>
+    void AppendPtr(size_t sz, const T* s) { vis->AppendPtr(sz, s, alignof(T)); }
+    void Append(size_t sz, const void* s, size_t align) { vis->Append(sz, s, align); }
+    void AppendPtr(size_t sz, const void* s, size_t align) { vis->AppendPtr(sz, s, align); }
+    /// type-erased scalar argument, which is aligned to the largest power of
+    /// two dividing its size, at most 16
+    void Append(size_t sz, const void* s) { vis->Append(sz, s, scalarAlign(sz)); }
+    void AppendPtr(size_t sz, const void* s) { vis->AppendPtr(sz, s, scalarAlign(sz)); }
     void visit_buffer(struct rw_info* rw, bool modify, bool isArray) {
         vis->visit_buffer(rw, modify, isArray);
     }
+private:
+    static size_t scalarAlign(size_t sz) {
+        size_t align = sz & (~sz + 1);
+        return (align == 0) ? 1 : (align > 16) ? 16 : align;
+    }
 };
 
 /// Change the data pointer with device pointer
@@ -56,20 +72,64 @@ public:
     }
 };
 
+/// Host image of the kernel arguments, laid out as they appear in the kernarg
+/// segment.  Small images stay in the inline buffer.
+class KernargImage
+{
+    static const size_t inline_size = 512;
+    alignas(16) char inline_data[inline_size];
+    std::vector<char> spill;
+    char* data_;
+    size_t size_;
+    size_t capacity_;
+
+    void reserve(size_t bytes) {
+        if (bytes > capacity_) {
+            capacity_ = std::max(bytes, 2 * capacity_);
+            std::vector<char> grown(capacity_);
+            memcpy(grown.data(), data_, size_);
+            spill.swap(grown);
+            data_ = spill.data();
+        }
+    }
+public:
+    KernargImage() : data_(inline_data), size_(0), capacity_(inline_size) {}
+    KernargImage(const KernargImage&) = delete;
+    KernargImage& operator=(const KernargImage&) = delete;
+
+    /// append \p sz bytes at the next multiple of \p align
+    void append(size_t sz, const void* s, size_t align) {
+        size_t offset = (size_ + align - 1) / align * align;
+        reserve(offset + sz);
+        memset(data_ + size_, 0, offset - size_);
+        memcpy(data_ + offset, s, sz);
+        size_ = offset + sz;
+    }
+
+    const void* data() const { return data_; }
+    size_t size() const { return size_; }
+};
+
 /// Append kernel argument to kernel
+///
+/// The arguments are collected into a KernargImage and handed to the runtime
+/// in one call by flush(), rather than one runtime call per argument.
 class BufferArgumentsAppender : public FunctorBufferWalker
 {
     std::shared_ptr<KalmarQueue> pQueue;
     void* k_;
     int current_idx_;
+    KernargImage args;
 public:
     BufferArgumentsAppender(std::shared_ptr<KalmarQueue> pQueue, void* k)
         : pQueue(pQueue), k_(k), current_idx_(0) {}
-    void Append(size_t sz, const void *s) override {
-        CLAMP::PushArg(k_, current_idx_++, sz, s);
+    void Append(size_t sz, const void *s, size_t align) override {
+        args.append(sz, s, align);
+        current_idx_++;
     }
-    void AppendPtr(size_t sz, const void *s) override {
-        CLAMP::PushArgPtr(k_, current_idx_++, sz, s);
+    void AppendPtr(size_t sz, const void *s, size_t align) override {
+        args.append(sz, s, align);
+        current_idx_++;
     }
     void visit_buffer(struct rw_info* rw, bool modify, bool isArray) override {
         if (isArray) {
@@ -82,8 +142,18 @@ public:
             }
         }
         rw->sync(pQueue, modify, false);
-        pQueue->Push(k_, current_idx_++, rw->devs[pQueue->getDev()].data, modify);
+        void* device = rw->devs[pQueue->getDev()].data;
+        args.append(sizeof(void*), &device, alignof(void*));
+        pQueue->Push(k_, current_idx_++, device, modify);
+    }
+
+    /// pass the kernarg image to the kernel
+    void flush() {
+        if (args.size() > 0) {
+            CLAMP::PushArgs(k_, args.data(), args.size());
+        }
     }
+    const KernargImage& image() const { return args; }
 };
 
 /// In C++AMP Standard V1.2 Line 3014
@@ -14,7 +14,8 @@
 #include <kalmar_runtime.h>
 #include <kalmar_aligned_alloc.h>
 
-extern "C" void PushArgImpl(void *ker, int idx, size_t sz, const void *v) {}
+extern "C" void PushArgImpl(void *ker, int idx, size_t sz, size_t align, const void *v) {}
+extern "C" void PushArgsImpl(void *ker, const void *image, size_t sz) {}
 
 namespace Kalmar {
 
@@ -0,0 +1,126 @@
+//===----------------------------------------------------------------------===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+//-------------------------------------------------------------------------------------------------
+// Host waits on completion signals.
+//
+// waitSignal() waits on anything which provides
+//     bool done();                                  // has the signal fired, without waiting
+//     bool wait(bool active, uint64_t timeoutNs);   // wait for at most timeoutNs (UINT64_MAX: no
+//                                                   // limit), spinning if active; true if fired
+// so the HSA completion signals of mcwamp_hsa.cpp and mock signals in benchmarks share the same
+// spin-then-block logic.  wait() may return before the signal fires or the timeout passes.
+namespace Kalmar {
+
+static const uint64_t WAIT_FOREVER = UINT64_MAX;
+
+enum class WaitStrategy {
+    Block,          // sleep in the signal wait
+    Spin,           // busy-wait in the signal wait
+    SpinThenBlock   // spin for as long as AdaptiveSpin suggests, then sleep
+};
+
+// Learns how long waits on one kind of op take, to decide how long the next waiter spins.
+//
+// Waits which usually end within maxSpinNs are spun for twice their running average, so the
+// waiter is awake when the op completes; ops which usually take longer only get minSpinNs
+// before the waiter sleeps.  Waits are recorded clamped to 2 * maxSpinNs, so a few long ops
+// do not keep the waiters of the short ops which follow asleep for long.
+class AdaptiveSpin {
+public:
+    AdaptiveSpin(uint64_t maxSpinNs = 200 * 1000, uint64_t minSpinNs = 2 * 1000)
+        : _maxSpinNs(maxSpinNs), _minSpinNs(std::min(minSpinNs, maxSpinNs)), _averageNs(0) {}
+
+    AdaptiveSpin(const AdaptiveSpin&) = delete;
+    AdaptiveSpin& operator=(const AdaptiveSpin&) = delete;
+
+    uint64_t spinNs() const {
+        const uint64_t average = _averageNs.load(std::memory_order_relaxed);
+        if (average == 0) {
+            // nothing learned yet
+            return _maxSpinNs;
+        }
+        return (2 * average <= _maxSpinNs) ? std::max(2 * average, _minSpinNs) : _minSpinNs;
+    }
+
+    // Record how long a wait took until the signal fired.  Racing updates may lose a sample.
+    void record(uint64_t waitedNs) {
+        const int64_t sample = std::min(waitedNs, 2 * _maxSpinNs);
+        const int64_t average = _averageNs.load(std::memory_order_relaxed);
+        const int64_t next = (average == 0) ? sample : average + (sample - average) / 8;
+        _averageNs.store(std::max<int64_t>(next, 1), std::memory_order_relaxed);
+    }
+
+    uint64_t averageNs() const { return _averageNs.load(std::memory_order_relaxed); }
+
+private:
+    const uint64_t _maxSpinNs;
+    const uint64_t _minSpinNs;
+    std::atomic<int64_t> _averageNs;
+};
+
+static inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// Wait until signal fires or timeoutNs passes.  spin is required for WaitStrategy::SpinThenBlock
+// and learns from every wait which ends with the signal fired.
+// Returns true if the signal fired.
+template <typename Signal>
+bool waitSignal(Signal& signal, WaitStrategy strategy, AdaptiveSpin* spin, uint64_t timeoutNs = WAIT_FOREVER)
+{
+    typedef std::chrono::steady_clock clock;
+    const clock::time_point start = clock::now();
+    const auto elapsedNs = [&start]() -> uint64_t {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+    };
+    const auto fired = [&]() {
+        if (strategy == WaitStrategy::SpinThenBlock) {
+            spin->record(elapsedNs());
+        }
+        return true;
+    };
+
+    if (strategy == WaitStrategy::SpinThenBlock) {
+        const uint64_t spinNs = std::min(spin->spinNs(), timeoutNs);
+        for (;;) {
+            if (signal.done()) {
+                return fired();
+            }
+            if (elapsedNs() >= spinNs) {
+                break;
+            }
+            cpuRelax();
+        }
+    }
+
+    // the signal wait may return early, so go round until the timeout has passed
+    for (;;) {
+        uint64_t remainingNs = WAIT_FOREVER;
+        if (timeoutNs != WAIT_FOREVER) {
+            const uint64_t elapsed = elapsedNs();
+            remainingNs = (elapsed >= timeoutNs) ? 0 : timeoutNs - elapsed;
+        }
+        if (signal.wait(strategy == WaitStrategy::Spin, remainingNs)) {
+            return fired();
+        }
+        if (remainingNs == 0) {
+            return false;
+        }
+    }
+}
+
+} // namespace Kalmar
@@ -0,0 +1,133 @@
+//===----------------------------------------------------------------------===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <streambuf>
+
+//-------------------------------------------------------------------------------------------------
+// Helpers to inspect code objects embedded in the executable without copying them.
+//
+// The code object bundles live in a read-only section of the process image, so everything
+// here works on the bytes in place:
+//  - code_object_elf_flags reads e_flags (which carries EF_AMDGPU_MACH) straight from the
+//    ELF header, enough to decide whether a code object matches an agent.
+//  - code_object_checksum keys the executables built from a code object.  It consumes
+//    8-byte words in four independent lanes rather than one byte at a time.
+//  - MemoryStreamBuf lets ELFIO read a code object through an std::istream over the
+//    original bytes instead of a copy in an std::string.
+namespace Kalmar {
+
+// ELF64 header fields used below (see elf.h)
+static const size_t ELF_IDENT_SIZE = 16;
+static const size_t ELF64_HEADER_SIZE = 64;
+static const size_t ELF64_FLAGS_OFFSET = 48;
+static const unsigned char ELF_CLASS64 = 2;
+static const unsigned char ELF_DATA2LSB = 1;
+
+// Read e_flags of the little endian ELF64 object at image.  Returns false if image is
+// not one.
+inline bool code_object_elf_flags(const void* image, size_t size, uint32_t* flags) {
+    const unsigned char* ident = static_cast<const unsigned char*>(image);
+    if (image == nullptr || size < ELF64_HEADER_SIZE ||
+        ident[0] != 0x7f || ident[1] != 'E' || ident[2] != 'L' || ident[3] != 'F' ||
+        ident[4] != ELF_CLASS64 || ident[5] != ELF_DATA2LSB) {
+        return false;
+    }
+    static_assert(ELF64_FLAGS_OFFSET >= ELF_IDENT_SIZE, "e_flags follows e_ident");
+    memcpy(flags, ident + ELF64_FLAGS_OFFSET, sizeof(*flags));
+    return true;
+}
+
+namespace detail {
+
+inline uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+// murmur3 finalizer
+inline uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+inline uint64_t mix_word(uint64_t lane, uint64_t word) {
+    word *= 0x87c37b91114253d5ULL;
+    word = rotl64(word, 31);
+    word *= 0x4cf5ad432745937fULL;
+    lane ^= word;
+    return rotl64(lane, 27) * 5 + 0x52dce729;
+}
+
+} // namespace detail
+
+// 64-bit checksum of a code object
+inline uint64_t code_object_checksum(const void* image, size_t size) {
+    const unsigned char* p = static_cast<const unsigned char*>(image);
+    uint64_t lanes[4] = { 0xcbf29ce484222325ULL, 0x9e3779b97f4a7c15ULL,
+                          0x100000001b3ULL ^ size, 0x2545f4914f6cdd1dULL };
+
+    size_t blocks = size / sizeof(lanes);
+    for (size_t i = 0; i < blocks; ++i, p += sizeof(lanes)) {
+        uint64_t words[4];
+        memcpy(words, p, sizeof(words));
+        lanes[0] = detail::mix_word(lanes[0], words[0]);
+        lanes[1] = detail::mix_word(lanes[1], words[1]);
+        lanes[2] = detail::mix_word(lanes[2], words[2]);
+        lanes[3] = detail::mix_word(lanes[3], words[3]);
+    }
+
+    // remaining bytes, zero padded to whole words
+    size_t tail = size % sizeof(lanes);
+    for (size_t lane = 0; tail > 0; ++lane) {
+        uint64_t word = 0;
+        size_t n = tail < sizeof(word) ? tail : sizeof(word);
+        memcpy(&word, p, n);
+        lanes[lane] = detail::mix_word(lanes[lane], word);
+        p += n;
+        tail -= n;
+    }
+
+    uint64_t hash = size;
+    for (auto lane : lanes) {
+        hash = detail::fmix64(hash ^ lane) + lane;
+    }
+    return hash;
+}
+
+// Read-only std::streambuf over bytes owned by someone else.
+class MemoryStreamBuf : public std::streambuf {
+public:
+    MemoryStreamBuf(const void* data, size_t size) {
+        char* begin = const_cast<char*>(static_cast<const char*>(data));
+        setg(begin, begin, begin + size);
+    }
+
+protected:
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                     std::ios_base::openmode which = std::ios_base::in) override {
+        off_type base = (dir == std::ios_base::beg) ? 0 :
+                        (dir == std::ios_base::cur) ? gptr() - eback() : egptr() - eback();
+        return seekpos(pos_type(base + off), which);
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which = std::ios_base::in) override {
+        off_type off = off_type(pos);
+        if (!(which & std::ios_base::in) || off < 0 || off > egptr() - eback()) {
+            return pos_type(off_type(-1));
+        }
+        setg(eback(), eback() + off, egptr());
+        return pos;
+    }
+};
+
+} // namespace Kalmar
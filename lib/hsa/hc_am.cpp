@@ -2,15 +2,30 @@
 #include "hc.hpp"
 #include "hc_am.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <cstddef>
+#include <cstdlib>
 #include <mutex>
 #include <cstdint>
 #include <iomanip>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+#include <pthread.h>
 #include <hsa/hsa.h>
 #include <hsa/hsa_ext_amd.h>
 
 #define DB_TRACKER 0
 
+// Number of ranges each thread remembers from its last tracker lookups.  Copies look up
+// a source and a destination, so this should be at least 2.
+#define AM_TRACKER_LAST_HITS (4)
+
+// am_alloc_async rounds sizes up to this, and reuses blocks up to this many times the size.
+#define AM_ASYNC_ALLOC_GRANULARITY (4096)
+#define AM_ASYNC_ALLOC_MAX_SLACK (2)
+
 #if DB_TRACKER 
 #define mprintf( ...) {\
         fprintf (stderr, __VA_ARGS__);\
@@ -123,66 +138,215 @@ std::ostream &operator<<(std::ostream &os, const hc::AmPointerInfo &ap)
     return os;
 }
 
+//-------------------------------------------------------------------------------------------------
+// Reader-writer lock for the tracker (std::shared_timed_mutex needs C++14).
+// lock/unlock take it exclusively so it works with std::lock_guard.
+class AmSharedMutex {
+public:
+    AmSharedMutex()  { pthread_rwlock_init(&_lock, NULL); }
+    ~AmSharedMutex() { pthread_rwlock_destroy(&_lock); }
+
+    void lock()          { pthread_rwlock_wrlock(&_lock); }
+    void unlock()        { pthread_rwlock_unlock(&_lock); }
+    void lock_shared()   { pthread_rwlock_rdlock(&_lock); }
+    void unlock_shared() { pthread_rwlock_unlock(&_lock); }
+
+private:
+    pthread_rwlock_t _lock;
+};
+
+struct AmSharedLock {
+    AmSharedMutex &_mutex;
+    AmSharedLock(AmSharedMutex &mutex) : _mutex(mutex) { _mutex.lock_shared(); }
+    ~AmSharedLock() { _mutex.unlock_shared(); }
+};
+
+
 //-------------------------------------------------------------------------------------------------
 // This structure tracks information for each pointer.
 // Uses memory-range-based lookups - so pointers that exist anywhere in the range of hostPtr + size 
 // will find the associated AmPointerInfo.
 // The insertions and lookups use a self-balancing binary tree and should support O(logN) lookup speed.
-// The structure is thread-safe - writers obtain a mutex before modifying the tree.  Multiple simulatenous readers are supported.
+// The structure is thread-safe - writers take the lock exclusively, lookups share it.
+//
+// Each thread also remembers the ranges of its last few successful lookups.  Copies tend to
+// look up the same few pointers over and over, so most lookups are answered from there
+// without taking the lock.  A remembered range is valid while _generation has not changed;
+// it is bumped whenever a range is removed or its info is updated.
+//
+// Sizes of the tracked ranges are summed per accelerator and kind as ranges come and go,
+// so am_memtracker_sizeinfo does not walk the tree.
 class AmPointerTracker {
 typedef std::map<AmMemoryRange, hc::AmPointerInfo, AmMemoryRangeCompare> MapTrackerType;
 public:
+    struct SizeInfo {
+        std::size_t _deviceMemSize;  // allocated by AM in device memory
+        std::size_t _hostMemSize;    // allocated by AM in host memory
+        std::size_t _userMemSize;    // added by am_memtracker_add or host locking
+    };
 
     void insert(void *pointer, hc::AmPointerInfo &p);
-    int remove(void *pointer);
 
-    MapTrackerType::iterator find(const void *hostPtr) ;
-    
-    MapTrackerType::iterator readerLockBegin() { _mutex.lock(); return _tracker.begin(); } ;
-    MapTrackerType::iterator end() { return _tracker.end(); } ;
-    void readerUnlock() { _mutex.unlock(); };
+    // Remove the range holding pointer, and return its info in removed if not NULL.
+    // Return 1 if removed or 0 if not found.
+    int remove(void *pointer, hc::AmPointerInfo *removed = NULL);
+
+    // Copy the info of the range holding pointer to info if not NULL.  Return false if not found.
+    bool find(const void *pointer, hc::AmPointerInfo *info);
 
+    bool update(const void *pointer, int appId, unsigned allocationFlags, void *appPtr);
+
+    // Call f(range, info) for every tracked range, in address order, while holding the lock shared.
+    template <typename F>
+    void forEach(F f) {
+        AmSharedLock l (_mutex);
+        for (auto &entry : _tracker) {
+            f(entry.first, entry.second);
+        }
+    }
+
+    SizeInfo sizeinfo(const hc::accelerator &acc);
 
     std::size_t reset (const hc::accelerator &acc);
     void update_peers (const hc::accelerator &acc, int peerCnt, hsa_agent_t *peerAgents) ;
 
 private:
+    struct LastHit {
+        AmMemoryRange      _range;
+        uint64_t           _generation;
+        hc::AmPointerInfo  _info;
+        LastHit() : _range(NULL, 1), _generation(0) {};
+    };
+
+    struct LastHits {
+        LastHit _hits[AM_TRACKER_LAST_HITS];
+        int     _next = 0;  // replaced by the next miss
+    };
+
+    static LastHits &lastHits() {
+        static thread_local LastHits hits;
+        return hits;
+    }
+
+    // The following are called with _mutex held exclusively.
+    void addSize(const hc::AmPointerInfo &p, bool add);
+    void invalidate() { _generation.fetch_add(1, std::memory_order_release); }
+
     MapTrackerType  _tracker;
-    std::mutex      _mutex;
-    //std::shared_timed_mutex _mut;
+    AmSharedMutex   _mutex;
     uint64_t        _allocSeqNum = 0;
+
+    std::atomic<uint64_t>                               _generation {1};
+    std::unordered_map<Kalmar::KalmarDevice*, SizeInfo> _sizes;  // by accelerator
 };
 
 
+//---
+void AmPointerTracker::addSize(const hc::AmPointerInfo &p, bool add)
+{
+    SizeInfo &sizes = _sizes[p._acc.get_dev_ptr()];
+    std::size_t &size = !p._isAmManaged ? sizes._userMemSize :
+                        (p._isInDeviceMem ? sizes._deviceMemSize : sizes._hostMemSize);
+    if (add) {
+        size += p._sizeBytes;
+    } else {
+        size -= p._sizeBytes;
+    }
+}
+
+
 //---
 void AmPointerTracker::insert (void *pointer, hc::AmPointerInfo &p)
 {
-    std::lock_guard<std::mutex> l (_mutex);
+    std::lock_guard<AmSharedMutex> l (_mutex);
 
     p._allocSeqNum = ++ this->_allocSeqNum;
 
     mprintf ("insert: %p + %zu\n", pointer, p._sizeBytes);
-    _tracker.insert(std::make_pair(AmMemoryRange(pointer, p._sizeBytes), p));
+    if (_tracker.insert(std::make_pair(AmMemoryRange(pointer, p._sizeBytes), p)).second) {
+        addSize(p, true);
+    }
 }
 
 
 //---
-// Return 1 if removed or 0 if not found.
-int AmPointerTracker::remove (void *pointer)
+int AmPointerTracker::remove (void *pointer, hc::AmPointerInfo *removed)
 {
-    std::lock_guard<std::mutex> l (_mutex);
+    std::lock_guard<AmSharedMutex> l (_mutex);
     mprintf ("remove: %p\n", pointer);
-    return _tracker.erase(AmMemoryRange(pointer,1));
+
+    auto iter = _tracker.find(AmMemoryRange(pointer,1));
+    if (iter == _tracker.end()) {
+        return 0;
+    }
+    if (removed) {
+        *removed = iter->second;
+    }
+    addSize(iter->second, false);
+    _tracker.erase(iter);
+    invalidate();
+    return 1;
 }
 
 
 //---
-AmPointerTracker::MapTrackerType::iterator  AmPointerTracker::find (const void *pointer)
+bool AmPointerTracker::find (const void *pointer, hc::AmPointerInfo *info)
 {
-    std::lock_guard<std::mutex> l (_mutex);
-    auto iter = _tracker.find(AmMemoryRange(pointer,1));
     mprintf ("find: %p\n", pointer);
-    return iter;
+
+    LastHits &hits = lastHits();
+    uint64_t generation = _generation.load(std::memory_order_acquire);
+    for (auto &hit : hits._hits) {
+        if ((pointer >= hit._range._basePointer) && (pointer <= hit._range._endPointer) &&
+            (hit._generation == generation)) {
+            if (info) {
+                *info = hit._info;
+            }
+            return true;
+        }
+    }
+
+    AmSharedLock l (_mutex);
+    auto iter = _tracker.find(AmMemoryRange(pointer,1));
+    if (iter == _tracker.end()) {
+        return false;
+    }
+
+    LastHit &hit = hits._hits[hits._next];
+    hits._next = (hits._next + 1) % AM_TRACKER_LAST_HITS;
+    hit._range      = iter->first;
+    hit._generation = _generation.load(std::memory_order_relaxed);
+    hit._info       = iter->second;
+    if (info) {
+        *info = iter->second;
+    }
+    return true;
+}
+
+
+//---
+bool AmPointerTracker::update (const void *pointer, int appId, unsigned allocationFlags, void *appPtr)
+{
+    std::lock_guard<AmSharedMutex> l (_mutex);
+
+    auto iter = _tracker.find(AmMemoryRange(pointer,1));
+    if (iter == _tracker.end()) {
+        return false;
+    }
+    iter->second._appId              = appId;
+    iter->second._appAllocationFlags = allocationFlags;
+    iter->second._appPtr             = appPtr;
+    invalidate();
+    return true;
+}
+
+
+//---
+AmPointerTracker::SizeInfo AmPointerTracker::sizeinfo (const hc::accelerator &acc)
+{
+    AmSharedLock l (_mutex);
+    auto iter = _sizes.find(acc.get_dev_ptr());
+    return (iter != _sizes.end()) ? iter->second : SizeInfo{0, 0, 0};
 }
 
 
@@ -191,7 +355,7 @@ AmPointerTracker::MapTrackerType::iterator  AmPointerTracker::find (const void *
 // Returns count of ranges removed.
 std::size_t AmPointerTracker::reset (const hc::accelerator &acc) 
 {
-    std::lock_guard<std::mutex> l (_mutex);
+    std::lock_guard<AmSharedMutex> l (_mutex);
     mprintf ("reset: \n");
 
     std::size_t count = 0;
@@ -209,6 +373,8 @@ std::size_t AmPointerTracker::reset (const hc::accelerator &acc)
         }
     }
 
+    _sizes.erase(acc.get_dev_ptr());
+    invalidate();
     return count;
 }
 
@@ -218,7 +384,7 @@ std::size_t AmPointerTracker::reset (const hc::accelerator &acc)
 // Returns count of ranges removed.
 void AmPointerTracker::update_peers (const hc::accelerator &acc, int peerCnt, hsa_agent_t *peerAgents) 
 {
-    std::lock_guard<std::mutex> l (_mutex);
+    AmSharedLock l (_mutex);
 
     // relies on C++11 (erase returns iterator)
     for (auto iter = _tracker.begin() ; iter != _tracker.end(); ) {
@@ -236,6 +402,319 @@ void AmPointerTracker::update_peers (const hc::accelerator &acc, int peerCnt, hs
 AmPointerTracker g_amPointerTracker;  // Track all am pointer allocations.
 
 
+//=========================================================================================================
+// Stream-ordered allocation:
+//=========================================================================================================
+
+// Free memory allocated by AM and stop tracking it.  Returns false if ptr is not tracked.
+static bool amReleaseBlock(void *ptr)
+{
+    hc::AmPointerInfo info;
+    if (g_amPointerTracker.remove(ptr, &info) == 0) {
+        return false;
+    }
+    hsa_amd_memory_pool_free(info._unalignedDevicePointer);
+    return true;
+}
+
+
+static std::size_t defaultReleaseThreshold()
+{
+    const char *env = getenv("HCC_AM_POOL_RELEASE_THRESHOLD");
+    if (env != nullptr) {
+        return static_cast<std::size_t>(strtoull(env, nullptr, 0)) << 20;
+    }
+    return std::numeric_limits<std::size_t>::max();
+}
+
+
+// Blocks released by am_free_async are cached per accelerator and allocation flags, ordered
+// by size.  Each remembers the accelerator_view it was freed on and a marker enqueued behind
+// the commands which may still use it: an in-order view can take the block back straight
+// away since its later commands run after those, other views once the marker has completed.
+//
+// completion_future::is_ready takes the lock of the marker's queue, so markers are never
+// queried with _mutex held: candidate blocks are copied out under _mutex, queried unlocked,
+// and taken out of the cache under _mutex again if nobody took them meanwhile.
+class AmAsyncAllocator {
+public:
+    void* allocate(std::size_t sizeBytes, hc::accelerator_view &av, unsigned flags);
+    am_status_t free(void *ptr, hc::accelerator_view &av);
+
+    std::size_t trim(const hc::accelerator &acc, std::size_t keepBytes);
+    void setReleaseThreshold(const hc::accelerator &acc, std::size_t bytes);
+    std::size_t cachedSize(const hc::accelerator &acc);
+
+    // ptr was released by am_free
+    void forget(void *ptr);
+    // blocks of acc were released by am_memtracker_reset
+    void reset(const hc::accelerator &acc);
+
+private:
+    struct FreeBlock {
+        void                  *ptr;
+        hc::accelerator_view   av;       // view the block was freed on
+        hc::completion_future  lastUse;  // marker behind the commands enqueued before the free
+    };
+
+    struct LiveBlock {
+        int         accSeqNum;
+        unsigned    flags;
+        std::size_t sizeBytes;
+    };
+
+    struct Cache {
+        std::map<unsigned, std::multimap<std::size_t, FreeBlock>> freeBlocks;  // by am_alloc flags, then size
+        std::size_t cachedBytes;
+        std::size_t releaseThreshold;
+    };
+
+    // cached block copied out of the cache, to query its marker without _mutex
+    struct Candidate {
+        std::size_t            sizeBytes;
+        unsigned               flags;
+        void                  *ptr;
+        hc::completion_future  lastUse;
+    };
+
+    // The following are called with _mutex held.
+    Cache &getCache(int accSeqNum);
+    bool takeBlock(Cache &cache, const Candidate &candidate);
+
+    // Called without _mutex.
+    std::size_t releaseUnused(int accSeqNum, std::size_t keepBytes);
+
+    std::map<int, Cache>                   _caches;      // by accelerator seqnum
+    std::unordered_map<void*, LiveBlock>   _liveBlocks;  // handed out by allocate
+    std::mutex                             _mutex;
+};
+
+
+AmAsyncAllocator::Cache &AmAsyncAllocator::getCache(int accSeqNum)
+{
+    auto iter = _caches.find(accSeqNum);
+    if (iter == _caches.end()) {
+        iter = _caches.emplace(accSeqNum, Cache{{}, 0, defaultReleaseThreshold()}).first;
+    }
+    return iter->second;
+}
+
+
+// Remove candidate from the cache.  Returns false if it was taken or released meanwhile.
+bool AmAsyncAllocator::takeBlock(Cache &cache, const Candidate &candidate)
+{
+    auto &blocks = cache.freeBlocks[candidate.flags];
+    auto range = blocks.equal_range(candidate.sizeBytes);
+    for (auto iter = range.first; iter != range.second; ++iter) {
+        if (iter->second.ptr == candidate.ptr) {
+            blocks.erase(iter);
+            cache.cachedBytes -= candidate.sizeBytes;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Release blocks whose last use has completed, largest first, until at most keepBytes are cached.
+// Returns the number of bytes released.
+std::size_t AmAsyncAllocator::releaseUnused(int accSeqNum, std::size_t keepBytes)
+{
+    std::vector<Candidate> candidates;
+    {
+        std::lock_guard<std::mutex> l (_mutex);
+        Cache &cache = getCache(accSeqNum);
+        if (cache.cachedBytes <= keepBytes) {
+            return 0;
+        }
+        for (auto &flagBlocks : cache.freeBlocks) {
+            for (auto &block : flagBlocks.second) {
+                candidates.push_back(Candidate{block.first, flagBlocks.first, block.second.ptr, block.second.lastUse});
+            }
+        }
+    }
+
+    std::stable_sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b) {
+        return a.sizeBytes > b.sizeBytes;
+    });
+    candidates.erase(std::remove_if(candidates.begin(), candidates.end(), [](Candidate &candidate) {
+        return !candidate.lastUse.is_ready();
+    }), candidates.end());
+
+    std::vector<void*> unused;
+    std::size_t released = 0;
+    {
+        std::lock_guard<std::mutex> l (_mutex);
+        Cache &cache = getCache(accSeqNum);
+        for (auto &candidate : candidates) {
+            if (cache.cachedBytes <= keepBytes) {
+                break;
+            }
+            if (takeBlock(cache, candidate)) {
+                unused.push_back(candidate.ptr);
+                released += candidate.sizeBytes;
+            }
+        }
+    }
+
+    for (void *ptr : unused) {
+        mprintf ("async pool release: %p\n", ptr);
+        amReleaseBlock(ptr);
+    }
+    return released;
+}
+
+
+void* AmAsyncAllocator::allocate(std::size_t sizeBytes, hc::accelerator_view &av, unsigned flags)
+{
+    if (sizeBytes == 0) {
+        return nullptr;
+    }
+    sizeBytes = (sizeBytes + AM_ASYNC_ALLOC_GRANULARITY - 1) & ~static_cast<std::size_t>(AM_ASYNC_ALLOC_GRANULARITY - 1);
+
+    hc::accelerator acc = av.get_accelerator();
+    // Commands on an in-order view are ordered with the ones which used a block before it
+    // was freed there, so device memory can be handed out again right away.  Host access
+    // to host memory is not ordered with them.
+    bool streamOrdered = (av.get_execute_order() == hc::execute_in_order) &&
+                         !(flags & (amHostPinned | amHostCoherent));
+    std::vector<Candidate> candidates;
+    {
+        std::lock_guard<std::mutex> l (_mutex);
+
+        Cache &cache = getCache(acc.get_seqnum());
+        auto &blocks = cache.freeBlocks[flags];
+        for (auto iter = blocks.lower_bound(sizeBytes);
+             (iter != blocks.end()) && (iter->first <= AM_ASYNC_ALLOC_MAX_SLACK * sizeBytes); ++iter) {
+            FreeBlock &block = iter->second;
+            if (streamOrdered && (block.av == av)) {
+                void *ptr = block.ptr;
+                mprintf ("async pool reuse: %p + %zu\n", ptr, iter->first);
+                _liveBlocks[ptr] = LiveBlock{acc.get_seqnum(), flags, iter->first};
+                cache.cachedBytes -= iter->first;
+                blocks.erase(iter);
+                return ptr;
+            }
+            candidates.push_back(Candidate{iter->first, flags, block.ptr, block.lastUse});
+        }
+    }
+
+    // blocks freed on other views, or host memory, once the commands which used them have completed
+    for (auto &candidate : candidates) {
+        if (!candidate.lastUse.is_ready()) {
+            continue;
+        }
+        std::lock_guard<std::mutex> l (_mutex);
+        if (takeBlock(getCache(acc.get_seqnum()), candidate)) {
+            mprintf ("async pool reuse: %p + %zu\n", candidate.ptr, candidate.sizeBytes);
+            _liveBlocks[candidate.ptr] = LiveBlock{acc.get_seqnum(), flags, candidate.sizeBytes};
+            return candidate.ptr;
+        }
+    }
+
+    void *ptr = hc::am_alloc(sizeBytes, acc, flags);
+    if (ptr != nullptr) {
+        std::lock_guard<std::mutex> l (_mutex);
+        _liveBlocks[ptr] = LiveBlock{acc.get_seqnum(), flags, sizeBytes};
+    }
+    return ptr;
+}
+
+
+am_status_t AmAsyncAllocator::free(void *ptr, hc::accelerator_view &av)
+{
+    LiveBlock live;
+    bool pooled = false;
+    {
+        std::lock_guard<std::mutex> l (_mutex);
+        auto iter = _liveBlocks.find(ptr);
+        if (iter != _liveBlocks.end()) {
+            live = iter->second;
+            _liveBlocks.erase(iter);
+            pooled = true;
+        }
+    }
+
+    if (!pooled) {
+        hc::AmPointerInfo info;
+        if ((hc::am_memtracker_getinfo(&info, ptr) != AM_SUCCESS) || !info._isAmManaged) {
+            return AM_ERROR_MISC;
+        }
+        // not from am_alloc_async: release it once the commands which may use it are done
+        av.create_marker(hc::no_scope).then([ptr] { amReleaseBlock(ptr); });
+        return AM_SUCCESS;
+    }
+
+    FreeBlock block{ptr, av, av.create_marker(hc::no_scope)};
+
+    std::size_t releaseThreshold;
+    {
+        std::lock_guard<std::mutex> l (_mutex);
+        Cache &cache = getCache(live.accSeqNum);
+        cache.freeBlocks[live.flags].emplace(live.sizeBytes, std::move(block));
+        cache.cachedBytes += live.sizeBytes;
+        releaseThreshold = cache.releaseThreshold;
+    }
+    releaseUnused(live.accSeqNum, releaseThreshold);
+    return AM_SUCCESS;
+}
+
+
+std::size_t AmAsyncAllocator::trim(const hc::accelerator &acc, std::size_t keepBytes)
+{
+    return releaseUnused(acc.get_seqnum(), keepBytes);
+}
+
+
+void AmAsyncAllocator::setReleaseThreshold(const hc::accelerator &acc, std::size_t bytes)
+{
+    {
+        std::lock_guard<std::mutex> l (_mutex);
+        getCache(acc.get_seqnum()).releaseThreshold = bytes;
+    }
+    releaseUnused(acc.get_seqnum(), bytes);
+}
+
+
+std::size_t AmAsyncAllocator::cachedSize(const hc::accelerator &acc)
+{
+    std::lock_guard<std::mutex> l (_mutex);
+    return getCache(acc.get_seqnum()).cachedBytes;
+}
+
+
+void AmAsyncAllocator::forget(void *ptr)
+{
+    std::lock_guard<std::mutex> l (_mutex);
+    _liveBlocks.erase(ptr);
+}
+
+
+void AmAsyncAllocator::reset(const hc::accelerator &acc)
+{
+    std::lock_guard<std::mutex> l (_mutex);
+    Cache &cache = getCache(acc.get_seqnum());
+    cache.freeBlocks.clear();
+    cache.cachedBytes = 0;
+
+    for (auto iter = _liveBlocks.begin(); iter != _liveBlocks.end(); ) {
+        if (iter->second.accSeqNum == acc.get_seqnum()) {
+            iter = _liveBlocks.erase(iter);
+        } else {
+            iter++;
+        }
+    }
+}
+
+
+// Never destroyed: cached blocks hold accelerator_views, which must not outlive the runtime.
+static AmAsyncAllocator &amAsyncAllocator()
+{
+    static AmAsyncAllocator *allocator = new AmAsyncAllocator();
+    return *allocator;
+}
+
+
 //=========================================================================================================
 // API Definitions.
 //=========================================================================================================
@@ -264,6 +743,10 @@ auto_voidp am_aligned_alloc(std::size_t sizeBytes, hc::accelerator &acc, unsigne
             if (alloc_region && alloc_region->handle != -1) {
                 sizeBytes = alignment != 0 ? sizeBytes + alignment : sizeBytes;
                 hsa_status_t s1 = hsa_amd_memory_pool_allocate(*alloc_region, sizeBytes, 0, &ptr);
+                if ((s1 != HSA_STATUS_SUCCESS) && (amAsyncAllocator().trim(acc, 0) != 0)) {
+                    // retry with the blocks cached for am_alloc_async released
+                    s1 = hsa_amd_memory_pool_allocate(*alloc_region, sizeBytes, 0, &ptr);
+                }
 
                 void *unalignedPtr = ptr;
                 if (alignment != 0) {
@@ -311,12 +794,8 @@ am_status_t am_free(void* ptr)
     am_status_t status = AM_SUCCESS;
 
     if (ptr != NULL) {
-        auto info = g_amPointerTracker.find(ptr);
-        if (info != g_amPointerTracker.end()) {
-            hsa_amd_memory_pool_free(info->second._unalignedDevicePointer);
-        }
-        int numRemoved = g_amPointerTracker.remove(ptr) ;
-        if (numRemoved == 0) {
+        amAsyncAllocator().forget(ptr);
+        if (!amReleaseBlock(ptr)) {
             status = AM_ERROR_MISC;
         }
     }
@@ -324,6 +803,54 @@ am_status_t am_free(void* ptr)
 }
 
 
+auto_voidp am_alloc_async(std::size_t sizeBytes, hc::accelerator_view &av, unsigned flags)
+{
+    return amAsyncAllocator().allocate(sizeBytes, av, flags);
+}
+
+am_status_t am_free_async(void* ptr, hc::accelerator_view &av)
+{
+    if (ptr == NULL) {
+        return AM_SUCCESS;
+    }
+    return amAsyncAllocator().free(ptr, av);
+}
+
+void am_pool_set_release_threshold(const hc::accelerator &acc, std::size_t bytes)
+{
+    amAsyncAllocator().setReleaseThreshold(acc, bytes);
+}
+
+std::size_t am_pool_trim(const hc::accelerator &acc, std::size_t keepBytes)
+{
+    return amAsyncAllocator().trim(acc, keepBytes);
+}
+
+std::size_t am_pool_get_cached_size(const hc::accelerator &acc)
+{
+    return amAsyncAllocator().cachedSize(acc);
+}
+
+
+std::size_t am_cache_trim(const hc::accelerator &acc, std::size_t keepBytes)
+{
+    return acc.get_dev_ptr()->cacheTrim(keepBytes);
+}
+
+void am_cache_set_limit(const hc::accelerator &acc, std::size_t bytes)
+{
+    acc.get_dev_ptr()->cacheSetLimit(bytes);
+}
+
+am_status_t am_cache_get_stats(const hc::accelerator &acc, AmCacheStats *stats)
+{
+    if ((stats == nullptr) || !acc.get_dev_ptr()->getCacheStats(stats)) {
+        return AM_ERROR_MISC;
+    }
+    return AM_SUCCESS;
+}
+
+
 am_status_t am_copy(void*  dst, const void*  src, std::size_t sizeBytes)
 {
     am_status_t am_status = AM_ERROR_MISC;
@@ -341,11 +868,7 @@ am_status_t am_copy(void*  dst, const void*  src, std::size_t sizeBytes)
 
 am_status_t am_memtracker_getinfo(hc::AmPointerInfo *info, const void *ptr)
 {
-    auto infoI = g_amPointerTracker.find(ptr);
-    if (infoI != g_amPointerTracker.end()) {
-        if (info) {
-            *info = infoI->second;
-        }
+    if (g_amPointerTracker.find(ptr, info)) {
         return AM_SUCCESS;
     } else {
         return AM_ERROR_MISC;
@@ -367,11 +890,7 @@ am_status_t am_memtracker_add(void* ptr, hc::AmPointerInfo &info)
 
 am_status_t am_memtracker_update(const void* ptr, int appId, unsigned allocationFlags, void *appPtr)
 {
-    auto iter = g_amPointerTracker.find(ptr);
-    if (iter != g_amPointerTracker.end()) {
-        iter->second._appId              = appId;
-        iter->second._appAllocationFlags = allocationFlags;
-        iter->second._appPtr             = appPtr;;
+    if (g_amPointerTracker.update(ptr, appId, allocationFlags, appPtr)) {
         return AM_SUCCESS;
     } else {
         return AM_ERROR_MISC;
@@ -399,42 +918,47 @@ void am_memtracker_print(void *targetAddress)
 
     uint64_t beforeD = std::numeric_limits<uint64_t>::max() ;
     uint64_t afterD =  std::numeric_limits<uint64_t>::max() ;
-    auto closestBefore = g_amPointerTracker.end();
-    auto closestAfter  = g_amPointerTracker.end();
+    hc::AmPointerInfo closestBefore;
+    hc::AmPointerInfo closestAfter;
+    bool foundBefore = false;
+    bool foundAfter = false;
     bool foundMatch = false;
 
 
     if (targetAddress) {
-        for (auto iter = g_amPointerTracker.readerLockBegin() ; iter != g_amPointerTracker.end(); iter++) {
-            const auto basePointer = static_cast<const char*> (iter->first._basePointer);
-            const auto endPointer = static_cast<const char*> (iter->first._endPointer);
+        g_amPointerTracker.forEach([&] (const AmMemoryRange &range, const hc::AmPointerInfo &info) {
+            if (foundMatch) {
+                return;
+            }
+            const auto basePointer = static_cast<const char*> (range._basePointer);
+            const auto endPointer = static_cast<const char*> (range._endPointer);
             if ((targetAddressP >= basePointer) && (targetAddressP < endPointer)) {
                 ptrdiff_t offset = targetAddressP - basePointer;
                 os << "db: memtracker found pointer:" << targetAddress << " offset:" << offset << " bytes inside this allocation:\n";
-                os << "   " << iter->first._basePointer << "-" << iter->first._endPointer << "::  ";
-                os << iter->second << std::endl;
+                os << "   " << range._basePointer << "-" << range._endPointer << "::  ";
+                os << info << std::endl;
                 foundMatch = true;
-                break;
             } else {
                 if ((targetAddressP < basePointer) && (basePointer - targetAddressP < beforeD)) {
                     beforeD = (basePointer - targetAddressP);
-                    closestBefore = iter;
+                    closestBefore = info;
+                    foundBefore = true;
                 }
                 if ((targetAddressP > endPointer) && (targetAddressP - endPointer < afterD)) {
                     afterD = (targetAddressP - endPointer);
-                    closestAfter = iter;
+                    closestAfter = info;
+                    foundAfter = true;
                 }
             };
-
-        }
+        });
 
         if (!foundMatch) {
             os << "db: memtracker did not find pointer:" << targetAddress << ".  However, it is closest to the following allocations:\n";
-            if (closestBefore != g_amPointerTracker.end()) {
-                os << "db: closest before: " << beforeD << " bytes before base of: " << closestBefore->second << std::endl;
+            if (foundBefore) {
+                os << "db: closest before: " << beforeD << " bytes before base of: " << closestBefore << std::endl;
             }
-            if (closestAfter != g_amPointerTracker.end()) {
-                os << "db: closest after: " << afterD << " bytes after end of " << closestAfter->second << std::endl ;
+            if (foundAfter) {
+                os << "db: closest after: " << afterD << " bytes after end of " << closestAfter << std::endl ;
             }
         }
     } else {
@@ -452,44 +976,30 @@ void am_memtracker_print(void *targetAddress)
             << setw(12) << left << " Peers" << right
             << "\n";
 
-        for (auto iter = g_amPointerTracker.readerLockBegin() ; iter != g_amPointerTracker.end(); iter++) {
-            os << setw(PTRW) << iter->first._basePointer << "-" << setw(PTRW) << iter->first._endPointer << ": ";
-            printShortPointerInfo(os, iter->second);
-            printRocrPointerInfo(os, iter->first._basePointer);
+        g_amPointerTracker.forEach([&] (const AmMemoryRange &range, const hc::AmPointerInfo &info) {
+            os << setw(PTRW) << range._basePointer << "-" << setw(PTRW) << range._endPointer << ": ";
+            printShortPointerInfo(os, info);
+            printRocrPointerInfo(os, range._basePointer);
             os << "\n";
-        }
+        });
     }
-
-    g_amPointerTracker.readerUnlock();
 }
 
 
 //---
 void am_memtracker_sizeinfo(const hc::accelerator &acc, std::size_t *deviceMemSize, std::size_t *hostMemSize, std::size_t *userMemSize)
 {
-    *deviceMemSize = *hostMemSize = *userMemSize = 0;
-    for (auto iter = g_amPointerTracker.readerLockBegin() ; iter != g_amPointerTracker.end(); iter++) {
-        if (iter->second._acc == acc) {
-            std::size_t sizeBytes = iter->second._sizeBytes;
-            if (iter->second._isAmManaged) {
-                if (iter->second._isInDeviceMem) {
-                    *deviceMemSize += sizeBytes;
-                } else {
-                    *hostMemSize += sizeBytes;
-                }
-            } else {
-                *userMemSize += sizeBytes;
-            }
-        }
-    }
-
-    g_amPointerTracker.readerUnlock();
+    AmPointerTracker::SizeInfo sizes = g_amPointerTracker.sizeinfo(acc);
+    *deviceMemSize = sizes._deviceMemSize;
+    *hostMemSize   = sizes._hostMemSize;
+    *userMemSize   = sizes._userMemSize;
 }
 
 
 //---
 std::size_t am_memtracker_reset(const hc::accelerator &acc)
 {
+    amAsyncAllocator().reset(acc);
     return g_amPointerTracker.reset(acc);
 }
 
@@ -0,0 +1,52 @@
+//===----------------------------------------------------------------------===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+
+//-------------------------------------------------------------------------------------------------
+// LazyInit<T> owns a T which is created by the first call to get().
+//
+// Concurrent first callers block in std::call_once until one of them has created the object;
+// if the factory throws, the next caller tries again.  Once created, get() is a single acquire
+// load, so resources set up this way add no lock to the steady-state path.
+namespace Kalmar {
+
+template <typename T>
+class LazyInit {
+public:
+    LazyInit() : value(nullptr) {}
+    LazyInit(const LazyInit&) = delete;
+    LazyInit& operator=(const LazyInit&) = delete;
+
+    ~LazyInit() { delete value.load(std::memory_order_relaxed); }
+
+    // Returns the object, creating it with create() (which returns a T* to own) on first use.
+    template <typename Create>
+    T* get(Create create) {
+        T* p = value.load(std::memory_order_acquire);
+        if (p != nullptr) {
+            return p;
+        }
+        std::call_once(once, [&] { value.store(create(), std::memory_order_release); });
+        return value.load(std::memory_order_acquire);
+    }
+
+    // Returns the object if it has been created, without creating it.
+    T* peek() const { return value.load(std::memory_order_acquire); }
+
+    // Destroys the object.  Only for teardown: the object is not created again afterwards.
+    void reset() { delete value.exchange(nullptr, std::memory_order_acq_rel); }
+
+private:
+    std::atomic<T*> value;
+    std::once_flag once;
+};
+
+} // namespace Kalmar
@@ -9,15 +9,19 @@
 #include "../hc2/headers/types/program_state.hpp"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <fstream>
 #include <future>
 #include <iostream>
+#include <iterator>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <sstream>
 #include <string>
@@ -44,6 +48,11 @@
 
 #include "hc_am_internal.hpp"
 #include "unpinned_copy_engine.h"
+#include "signal_pool.h"
+#include "memory_cache.h"
+#include "code_object.h"
+#include "lazy_init.h"
+#include "adaptive_wait.h"
 #include "hc_rt_debug.h"
 #include "hc_printf.hpp"
 
@@ -67,11 +76,24 @@
 // size of default kernarg buffer in the kernarg pool in HSAContext
 #define KERNARG_BUFFER_SIZE (512)
 
-// number of pre-allocated kernarg buffers in HSAContext
+// number of kernarg buffers allocated at a time in the kernarg pool of HSADevice
 // Not required but typically should be greater than HCC_SIGNAL_POOL_SIZE 
 // (some kernels don't allocate signals but nearly all need kernargs)
 #define KERNARG_POOL_SIZE (1024)
 
+// Per-queue kernarg rings (see KernargRing) grow in chunks of this many bytes
+// for each size class, up to KERNARG_RING_MAX_CHUNKS chunks per class.
+// Size classes are KERNARG_BUFFER_SIZE, 4x and 16x that.
+#define KERNARG_RING_CHUNK_BYTES (128*1024)
+#define KERNARG_RING_MAX_CHUNKS  (64)
+
+// Storage for HSADispatch/HSACopy/HSABarrier objects (and their shared_ptr control
+// blocks) is recycled through a per-queue HSAOpPool.  Blocks are grouped in classes of
+// OP_POOL_GRANULARITY bytes; at most OP_POOL_CACHE_LIMIT free blocks are kept per class.
+#define OP_POOL_GRANULARITY (64)
+#define OP_POOL_CLASS_COUNT (32)
+#define OP_POOL_CACHE_LIMIT (1024)
+
 
 // Maximum number of inflight commands sent to a single queue.
 // If limit is exceeded, HCC will force a queue wait to reclaim
@@ -79,8 +101,13 @@
 // MUST be a power of 2.
 #define MAX_INFLIGHT_COMMANDS_PER_QUEUE  (2*8192)
 
-// threshold to clean up finished kernel in HSAQueue.asyncOps
-#define ASYNCOPS_VECTOR_GC_SIZE (2*8192)
+// number of completion signals HSAQueue::pushAsyncOp polls at the oldest end of
+// the in-flight ring to retire finished ops
+#define ASYNCOPS_REAP_BATCH (8)
+
+// number of retired ops whose references (and so signals, kernargs, ...) are released
+// per HSAQueue::pushAsyncOp; see AsyncOpRing::reclaim
+#define ASYNCOPS_RECLAIM_BATCH (16)
 
 
 //---
@@ -105,6 +132,9 @@ int HCC_STAGING_BUFFER_SIZE = 4*1024;
 unsigned int HCC_DEFAULT_GPU = 0;
 
 unsigned int HCC_ENABLE_PRINTF = 0;
+// Interval (in us) at which a background thread drains the printf buffer while
+// kernels run.  0 drains it only when the host flushes it
+int HCC_PRINTF_DRAIN_INTERVAL = 0;
 
 // Chicken bits:
 int HCC_SERIALIZE_KERNEL = 0;
@@ -114,12 +144,29 @@ int HCC_FORCE_CROSS_QUEUE_FLUSH=0;
 
 int HCC_OPT_FLUSH=1;
 
+// Default wait mode of accelerator_views, one of Kalmar::hcWaitMode
+int HCC_WAIT_MODE = Kalmar::hcWaitModeAdaptive;
+// Max time (in us) an adaptive wait spins before it blocks
+int HCC_WAIT_SPIN_MAX = 200;
+
 
 unsigned HCC_DB = 0;
 unsigned HCC_DB_SYMBOL_FORMAT=0x10;
 
 int HCC_MAX_QUEUES = 20;
 
+// Device memory cache behind HSADevice::create, see memory_cache.h.  am_alloc memory is
+// never sub-allocated: peer access and IPC act on whole pool allocations
+int HCC_DEVICE_MEMORY_CACHE = 1;
+// Max bytes (in MB) kept cached per device once freed
+int HCC_DEVICE_MEMORY_CACHE_LIMIT = 256;
+
+// Upload array and array_view kernel arguments with async copies from pinned
+// staging memory, rather than a blocking copy per argument
+int HCC_ASYNC_UPLOADS = 1;
+// Max bytes (in MB) of one async upload, and of staging memory kept cached per device
+int HCC_ASYNC_UPLOAD_LIMIT = 64;
+
 
 #define HCC_PROFILE_SUMMARY (1<<0)
 #define HCC_PROFILE_TRACE   (1<<1)
@@ -249,6 +296,59 @@ static const char* getHSAErrorString(hsa_status_t s) {
     }
 
 
+// Adapts hsa_signal_t to SignalPool (see signal_pool.h).
+struct HSASignalTraits {
+    typedef hsa_signal_t signal_type;
+
+    static void create(hsa_signal_t *signal) {
+        hsa_status_t status = hsa_signal_create(1, 0, NULL, signal);
+        STATUS_CHECK(status, __LINE__);
+        DBOUT(DB_SIG, "  created signal 0x" << std::hex << signal->handle << std::dec << "\n");
+    }
+
+    static void destroy(hsa_signal_t signal) {
+        hsa_status_t status = hsa_signal_destroy(signal);
+        STATUS_CHECK(status, __LINE__);
+    }
+
+    // restore signal to the initial value 1
+    static void reset(hsa_signal_t signal) {
+        hsa_signal_store_screlease(signal, 1);
+    }
+};
+
+
+// Adapts an HSA memory pool to MemoryCache (see memory_cache.h).  Chunks are made
+// accessible to the agent owning the cache when they are allocated.
+struct HSAMemoryPool {
+    hsa_amd_memory_pool_t pool;
+    hsa_agent_t           agent;
+};
+
+struct HSAMemoryPoolTraits {
+    typedef HSAMemoryPool pool_type;
+
+    static void *allocate(HSAMemoryPool &p, size_t size) {
+        void *ptr = nullptr;
+        hsa_status_t status = hsa_amd_memory_pool_allocate(p.pool, size, 0, &ptr);
+        if (status != HSA_STATUS_SUCCESS) {
+            return nullptr;
+        }
+        status = hsa_amd_agents_allow_access(1, &p.agent, NULL, ptr);
+        if (status != HSA_STATUS_SUCCESS) {
+            hsa_amd_memory_pool_free(ptr);
+            return nullptr;
+        }
+        DBOUT(DB_RESOURCE, "  memory cache grown by " << size << " bytes at " << ptr << "\n");
+        return ptr;
+    }
+
+    static void free(HSAMemoryPool &p, void *ptr) {
+        hsa_amd_memory_pool_free(ptr);
+    }
+};
+
+
 // debug function to dump information on an HSA agent
 static void dumpHSAAgentInfo(hsa_agent_t agent, const char* extra_string = (const char*)"") {
   hsa_status_t status;
@@ -382,6 +482,27 @@ namespace
         return r;
     }
 
+    inline
+    bool process_has_symtab()
+    {
+        using namespace ELFIO;
+        using namespace std;
+
+        static bool r = false;
+        static once_flag f;
+
+        call_once(f, []() {
+            elfio self_reader;
+            if (self_reader.load("/proc/self/exe")) {
+                r = find_section_if(self_reader, [](const class section* x) {
+                    return x->get_type() == SHT_SYMTAB;
+                }) != nullptr;
+            }
+        });
+
+        return r;
+    }
+
     inline
     const std::vector<hsa_agent_t>& all_agents()
     {
@@ -405,16 +526,14 @@ namespace
     inline
     void associate_code_object_symbols_with_host_allocation(
         const ELFIO::elfio& reader,
-        const ELFIO::elfio& self_reader,
         ELFIO::section* code_object_dynsym,
-        ELFIO::section* process_symtab,
         hsa_agent_t agent,
         hsa_executable_t executable)
     {
         using namespace ELFIO;
         using namespace std;
 
-        if (!code_object_dynsym || !process_symtab) return;
+        if (!code_object_dynsym || !process_has_symtab()) return;
 
         const auto undefined_symbols = copy_names_of_undefined_symbols(
             symbol_section_accessor{reader, code_object_dynsym});
@@ -427,6 +546,10 @@ namespace
             static once_flag f;
             call_once(f, [=]() { globals.reserve(symbol_addresses().size()); });
 
+            // devices may load their programs concurrently
+            static mutex mtx;
+            lock_guard<mutex> lck{mtx};
+
             if (globals.find(x) != globals.cend()) return;
 
             const auto it1 = symbol_addresses().find(x);
@@ -435,11 +558,6 @@ namespace
                 throw runtime_error{"Global symbol: " + x + " is undefined."};
             }
 
-            static mutex mtx;
-            lock_guard<mutex> lck{mtx};
-
-            if (globals.find(x) != globals.cend()) return;
-
             void* host_ptr =
                 reinterpret_cast<void*>(it1->second.first);
             void* agent_ptr = nullptr;
@@ -544,8 +662,11 @@ inline static void checkHCCRuntimeStatus(const HCCRuntimeStatus status, const un
 
 
 
-extern "C" void PushArgImpl(void *ker, int idx, size_t sz, const void *v);
+static Kalmar::hcCommandKind resolveMemcpyDirection(bool srcInDeviceMem, bool dstInDeviceMem);
+
+extern "C" void PushArgImpl(void *ker, int idx, size_t sz, size_t align, const void *v);
 extern "C" void PushArgPtrImpl(void *ker, int idx, size_t sz, const void *v);
+extern "C" void PushArgsImpl(void *ker, const void *image, size_t sz);
 
 // forward declaration
 namespace Kalmar {
@@ -553,8 +674,12 @@ class HSAQueue;
 class HSADevice;
 
 namespace CLAMP {
-  void LoadInMemoryProgram(KalmarQueue*);
+  void LoadInMemoryProgram(KalmarDevice*);
+  void PrefetchProgram(KalmarDevice*);
+  void FinishProgramLoad(KalmarDevice*);
 } // namespace CLAMP
+
+static void* PrintfBufferPointerVA();
 } // namespace Kalmar
 
 ///
@@ -610,10 +735,135 @@ public:
     }
 };
 
+// Returns the short kernel name used for debug and profile output.
+// Format is selected by HCC_DB_SYMBOL_FORMAT.
+static std::string kernelShortName(const std::string &fun)
+{
+    std::string shortName;
+    int kernelNameFormat = HCC_DB_SYMBOL_FORMAT & 0xf;
+    if (kernelNameFormat == 1) {
+        return fun; // mangled name
+    }
+
+    int demangleStatus = -1;
+    char *demangled = nullptr;
+#ifndef USE_LIBCXX
+    demangled = abi::__cxa_demangle(fun.c_str(), nullptr, nullptr, &demangleStatus);
+#endif
+    shortName = demangleStatus ? fun : std::string(demangled);
+    try {
+        if (demangleStatus == 0) {
+
+            if (kernelNameFormat == 2) {
+                shortName = demangled;
+            } else {
+                // kernelNameFormat == 0 or unspecified:
+
+                // Example: HIP_kernel_functor_name_begin_unnamed_HIP_kernel_functor_name_end_5::__cxxamp_trampoline(unsigned int, unsigned int, unsigned int, unsigned int, unsigned int, unsigned int, float*, long long)"
+
+                std::string hip_begin_str  ("::HIP_kernel_functor_name_begin_");
+                std::string hip_end_str    ("_HIP_kernel_functor_name_end");
+                int hip_begin = shortName.find(hip_begin_str);
+                int hip_end   = shortName.find(hip_end_str);
+
+                if ((hip_begin != -1) && (hip_end != -1) && (hip_end > hip_begin)) {
+                    // HIP kernel with markers
+                    int start_pos = hip_begin + hip_begin_str.length();
+                    std::string hipname = shortName.substr(start_pos, hip_end - start_pos) ;
+                    DBOUTL(DB_CODE, "hipname=" << hipname);
+                    if (hipname == "unnamed") {
+                        shortName = shortName.substr(0, hip_begin);
+                    } else {
+                        shortName = hipname;
+                    }
+
+                } else {
+                    // PFE not from HIP:
+
+                    // strip off hip launch template wrapper:
+                    std::string hipImplString ("void hip_impl::grid_launch_hip_impl_<");
+                    int begin = shortName.find(hipImplString);
+                    if ((begin != std::string::npos)) {
+                        begin += hipImplString.length() ;
+                    } else {
+                        begin = 0;
+                    }
+
+                    shortName = shortName.substr(begin);
+
+                    // Strip off any leading return type:
+                    begin = shortName.find(" ", 0);
+                    if (begin == std::string::npos) {
+                        begin = 0;
+                    } else {
+                        begin +=1; // skip the space
+                    }
+                    shortName = shortName.substr(begin);
+
+                    DBOUTL(DB_CODE, "shortKernel processing demangled non-hip.  beginChar=" << begin << " shortName=" << shortName);
+                }
+
+            }
+
+            if (HCC_DB_SYMBOL_FORMAT & 0x10) {
+                // trim everything after first (
+                int begin = shortName.find("(");
+                shortName = shortName.substr(0, begin);
+            }
+        }
+    } catch (std::out_of_range& exception) {
+        // Do something sensible if string pattern is not what we expect
+        shortName = fun;
+    };
+
+    DBOUT (DB_CODE, "CreateKernel_short=      " << shortName << "\n");
+    DBOUT (DB_CODE, "CreateKernel_demangled=  " << (demangled ? demangled : "<demangle_error>") << "\n");
+    DBOUT (DB_CODE, "CreateKernel_raw=       " << fun << "\n");
+
+    if (demangled) {
+        free(demangled); // cxa_demangle mallocs memory.
+    }
+
+    return shortName;
+}
+
+// AMD loader extension table, queried once per process.
+static const hsa_ven_amd_loader_1_01_pfn_t& loaderExtTable()
+{
+    static hsa_ven_amd_loader_1_01_pfn_t ext_table = {nullptr};
+    static std::once_flag f;
+
+    std::call_once(f, []() {
+        uint16_t ext_version_major = 1;
+        uint16_t ext_version_minor = 0;
+        bool ext_supported = false;
+        hsa_status_t status =
+            hsa_system_major_extension_supported(
+                HSA_EXTENSION_AMD_LOADER,
+                ext_version_major,
+                &ext_version_minor,
+                &ext_supported);
+        STATUS_CHECK(status, __LINE__);
+        if(!ext_supported)
+            throw Kalmar::runtime_exception("HSA_EXTENSION_AMD_LOADER not supported.", 0);
+
+        status =
+            hsa_system_get_major_extension_table(
+                HSA_EXTENSION_AMD_LOADER,
+                1,
+                sizeof(ext_table),
+                &ext_table);
+        STATUS_CHECK(status, __LINE__);
+    });
+
+    return ext_table;
+}
+
 class HSAKernel {
 private:
     std::string kernelName;
-    std::string shortKernelName; // short handle, format selectable with HCC_DB_KERNEL_NAME
+    mutable std::string shortKernelName; // short handle, format selectable with HCC_DB_SYMBOL_FORMAT
+    mutable std::once_flag shortKernelNameFlag; // shortKernelName is demangled on first use
     HSAExecutable* executable;
     uint64_t kernelCodeHandle;
     hsa_executable_symbol_t hsaExecutableSymbol;
@@ -623,19 +873,14 @@ private:
     friend class HSADispatch;
 
 public:
-    HSAKernel(std::string &_kernelName, const std::string &x_shortKernelName, HSAExecutable* _executable,
+    HSAKernel(const std::string &_kernelName, HSAExecutable* _executable,
               hsa_executable_symbol_t _hsaExecutableSymbol,
               uint64_t _kernelCodeHandle) :
         kernelName(_kernelName),
-        shortKernelName(x_shortKernelName),
         executable(_executable),
         hsaExecutableSymbol(_hsaExecutableSymbol),
         kernelCodeHandle(_kernelCodeHandle) {
 
-        if (shortKernelName.empty()) {
-            shortKernelName = "<unknown_kernel>";
-        }
-
         hsa_status_t status =
             hsa_executable_symbol_get_info(
                 _hsaExecutableSymbol,
@@ -652,28 +897,7 @@ public:
 
         workitem_vgpr_count = 0;
 
-        uint16_t ext_version_major = 1;
-        uint16_t ext_version_minor = 0;
-        bool ext_supported = false;
-        status =
-            hsa_system_major_extension_supported(
-                HSA_EXTENSION_AMD_LOADER,
-                ext_version_major,
-                &ext_version_minor,
-                &ext_supported);
-        STATUS_CHECK(status, __LINE__);
-        if(!ext_supported)
-            throw Kalmar::runtime_exception("HSA_EXTENSION_AMD_LOADER not supported.", 0);
-
-        hsa_ven_amd_loader_1_01_pfn_t ext_table = {nullptr};
-        status =
-            hsa_system_get_major_extension_table(
-                HSA_EXTENSION_AMD_LOADER,
-                1,
-                sizeof(ext_table),
-                &ext_table);
-        STATUS_CHECK(status, __LINE__);
-
+        const hsa_ven_amd_loader_1_01_pfn_t &ext_table = loaderExtTable();
         if (nullptr != ext_table.hsa_ven_amd_loader_query_host_address) {
             const amd_kernel_code_t* akc = nullptr;
             status =
@@ -685,14 +909,22 @@ public:
             workitem_vgpr_count = akc->workitem_vgpr_count;
         }
 
-        DBOUTL(DB_CODE, "Create kernel " << shortKernelName << " vpr_cnt=" << this->workitem_vgpr_count
+        DBOUTL(DB_CODE, "Create kernel " << getKernelName() << " vpr_cnt=" << this->workitem_vgpr_count
                 << " static_group_segment_size=" << this->static_group_segment_size
                 << " private_segment_size=" << this->private_segment_size );
 
     }
 
     //TODO - fix this so all Kernels set the _kernelName to something sensible.
-    const std::string &getKernelName() const { return shortKernelName; }
+    const std::string &getKernelName() const {
+        std::call_once(shortKernelNameFlag, [this]() {
+            shortKernelName = kernelShortName(kernelName);
+            if (shortKernelName.empty()) {
+                shortKernelName = "<unknown_kernel>";
+            }
+        });
+        return shortKernelName;
+    }
     const std::string &getLongKernelName() const { return kernelName; }
 
     ~HSAKernel() {
@@ -700,6 +932,262 @@ public:
     }
 }; // end of HSAKernel
 
+// Per-HSAQueue kernarg allocator.
+//
+// Each size class is a ring of fixed-size kernarg buffers carved out of chunks of the
+// kernarg memory pool.  Buffers are handed out in ring order by the single producer - the
+// thread holding the HSAQueue lock in HSADispatch::dispatchKernel - so allocate() takes no
+// lock.  A buffer is returned by clearing its busy flag when the op is disposed, which may
+// happen on any thread.
+//
+// Ops on in-order queues retire in submission order, so the buffer under the cursor is
+// normally free again by the time the ring wraps around.  If it is still busy the class
+// grows by another chunk at the cursor.  Requests larger than the biggest class, or a class
+// which already has KERNARG_RING_MAX_CHUNKS chunks, miss and the caller falls back to
+// HSADevice::getKernargBuffer; misses are counted in the stats.
+class KernargRing {
+public:
+    typedef std::atomic<bool> Slot;
+
+    static const int CLASS_COUNT = 3;
+
+    struct Stats {
+        uint64_t allocs[CLASS_COUNT];
+        uint64_t grows;
+        uint64_t fallbacks;
+        uint64_t fallbackBytes;
+    };
+
+    KernargRing(hsa_amd_memory_pool_t pool, hsa_agent_t agent) : _pool(pool), _agent(agent) {
+        for (int c = 0; c < CLASS_COUNT; ++c) {
+            _classes[c].slotSize = KERNARG_BUFFER_SIZE << (2*c);
+            _classes[c].slotsPerChunk = KERNARG_RING_CHUNK_BYTES / _classes[c].slotSize;
+            _classes[c].chunk = 0;
+            _classes[c].slot = 0;
+        }
+        resetStats();
+    }
+
+    ~KernargRing() {
+        for (auto &sc : _classes) {
+            for (auto &ch : sc.chunks) {
+                hsa_amd_memory_pool_free(ch.memory);
+            }
+        }
+    }
+
+    // Returns a kernarg buffer of at least size bytes and the flag to pass to release(),
+    // or nullptr if the request has to be served elsewhere.
+    void* allocate(int size, Slot **slot) {
+        int c = 0;
+        while (c < CLASS_COUNT && size > _classes[c].slotSize) {
+            ++c;
+        }
+        if (c == CLASS_COUNT) {
+            return nullptr;
+        }
+
+        SizeClass &sc = _classes[c];
+        if (sc.chunks.empty() || sc.chunks[sc.chunk].busy[sc.slot].load(std::memory_order_acquire)) {
+            if (sc.chunks.size() >= KERNARG_RING_MAX_CHUNKS) {
+                return nullptr;
+            }
+            grow(sc);
+        }
+
+        Chunk &ch = sc.chunks[sc.chunk];
+        *slot = &ch.busy[sc.slot];
+        (*slot)->store(true, std::memory_order_relaxed);
+        uint8_t *ret = ch.memory + sc.slot * sc.slotSize;
+
+        if (++sc.slot == sc.slotsPerChunk) {
+            sc.slot = 0;
+            if (++sc.chunk == sc.chunks.size()) {
+                sc.chunk = 0;
+            }
+        }
+
+        // match the pool buffers which are cleared before use; the kernel may read past
+        // size, up to its kernarg segment size, so clear the whole slot
+        if (size < sc.slotSize) {
+            memset(ret + size, 0x00, sc.slotSize - size);
+        }
+
+        _stats.allocs[c]++;
+        return ret;
+    }
+
+    static void release(Slot *slot) {
+        slot->store(false, std::memory_order_release);
+    }
+
+    void recordFallback(int size) {
+        _stats.fallbacks++;
+        _stats.fallbackBytes += size;
+    }
+
+    const Stats &getStats() const { return _stats; }
+    void resetStats() { memset(&_stats, 0, sizeof(_stats)); }
+
+private:
+    struct Chunk {
+        uint8_t *memory;
+        std::unique_ptr<Slot[]> busy;
+    };
+
+    struct SizeClass {
+        int slotSize;
+        int slotsPerChunk;
+        std::vector<Chunk> chunks;
+        size_t chunk;  // cursor: next buffer handed out is chunks[chunk] at index slot
+        int slot;
+    };
+
+    // Insert a new chunk at the cursor.  If the cursor is partway through a chunk the
+    // remaining (oldest) buffers of that chunk are skipped until the ring wraps around.
+    void grow(SizeClass &sc) {
+        Chunk ch;
+        hsa_status_t status = hsa_amd_memory_pool_allocate(_pool, KERNARG_RING_CHUNK_BYTES, 0, (void**)&ch.memory);
+        STATUS_CHECK(status, __LINE__);
+
+        status = hsa_amd_agents_allow_access(1, &_agent, NULL, ch.memory);
+        STATUS_CHECK(status, __LINE__);
+
+        ch.busy.reset(new Slot[sc.slotsPerChunk]);
+        for (int i = 0; i < sc.slotsPerChunk; ++i) {
+            ch.busy[i].store(false, std::memory_order_relaxed);
+        }
+
+        if (!sc.chunks.empty() && sc.slot != 0) {
+            ++sc.chunk;
+        }
+        sc.chunks.insert(sc.chunks.begin() + sc.chunk, std::move(ch));
+        sc.slot = 0;
+
+        _stats.grows++;
+        DBOUTL(DB_RESOURCE, "Growing kernarg ring class " << sc.slotSize << "B to " << sc.chunks.size() << " chunks");
+    }
+
+    hsa_amd_memory_pool_t _pool;
+    hsa_agent_t           _agent;
+    SizeClass             _classes[CLASS_COUNT];
+    Stats                 _stats;
+};
+
+// Free list of op storage for a single queue.
+// Ops can outlive their queue (a completion_future keeps the op alive), so the pool is
+// reference counted by the queue and by every allocator copy held in an op's control block.
+class HSAOpPool {
+public:
+    struct Stats {
+        uint64_t hits;      // allocations served from the free list
+        uint64_t misses;    // allocations which went to operator new
+    };
+
+    HSAOpPool() : _stats() {
+        for (int i = 0; i < OP_POOL_CLASS_COUNT; ++i) {
+            _free[i] = nullptr;
+            _freeCount[i] = 0;
+        }
+    }
+
+    ~HSAOpPool() {
+        for (int i = 0; i < OP_POOL_CLASS_COUNT; ++i) {
+            while (_free[i]) {
+                FreeBlock *b = _free[i];
+                _free[i] = b->next;
+                ::operator delete(b);
+            }
+        }
+    }
+
+    void* allocate(size_t bytes) {
+        int c = sizeClass(bytes);
+        if (c < OP_POOL_CLASS_COUNT) {
+            std::lock_guard<std::mutex> l(_mutex);
+            if (_free[c]) {
+                FreeBlock *b = _free[c];
+                _free[c] = b->next;
+                _freeCount[c]--;
+                _stats.hits++;
+                return b;
+            }
+            _stats.misses++;
+            return ::operator new((c + 1) * OP_POOL_GRANULARITY);
+        }
+        return ::operator new(bytes);
+    }
+
+    void deallocate(void *p, size_t bytes) {
+        int c = sizeClass(bytes);
+        if (c < OP_POOL_CLASS_COUNT) {
+            std::lock_guard<std::mutex> l(_mutex);
+            if (_freeCount[c] < OP_POOL_CACHE_LIMIT) {
+                FreeBlock *b = static_cast<FreeBlock*>(p);
+                b->next = _free[c];
+                _free[c] = b;
+                _freeCount[c]++;
+                return;
+            }
+        }
+        ::operator delete(p);
+    }
+
+    Stats getStats() {
+        std::lock_guard<std::mutex> l(_mutex);
+        return _stats;
+    }
+
+private:
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+
+    static int sizeClass(size_t bytes) {
+        return (bytes + OP_POOL_GRANULARITY - 1) / OP_POOL_GRANULARITY - 1;
+    }
+
+    std::mutex  _mutex;
+    FreeBlock  *_free[OP_POOL_CLASS_COUNT];
+    int         _freeCount[OP_POOL_CLASS_COUNT];
+    Stats       _stats;
+};
+
+// Allocator handed to std::allocate_shared so an op and its control block share one
+// pooled block.
+template <typename T>
+class HSAOpAllocator {
+public:
+    typedef T value_type;
+
+    explicit HSAOpAllocator(const std::shared_ptr<HSAOpPool> &pool) : _pool(pool) {}
+    template <typename U>
+    HSAOpAllocator(const HSAOpAllocator<U> &other) : _pool(other._pool) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(_pool->allocate(n * sizeof(T))); }
+    void deallocate(T *p, size_t n) { _pool->deallocate(p, n * sizeof(T)); }
+
+    template <typename U>
+    bool operator==(const HSAOpAllocator<U> &other) const { return _pool == other._pool; }
+    template <typename U>
+    bool operator!=(const HSAOpAllocator<U> &other) const { return _pool != other._pool; }
+
+    std::shared_ptr<HSAOpPool> _pool;
+};
+
+// Deleter for ops which were placement-constructed in pool storage.
+template <typename T>
+struct HSAOpDeleter {
+    explicit HSAOpDeleter(const std::shared_ptr<HSAOpPool> &pool) : _pool(pool) {}
+
+    void operator()(T *op) const {
+        op->~T();
+        _pool->deallocate(op, sizeof(T));
+    }
+
+    std::shared_ptr<HSAOpPool> _pool;
+};
+
 // Stores the device and queue for op coordinate:
 struct HSAOpCoord
 {
@@ -715,9 +1203,9 @@ public:
     HSAOp(hc::HSAOpId id, Kalmar::KalmarQueue *queue, hc::hcCommandKind commandKind);
 
     const HSAOpCoord opCoord() const { return _opCoord; };
-    int asyncOpsIndex() const { return _asyncOpsIndex; };
+    uint64_t asyncOpsIndex() const { return _asyncOpsIndex; };
 
-    void asyncOpsIndex(int asyncOpsIndex) { _asyncOpsIndex = asyncOpsIndex; };
+    void asyncOpsIndex(uint64_t asyncOpsIndex) { _asyncOpsIndex = asyncOpsIndex; };
 
     void* getNativeHandle() override { return &_signal; }
 
@@ -726,10 +1214,42 @@ public:
 
     Kalmar::HSAQueue *hsaQueue() const;
     bool isReady() override;
+
+    // Wait for the submitted op to complete, in the op's wait mode or in mode.  Only the
+    // first call waits on the signal; this replaces the std::shared_future each op used
+    // to allocate.
+    void wait() override { wait(_waitMode); }
+    void wait(Kalmar::hcWaitMode mode) override;
+
+    // Wait for at most timeout; wait() once the op completed.
+    bool waitFor(std::chrono::nanoseconds timeout) override;
+
+    // wait for the op to complete in mode, implemented by each op type
+    virtual hsa_status_t waitComplete(Kalmar::hcWaitMode mode) = 0;
+
+    void setWaitMode(Kalmar::hcWaitMode mode) override { _waitMode = mode; }
+
+    // Run callback on the callback workers once the completion signal fires.
+    void setCallback(std::function<void()> callback) override;
 protected:
+    // Signal fd from the HSA signal handler thread once the completion signal fires.
+    void notifyOnCompletion(const std::shared_ptr<Kalmar::CompletionFd>& fd,
+                            const std::shared_ptr<Kalmar::KalmarAsyncOp>& self) override;
+
+    // Called once the op has been submitted, so wait() has something to wait for.
+    void setWaitable() { _waitable = true; }
+
+    // Wait until _signal drops below 1, in mode, for at most timeoutNs.
+    // Returns true if it did.
+    bool waitSignal(Kalmar::hcWaitMode mode, uint64_t timeoutNs = Kalmar::WAIT_FOREVER);
+
     uint64_t     apiStartTick;
     HSAOpCoord   _opCoord;
-    int          _asyncOpsIndex;
+    uint64_t     _asyncOpsIndex;  // position in the queue's AsyncOpRing
+
+    bool               _waitable;
+    std::once_flag     _waitOnce;
+    std::atomic<Kalmar::hcWaitMode> _waitMode;  // set by setWaitMode while other threads wait
 
     hsa_signal_t _signal;
     int          _signalIndex;
@@ -748,9 +1268,6 @@ private:
     bool isSingleStepCopy;; // copy was performed on fast-path via a single call to the HSA copy routine
     bool isPeerToPeer;
     uint64_t apiStartTick;
-    hsa_wait_state_t waitMode;
-
-    std::shared_future<void>* future;
 
 
     // If copy is dependent on another operation, record reference here.
@@ -769,22 +1286,15 @@ private:
     // bytes to be copied
     size_t sizeBytes;
 
+    // pinned host memory src was staged in, released with this op
+    std::shared_ptr<void> stagingBuffer;
+
 
 public:
-    std::shared_future<void>* getFuture() override { return future; }
     const Kalmar::HSADevice* getCopyDevice() const { return copyDevice; } ;  // Which device did the copy.
 
+    void adoptStagingBuffer(std::shared_ptr<void> buffer) { stagingBuffer = std::move(buffer); }
 
-    void setWaitMode(Kalmar::hcWaitMode mode) override {
-        switch (mode) {
-            case Kalmar::hcWaitModeBlocked:
-                waitMode = HSA_WAIT_STATE_BLOCKED;
-            break;
-            case Kalmar::hcWaitModeActive:
-                waitMode = HSA_WAIT_STATE_ACTIVE;
-            break;
-        }
-    }
 
 
     std::string getCopyCommandString()
@@ -831,7 +1341,7 @@ public:
     ~HSACopy() {
         if (isSubmitted) {
             hsa_status_t status = HSA_STATUS_SUCCESS;
-            status = waitComplete();
+            status = waitComplete(_waitMode);
             STATUS_CHECK(status, __LINE__);
         }
         dispose();
@@ -841,7 +1351,7 @@ public:
     hsa_status_t enqueueAsyncCopy2dCommand(size_t width, size_t height, size_t srcPitch, size_t dstPitch, const Kalmar::HSADevice *copyDevice, const hc::AmPointerInfo &srcPtrInfo, const hc::AmPointerInfo &dstPtrInfo);
 
     // wait for the async copy to complete
-    hsa_status_t waitComplete();
+    hsa_status_t waitComplete(Kalmar::hcWaitMode mode) override;
 
     void dispose();
 
@@ -882,10 +1392,6 @@ private:
 class HSABarrier : public HSAOp {
 private:
     bool isDispatched;
-    hsa_wait_state_t waitMode;
-
-
-    std::shared_future<void>* future;
 
     // prior dependencies
     // maximum up to 5 prior dependencies could be associated with one
@@ -907,24 +1413,12 @@ public:
     std::shared_ptr<HSAOp> depAsyncOps [HSA_BARRIER_DEP_SIGNAL_CNT];
 
 public:
-    std::shared_future<void>* getFuture() override { return future; }
     void acquire_scope(hc::memory_scope acquireScope) { _acquire_scope = acquireScope;};
 
     bool barrierNextSyncNeedsSysRelease() const override { return _barrierNextSyncNeedsSysRelease; };
     bool barrierNextKernelNeedsSysAcquire() const override { return _barrierNextKernelNeedsSysAcquire; };
 
 
-    void setWaitMode(Kalmar::hcWaitMode mode) override {
-        switch (mode) {
-            case Kalmar::hcWaitModeBlocked:
-                waitMode = HSA_WAIT_STATE_BLOCKED;
-            break;
-            case Kalmar::hcWaitModeActive:
-                waitMode = HSA_WAIT_STATE_ACTIVE;
-            break;
-        }
-    }
-
 
 
 
@@ -934,11 +1428,9 @@ public:
     HSABarrier(Kalmar::KalmarQueue *queue, std::shared_ptr <Kalmar::KalmarAsyncOp> dependent_op) :
         HSAOp(hc::HSA_OP_ID_BARRIER, queue, Kalmar::hcCommandMarker),
         isDispatched(false),
-        future(nullptr),
         _acquire_scope(hc::no_scope),
         _barrierNextSyncNeedsSysRelease(false),
-        _barrierNextKernelNeedsSysAcquire(false),
-        waitMode(HSA_WAIT_STATE_BLOCKED)
+        _barrierNextKernelNeedsSysAcquire(false)
     {
 
         if (dependent_op != nullptr) {
@@ -955,11 +1447,9 @@ public:
     HSABarrier(Kalmar::KalmarQueue *queue, int count, std::shared_ptr <Kalmar::KalmarAsyncOp> *dependent_op_array) :
         HSAOp(hc::HSA_OP_ID_BARRIER, queue, Kalmar::hcCommandMarker),
         isDispatched(false),
-        future(nullptr),
         _acquire_scope(hc::no_scope),
         _barrierNextSyncNeedsSysRelease(false),
         _barrierNextKernelNeedsSysAcquire(false),
-        waitMode(HSA_WAIT_STATE_BLOCKED),
         depCount(0)
     {
         if ((count >= 0) && (count <= 5)) {
@@ -979,7 +1469,7 @@ public:
     ~HSABarrier() {
         if (isDispatched) {
             hsa_status_t status = HSA_STATUS_SUCCESS;
-            status = waitComplete();
+            status = waitComplete(_waitMode);
             STATUS_CHECK(status, __LINE__);
         }
         dispose();
@@ -989,7 +1479,7 @@ public:
     hsa_status_t enqueueAsync(hc::memory_scope memory_scope);
 
     // wait for the barrier to complete
-    hsa_status_t waitComplete();
+    hsa_status_t waitComplete(Kalmar::hcWaitMode mode) override;
 
     void dispose();
 
@@ -1011,53 +1501,52 @@ private:
     Kalmar::HSADevice* device;
 
     const char *kernel_name;
+    std::shared_ptr<const std::string> kernel_name_owner;  // set if kernel_name came from a command_graph
     const HSAKernel* kernel;
 
-    std::vector<uint8_t> arg_vec;
+    // Host copy of the kernargs.  Arguments are packed into argInline, which covers
+    // nearly all kernels, and move to argSpill once they outgrow it.
+    uint8_t  argInline[KERNARG_BUFFER_SIZE] __attribute__((aligned(16)));
+    std::vector<uint8_t> argSpill;
+    uint8_t *argData;
+    size_t   argSize;
+    size_t   argCapacity;
     uint32_t arg_count;
-    size_t prevArgVecCapacity;
     void* kernargMemory;
     int kernargMemoryIndex;
+    KernargRing::Slot* kernargSlot;  // set if kernargMemory came from the queue's kernarg ring
 
 
     hsa_kernel_dispatch_packet_t aql;
     bool isDispatched;
-    hsa_wait_state_t waitMode;
 
-
-    std::shared_future<void>* future;
+    // copy this kernel waits for through a dependency barrier packet, see HSAQueue::waitForStreamDeps
+    std::shared_ptr<HSAOp> streamDepOp;
 
 public:
-    std::shared_future<void>* getFuture() override { return future; }
+    void setStreamDependency(std::shared_ptr<HSAOp> depOp) { streamDepOp = std::move(depOp); }
 
     void setKernelName(const char *x_kernel_name) { kernel_name = x_kernel_name;};
-    const char *getKernelName() { return kernel_name ? kernel_name : (kernel ? kernel->shortKernelName.c_str() : "<unknown_kernel>"); };
+    void setKernelName(std::shared_ptr<const std::string> x_kernel_name) {
+        kernel_name_owner = std::move(x_kernel_name);
+        kernel_name = kernel_name_owner->c_str();
+    }
+    const char *getKernelName() { return kernel_name ? kernel_name : (kernel ? kernel->getKernelName().c_str() : "<unknown_kernel>"); };
     const char *getLongKernelName() { return (kernel ? kernel->getLongKernelName().c_str() : "<unknown_kernel>"); };
 
 
-    void setWaitMode(Kalmar::hcWaitMode mode) override {
-        switch (mode) {
-            case Kalmar::hcWaitModeBlocked:
-                waitMode = HSA_WAIT_STATE_BLOCKED;
-            break;
-            case Kalmar::hcWaitModeActive:
-                waitMode = HSA_WAIT_STATE_ACTIVE;
-            break;
-        }
-    }
-
 
     ~HSADispatch() {
 
         if (isDispatched) {
             hsa_status_t status = HSA_STATUS_SUCCESS;
-            status = waitComplete();
+            status = waitComplete(_waitMode);
             STATUS_CHECK(status, __LINE__);
         }
         dispose();
     }
 
-    HSADispatch(Kalmar::HSADevice* _device, Kalmar::KalmarQueue* _queue, HSAKernel* _kernel,
+    HSADispatch(Kalmar::HSADevice* _device, Kalmar::KalmarQueue* _queue, const HSAKernel* _kernel,
                 const hsa_kernel_dispatch_packet_t *aql=nullptr);
 
     hsa_status_t pushFloatArg(float f) { return pushArgPrivate(f); }
@@ -1069,9 +1558,13 @@ public:
     hsa_status_t pushShortArg(short s) { return pushArgPrivate(s); }
     hsa_status_t pushPointerArg(void *addr) { return pushArgPrivate(addr); }
 
+    // append an argument of any size, or a kernarg image laid out by
+    // BufferArgumentsAppender, at the next multiple of align
+    hsa_status_t pushArgBytes(const void *val, size_t size, size_t align);
+
     hsa_status_t clearArgs() {
         arg_count = 0;
-        arg_vec.clear();
+        argSize = 0;
         return HSA_STATUS_SUCCESS;
     }
 
@@ -1090,7 +1583,7 @@ public:
                                int hostKernargSize, bool allocSignal);
 
     // wait for the kernel to finish execution
-    hsa_status_t waitComplete();
+    hsa_status_t waitComplete(Kalmar::hcWaitMode mode) override;
 
     void dispose();
 
@@ -1107,26 +1600,26 @@ public:
 
     const hsa_kernel_dispatch_packet_t &getAql() const { return aql; };
 
-private:
-    template <typename T>
-    hsa_status_t pushArgPrivate(T val) {
-        /* add padding if necessary */
-        int padding_size = (arg_vec.size() % sizeof(T)) ? (sizeof(T) - (arg_vec.size() % sizeof(T))) : 0;
-        DBOUT(DB_KERNARG, "push " << (sizeof(T) + padding_size) << " bytes into kernarg: ");
+    const HSAKernel *getKernel() const { return kernel; };
+    const void *getArgData() const { return argData; };
+    size_t getArgSize() const { return argSize; };
 
-        for (size_t i = 0; i < padding_size; ++i) {
-            arg_vec.push_back((uint8_t)0x00);
-            DBOUT(DB_KERNARG, std::hex << std::setw(2) << std::setfill('0') << 0x00 << " ");
-        }
-        uint8_t* ptr = static_cast<uint8_t*>(static_cast<void*>(&val));
-        for (size_t i = 0; i < sizeof(T); ++i) {
-            arg_vec.push_back(ptr[i]);
-            DBOUT(DB_KERNARG, std::hex << std::setw(2) << std::setfill('0') << +ptr[i] << " ");
+private:
+    void reserveArgs(size_t bytes) {
+        if (bytes > argCapacity) {
+            bool wasInline = (argData == argInline);
+            argCapacity = std::max(bytes, 2 * argCapacity);
+            argSpill.resize(argCapacity);
+            if (wasInline) {
+                memcpy(argSpill.data(), argInline, argSize);
+            }
+            argData = argSpill.data();
         }
-        DBOUT(DB_KERNARG, std::endl);
+    }
 
-        arg_count++;
-        return HSA_STATUS_SUCCESS;
+    template <typename T>
+    hsa_status_t pushArgPrivate(T val) {
+        return pushArgBytes(&val, sizeof(T), alignof(T));
     }
 
 }; // end of HSADispatch
@@ -1258,6 +1751,191 @@ struct RocrQueue {
 
 
 
+// Commands recorded by an HSAQueue between beginCapture and endCapture, see hc::command_graph.
+// Kernel nodes keep a finished AQL packet and a host copy of the kernargs, which is the only
+// part changed between replays.  Whether a node needs an explicit dependency on the node
+// before it is worked out once, on capture, with the rules of HSAQueue::detectStreamDeps.
+// Copy nodes look their pointers up in the memory tracker again on every replay, see
+// refreshPointerInfo.
+class HSAGraph final : public KalmarGraph {
+public:
+    struct KernelNode {
+        const HSAKernel              *kernel;  // nullptr if recorded by dispatch_hsa_kernel
+        std::shared_ptr<const std::string> name;  // shared with replayed dispatches, which may outlive the graph
+        hsa_kernel_dispatch_packet_t  aql;     // without completion signal and kernarg address
+        std::vector<uint8_t>          args;
+        std::vector<void*>            buffers; // read-only array_view buffers, used by every replay
+    };
+
+    struct CopyNode {
+        const void               *src;
+        void                     *dst;
+        size_t                    sizeBytes;
+        hc::AmPointerInfo         srcInfo;
+        hc::AmPointerInfo         dstInfo;
+        const Kalmar::HSADevice  *copyDevice;
+    };
+
+    struct Node {
+        hcCommandKind    kind;
+        size_t           index;              // into kernels or copies
+        hc::memory_scope scope;              // fence scope of a marker
+        bool             dependsOnPrevious;
+    };
+
+    explicit HSAGraph(Kalmar::HSADevice *device) : device(device) {}
+
+    size_t size() const override { return nodes.size(); }
+
+    hcCommandKind getNodeKind(size_t node) const override { return nodes[node].kind; }
+
+    void* getKernelArgs(size_t node, size_t *size) override {
+        if (nodes[node].kind != hcCommandKernel) {
+            *size = 0;
+            return nullptr;
+        }
+        KernelNode &k = kernels[nodes[node].index];
+        *size = k.args.size();
+        return k.args.data();
+    }
+
+    Kalmar::HSADevice *getDevice() const { return device; }
+
+    const Node &getNode(size_t node) const { return nodes[node]; }
+    const KernelNode &getKernel(const Node &node) const { return kernels[node.index]; }
+    const CopyNode &getCopy(const Node &node) const { return copies[node.index]; }
+
+    void appendKernel(const HSAKernel *kernel, const char *name, const hsa_kernel_dispatch_packet_t &aql,
+                      const void *args, size_t argSize, std::vector<void*> buffers = std::vector<void*>()) {
+        const uint8_t *p = static_cast<const uint8_t*> (args);
+        std::shared_ptr<const std::string> nameCopy;
+        if (name) {
+            nameCopy = std::make_shared<const std::string>(name);
+        }
+        kernels.push_back(KernelNode{kernel, std::move(nameCopy), aql, std::vector<uint8_t>(p, p + argSize),
+                                     std::move(buffers)});
+        append(hcCommandKernel, kernels.size() - 1, hc::no_scope, nullptr);
+    }
+
+    void appendCopy(hcCommandKind copyDir, const void *src, void *dst, size_t sizeBytes,
+                    const hc::AmPointerInfo &srcInfo, const hc::AmPointerInfo &dstInfo,
+                    const Kalmar::HSADevice *copyDevice) {
+        copies.push_back(CopyNode{src, dst, sizeBytes, srcInfo, dstInfo, copyDevice});
+        append(copyDir, copies.size() - 1, hc::no_scope, copyDevice);
+    }
+
+    void appendMarker(hc::memory_scope scope) {
+        append(hcCommandMarker, 0, scope, nullptr);
+    }
+
+    // Update info, captured for ptr, from the memory tracker.  Returns false if ptr was tracked
+    // on capture but has been freed since, or now lives elsewhere, so the copy direction
+    // recorded for the node no longer holds.  Untracked host memory is left as it is.
+    static bool refreshPointerInfo(hc::AmPointerInfo *info, const void *ptr) {
+        if (info->_sizeBytes == 0) {
+            return true;
+        }
+        bool wasInDeviceMem = info->_isInDeviceMem;
+        return (hc::am_memtracker_getinfo(info, ptr) == AM_SUCCESS) && (info->_isInDeviceMem == wasInDeviceMem);
+    }
+
+private:
+    void append(hcCommandKind kind, size_t index, hc::memory_scope scope, const Kalmar::HSADevice *copyDevice) {
+        bool needDep = false;
+        if (!nodes.empty()) {
+            const Node &prev = nodes.back();
+            if (isCopyCommand(kind) && isCopyCommand(prev.kind)) {
+                needDep = (kind != prev.kind) || (copyDevice != copies[prev.index].copyDevice) ||
+                          FORCE_SIGNAL_DEP_BETWEEN_COPIES;
+            } else {
+                // kernels and markers are ordered by the AQL barrier bit
+                needDep = (kind != prev.kind) && !(isComputeQueueCommand(kind) && isComputeQueueCommand(prev.kind));
+            }
+        }
+        nodes.push_back(Node{kind, index, scope, needDep});
+    }
+
+    Kalmar::HSADevice        *device;
+    std::vector<Node>         nodes;
+    std::vector<KernelNode>   kernels;
+    std::vector<CopyNode>     copies;
+};
+
+
+// Fixed-capacity ring of the ops in flight on an HSAQueue, oldest at head().
+// Positions are absolute (they only grow), so an op can remember where it was pushed
+// and later be found again in O(1).  Ops are always retired from the oldest end.
+//
+// Retiring an op only advances head(); the ring keeps its reference until reclaim()
+// releases it.  Releasing the last reference runs the op destructor, which returns the
+// signal and kernarg buffer, so this work can be kept off the path of a waiting thread.
+class AsyncOpRing {
+public:
+    explicit AsyncOpRing(size_t capacity) : _ops(capacity), _mask(capacity - 1), _reclaim(0), _head(0), _tail(0) {
+        assert((capacity & _mask) == 0);
+    }
+
+    // live (not retired) ops
+    bool     empty() const { return _head == _tail; }
+    size_t   size() const { return _tail - _head; }
+    uint64_t head() const { return _head; }
+    uint64_t tail() const { return _tail; }
+
+    // retired ops still referenced by the ring
+    size_t   retired() const { return _head - _reclaim; }
+
+    const std::shared_ptr<HSAOp> &at(uint64_t pos) const { return _ops[pos & _mask]; }
+    const std::shared_ptr<HSAOp> &oldest() const { return at(_head); }
+    const std::shared_ptr<HSAOp> &youngest() const { return at(_tail - 1); }
+
+    bool contains(uint64_t pos, const HSAOp *op) const {
+        return pos >= _head && pos < _tail && at(pos).get() == op;
+    }
+
+    // Returns the position of the op.
+    uint64_t push(std::shared_ptr<HSAOp> op) {
+        if (_tail - _reclaim == _ops.size()) {
+            reclaim(_ops.size());
+            if (_tail - _reclaim == _ops.size()) {
+                throw Kalmar::runtime_exception("too many ops in flight on queue", 0);
+            }
+        }
+        _ops[_tail & _mask] = std::move(op);
+        return _tail++;
+    }
+
+    // Retire the ops up to and including position pos.
+    void retireThrough(uint64_t pos) {
+        if (pos >= _head && pos < _tail) {
+            _head = pos + 1;
+        }
+    }
+
+    // Release the references to at most maxOps retired ops, oldest first.  Each slot is
+    // emptied before the reference is dropped, so an op destructor calling back into the
+    // queue no longer finds itself in the ring.
+    void reclaim(size_t maxOps) {
+        for (; maxOps && _reclaim < _head; --maxOps) {
+            std::shared_ptr<HSAOp> op;
+            op.swap(_ops[_reclaim & _mask]);
+            ++_reclaim;
+        }
+    }
+
+    void clear() {
+        _head = _tail;
+        reclaim(_ops.size());
+    }
+
+private:
+    std::vector<std::shared_ptr<HSAOp>> _ops;
+    uint64_t                            _mask;
+    uint64_t                            _reclaim;  // oldest slot still holding a retired op
+    uint64_t                            _head;
+    uint64_t                            _tail;
+};
+
+
 class HSAQueue final : public KalmarQueue
 {
 private:
@@ -1287,11 +1965,21 @@ private:
     // kernel dispatches and barriers associated with this HSAQueue instance
     //
     // When a kernel k is dispatched, we'll get a KalmarAsyncOp f.
-    // This vector would hold f.  acccelerator_view::wait() would trigger
-    // HSAQueue::wait(), and all future objects in the KalmarAsyncOp objects
-    // will be waited on.
+    // This ring would hold f.  acccelerator_view::wait() would trigger
+    // HSAQueue::wait(), and all the KalmarAsyncOp objects will be waited on.
+    // Completed ops are also retired from the oldest end as new ops are pushed.
     //
-    std::vector< std::shared_ptr<HSAOp> > asyncOps;
+    AsyncOpRing asyncOps;
+
+    // Ring positions of the copies pushed on an any-order queue, oldest first, which the
+    // marker wait() enqueues has to depend on.  Retired ones are dropped lazily.
+    std::deque<uint64_t> copyPositions;
+
+    struct AsyncOpStats {
+        uint64_t reaped;             // ops retired by pushAsyncOp polling their signal
+        uint64_t backPressureWaits;  // pushes which found the ring full and waited for the oldest op
+        uint64_t drains;             // back-pressure waits which had to drain the whole queue
+    } asyncOpStats;
 
     uint64_t                                      queueSeqNum; // sequence-number of this queue.
 
@@ -1324,18 +2012,19 @@ private:
     // kernel / kernel dispatches / buffers
     //
     // For a particular kernel k, kernelBufferMap[k] holds a vector of
-    // host buffers used by k. The vector is filled at HSAQueue::Push(),
-    // when kernel arguments are prepared.
+    // host buffers used by k, and whether k may write them. The vector is
+    // filled at HSAQueue::Push(), when kernel arguments are prepared.
     //
     // When a kenrel k is to be dispatched, kernelBufferMap[k] will be traversed
     // to figure out if there is any previous kernel dispatch associated for
-    // each buffer b used by k.  This is done by checking bufferKernelMap[b].
+    // each buffer b written by k.  This is done by checking bufferKernelMap[b].
     // If there are previous kernel dispatches which use b, then we wait on
     // them before dispatch kernel k. bufferKernelMap[b] will be cleared then.
     //
     // After kernel k is dispatched, we'll get a KalmarAsync object f, we then
-    // walk through each buffer b used by k and mark the association as:
+    // walk through each buffer b written by k and mark the association as:
     // bufferKernelMap[b] = f
+    // and through each buffer b used by k and record f in bufferLastUse[b].
     //
     // Finally kernelBufferMap[k] will be cleared.
     //
@@ -1347,16 +2036,65 @@ private:
 
     // association between a kernel and buffers used by it
     // key: kernel
-    // value: a vector of buffers used by the kernel
-    std::map<void*, std::vector<void*> > kernelBufferMap;
+    // value: a vector of buffers used by the kernel, and whether it may write them
+    std::map<void*, std::vector< std::pair<void*, bool> > > kernelBufferMap;
+
+    // kernel dispatches and uploads which may still use a buffer, read or
+    // written, so that the buffer of a destroyed array or array_view is
+    // released once they completed instead of draining the queue, and
+    // blocking copies wait for them.  Protected by qmutex.
+    // key: buffer address
+    // value: a vector of kernel dispatches and copies
+    std::map<void*, std::vector< std::weak_ptr<KalmarAsyncOp> > > bufferLastUse;
 
     // signal used by sync copy only
     hsa_signal_t  sync_copy_signal;
 
+    // kernarg buffers for dispatches on this queue.  Borrowed from the device on creation
+    // and handed back in dispose(), so ops outliving the queue can still release into it.
+    KernargRing  *kernargRing;
+
+    // storage for the ops enqueued on this queue, shared with ops which outlive it
+    std::shared_ptr<HSAOpPool> opPool;
+
+    // Dispatch batching, see beginDispatchBatch().
+    // While a batch is open, packets are written into reserved slots of the ROCR queue but
+    // their headers, the write index and the doorbell are only published by flushDispatchBatch().
+    // Guarded by qmutex, except batchPendingCount which waiters poll without the lock.
+    int                                          batchDepth;
+    hsa_queue_t                                 *batchHwQueue;
+    uint64_t                                     batchWriteIndex;  // next free slot while packets are pending
+    std::vector<std::pair<uint16_t*, uint16_t>>  batchHeaders;     // header location and value, in queue order
+    std::atomic<int>                             batchPendingCount;
+
+    void flushDispatchBatch();
+
+    // Graph commands are recorded into while capturing, see beginCapture().  Guarded by qmutex.
+    std::shared_ptr<HSAGraph>                    captureGraph;
+
+    // Returned for commands recorded into a graph: they do not run, so they are complete.
+    static std::shared_ptr<KalmarAsyncOp> capturedOpPlaceholder() {
+        auto op = std::make_shared<KalmarHostOp>();
+        op->complete();
+        return op;
+    }
+
+    HSAGraph *capturingGraph() {
+        std::lock_guard<std::recursive_mutex> lg(qmutex);
+        return captureGraph.get();
+    }
+
+    // How long adaptive waits on kernels, markers and copies of this queue took, see HSAOp::waitSignal.
+    Kalmar::AdaptiveSpin                         waitSpins[3];
+
 
 public:
     HSAQueue(KalmarDevice* pDev, hsa_agent_t agent, execute_order order, queue_priority priority) ;
 
+    Kalmar::AdaptiveSpin& waitSpin(hcCommandKind kind) {
+        return waitSpins[(kind == hcCommandKernel) ? 0 : (kind == hcCommandMarker) ? 1 : 2];
+    }
+
     bool nextKernelNeedsSysAcquire() const { return _nextKernelNeedsSysAcquire; };
     void setNextKernelNeedsSysAcquire(bool r) { _nextKernelNeedsSysAcquire = r; };
 
@@ -1373,6 +2111,54 @@ public:
 
     Kalmar::HSADevice * getHSADev() const;
 
+    KernargRing *getKernargRing() const { return kernargRing; };
+
+    // Create an op whose storage (object and shared_ptr control block) comes from opPool.
+    template <typename T, typename... Args>
+    std::shared_ptr<T> makeOp(Args&&... args) {
+        return std::allocate_shared<T>(HSAOpAllocator<T>(opPool), std::forward<Args>(args)...);
+    }
+
+    // Kernel dispatches are created by HSADevice::CreateKernel before it is known whether
+    // they will be launched synchronously or asynchronously, so they are constructed in
+    // pool storage and either destroyed with deleteDispatch or adopted by a shared_ptr.
+    HSADispatch *newDispatch(Kalmar::HSADevice *device, HSAKernel *kernel) {
+        void *p = opPool->allocate(sizeof(HSADispatch));
+        return new (p) HSADispatch(device, this, kernel);
+    }
+
+    void deleteDispatch(HSADispatch *dispatch) {
+        HSAOpDeleter<HSADispatch>(opPool)(dispatch);
+    }
+
+    std::shared_ptr<KalmarAsyncOp> adoptDispatch(HSADispatch *dispatch) {
+        return std::shared_ptr<KalmarAsyncOp>(dispatch, HSAOpDeleter<HSADispatch>(opPool),
+                                              HSAOpAllocator<HSADispatch>(opPool));
+    }
+
+    // Packet submission helpers; the caller must hold the ROCR queue (acquireLockedRocrQueue).
+    // reservePacketSlot returns the index of the next free slot in the ROCR queue.
+    // publishPacket makes the packet at that slot visible to the packet processor,
+    // or defers it to the end of the open dispatch batch.
+    uint64_t reservePacketSlot(hsa_queue_t *lockedHsaQueue);
+    void publishPacket(hsa_queue_t *lockedHsaQueue, uint16_t *packetHeader, uint16_t header, uint64_t index);
+
+    void beginDispatchBatch() override;
+    void endDispatchBatch() override;
+    void flush() override;
+
+    void beginCapture() override;
+    std::shared_ptr<KalmarGraph> endCapture() override;
+    std::shared_ptr<KalmarAsyncOp> replayGraph(const std::shared_ptr<KalmarGraph>& graph) override;
+
+    // Called before blocking on an op: packets held back by a batch must reach the
+    // device first or the wait would never finish.
+    void flushPendingPackets() {
+        if (batchPendingCount.load(std::memory_order_acquire)) {
+            flush();
+        }
+    }
+
     void dispose() override;
 
     ~HSAQueue() {
@@ -1384,15 +2170,13 @@ public:
         DBOUT(DB_INIT, "HSAQueue::~HSAQueue() " << this << "out\n");
     }
 
-    // FIXME: implement flush
-    //
     void printAsyncOps(std::ostream &s = std::cerr)
     {
         std::lock_guard<std::recursive_mutex> lg(qmutex);
         hsa_signal_value_t oldv=0;
         s << *this << " : " << asyncOps.size() << " op entries\n";
-        for (int i=0; i<asyncOps.size(); i++) {
-            const std::shared_ptr<HSAOp> &op = asyncOps[i];
+        for (uint64_t i=asyncOps.head(); i<asyncOps.tail(); i++) {
+            const std::shared_ptr<HSAOp> &op = asyncOps.at(i);
             s << "index:" << std::setw(4) << i ;
             if (op != nullptr) {
                 s << " op#"<< op->getSeqNum() ;
@@ -1442,17 +2226,28 @@ public:
 
 
 
-        if (!drainingQueue_ && (asyncOps.size() >= MAX_INFLIGHT_COMMANDS_PER_QUEUE-1)) {
-            DBOUT(DB_WAIT, "*** Hit max inflight ops asyncOps.size=" << asyncOps.size() << ". " << op << " force sync\n");
-            DBOUT(DB_RESOURCE, "*** Hit max inflight ops asyncOps.size=" << asyncOps.size() << ". " << op << " force sync\n");
+        if (!drainingQueue_) {
+            reapAsyncOps();
+            asyncOps.reclaim(ASYNCOPS_RECLAIM_BATCH);
+
+            // One slot is kept free for the marker wait() may have to enqueue.
+            if (asyncOps.size() >= MAX_INFLIGHT_COMMANDS_PER_QUEUE-1) {
+                DBOUT(DB_WAIT, "*** Hit max inflight ops asyncOps.size=" << asyncOps.size() << ". " << op << " wait for oldest op\n");
+                DBOUT(DB_RESOURCE, "*** Hit max inflight ops asyncOps.size=" << asyncOps.size() << ". " << op << " wait for oldest op\n");
 
-            drainingQueue_ = true;
+                drainingQueue_ = true;
 
-            wait();
+                asyncOpStats.backPressureWaits++;
+                waitOldestAsyncOp();
+            }
         }
-        op->asyncOpsIndex(asyncOps.size());
+        op->asyncOpsIndex(asyncOps.tail());
         youngestCommandKind = op->getCommandKind();
-        asyncOps.push_back(std::move(op));
+        if (get_execute_order() != execute_in_order && isCopyCommand(youngestCommandKind)) {
+            dropRetiredCopies();
+            copyPositions.push_back(asyncOps.tail());
+        }
+        asyncOps.push(std::move(op));
 
         drainingQueue_ = false;
 
@@ -1463,6 +2258,35 @@ public:
 
 
 
+    // Retire ops at the oldest end of the ring whose completion signal has fired.
+    // At most ASYNCOPS_REAP_BATCH signals are polled so pushes stay cheap; the ops are
+    // retired in order, so an op without a signal (or not yet dispatched) stops the scan.
+    void reapAsyncOps() {
+        for (int i = 0; i < ASYNCOPS_REAP_BATCH && !asyncOps.empty(); ++i) {
+            hsa_signal_t signal = *(static_cast<hsa_signal_t*> (asyncOps.oldest()->getNativeHandle()));
+            if (signal.handle == 0 || hsa_signal_load_scacquire(signal) != 0) {
+                break;
+            }
+            asyncOps.retireThrough(asyncOps.head());
+            asyncOpStats.reaped++;
+        }
+    }
+
+    // Block until the oldest in-flight op has completed, which retires it (and any op
+    // older than it) from the ring.  Falls back to draining the queue if the oldest op
+    // cannot be waited on by itself, for example because it has not been dispatched yet.
+    void waitOldestAsyncOp() {
+        uint64_t oldestPos = asyncOps.head();
+        std::shared_ptr<HSAOp> oldest = asyncOps.oldest();
+
+        oldest->wait();
+
+        if (asyncOps.head() <= oldestPos) {
+            asyncOpStats.drains++;
+            wait(getDefaultWaitMode());
+        }
+    }
+
     // Check upcoming command that will be sent to this queue against the youngest async op
     // in the queue to detect if any command dependency is required.
     //
@@ -1475,16 +2299,21 @@ public:
 
         std::lock_guard<std::recursive_mutex> lg(qmutex);
 
+        // nothing recorded into a graph runs, and the graph keeps its own dependencies
+        if (captureGraph) {
+            return nullptr;
+        }
+
         const auto newOp = static_cast<const HSAOp*> (kNewOp);
 
         assert (newCommandKind != hcCommandInvalid);
 
-        if (!asyncOps.empty() && asyncOps.back().get()!=nullptr) {
+        if (!asyncOps.empty()) {
             assert (youngestCommandKind != hcCommandInvalid);
 
             // Ensure we have not already added the op we are checking into asyncOps,
             // that must be done after we check for deps.
-            if (newOp && (newOp == asyncOps.back().get())) {
+            if (newOp && (newOp == asyncOps.youngest().get())) {
                 throw Kalmar::runtime_exception("enqueued op before checking dependencies!", 0);
             }
 
@@ -1505,7 +2334,7 @@ public:
             } else if (isCopyCommand(newCommandKind) && isCopyCommand(youngestCommandKind)) {
                 assert (newOp);
                 auto hsaCopyOp = static_cast<const HSACopy*> (newOp);
-                auto youngestCopyOp = static_cast<const HSACopy*> (asyncOps.back().get());
+                auto youngestCopyOp = static_cast<const HSACopy*> (asyncOps.youngest().get());
                 if (hsaCopyOp->getCopyDevice() != youngestCopyOp->getCopyDevice()) {
                     // This covers cases where two copies are back-to-back in the queue but use different copy engines.
                     // In this case there is no implicit dependency between the ops so we need to add one
@@ -1520,8 +2349,15 @@ public:
             }
 
             if (needDep) {
+                // Nothing to wait for if the youngest op has already completed.
+                hsa_signal_t signal = *(static_cast<hsa_signal_t*> (asyncOps.youngest()->getNativeHandle()));
+                if ((signal.handle != 0) && (hsa_signal_load_scacquire(signal) == 0)) {
+                    DBOUT(DB_CMD2, "youngest op already complete, no dependency needed\n");
+                    return nullptr;
+                }
+
                 DBOUT(DB_CMD2, "command type changed " << getHcCommandKindString(youngestCommandKind) << "  ->  " << getHcCommandKindString(newCommandKind) << "\n") ;
-                return asyncOps.back();
+                return asyncOps.youngest();
             }
         }
 
@@ -1529,19 +2365,39 @@ public:
     }
 
 
-    void waitForStreamDeps (HSAOp *newOp) {
+    // Make a kernel wait for the youngest op in the queue if detectStreamDeps finds it has to
+    // (copies pass the dependency signal to the copy engine themselves, see HSACopy).
+    // A kernel after a copy is preceded by a bare barrier packet on the copy's signal rather
+    // than a full marker; the dispatch keeps the copy alive until it has completed.
+    void waitForStreamDeps (HSADispatch *newOp) {
         std::shared_ptr<KalmarAsyncOp> depOp = detectStreamDeps(newOp->getCommandKind(), newOp);
         if (depOp != nullptr) {
-            EnqueueMarkerWithDependency(1, &depOp, HCC_OPT_FLUSH ? hc::no_scope : hc::system_scope);
+            addStreamDependency(newOp, depOp);
+        }
+    }
+
+    void addStreamDependency(HSADispatch *newOp, std::shared_ptr<KalmarAsyncOp> depOp) {
+        hc::memory_scope fenceScope = HCC_OPT_FLUSH ? hc::no_scope : hc::system_scope;
+        hsa_signal_t depSignal = *(static_cast<hsa_signal_t*> (depOp->getNativeHandle()));
+        if (depSignal.handle != 0) {
+            newOp->setStreamDependency(std::static_pointer_cast<HSAOp> (depOp));
+            enqueueDependencyPacket(depSignal, fenceScope);
+        } else {
+            EnqueueMarkerWithDependency(1, &depOp, fenceScope);
         }
     }
 
+    // Enqueue a barrier packet which holds back later packets until depSignal reaches 0.
+    // It has no completion signal and is not tracked in asyncOps, so the caller has to keep
+    // the op owning depSignal alive until a command behind the packet has completed.
+    void enqueueDependencyPacket(hsa_signal_t depSignal, hc::memory_scope fenceScope);
+
 
     int getPendingAsyncOps() override {
         std::lock_guard<std::recursive_mutex> lg(qmutex);
         int count = 0;
-        for (int i = 0; i < asyncOps.size(); ++i) {
-            auto &asyncOp = asyncOps[i];
+        for (uint64_t i = asyncOps.head(); i < asyncOps.tail(); ++i) {
+            auto &asyncOp = asyncOps.at(i);
 
             if (asyncOp != nullptr) {
                 hsa_signal_t signal = *(static_cast <hsa_signal_t*> (asyncOp->getNativeHandle()));
@@ -1560,24 +2416,27 @@ public:
 
 
     bool isEmpty() override {
-        // Have to walk asyncOps since it can contain null pointers (if event is waited on and removed)
-        // Also not all commands contain signals.
+        // Not all commands contain signals.
         
         std::lock_guard<std::recursive_mutex> lg(qmutex);
 
-        bool isEmpty = true;
-
-        const auto& oldest = find_if(
-                    asyncOps.crbegin(), asyncOps.crend(), [](const std::shared_ptr<HSAOp> &asyncOp) { return asyncOp != nullptr; });
+        // unpublished packets still own slots in the ROCR queue, so it can't be stolen
+        if (!batchHeaders.empty()) {
+            return false;
+        }
 
+        bool isEmpty = true;
 
-        if (oldest != asyncOps.crend()) {
-            hsa_signal_t signal = *(static_cast <hsa_signal_t*> ((*oldest)->getNativeHandle()));
+        if (!asyncOps.empty()) {
+            hsa_signal_t signal = *(static_cast <hsa_signal_t*> (asyncOps.youngest()->getNativeHandle()));
             if (signal.handle) {
                 hsa_signal_value_t v = hsa_signal_load_scacquire(signal);
                 if (v != 0) {
                     isEmpty=false;
                 }
+            } else if (captureGraph) {
+                // a marker would be recorded into the graph rather than submitted
+                isEmpty=false;
             } else {
                 // oldest has no signal - enqueue a new one:
                 auto marker = EnqueueMarker(hc::system_scope);
@@ -1590,18 +2449,63 @@ public:
     };
 
 
-    // Must retain this exact function signature here even though mode not used since virtual interface in
-    // runtime depends on this signature.
+    // forget the copies retired from the ring
+    void dropRetiredCopies() {
+        while (!copyPositions.empty() && copyPositions.front() < asyncOps.head()) {
+            copyPositions.pop_front();
+        }
+    }
+
+    // Returns an op whose completion implies every op currently in the ring has completed.
+    // On an in-order queue that is the youngest op, as long as it carries a signal.
+    // Otherwise a marker is enqueued behind everything: barrier packets wait for all older
+    // packets in the queue, but not for copies, which run on the copy engines.  On an in-order
+    // queue each copy waits for the command before it, so the marker only depends on the
+    // youngest op if that is a copy.  Copies on an any-order queue are not ordered with each
+    // other, so there the marker depends on every copy still in the ring.
+    std::shared_ptr<HSAOp> tailOpForWait() {
+        std::shared_ptr<HSAOp> youngest = asyncOps.youngest();
+        hsa_signal_t signal = *(static_cast <hsa_signal_t*> (youngest->getNativeHandle()));
+
+        if (get_execute_order() == execute_in_order && signal.handle != 0) {
+            return youngest;
+        }
+
+        std::vector<std::shared_ptr<KalmarAsyncOp>> copies;
+        if (get_execute_order() == execute_in_order) {
+            if (isCopyCommand(youngest->getCommandKind())) {
+                copies.push_back(youngest);
+            }
+        } else {
+            dropRetiredCopies();
+            for (uint64_t pos : copyPositions) {
+                copies.push_back(asyncOps.at(pos));
+            }
+        }
+
+        // completed copies are dropped by EnqueueMarkerWithDependency, see isImpliedDependency
+        std::shared_ptr<KalmarAsyncOp> marker;
+        if (!copies.empty()) {
+            marker = EnqueueMarkerWithDependency(static_cast<int>(copies.size()), copies.data(), hc::no_scope);
+        } else {
+            marker = EnqueueMarker(hc::no_scope);
+        }
+        DBOUTL(DB_WAIT, *this << " wait enqueued tail marker " << *std::static_pointer_cast<HSAOp>(marker));
+        return std::static_pointer_cast<HSAOp>(marker);
+    }
+
     void wait(hcWaitMode mode = hcWaitModeBlocked) override {
         // wait on all previous async operations to complete
-        // Go in reverse order (from youngest to oldest).
-        // Ensures younger ops have chance to complete before older ops reclaim their resources
-        //
+        // This waits on a single completion signal (see tailOpForWait) and then retires
+        // everything up to it, independent of how many ops are in flight.
 
+        if (capturingGraph()) {
+            throw Kalmar::runtime_exception("commands which synchronize with the host can't be recorded into a command_graph", 0);
+        }
 
         if (HCC_OPT_FLUSH && nextSyncNeedsSysRelease()) {
 
-            // In the loop below, this will be the first op waited on
+            // This will be the op waited on below
             auto marker = EnqueueMarker(hc::system_scope);
 
             DBOUT(DB_CMD2, " Sys-release needed, enqueued marker into " << *this << " to release written data " << marker<<"\n");
@@ -1613,28 +2517,34 @@ public:
             printAsyncOps(std::cerr);
         }
 
-
+        std::shared_ptr<HSAOp> tailOp;
+        uint64_t tailPos;
         {
             std::lock_guard<std::recursive_mutex> lg(qmutex);
-            bool foundFirstValidOp = false;
-            for (int i = asyncOps.size()-1; i >= 0;  i--) {
-                if (asyncOps[i] != nullptr) {
-                    auto asyncOp = asyncOps[i];
-                    if (!foundFirstValidOp) {
-                        hsa_signal_t sig =  *(static_cast <hsa_signal_t*> (asyncOp->getNativeHandle()));
-                        assert(sig.handle != 0);
-                        foundFirstValidOp = true;
-                    }
-                    // wait on valid futures only
-                    std::shared_future<void>* future = asyncOp->getFuture();
-                    if (future && future->valid()) {
-                        future->wait();
-                    }
-                }
+
+            // packets held back by an open dispatch batch have to be submitted first
+            flushDispatchBatch();
+
+            if (asyncOps.empty()) {
+                return;
+            }
+
+            tailOp = tailOpForWait();
+            tailPos = tailOp->asyncOpsIndex();
+
+            // Release ops retired earlier while the device is still busy, rather than
+            // after the wait returns.
+            if (!tailOp->isReady()) {
+                asyncOps.reclaim(asyncOps.retired());
             }
+        }
+
+        // Ops pushed by other threads meanwhile are younger than tailOp and are not waited for.
+        tailOp->wait(mode);
 
-            // clear async operations table
-            asyncOps.clear();
+        {
+            std::lock_guard<std::recursive_mutex> lg(qmutex);
+            asyncOps.retireThrough(tailPos);
         }
    }
 
@@ -1645,6 +2555,11 @@ public:
     void LaunchKernelWithDynamicGroupMemory(void *ker, size_t nr_dim, size_t *global, size_t *local, size_t dynamic_group_size) override {
         HSADispatch *dispatch =
             reinterpret_cast<HSADispatch*>(ker);
+        if (capturingGraph()) {
+            kernelBufferMap.erase(ker);
+            deleteDispatch(dispatch);
+            throw Kalmar::runtime_exception("synchronous kernel launches can't be recorded into a command_graph", 0);
+        }
         size_t tmp_local[] = {0, 0, 0};
         if (!local)
             local = tmp_local;
@@ -1652,8 +2567,9 @@ public:
 
         // wait for previous kernel dispatches be completed
         std::for_each(std::begin(kernelBufferMap[ker]), std::end(kernelBufferMap[ker]),
-                      [&] (void* buffer) {
-                        waitForDependentAsyncOps(buffer);
+                      [&] (const std::pair<void*, bool>& buffer) {
+                        if (buffer.second)
+                            waitForDependentAsyncOps(buffer.first);
                       });
 
         waitForStreamDeps(dispatch);
@@ -1668,7 +2584,7 @@ public:
         kernelBufferMap[ker].clear();
         kernelBufferMap.erase(ker);
 
-        delete(dispatch);
+        dispatch->hsaQueue()->deleteDispatch(dispatch);
     }
 
     std::shared_ptr<KalmarAsyncOp> LaunchKernelAsync(void *ker, size_t nr_dim, size_t *global, size_t *local) override {
@@ -1681,6 +2597,9 @@ public:
         HSADispatch *dispatch =
             reinterpret_cast<HSADispatch*>(ker);
 
+        if (capturingGraph()) {
+            return captureKernel(dispatch, ker, nr_dim, global, local, dynamic_group_size);
+        }
 
 
         bool hasArrayViewBufferDeps = (kernelBufferMap.find(ker) != kernelBufferMap.end());
@@ -1689,16 +2608,17 @@ public:
         if (hasArrayViewBufferDeps) {
             // wait for previous kernel dispatches be completed
             std::for_each(std::begin(kernelBufferMap[ker]), std::end(kernelBufferMap[ker]),
-                      [&] (void* buffer) {
-                        waitForDependentAsyncOps(buffer);
+                      [&] (const std::pair<void*, bool>& buffer) {
+                        if (buffer.second)
+                            waitForDependentAsyncOps(buffer.first);
                      });
         }
 
         waitForStreamDeps(dispatch);
 
 
-        // create a shared_ptr instance
-        std::shared_ptr<KalmarAsyncOp> sp_dispatch(dispatch);
+        // create a shared_ptr instance, which hands the dispatch back to the op pool
+        std::shared_ptr<KalmarAsyncOp> sp_dispatch = dispatch->hsaQueue()->adoptDispatch(dispatch);
         // associate the kernel dispatch with this queue
         pushAsyncOp(std::static_pointer_cast<HSAOp> (sp_dispatch));
 
@@ -1713,10 +2633,13 @@ public:
 
 
         if (hasArrayViewBufferDeps) {
-            // associate all buffers used by the kernel with the kernel dispatch instance
+            // associate all buffers written by the kernel with the kernel dispatch instance
+            std::lock_guard<std::recursive_mutex> lg(qmutex);
             std::for_each(std::begin(kernelBufferMap[ker]), std::end(kernelBufferMap[ker]),
-                          [&] (void* buffer) {
-                            bufferKernelMap[buffer].push_back(sp_dispatch);
+                          [&] (const std::pair<void*, bool>& buffer) {
+                            if (buffer.second)
+                                bufferKernelMap[buffer.first].push_back(sp_dispatch);
+                            recordBufferUse(buffer.first, sp_dispatch);
                           });
 
                 // clear data in kernelBufferMap
@@ -1728,6 +2651,53 @@ public:
     }
 
 
+    // Record a kernel into the graph being captured instead of dispatching it.
+    std::shared_ptr<KalmarAsyncOp> captureKernel(HSADispatch *dispatch, void *ker, size_t nr_dim, size_t *global, size_t *local, size_t dynamic_group_size) {
+        std::lock_guard<std::recursive_mutex> lg(qmutex);
+
+        // array and array_view data is synchronized when the kernel is launched, not on replay,
+        // so writes would not be seen by the host.  Read-only buffers are recorded as used
+        // by each replay, so they are kept alive while replayed kernels use them, see Push.
+        std::vector<void*> readBuffers;
+        auto buffers = kernelBufferMap.find(ker);
+        if (buffers != kernelBufferMap.end()) {
+            bool writes = std::any_of(buffers->second.begin(), buffers->second.end(),
+                                      [] (const std::pair<void*, bool>& buffer) { return buffer.second; });
+            for (auto& buffer : buffers->second) {
+                readBuffers.push_back(buffer.first);
+            }
+            kernelBufferMap.erase(buffers);
+            if (writes) {
+                deleteDispatch(dispatch);
+                throw Kalmar::runtime_exception("kernels with writable array or array_view arguments can't be recorded into a command_graph", 0);
+            }
+        }
+
+        size_t tmp_local[] = {0, 0, 0};
+        if (!local)
+            local = tmp_local;
+
+        // Keep only the base fences in the packet, a system-scope acquire is added on
+        // replay if the queue needs one then.
+        bool needsSysAcquire = nextKernelNeedsSysAcquire();
+        setNextKernelNeedsSysAcquire(false);
+        try {
+            dispatch->setLaunchConfiguration(nr_dim, global, local, dynamic_group_size);
+        } catch (...) {
+            setNextKernelNeedsSysAcquire(needsSysAcquire);
+            deleteDispatch(dispatch);
+            throw;
+        }
+        setNextKernelNeedsSysAcquire(needsSysAcquire);
+
+        captureGraph->appendKernel(dispatch->getKernel(), nullptr, dispatch->getAql(),
+                                   dispatch->getArgData(), dispatch->getArgSize(), std::move(readBuffers));
+        deleteDispatch(dispatch);
+
+        return capturedOpPlaceholder();
+    }
+
+
     void releaseToSystemIfNeeded()
     {
         if (HCC_OPT_FLUSH && nextSyncNeedsSysRelease()) {
@@ -1739,6 +2709,57 @@ public:
     }
 
 
+    // remember op may use buffer until it completes
+    // dispatches on an in-order queue complete in order, so the last one is enough
+    void recordBufferUse(void* buffer, const std::shared_ptr<KalmarAsyncOp>& op) {
+        auto& uses = bufferLastUse[buffer];
+        if (get_execute_order() == execute_in_order) {
+            uses.clear();
+        } else {
+            uses.erase(std::remove_if(uses.begin(), uses.end(),
+                                      [] (const std::weak_ptr<KalmarAsyncOp>& use) {
+                                        return use.expired() || use.lock()->isReady();
+                                      }),
+                       uses.end());
+        }
+        uses.push_back(op);
+    }
+
+    // Forget the dispatches using buffer, and return the ones still in flight.
+    // Called when the buffer is about to be released.
+    std::vector< std::weak_ptr<KalmarAsyncOp> > takeBufferUses(void* buffer) {
+        std::vector< std::weak_ptr<KalmarAsyncOp> > pending;
+        std::lock_guard<std::recursive_mutex> lg(qmutex);
+        auto iter = bufferLastUse.find(buffer);
+        if (iter != bufferLastUse.end()) {
+            for (auto& use : iter->second) {
+                if (!use.expired() && !use.lock()->isReady()) {
+                    pending.push_back(use);
+                }
+            }
+            bufferLastUse.erase(iter);
+        }
+        return pending;
+    }
+
+    // wait for the async ops still using buffer, like an upload into it, to complete
+    void waitForBufferUses(void* buffer) {
+        std::vector< std::weak_ptr<KalmarAsyncOp> > uses;
+        {
+            std::lock_guard<std::recursive_mutex> lg(qmutex);
+            auto iter = bufferLastUse.find(buffer);
+            if (iter == bufferLastUse.end()) {
+                return;
+            }
+            uses = iter->second;
+        }
+        for (auto& use : uses) {
+            if (auto op = use.lock()) {
+                op->wait();
+            }
+        }
+    }
+
     // wait for dependent async operations to complete
     void waitForDependentAsyncOps(void* buffer) {
         auto&& dependentAsyncOpVector = bufferKernelMap[buffer];
@@ -1746,11 +2767,7 @@ public:
           auto dependentAsyncOp = dependentAsyncOpVector[i];
           if (!dependentAsyncOp.expired()) {
             auto dependentAsyncOpPointer = dependentAsyncOp.lock();
-            // wait on valid futures only
-            std::shared_future<void>* future = dependentAsyncOpPointer->getFuture();
-            if (future->valid()) {
-              future->wait();
-            }
+            dependentAsyncOpPointer->wait();
           }
         }
         dependentAsyncOpVector.clear();
@@ -1779,6 +2796,7 @@ public:
 
     void read(void* device, void* dst, size_t count, size_t offset) override {
         waitForDependentAsyncOps(device);
+        waitForBufferUses(device);
         releaseToSystemIfNeeded();
 
         // do read
@@ -1817,8 +2835,19 @@ public:
         }
     }
 
+    // Upload for a kernel argument: stage src in pinned memory and copy it to
+    // device asynchronously on this queue, so the kernel is ordered after it.
+    // Returns false if the upload has to be done with a blocking copy.
+    bool writeAsync(void* device, const void* src, size_t count, size_t offset);
+
     void write(void* device, const void* src, size_t count, size_t offset, bool blocking) override {
+        // non-blocking writes upload kernel arguments, don't wait for those
+        if (!blocking && (src != device) && writeAsync(device, src, count, offset)) {
+            return;
+        }
+
         waitForDependentAsyncOps(device);
+        waitForBufferUses(device);
         releaseToSystemIfNeeded(); // may not be needed.
 
         // do write
@@ -1858,6 +2887,8 @@ public:
     void copy(void* src, void* dst, size_t count, size_t src_offset, size_t dst_offset, bool blocking) override {
         waitForDependentAsyncOps(dst);
         waitForDependentAsyncOps(src);
+        waitForBufferUses(dst);
+        waitForBufferUses(src);
         releaseToSystemIfNeeded();
 
         // do copy
@@ -1868,7 +2899,7 @@ public:
                 hsa_status_t status = HSA_STATUS_SUCCESS;
                 // FIXME: aftre p2p enabled, if this function is not expected to copy between two buffers from different device, then, delete allow_access API call.
                 hsa_agent_t* agent = static_cast<hsa_agent_t*>(getHSAAgent());
-                status = hsa_amd_agents_allow_access(1, agent, NULL, src);
+                status = hsa_amd_agents_allow_access(1, agent, NULL, getDev()->cacheAllocationBase(src));
                 STATUS_CHECK(status, __LINE__);
                 status = hsa_memory_copy((char*)dst + dst_offset, (char*)src + src_offset, count);
                 STATUS_CHECK(status, __LINE__);
@@ -1885,6 +2916,7 @@ public:
             dumpHSAAgentInfo(*static_cast<hsa_agent_t*>(getHSAAgent()), "map(...)");
         }
         waitForDependentAsyncOps(device);
+        waitForBufferUses(device);
         releaseToSystemIfNeeded();
 
         // do map
@@ -1957,14 +2989,11 @@ public:
     }
 
     void Push(void *kernel, int idx, void *device, bool modify) override {
-        PushArgImpl(kernel, idx, sizeof(void*), &device);
-
-        // register the buffer with the kernel
-        // when the buffer may be read/written by the kernel
-        // the buffer is not registered if it's only read by the kernel
-        if (modify) {
-          kernelBufferMap[kernel].push_back(device);
-        }
+        // register the buffer with the kernel, the pointer itself is part of
+        // the kernarg image pushed by PushArgsImpl
+        // only the buffers which may be written are waited for by later
+        // commands, but all of them are kept alive until the kernel completes
+        kernelBufferMap[kernel].push_back(std::make_pair(device, modify));
     }
 
     void* getHSAQueue() override {
@@ -2028,40 +3057,124 @@ public:
             if(bit_index != 0) {
                 this->cu_arrays.push_back(temp);
             }
-
-
-            // Apply the new cu mask to the hw queue:
-            return (rocrQueue->setCuMask(this) == HSA_STATUS_SUCCESS);
-
+
+
+            // Apply the new cu mask to the hw queue:
+            return (rocrQueue->setCuMask(this) == HSA_STATUS_SUCCESS);
+
+        }
+    }
+
+    // enqueue a barrier packet
+    std::shared_ptr<KalmarAsyncOp> EnqueueMarker(memory_scope release_scope) override {
+
+        hsa_status_t status = HSA_STATUS_SUCCESS;
+
+        if (HSAGraph *graph = capturingGraph()) {
+            graph->appendMarker(release_scope);
+            return capturedOpPlaceholder();
+        }
+
+        // create shared_ptr instance
+        std::shared_ptr<HSABarrier> barrier = makeOp<HSABarrier>(this, 0, nullptr);
+        // associate the barrier with this queue
+        pushAsyncOp(barrier);
+
+        // enqueue the barrier
+        status = barrier.get()->enqueueAsync(release_scope);
+        STATUS_CHECK(status, __LINE__);
+
+
+        return barrier;
+    }
+
+
+    // Carry the cache flush state of a dependency over to this queue.
+    // Returns true if the dependency was issued on another accelerator.
+    bool inheritDependencyState(HSAOp *depOp) {
+        auto depHSAQueue = static_cast<Kalmar::HSAQueue *> (depOp->getQueue());
+        // Same accelerator:
+        // Inherit system-acquire and system-release bits op we are dependent on.
+        //   - barriers
+        //
+        // _nextSyncNeedsSysRelease is set when a queue executes a kernel.
+        // It indicates the queue needs to execute a release-to-system
+        // before host can see the data - this is important for kernels which write
+        // non-coherent zero-copy host memory.
+        // If creating a dependency on a queue which needs_system_release, copy that
+        // state here.   If the host then waits on the freshly created marker,
+        // runtime will issue a system-release fence.
+        if (depOp->barrierNextKernelNeedsSysAcquire()) {
+            DBOUTL(DB_CMD2, *this << " setting NextKernelNeedsSysAcquire(true) due to dependency on barrier " << *depOp)
+            setNextKernelNeedsSysAcquire(true);
+        }
+        if (depOp->barrierNextSyncNeedsSysRelease()) {
+            DBOUTL(DB_CMD2, *this << " setting NextSyncNeedsSysRelease(true) due to dependency on barrier " << *depOp)
+            setNextSyncNeedsSysRelease(true);
+        }
+        if (HCC_FORCE_CROSS_QUEUE_FLUSH & 0x1) {
+            if (!depOp->barrierNextKernelNeedsSysAcquire()) {
+                DBOUTL(DB_RESOURCE, *this << " force setting NextSyncNeedsSysAcquire(true) even though barrier didn't require it " << *depOp)
+            }
+            setNextKernelNeedsSysAcquire(true);
+        }
+        if (HCC_FORCE_CROSS_QUEUE_FLUSH & 0x2) {
+            if (!depOp->barrierNextSyncNeedsSysRelease()) {
+                DBOUTL(DB_RESOURCE, *this << " force setting NextSyncNeedsSysRelease(true) even though barrier didn't require it " << *depOp)
+            }
+            setNextSyncNeedsSysRelease(true);
         }
+
+        return depHSAQueue->getHSADev() != this->getHSADev();
     }
 
-    // enqueue a barrier packet
-    std::shared_ptr<KalmarAsyncOp> EnqueueMarker(memory_scope release_scope) override {
+    // A dependency does not need a slot in a barrier packet if it has already
+    // completed, or if it is an older kernel or marker on this in-order queue:
+    // markers wait for all older commands in the queue anyway.
+    bool isImpliedDependency(HSAOp *depOp) {
+        if ((depOp->getQueue() == this) && (get_execute_order() == execute_in_order) &&
+            isComputeQueueCommand(depOp->getCommandKind())) {
+            return true;
+        }
 
-        hsa_status_t status = HSA_STATUS_SUCCESS;
+        hsa_signal_t signal = *(static_cast<hsa_signal_t*> (depOp->getNativeHandle()));
+        return (signal.handle != 0) && (hsa_signal_load_scacquire(signal) == 0);
+    }
 
+    // enqueue a single barrier packet for at most HSA_BARRIER_DEP_SIGNAL_CNT dependencies
+    std::shared_ptr<HSABarrier> enqueueBarrierPacket(int count, std::shared_ptr <KalmarAsyncOp> *depOps,
+                                                     hc::memory_scope fenceScope, bool crossAccelerator) {
         // create shared_ptr instance
-        std::shared_ptr<HSABarrier> barrier = std::make_shared<HSABarrier>(this, 0, nullptr);
+        std::shared_ptr<HSABarrier> barrier = makeOp<HSABarrier>(this, count, depOps);
         // associate the barrier with this queue
         pushAsyncOp(barrier);
 
+        if (crossAccelerator) {
+            // Cross-accelerator dependency case.
+            // This requires system-scope acquire
+            // TODO - only needed if these are peer GPUs, could optimize with an extra check
+            DBOUT(DB_WAIT, "  Adding cross-accelerator system-scope acquire\n");
+            barrier->acquire_scope (hc::system_scope);
+        }
+
         // enqueue the barrier
-        status = barrier.get()->enqueueAsync(release_scope);
+        hsa_status_t status = barrier.get()->enqueueAsync(fenceScope);
         STATUS_CHECK(status, __LINE__);
 
-
         return barrier;
     }
 
-
     // enqueue a barrier packet with multiple prior dependencies
     // The marker will wait for all specified input dependencies to resolve and
     // also for all older commands in the queue to execute, and then will
     // signal completion by decrementing the associated signal.
     //
     // depOps specifies the other ops that this marker will depend on.  These
-    // can be in any queue on any GPU .
+    // can be in any queue on any GPU .  Dependencies which are already satisfied
+    // (see isImpliedDependency) are dropped.  A barrier packet holds at most
+    // HSA_BARRIER_DEP_SIGNAL_CNT signals, so the remaining ones are spread over a
+    // chain of packets: barrier packets in a queue execute in order, so the last
+    // packet, which is returned, completes after all of them.
     //
     // fenceScope specifies the scope of the acquire and release fence that will be
     // applied after the marker executes.  See hc::memory_scope
@@ -2069,74 +3182,58 @@ public:
             std::shared_ptr <KalmarAsyncOp> *depOps,
             hc::memory_scope fenceScope) override {
 
-        hsa_status_t status = HSA_STATUS_SUCCESS;
+        if (count < 0) {
+            // throw an exception
+            throw Kalmar::runtime_exception("Incorrect number of dependent signals passed to EnqueueMarkerWithDependency", count);
+        }
 
-        if ((count >= 0) && (count <= HSA_BARRIER_DEP_SIGNAL_CNT)) {
-
-            // create shared_ptr instance
-            std::shared_ptr<HSABarrier> barrier = std::make_shared<HSABarrier>(this, count, depOps);
-            // associate the barrier with this queue
-            pushAsyncOp(barrier);
-
-            for (int i=0; i<count; i++) {
-                auto depOp = barrier->depAsyncOps[i];
-                if (depOp != nullptr) {
-                    auto depHSAQueue = static_cast<Kalmar::HSAQueue *> (depOp->getQueue());
-                    // Same accelerator:
-                    // Inherit system-acquire and system-release bits op we are dependent on.
-                    //   - barriers
-                    //
-                    // _nextSyncNeedsSysRelease is set when a queue executes a kernel.
-                    // It indicates the queue needs to execute a release-to-system
-                    // before host can see the data - this is important for kernels which write
-                    // non-coherent zero-copy host memory.
-                    // If creating a dependency on a queue which needs_system_release, copy that
-                    // state here.   If the host then waits on the freshly created marker,
-                    // runtime will issue a system-release fence.
-                    if (depOp->barrierNextKernelNeedsSysAcquire()) {
-                        DBOUTL(DB_CMD2, *this << " setting NextKernelNeedsSysAcquire(true) due to dependency on barrier " << *depOp)
-                        setNextKernelNeedsSysAcquire(true);
-                    }
-                    if (depOp->barrierNextSyncNeedsSysRelease()) {
-                        DBOUTL(DB_CMD2, *this << " setting NextSyncNeedsSysRelease(true) due to dependency on barrier " << *depOp)
-                        setNextSyncNeedsSysRelease(true);
-                    }
-                    if (HCC_FORCE_CROSS_QUEUE_FLUSH & 0x1) {
-                        if (!depOp->barrierNextKernelNeedsSysAcquire()) {
-                            DBOUTL(DB_RESOURCE, *this << " force setting NextSyncNeedsSysAcquire(true) even though barrier didn't require it " << *depOp)
-                        }
-                        setNextKernelNeedsSysAcquire(true);
-                    }
-                    if (HCC_FORCE_CROSS_QUEUE_FLUSH & 0x2) {
-                        if (!depOp->barrierNextSyncNeedsSysRelease()) {
-                            DBOUTL(DB_RESOURCE, *this << " force setting NextSyncNeedsSysRelease(true) even though barrier didn't require it " << *depOp)
-                        }
-                        setNextSyncNeedsSysRelease(true);
-                    }
+        if (HSAGraph *graph = capturingGraph()) {
+            // Commands recorded into the graph are complete placeholders.  A graph can only
+            // depend on commands outside of it which have already completed.
+            for (int i = 0; i < count; i++) {
+                if (depOps[i] && depOps[i]->getQueue() && !depOps[i]->isReady()) {
+                    throw Kalmar::runtime_exception("a command_graph can't depend on commands which have not completed", 0);
+                }
+            }
+            graph->appendMarker(fenceScope);
+            return capturedOpPlaceholder();
+        }
 
-                    if (depHSAQueue->getHSADev() != this->getHSADev()) {
-                        // Cross-accelerator dependency case.
-                        // This requires system-scope acquire
-                        // TODO - only needed if these are peer GPUs, could optimize with an extra check
-                        DBOUT(DB_WAIT, "  Adding cross-accelerator system-scope acquire\n");
-                        barrier->acquire_scope (hc::system_scope);
-                    }
+        std::shared_ptr<KalmarAsyncOp> packetDepOps[HSA_BARRIER_DEP_SIGNAL_CNT];
+        int packetDepCount = 0;
+        bool crossAccelerator = false;
 
-                } else {
-                    break;
-                }
+        for (int i = 0; i < count; i++) {
+            if (depOps[i] == nullptr) {
+                continue;
             }
 
-            // enqueue the barrier
-            status = barrier.get()->enqueueAsync(fenceScope);
-            STATUS_CHECK(status, __LINE__);
+            // Ops completed by the host (continuations from completion_future::then)
+            // have no signal a barrier packet could wait on, so wait for them here.
+            if (depOps[i]->getQueue() == nullptr) {
+                depOps[i]->wait();
+                continue;
+            }
 
+            HSAOp *depOp = static_cast<HSAOp*> (depOps[i].get());
+            crossAccelerator |= inheritDependencyState(depOp);
+            if (isImpliedDependency(depOp)) {
+                DBOUTL(DB_CMD2, *this << " marker drops satisfied dependency " << *depOp);
+                continue;
+            }
 
-            return barrier;
-        } else {
-            // throw an exception
-            throw Kalmar::runtime_exception("Incorrect number of dependent signals passed to EnqueueMarkerWithDependency", count);
+            if (packetDepCount == HSA_BARRIER_DEP_SIGNAL_CNT) {
+                DBOUTL(DB_CMD2, *this << " marker has more than " << HSA_BARRIER_DEP_SIGNAL_CNT << " dependencies, chaining barrier packets");
+                enqueueBarrierPacket(packetDepCount, packetDepOps, hc::no_scope, crossAccelerator);
+                for (int j = 0; j < packetDepCount; j++) {
+                    packetDepOps[j].reset();
+                }
+                packetDepCount = 0;
+            }
+            packetDepOps[packetDepCount++] = depOps[i];
         }
+
+        return enqueueBarrierPacket(packetDepCount, packetDepOps, fenceScope, crossAccelerator);
     }
 
     std::shared_ptr<KalmarAsyncOp> EnqueueAsyncCopyExt(const void* src, void* dst, size_t size_bytes,
@@ -2154,7 +3251,7 @@ public:
     void copy(const void *src, void *dst, size_t size_bytes) override {
         DBOUT(DB_COPY, "HSAQueue::copy(" << src << ", " << dst << ", " << size_bytes << ")\n");
         // wait for all previous async commands in this queue to finish
-        this->wait();
+        this->wait(getDefaultWaitMode());
 
         // create a HSACopy instance
         HSACopy* copyCommand = new HSACopy(this, src, dst, size_bytes);
@@ -2178,49 +3275,27 @@ public:
 
         std::lock_guard<std::recursive_mutex> lg(qmutex);
 
-        int targetIndex = asyncOp->asyncOpsIndex();
+        uint64_t targetIndex = asyncOp->asyncOpsIndex();
 
-        // Make sure the opindex is still valid.
-        // If the queue is destroyed first it may not exist in asyncops anymore so no need to destroy.
-        if (targetIndex < asyncOps.size() &&
-            asyncOp == asyncOps[targetIndex].get()) {
+        // Make sure the op is still in the ring.
+        // If the queue is destroyed first, or the op was already retired, there is nothing to do.
+        if (asyncOps.contains(targetIndex, asyncOp)) {
 
             // All older ops are known to be done and we can reclaim their resources here:
             // Both execute_in_order and execute_any_order flags always remove ops in-order at the end of the pipe.
-            // Note if not found above targetIndex=-1 and we skip the loop:
-            for (int i = targetIndex; i>=0; i--) {
-                Kalmar::KalmarAsyncOp *op = asyncOps[i].get();
-                if (op) {
-                    asyncOps[i].reset();
-
         #if CHECK_OLDER_COMPLETE
-                    // opportunistically update status for any ops we encounter along the way:
-                    hsa_signal_t signal =  *(static_cast<hsa_signal_t*> (op->getNativeHandle()));
-
-                    // v<0 : no signal, v==0 signal and done, v>0 : signal and not done:
-                    hsa_signal_value_t v = -1;
-                    if (signal.handle)
-                        v = hsa_signal_load_scacquire(signal);
-                    assert (v <=0);
-        #endif
+            for (uint64_t i = asyncOps.head(); i < targetIndex; i++) {
+                // opportunistically update status for any ops we encounter along the way:
+                hsa_signal_t signal =  *(static_cast<hsa_signal_t*> (asyncOps.at(i)->getNativeHandle()));
 
-                } else {
-                    // The queue is retired in-order, and ops only inserted at "top", and ops can only be removed at two defined points:
-                    //   - Draining the entire queue in HSAQueue::wait() - this calls asyncOps.clear()
-                    //   - Events in the middle of the queue can be removed, but will call this function which removes all older ops.
-                    //   So once we remove the asyncOps, there is no way for an older async op to be come non-null and we can stop search here:
-
-                    break; // stop searching if we find null, there cannot be any more valid pointers below.
-                }
+                // v<0 : no signal, v==0 signal and done, v>0 : signal and not done:
+                hsa_signal_value_t v = -1;
+                if (signal.handle)
+                    v = hsa_signal_load_scacquire(signal);
+                assert (v <=0);
             }
-        }
-
-
-        // GC for finished kernels
-        if (asyncOps.size() > ASYNCOPS_VECTOR_GC_SIZE) {
-            DBOUTL(DB_RESOURCE, "asyncOps size=" << asyncOps.size() << " exceeds collection size, compacting");
-            asyncOps.erase(std::remove(asyncOps.begin(), asyncOps.end(), nullptr),
-                         asyncOps.end());
+        #endif
+            asyncOps.retireThrough(targetIndex);
         }
     }
 };
@@ -2257,8 +3332,54 @@ private:
     int kernargCursor;
     std::mutex kernargPoolMutex;
 
+    /// per-queue kernarg rings; idle ones are recycled for new queues.
+    /// guarded by kernargPoolMutex
+    std::vector<KernargRing*> kernargRings;
+    std::vector<KernargRing*> freeKernargRings;
+
+
+    // Kernel symbol index: mangled name -> kernel, for every kernel symbol of the
+    // executables loaded on this device (and, once looked up, of the code objects
+    // embedded in shared objects).
+    // The map is an immutable snapshot which is replaced as a whole when code objects
+    // are loaded, so CreateKernel looks kernels up without taking a lock.
+    struct KernelIndexEntry {
+        std::string name;
+        HSAExecutable* executable;           // nullptr for kernels from shared objects
+        hsa_executable_symbol_t symbol;
+        uint64_t kernelCodeHandle;
+        std::atomic<HSAKernel*> kernel;      // created on first use
+    };
+
+    // Keys point at KernelIndexEntry::name, so lookups by const char* need no std::string.
+    struct KernelName {
+        const char *name;
+        size_t      length;
+    };
+    struct KernelNameHash {
+        size_t operator()(const KernelName &k) const {
+            // FNV-1a
+            uint64_t hash = 0xcbf29ce484222325;
+            for (size_t i = 0; i < k.length; ++i) {
+                hash ^= static_cast<unsigned char>(k.name[i]);
+                hash *= 0x100000001b3;
+            }
+            return hash;
+        }
+    };
+    struct KernelNameEqual {
+        bool operator()(const KernelName &a, const KernelName &b) const {
+            return a.length == b.length && memcmp(a.name, b.name, a.length) == 0;
+        }
+    };
+    typedef std::unordered_map<KernelName, KernelIndexEntry*, KernelNameHash, KernelNameEqual> KernelIndex;
+
+    std::shared_ptr<const KernelIndex> kernelIndex;
+    std::mutex kernelIndexMutex;  // serializes index updates and owns kernelIndexEntries
+    std::vector<std::unique_ptr<KernelIndexEntry>> kernelIndexEntries;
+    std::once_flag sharedObjectKernelsOnce;
+    std::atomic<bool> programsLoaded;  // set once the embedded programs are all built
 
-    std::map<std::string, HSAKernel *> programs;
     hsa_agent_t agent;
     size_t max_tile_static_size;
 
@@ -2275,6 +3396,32 @@ private:
 
     bool useCoarseGrainedRegion;
 
+    /// caching sub-allocator for device memory from create() and am_alloc;
+    /// nullptr if disabled with HCC_DEVICE_MEMORY_CACHE=0 or the device has no local memory
+    std::unique_ptr<MemoryCache<HSAMemoryPoolTraits>> memoryCache;
+
+    /// pinned host memory async uploads are staged in, see HSAQueue::writeAsync;
+    /// nullptr if disabled with HCC_ASYNC_UPLOADS=0.  Shared with the copies
+    /// holding staging buffers, which may outlive the device.
+    std::shared_ptr<MemoryCache<HSAMemoryPoolTraits>> stagingCache;
+
+    /// buffer of a destroyed array or array_view which kernels in flight may still use
+    struct DeferredRelease {
+        void* ptr;
+        struct rw_info* key;
+        std::atomic<size_t> pending;  // uses which have not completed yet
+    };
+
+    /// buffers passed to releaseDeferred() and not released yet.  Shared with the completion
+    /// callbacks which release them, since those may run after teardown; closed is set once
+    /// teardown released the remaining buffers itself.
+    struct DeferredReleases {
+        std::mutex mutex;
+        std::vector< std::shared_ptr<DeferredRelease> > buffers;
+        bool closed = false;
+    };
+    std::shared_ptr<DeferredReleases> deferredReleases = std::make_shared<DeferredReleases>();
+
     uint32_t workgroup_max_size;
     uint16_t workgroup_max_dim[3];
 
@@ -2296,11 +3443,39 @@ private:
     uint64_t queueSeqNums;  // used to assign queue seqnums.
 
 
+    // Structures to manage unpinnned memory copies, one for each direction.
+    // Created on first copy, along with their pinned staging buffers.
+    LazyInit<UnpinnedCopyEngine> copy_engine[2];
+
+    /// bytes of pinned kernarg pool and staging buffers held by this device
+    std::atomic<size_t> pinnedBytes;
+
+    void addPinnedBytes(const char* what, size_t bytes) {
+        size_t total = pinnedBytes.fetch_add(bytes) + bytes;
+        DBOUTL(DB_RESOURCE, "agent " << agent.handle << ": allocated " << bytes << " pinned bytes for "
+                            << what << ", resident pinned bytes " << total);
+    }
+
 public:
-    // Structures to manage unpinnned memory copies
-    class UnpinnedCopyEngine      *copy_engine[2]; // one for each direction.
     UnpinnedCopyEngine::CopyMode  copy_mode;
 
+    UnpinnedCopyEngine* getCopyEngine(int direction) {
+        return copy_engine[direction].get([this] {
+            // sizes and thresholds are given in KB
+            const size_t stagingSize = HCC_STAGING_BUFFER_SIZE * 1024;
+            UnpinnedCopyEngine* engine =
+                new UnpinnedCopyEngine(agent, hostAgent, stagingSize, 2/*staging buffers*/,
+                                       this->cpu_accessible_am,
+                                       HCC_H2D_STAGING_THRESHOLD * 1024,
+                                       HCC_H2D_PININPLACE_THRESHOLD * 1024,
+                                       HCC_D2H_PININPLACE_THRESHOLD * 1024);
+            addPinnedBytes("copy engine staging buffers", 2 * stagingSize);
+            return engine;
+        });
+    }
+
+    size_t getPinnedBytes() const { return pinnedBytes.load(); }
+
     // Creates or steals a rocrQueue and returns it in theif->rocrQueue
     void createOrstealRocrQueue(Kalmar::HSAQueue *thief, queue_priority priority = priority_normal) {
         RocrQueue *foundRQ = nullptr;
@@ -2561,6 +3736,9 @@ public:
     ~HSADevice() {
         DBOUT(DB_INIT, "HSADevice::~HSADevice() in\n");
 
+        // a loader worker may still be building programs on this device
+        CLAMP::FinishProgramLoad(this);
+
         // release all queues
         queues_mutex.lock();
 
@@ -2574,6 +3752,16 @@ public:
         queues.clear();
         queues_mutex.unlock();
 
+        // the queues are drained, so nothing uses the deferred buffers any more
+        {
+            std::lock_guard<std::mutex> l(deferredReleases->mutex);
+            for (auto& deferred : deferredReleases->buffers) {
+                release(deferred->ptr, deferred->key);
+            }
+            deferredReleases->buffers.clear();
+            deferredReleases->closed = true;
+        }
+
         // deallocate kernarg buffers in the pool
 #if KERNARG_POOL_SIZE > 0
         kernargPoolMutex.lock();
@@ -2593,11 +3781,21 @@ public:
         kernargPoolMutex.unlock();
 #endif
 
-        // release all data in programs
-        for (auto kernel_iterator : programs) {
-            delete kernel_iterator.second;
+        for (auto ring : kernargRings) {
+            delete ring;
         }
-        programs.clear();
+        kernargRings.clear();
+        freeKernargRings.clear();
+
+        memoryCache.reset();
+        stagingCache.reset();
+
+        // release all kernels in the symbol index
+        for (auto &entry : kernelIndexEntries) {
+            delete entry->kernel.load();
+        }
+        std::atomic_store(&kernelIndex, std::shared_ptr<const KernelIndex>());
+        kernelIndexEntries.clear();
 
         // release executable
         for (auto executable_iterator : executables) {
@@ -2607,12 +3805,11 @@ public:
 
 
         for (int i=0; i<2; i++) {
-            if (copy_engine[i]) {
-                delete copy_engine[i];
-                copy_engine[i] = NULL;
-            }
+            copy_engine[i].reset();
         }
 
+        DBOUTL(DB_RESOURCE, "agent " << agent.handle << ": resident pinned bytes at exit " << pinnedBytes.load());
+
 
         DBOUT(DB_INIT, "HSADevice::~HSADevice() out\n");
     }
@@ -2634,12 +3831,54 @@ public:
 
     bool has_cpu_accessible_am() const override { return cpu_accessible_am; }
 
+    void* cacheAllocationBase(void* ptr) override {
+        void* base = memoryCache ? memoryCache->allocationBase(ptr) : nullptr;
+        return base ? base : ptr;
+    }
+
+    size_t cacheTrim(size_t keepBytes) override {
+        return memoryCache ? memoryCache->trim(keepBytes) : 0;
+    }
+
+    void cacheSetLimit(size_t bytes) override {
+        if (memoryCache) {
+            memoryCache->setMaxCachedBytes(bytes);
+        }
+    }
+
+    bool getCacheStats(hc::AmCacheStats* stats) override {
+        if (!memoryCache) {
+            return false;
+        }
+        MemoryCache<HSAMemoryPoolTraits>::Stats st = memoryCache->getStats();
+        stats->_reservedBytes    = st.reservedBytes;
+        stats->_allocatedBytes   = st.allocatedBytes;
+        stats->_requestedBytes   = st.requestedBytes;
+        stats->_cachedBytes      = st.cachedBytes;
+        stats->_largestFreeBlock = st.largestFreeBlock;
+        stats->_hits             = st.hits;
+        stats->_misses           = st.misses;
+        return true;
+    }
+
+    std::shared_ptr<MemoryCache<HSAMemoryPoolTraits>> getStagingCache() { return stagingCache; }
+
     void* create(size_t count, struct rw_info* key) override {
         void *data = nullptr;
 
         if (!is_unified()) {
             DBOUT(DB_INIT, "create( <count> " << count << ", <key> " << key << "): use HSA memory allocator\n");
             hsa_status_t status = HSA_STATUS_SUCCESS;
+
+            if (memoryCache) {
+                data = memoryCache->allocate(count);
+                if (data != nullptr) {
+                    return data;
+                }
+                // the cache rounds sizes up; an exact-size allocation may still fit
+                DBOUT(DB_RESOURCE, "create( <count> " << count << "): memory cache allocation failed, using the pool\n");
+            }
+
             auto am_region = getHSAAMRegion();
 
             status = hsa_amd_memory_pool_allocate(am_region, count, 0, &data);
@@ -2659,6 +3898,9 @@ public:
         hsa_status_t status = HSA_STATUS_SUCCESS;
         if (!is_unified()) {
             DBOUT(DB_INIT, "release(" << ptr << "," << key << "): use HSA memory deallocator\n");
+            if (memoryCache && memoryCache->release(ptr)) {
+                return;
+            }
             status = hsa_amd_memory_pool_free(ptr);
             STATUS_CHECK(status, __LINE__);
         } else {
@@ -2667,30 +3909,72 @@ public:
         }
     }
 
-    // calculate MD5 checksum
-    std::string kernel_checksum(size_t size, void* source) {
-        // FNV-1a hashing, 64-bit version
-        const uint64_t FNV_prime = 0x100000001b3;
-        const uint64_t FNV_basis = 0xcbf29ce484222325;
-        uint64_t hash = FNV_basis;
+    void releaseDeferred(void* ptr, struct rw_info* key) override {
+        std::vector< std::shared_ptr<KalmarAsyncOp> > inFlight;
+        for (auto& queue : get_all_queues()) {
+            for (auto& use : static_cast<HSAQueue*>(queue.get())->takeBufferUses(ptr)) {
+                std::shared_ptr<KalmarAsyncOp> op = use.lock();
+                if (op && !op->isReady()) {
+                    inFlight.push_back(std::move(op));
+                }
+            }
+        }
+
+        if (inFlight.empty()) {
+            release(ptr, key);
+            return;
+        }
+
+        DBOUT(DB_RESOURCE, "releaseDeferred(" << ptr << "," << key << "): used by "
+                           << inFlight.size() << " kernel(s) in flight\n");
+        std::shared_ptr<DeferredRelease> deferred = std::make_shared<DeferredRelease>();
+        deferred->ptr = ptr;
+        deferred->key = key;
+        deferred->pending = inFlight.size();
+
+        std::shared_ptr<DeferredReleases> registry = deferredReleases;
+        {
+            std::lock_guard<std::mutex> l(registry->mutex);
+            registry->buffers.push_back(deferred);
+        }
 
-        const char *str = static_cast<const char *>(source);
-        for (auto i = 0; i < size; ++i) {
-            hash ^= *str++;
-            hash *= FNV_prime;
+        // the completion callback of the last use releases the buffer.  Each callback holds
+        // its op, so the signal it waits on is not recycled before it ran; the reference is
+        // dropped with the callback, on a callback worker.
+        for (auto& op : inFlight) {
+            HSADevice* device = this;
+            std::shared_ptr<KalmarAsyncOp> use = op;
+            op->setCallback([device, registry, deferred, use]() {
+                if (--deferred->pending == 0) {
+                    releaseCompletedDeferred(device, *registry, deferred);
+                }
+            });
         }
-        return std::to_string(hash);
     }
 
-    void BuildProgram(void* size, void* source) override {
-        if (executables.find(kernel_checksum((size_t)size, source)) == executables.end()) {
-            size_t kernel_size = (size_t)((void *)size);
-            char *kernel_source = (char*)malloc(kernel_size+1);
-            memcpy(kernel_source, source, kernel_size);
-            kernel_source[kernel_size] = '\0';
-            BuildOfflineFinalizedProgramImpl(kernel_source, kernel_size);
-            free(kernel_source);
+    // Runs on a callback worker once every use of a deferred buffer completed.  The buffer
+    // is released under the registry lock, so teardown can't free the device meanwhile.
+    static void releaseCompletedDeferred(HSADevice* device, DeferredReleases& registry,
+                                         const std::shared_ptr<DeferredRelease>& deferred) {
+        std::lock_guard<std::mutex> l(registry.mutex);
+        if (registry.closed) {
+            // released at teardown
+            return;
         }
+        registry.buffers.erase(std::find(registry.buffers.begin(), registry.buffers.end(), deferred));
+        DBOUT(DB_RESOURCE, "releaseCompletedDeferred(" << deferred->ptr << "," << deferred->key << ")\n");
+        device->release(deferred->ptr, deferred->key);
+    }
+
+    // key of the executable built from a code object
+    std::string kernel_checksum(size_t size, const void* source) {
+        return std::to_string(code_object_checksum(source, size));
+    }
+
+    // code objects are read-only data of the process image, so executables
+    // are built from them in place
+    void BuildProgram(void* size, void* source) override {
+        BuildOfflineFinalizedProgramImpl(source, (size_t)size);
     }
 
     inline
@@ -2714,27 +3998,17 @@ public:
     }
 
     bool IsCompatibleKernel(void* size, void* source) override {
-        using namespace ELFIO;
-        using namespace std;
-
         hsa_status_t status;
 
-        // Allocate memory for kernel source
-        size_t kernel_size = (size_t)((void *)size);
-        char *kernel_source = (char*)malloc(kernel_size+1);
-        memcpy(kernel_source, source, kernel_size);
-        kernel_source[kernel_size] = '\0';
-
-        // Set up ELF header reader
-        elfio reader;
-        istringstream kern_stream{string{
-            kernel_source,
-            kernel_source + kernel_size}};
-        reader.load(kern_stream);
+        // Get ISA from the ELF header, read in place
+        uint32_t flags = 0;
+        if (!code_object_elf_flags(source, (size_t)size, &flags)) {
+            DBOUTL(DB_CODE, "skipping code object at " << source << ", not an ELF64 object");
+            return false;
+        }
 
-        // Get ISA from ELF header
         std::string triple = "amdgcn-amd-amdhsa--gfx";
-        unsigned MACH = reader.get_flags() & hc::EF_AMDGPU_MACH;
+        unsigned MACH = flags & hc::EF_AMDGPU_MACH;
 
         switch(MACH) {
             case hc::EF_AMDGPU_MACH_AMDGCN_GFX701 : triple.append("701"); break;
@@ -2769,170 +4043,146 @@ public:
                 &co_data);
         STATUS_CHECK(status, __LINE__);
 
-        // release allocated memory
-        free(kernel_source);
-
         return co_data.is_compatible;
     }
 
-    void* CreateKernel(const char* fun, Kalmar::KalmarQueue *queue) override {
-        // try load kernels lazily in case it was not done so at bootstrap
-        // due to HCC_LAZYINIT env var
-        if (executables.size() == 0) {
-          CLAMP::LoadInMemoryProgram(queue);
+    void ReportProgramLoad(uint64_t durationNs, size_t codeObjects) override;
+
+    // Add kernel symbols to the index.  Names already present keep their first definition.
+    void addToKernelIndex(HSAExecutable *executable, const std::vector<hsa_executable_symbol_t> &symbols) {
+        std::lock_guard<std::mutex> l(kernelIndexMutex);
+
+        std::shared_ptr<const KernelIndex> current = std::atomic_load(&kernelIndex);
+        std::shared_ptr<KernelIndex> updated = current ? std::make_shared<KernelIndex>(*current)
+                                                       : std::make_shared<KernelIndex>();
+        for (auto symbol : symbols) {
+            uint64_t kernelCodeHandle = 0;
+            if (hsa_executable_symbol_get_info(symbol, HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_OBJECT, &kernelCodeHandle) != HSA_STATUS_SUCCESS) {
+                continue;
+            }
+
+            std::string name = hc2::hsa_symbol_name(symbol);
+            // name length reported by ROCR may include the terminator
+            while (!name.empty() && name.back() == '\0') {
+                name.pop_back();
+            }
+            if (updated->find(KernelName{name.c_str(), name.size()}) != updated->end()) {
+                continue;
+            }
+
+            KernelIndexEntry *entry = new KernelIndexEntry;
+            entry->name = std::move(name);
+            entry->executable = executable;
+            entry->symbol = symbol;
+            entry->kernelCodeHandle = kernelCodeHandle;
+            entry->kernel.store(nullptr);
+            kernelIndexEntries.emplace_back(entry);
+            updated->emplace(KernelName{entry->name.c_str(), entry->name.size()}, entry);
         }
 
-        std::string str(fun);
-        HSAKernel *kernel = programs[str];
+        DBOUTL(DB_CODE, "kernel index for agent " << agent.handle << " has " << updated->size() << " kernels");
+        std::atomic_store(&kernelIndex, std::shared_ptr<const KernelIndex>(std::move(updated)));
+    }
 
-        const char *demangled = "<demangle_error>";
-        std::string shortName;
+    void indexExecutableKernels(HSAExecutable *executable) {
+        std::vector<hsa_executable_symbol_t> symbols;
+        hsa_status_t status = hsa_executable_iterate_agent_symbols(
+            executable->hsaExecutable, agent,
+            [](hsa_executable_t, hsa_agent_t, hsa_executable_symbol_t x, void* s) {
+                hsa_symbol_kind_t kind = HSA_SYMBOL_KIND_VARIABLE;
+                hsa_executable_symbol_get_info(x, HSA_EXECUTABLE_SYMBOL_INFO_TYPE, &kind);
+                if (kind == HSA_SYMBOL_KIND_KERNEL) {
+                    static_cast<std::vector<hsa_executable_symbol_t>*>(s)->push_back(x);
+                }
+                return HSA_STATUS_SUCCESS;
+            },
+            &symbols);
+        STATUS_CHECK(status, __LINE__);
 
-        if (!kernel) {
-            int demangleStatus = 0;
-            int kernelNameFormat = HCC_DB_SYMBOL_FORMAT & 0xf;
-            if (kernelNameFormat == 1) {
-                shortName = fun; // mangled name
-            } else {
-#ifndef USE_LIBCXX
-                demangled = abi::__cxa_demangle(fun, nullptr, nullptr, &demangleStatus);
-#endif
-                shortName = demangleStatus ? fun : std::string(demangled);
-                try {
-                    if (demangleStatus == 0) {
-
-                        if (kernelNameFormat == 2) {
-                            shortName = demangled;
-                        } else {
-                            // kernelNameFormat == 0 or unspecified:
-
-                            // Example: HIP_kernel_functor_name_begin_unnamed_HIP_kernel_functor_name_end_5::__cxxamp_trampoline(unsigned int, unsigned int, unsigned int, unsigned int, unsigned int, unsigned int, float*, long long)"
-
-                            std::string hip_begin_str  ("::HIP_kernel_functor_name_begin_");
-                            std::string hip_end_str    ("_HIP_kernel_functor_name_end");
-                            int hip_begin = shortName.find(hip_begin_str);
-                            int hip_end   = shortName.find(hip_end_str);
-
-                            if ((hip_begin != -1) && (hip_end != -1) && (hip_end > hip_begin)) {
-                                // HIP kernel with markers
-                                int start_pos = hip_begin + hip_begin_str.length();
-                                std::string hipname = shortName.substr(start_pos, hip_end - start_pos) ;
-                                DBOUTL(DB_CODE, "hipname=" << hipname);
-                                if (hipname == "unnamed") {
-                                    shortName = shortName.substr(0, hip_begin);
-                                } else {
-                                    shortName = hipname;
-                                }
-
-                            } else {
-                                // PFE not from HIP:
-
-                                // strip off hip launch template wrapper:
-                                std::string hipImplString ("void hip_impl::grid_launch_hip_impl_<");
-                                int begin = shortName.find(hipImplString);
-                                if ((begin != std::string::npos)) {
-                                    begin += hipImplString.length() ;
-                                } else {
-                                    begin = 0;
-                                }
-
-                                shortName = shortName.substr(begin);
-
-                                // Strip off any leading return type:
-                                begin = shortName.find(" ", 0);
-                                if (begin == std::string::npos) {
-                                    begin = 0;
-                                } else {
-                                    begin +=1; // skip the space
-                                }
-                                shortName = shortName.substr(begin);
-
-                                DBOUTL(DB_CODE, "shortKernel processing demangled non-hip.  beginChar=" << begin << " shortName=" << shortName);
-                            }
+        addToKernelIndex(executable, symbols);
+    }
 
-                        }
+    // Kernels in code objects embedded in shared objects are only indexed when a lookup
+    // misses, since discovering them means scanning every loaded library.  Threads
+    // which miss while the scan runs wait for it to be published.
+    void indexSharedObjectKernels() {
+        std::call_once(sharedObjectKernelsOnce, [this] {
+            const auto it = shared_object_kernels(hc2::program_state()).find(agent);
+            if (it != shared_object_kernels(hc2::program_state()).cend()) {
+                addToKernelIndex(nullptr, it->second);
+            }
+        });
+    }
 
-                        if (HCC_DB_SYMBOL_FORMAT & 0x10) {
-                            // trim everything after first (
-                            int begin = shortName.find("(");
-                            shortName = shortName.substr(0, begin);
-                        }
-                    }
-                } catch (std::out_of_range& exception) {
-                    // Do something sensible if string pattern is not what we expect
-                    shortName = fun;
-                };
+    HSAKernel* findKernel(const char *fun) {
+        const KernelName key = {fun, strlen(fun)};
+
+        std::shared_ptr<const KernelIndex> index = std::atomic_load(&kernelIndex);
+        KernelIndexEntry *entry = nullptr;
+        if (index) {
+            auto it = index->find(key);
+            if (it != index->end()) {
+                entry = it->second;
             }
-            DBOUT (DB_CODE, "CreateKernel_short=      " << shortName << "\n");
-            DBOUT (DB_CODE, "CreateKernel_demangled=  " << demangled << "\n");
-            DBOUT (DB_CODE, "CreateKernel_raw=       " << fun << "\n");
-
-            if (executables.size() != 0) {
-                for (auto executable_iterator : executables) {
-                    HSAExecutable *executable = executable_iterator.second;
-
-                    // Get symbol handle.
-                    hsa_status_t status;
-                    hsa_executable_symbol_t kernelSymbol;
-                    status = hsa_executable_get_symbol_by_name(executable->hsaExecutable, fun, const_cast<hsa_agent_t*>(&agent), &kernelSymbol);
-                    if (status == HSA_STATUS_SUCCESS) {
-                        // Get code handle.
-                        uint64_t kernelCodeHandle;
-                        status = hsa_executable_symbol_get_info(kernelSymbol, HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_OBJECT, &kernelCodeHandle);
-                        if (status == HSA_STATUS_SUCCESS) {
-                            kernel =  new HSAKernel(str, shortName, executable, kernelSymbol, kernelCodeHandle);
-                            break;
-                        }
-                    }
-                }
+        }
+
+        if (!entry) {
+            indexSharedObjectKernels();
+            index = std::atomic_load(&kernelIndex);
+            if (!index) {
+                return nullptr;
+            }
+            auto it = index->find(key);
+            if (it == index->end()) {
+                return nullptr;
             }
+            entry = it->second;
+        }
 
-            if (!kernel) {
-                const auto it =
-                    shared_object_kernels(hc2::program_state()).find(agent);
-                if (it != shared_object_kernels(hc2::program_state()).cend()) {
-                    const auto k = std::find_if(
-                        it->second.cbegin(),
-                        it->second.cend(),
-                        [&](hsa_executable_symbol_t x) {
-                            return hc2::hsa_symbol_name(x) == str;
-                        });
-                    if (k != it->second.cend()) {
-                        uint64_t h = 0u;
-                        if (hsa_executable_symbol_get_info(
-                                *k, HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_OBJECT, &h) ==
-                            HSA_STATUS_SUCCESS) {
-
-                            kernel = new HSAKernel(str, shortName, nullptr, *k, h);
-                        }
-                    }
-                }
-                if (!kernel) {
-                    hc::print_backtrace();
-                    std::cerr << "HSADevice::CreateKernel(): Unable to create kernel " << shortName << " \n";
-                    std::cerr << "  CreateKernel_raw=  " << fun << "\n";
-                    std::cerr << "  CreateKernel_demangled=  " << demangled << "\n";
-
-                    if (demangled) {
-                        free((void*)demangled); // cxa_dmangle mallocs memory.
-                    }
-                    abort();
-                }
+        HSAKernel *kernel = entry->kernel.load(std::memory_order_acquire);
+        if (!kernel) {
+            HSAKernel *created = new HSAKernel(entry->name, entry->executable, entry->symbol, entry->kernelCodeHandle);
+            if (entry->kernel.compare_exchange_strong(kernel, created, std::memory_order_acq_rel)) {
+                kernel = created;
             } else {
-                //std::cerr << "HSADevice::CreateKernel(): Created kernel\n";
+                // another thread created it first
+                delete created;
             }
-            programs[str] = kernel;
         }
 
-        // HSADispatch instance will be deleted in:
+        return kernel;
+    }
+
+    void* CreateKernel(const char* fun, Kalmar::KalmarQueue *queue) override {
+        // load kernels lazily in case it was not done so at bootstrap due to
+        // HCC_LAZYINIT env var, or wait for the load started in the background.
+        // The index is published after every program built, so a partial index
+        // does not mean the load is done.
+        if (!programsLoaded.load(std::memory_order_acquire)) {
+            CLAMP::LoadInMemoryProgram(this);
+            programsLoaded.store(true, std::memory_order_release);
+        }
+
+        HSAKernel *kernel = findKernel(fun);
+        if (!kernel) {
+            hc::print_backtrace();
+            std::cerr << "HSADevice::CreateKernel(): Unable to create kernel " << kernelShortName(fun) << " \n";
+            std::cerr << "  CreateKernel_raw=  " << fun << "\n";
+            abort();
+        }
+
+        // HSADispatch instance lives in the queue's op pool and will be deleted in:
         // HSAQueue::LaunchKernel()
-        // or it will be created as a shared_ptr<KalmarAsyncOp> in:
+        // or it will be adopted by a shared_ptr<KalmarAsyncOp> in:
         // HSAQueue::LaunchKernelAsync()
-        HSADispatch *dispatch = new HSADispatch(this, queue, kernel);
+        HSADispatch *dispatch = static_cast<Kalmar::HSAQueue*>(queue)->newDispatch(this, kernel);
         return dispatch;
     }
 
     std::shared_ptr<KalmarQueue> createQueue(execute_order order = execute_in_order, queue_priority priority= priority_normal) override {
+        // with HCC_LAZYINIT=HYBRID, start loading kernels on first use of the device
+        CLAMP::PrefetchProgram(this);
+
         auto hsaAv = new HSAQueue(this, agent, order, priority);
         std::shared_ptr<KalmarQueue> q =  std::shared_ptr<KalmarQueue>(hsaAv);
         queues_mutex.lock();
@@ -3061,6 +4311,26 @@ public:
          }
     }
 
+    KernargRing* acquireKernargRing() {
+        std::lock_guard<std::mutex> l(kernargPoolMutex);
+        if (!freeKernargRings.empty()) {
+            KernargRing *ring = freeKernargRings.back();
+            freeKernargRings.pop_back();
+            ring->resetStats();
+            return ring;
+        }
+        KernargRing *ring = new KernargRing(getHSAKernargRegion(), agent);
+        kernargRings.push_back(ring);
+        return ring;
+    }
+
+    // Buffers still in use by ops of the disposed queue stay busy until those ops are
+    // disposed; the next owner of the ring skips over them.
+    void releaseKernargRing(KernargRing *ring) {
+        std::lock_guard<std::mutex> l(kernargPoolMutex);
+        freeKernargRings.push_back(ring);
+    }
+
     void growKernargBuffer()
     {
         uint8_t * kernargMemory = nullptr;
@@ -3077,6 +4347,8 @@ public:
             kernargPool.push_back(kernargMemory+i);
             kernargPoolFlag.push_back(false);
         };
+
+        addPinnedBytes("kernarg pool", KERNARG_POOL_SIZE * KERNARG_BUFFER_SIZE);
     }
 
     std::pair<void*, int> getKernargBuffer(int size) {
@@ -3088,6 +4360,11 @@ public:
         // - requested size is smaller than KERNARG_BUFFER_SIZE
         if ( (KERNARG_POOL_SIZE > 0) && (size <= KERNARG_BUFFER_SIZE) ) {
             kernargPoolMutex.lock();
+
+            // the pool is allocated by the first request which does not fit a kernarg ring
+            if (kernargPool.empty()) {
+                growKernargBuffer();
+            }
             cursor = kernargCursor;
 
             if (kernargPoolFlag[cursor] == false) {
@@ -3195,6 +4472,8 @@ public:
     void* getSymbolAddress(const char* symbolName) override {
         hsa_status_t status;
 
+        CLAMP::LoadInMemoryProgram(this);
+
         unsigned long* symbol_ptr = nullptr;
         if (executables.size() != 0) {
             // iterate through all HSA executables
@@ -3232,6 +4511,8 @@ public:
     void memcpySymbol(void* symbolAddr, void* hostptr, size_t count, size_t offset = 0, enum hcCommandKind kind = hcMemcpyHostToDevice) override {
         hsa_status_t status;
 
+        CLAMP::LoadInMemoryProgram(this);
+
         if (executables.size() != 0) {
             // copy data
             if (kind == hcMemcpyHostToDevice) {
@@ -3250,6 +4531,8 @@ public:
 
     // FIXME: return values
     void memcpySymbol(const char* symbolName, void* hostptr, size_t count, size_t offset = 0, enum hcCommandKind kind = hcMemcpyHostToDevice) override {
+        CLAMP::LoadInMemoryProgram(this);
+
         if (executables.size() != 0) {
             unsigned long* symbol_ptr = (unsigned long*)getSymbolAddress(symbolName);
             memcpySymbol(symbol_ptr, hostptr, count, offset, kind);
@@ -3264,13 +4547,13 @@ public:
 
 private:
 
-    void BuildOfflineFinalizedProgramImpl(void* kernelBuffer, int kernelSize) {
+    void BuildOfflineFinalizedProgramImpl(void* kernelBuffer, size_t kernelSize) {
         using namespace ELFIO;
         using namespace std;
 
         hsa_status_t status;
 
-        string index = kernel_checksum((size_t)kernelSize, kernelBuffer);
+        string index = kernel_checksum(kernelSize, kernelBuffer);
 
         // load HSA program if we haven't done so
         if (executables.find(index) == executables.end()) {
@@ -3286,23 +4569,14 @@ private:
             // Define the global symbol hc::printf_buffer with the actual address
             status = hsa_executable_agent_global_variable_define(hsaExecutable, agent
                                                               , "_ZN2hc13printf_bufferE"
-                                                              , hc::printf_buffer_locked_va);
+                                                              , PrintfBufferPointerVA());
             STATUS_CHECK(status, __LINE__);
 
             elfio reader;
-            istringstream tmp{string{
-                static_cast<char*>(kernelBuffer),
-                static_cast<char*>(kernelBuffer) + kernelSize}};
+            MemoryStreamBuf kernelBuf{kernelBuffer, kernelSize};
+            istream tmp{&kernelBuf};
             reader.load(tmp);
 
-            elfio self_reader;
-            self_reader.load("/proc/self/exe");
-
-            const auto symtab =
-                find_section_if(self_reader, [](const ELFIO::section* x) {
-                    return x->get_type() == SHT_SYMTAB;
-            });
-
             const auto code_object_dynsym =
                 find_section_if(reader, [](const ELFIO::section* x) {
                     return x->get_type() == SHT_DYNSYM;
@@ -3310,9 +4584,7 @@ private:
 
             associate_code_object_symbols_with_host_allocation(
                 reader,
-                self_reader,
                 code_object_dynsym,
-                symtab,
                 agent,
                 hsaExecutable);
 
@@ -3324,8 +4596,11 @@ private:
             }
 
             // save everything as an HSAExecutable instance
-            executables[index] = new HSAExecutable(
+            HSAExecutable *executable = new HSAExecutable(
                 hsaExecutable, code_object_reader);
+            executables[index] = executable;
+
+            indexExecutableKernels(executable);
         }
     }
 
@@ -3378,10 +4653,7 @@ public:
     std::map<uint64_t, HSADevice *> agentToDeviceMap_;
 private:
     /// memory pool for signals
-    std::vector<hsa_signal_t> signalPool;
-    std::vector<bool> signalPoolFlag;
-    int signalCursor;
-    std::mutex signalPoolMutex;
+    SignalPool<HSASignalTraits> signalPool;
     /* TODO: Modify properly when supporing multi-gpu.
     When using memory pool api, each agent will only report memory pool
     which is attached with the agent itself physically, eg, GPU won't
@@ -3394,6 +4666,12 @@ private:
     // GPU devices
     std::vector<hsa_agent_t> agents;
 
+    /// the printf buffer is set up by the first getPrintfBufferPointerVA
+    std::once_flag printfBufferOnce;
+    /// writes out hc::printf output on flushes and, if HCC_PRINTF_DRAIN_INTERVAL is set,
+    /// from a background thread
+    hc::PrintfDrainer printfDrainer;
+
     std::ofstream hccProfileFile; // if using a file open it here
     std::ostream *hccProfileStream = nullptr; // point at file or default stream
 
@@ -3459,11 +4737,13 @@ public:
     void ReadHccEnv() ;
     std::ostream &getHccProfileStream() const { return *hccProfileStream; };
 
-    HSAContext() : KalmarContext(), signalPool(), signalPoolFlag(), signalCursor(0), signalPoolMutex() {
+    HSAContext() : KalmarContext(), signalPool() {
         host.handle = (uint64_t)-1;
 
         ReadHccEnv();
 
+        auto initStart = std::chrono::steady_clock::now();
+
         // initialize HSA runtime
 
         DBOUT(DB_INIT,"HSAContext::HSAContext(): init HSA runtime");
@@ -3502,23 +4782,23 @@ public:
         }
         def = Devices[first_gpu_index + HCC_DEFAULT_GPU];
 
-        signalPoolMutex.lock();
-
-        // pre-allocate signals
-        DBOUT(DB_SIG,  " pre-allocate " << HCC_SIGNAL_POOL_SIZE << " signals\n");
-        for (int i = 0; i < HCC_SIGNAL_POOL_SIZE; ++i) {
-          hsa_signal_t signal;
-          status = hsa_signal_create(1, 0, NULL, &signal);
-          STATUS_CHECK(status, __LINE__);
-          signalPool.push_back(signal);
-          signalPoolFlag.push_back(false);
-        }
-
-        signalPoolMutex.unlock();
-
-        initPrintfBuffer();
+        // signals are created in batches of HCC_SIGNAL_POOL_SIZE, the first one on first use.
+        // The printf buffer is set up before the first program is loaded.
+        signalPool.setGrowBatch(HCC_SIGNAL_POOL_SIZE);
 
         init_success = true;
+
+        uint64_t initNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              std::chrono::steady_clock::now() - initStart).count();
+        DBOUTL(DB_INIT, "initialized " << agents.size() << " GPU agents in " << initNs / 1000 << " us");
+        if (HCC_PROFILE) {
+            std::stringstream sstream;
+            sstream << "profile: " << std::setw(7) << "init" << ";\t"
+                    << std::setw(40) << "" << ";\t" << std::fixed << std::setw(6)
+                    << std::setprecision(1) << initNs / 1000.0 << " us;"
+                    << "\t" << agents.size() << " GPU agents;\n";
+            getHccProfileStream() << sstream.str();
+        }
     }
 
     void releaseSignal(hsa_signal_t signal, int signalIndex) {
@@ -3526,107 +4806,17 @@ public:
         if (signal.handle) {
 
             DBOUT(DB_SIG, "  releaseSignal: 0x" << std::hex << signal.handle << std::dec << " and restored value to 1\n");
-            hsa_status_t status = HSA_STATUS_SUCCESS;
-            signalPoolMutex.lock();
-
-            // restore signal to the initial value 1
-            hsa_signal_store_screlease(signal, 1);
 
-            // mark the signal pointed by signalIndex as available
-            signalPoolFlag[signalIndex] = false;
-
-            signalPoolMutex.unlock();
+            // restores the signal to value 1 and returns it to this thread's magazine
+            signalPool.release(signal, signalIndex);
         }
     }
 
+    // Hands out a signal with value 1, along with its index in the pool.
+    // Lock-free unless the calling thread's magazines are exhausted, in which case it
+    // trades with the shared depot (and grows the pool by HCC_SIGNAL_POOL_SIZE if needed).
     std::pair<hsa_signal_t, int> getSignal() {
-        hsa_signal_t ret;
-
-        signalPoolMutex.lock();
-        int cursor = signalCursor;
-
-        if (signalPoolFlag[cursor] == false) {
-            // the cursor is valid, use it
-            ret = signalPool[cursor];
-
-            // set the signal as used
-            signalPoolFlag[cursor] = true;
-
-            // simply move the cursor to the next index
-            ++signalCursor;
-            if (signalCursor == signalPool.size()) signalCursor = 0;
-        } else {
-            // the cursor is not valid, sequentially find the next available slot
-            bool found = false;
-            int startingCursor = cursor;
-            do {
-                ++cursor;
-                if (cursor == signalPool.size()) cursor = 0;
-
-                if (signalPoolFlag[cursor] == false) {
-                    // the cursor is valid, use it
-                    ret = signalPool[cursor];
-
-                    // set the signal as used
-                    signalPoolFlag[cursor] = true;
-
-                    // simply move the cursor to the next index
-                    signalCursor = cursor + 1;
-                    if (signalCursor == signalPool.size()) signalCursor = 0;
-
-                    // break from the loop
-                    found = true;
-                    break;
-                }
-            } while(cursor != startingCursor); // ensure we at most scan the vector once
-
-            if (found == false) {
-                hsa_status_t status = HSA_STATUS_SUCCESS;
-
-                // increase signal pool on demand by HCC_SIGNAL_POOL_SIZE
-
-                // keep track of the size of signal pool before increasing it
-                int oldSignalPoolSize = signalPool.size();
-                int oldSignalPoolFlagSize = signalPoolFlag.size();
-                assert(oldSignalPoolSize == oldSignalPoolFlagSize);
-
-                DBOUTL(DB_RESOURCE, "Growing signal pool from " << signalPool.size() << " to " << signalPool.size() + HCC_SIGNAL_POOL_SIZE);
-
-                // increase signal pool on demand for another HCC_SIGNAL_POOL_SIZE
-                for (int i = 0; i < HCC_SIGNAL_POOL_SIZE; ++i) {
-                    hsa_signal_t signal;
-                    status = hsa_signal_create(1, 0, NULL, &signal);
-                    STATUS_CHECK(status, __LINE__);
-                    signalPool.push_back(signal);
-                    signalPoolFlag.push_back(false);
-                }
-
-                DBOUT(DB_SIG,  "grew signal pool to size=" << signalPool.size() << "\n");
-
-                assert(signalPool.size() == oldSignalPoolSize + HCC_SIGNAL_POOL_SIZE);
-                assert(signalPoolFlag.size() == oldSignalPoolFlagSize + HCC_SIGNAL_POOL_SIZE);
-
-                // set return values, after the pool has been increased
-
-                // use the first item in the newly allocated pool
-                cursor = oldSignalPoolSize;
-
-                // access the new item through the newly assigned cursor
-                ret = signalPool[cursor];
-
-                // mark the item as used
-                signalPoolFlag[cursor] = true;
-
-                // simply move the cursor to the next index
-                signalCursor = cursor + 1;
-                if (signalCursor == signalPool.size()) signalCursor = 0;
-
-                found = true;
-            }
-        }
-
-        signalPoolMutex.unlock();
-        return std::make_pair(ret, cursor);
+        return signalPool.acquire();
     }
 
     ~HSAContext() {
@@ -3637,6 +4827,7 @@ public:
           return;
 
         // deallocate the printf buffer
+        printfDrainer.stop();
         if (HCC_ENABLE_PRINTF &&
             hc::printf_buffer != nullptr) {
            // do a final flush
@@ -3644,9 +4835,11 @@ public:
 
            hc::deletePrintfBuffer(hc::printf_buffer);
         }
-        status = hsa_amd_memory_unlock(&hc::printf_buffer);
-        STATUS_CHECK(status, __LINE__);
-        hc::printf_buffer_locked_va = nullptr;
+        if (hc::printf_buffer_locked_va != nullptr) {
+            status = hsa_amd_memory_unlock(&hc::printf_buffer);
+            STATUS_CHECK(status, __LINE__);
+            hc::printf_buffer_locked_va = nullptr;
+        }
 
         // destroy all KalmarDevices associated with this context
         for (auto dev : Devices)
@@ -3654,19 +4847,14 @@ public:
         Devices.clear();
         def = nullptr;
 
-        signalPoolMutex.lock();
-
-        // deallocate signals in the pool
-        for (int i = 0; i < signalPool.size(); ++i) {
-            hsa_signal_t signal;
-            status = hsa_signal_destroy(signalPool[i]);
-            STATUS_CHECK(status, __LINE__);
+        if (DBFLAG(DB_RESOURCE)) {
+            auto stats = signalPool.getStats();
+            DBOUTL(DB_RESOURCE, "signal pool: size=" << stats.size << " hits=" << stats.hits
+                                << " misses=" << stats.misses << " grows=" << stats.grows);
         }
 
-        signalPool.clear();
-        signalPoolFlag.clear();
-
-        signalPoolMutex.unlock();
+        // deallocate signals in the pool
+        signalPool.destroyAll();
 
         // shutdown HSA runtime
         status = hsa_shut_down();
@@ -3698,11 +4886,15 @@ public:
             hc::AmPointerInfo info;
             am_status_t status = am_memtracker_getinfo(&info, hc::printf_buffer);
             if (status != AM_SUCCESS) {
+              printfDrainer.stop();
               hc::printf_buffer = nullptr;
             }
           }
           if (hc::printf_buffer == nullptr) {
             hc::printf_buffer = hc::createPrintfBuffer(hc::default_printf_buffer_size);
+            if (HCC_PRINTF_DRAIN_INTERVAL > 0) {
+              printfDrainer.start(hc::printf_buffer, std::chrono::microseconds(HCC_PRINTF_DRAIN_INTERVAL));
+            }
           }
         }
 
@@ -3720,16 +4912,30 @@ public:
 
       if (!HCC_ENABLE_PRINTF)  return;
 
-      hc::processPrintfBuffer(hc::printf_buffer);
+      printfDrainer.drain(hc::printf_buffer);
+    }
+
+    void processPrintfBuffer(hc::PrintfPacket* buffer) override {
+      printfDrainer.drain(buffer);
     }
 
+    void processPrintfPackets(hc::PrintfPacket* packets, unsigned int numPackets) override {
+      printfDrainer.write(packets, numPackets);
+    }
+
+    // Agent accessible address of hc::printf_buffer, setting up the printf buffer on first use.
     void* getPrintfBufferPointerVA() override {
+      std::call_once(printfBufferOnce, [this] { initPrintfBuffer(); });
       return hc::printf_buffer_locked_va;
     }
 };
 
 static HSAContext ctx;
 
+static void* PrintfBufferPointerVA() {
+    return ctx.getPrintfBufferPointerVA();
+}
+
 } // namespace Kalmar
 
 // ----------------------------------------------------------------------
@@ -3762,7 +4968,15 @@ void HSAContext::ReadHccEnv()
     GET_ENV_INT(HCC_FORCE_CROSS_QUEUE_FLUSH, "create_blocking_marker will force need for sys acquire (0x1) and release (0x2) queue where the marker is created. 0x3 sets need for both flags.");
     GET_ENV_INT(HCC_MAX_QUEUES, "Set max number of HSA queues this process will use.  accelerator_views will share the allotted queues and steal from each other as necessary");
 
-    GET_ENV_INT(HCC_SIGNAL_POOL_SIZE, "Number of pre-allocated HSA signals.  Signals are precious resource so manage carefully");
+    GET_ENV_INT(HCC_WAIT_MODE, "Default wait mode of accelerator_views.  0=blocked, 1=active, 2=adaptive (spin for about as long as recent ops took, then block)");
+    GET_ENV_INT(HCC_WAIT_SPIN_MAX, "Max time (in us) an adaptive wait spins before it blocks");
+
+    GET_ENV_INT(HCC_SIGNAL_POOL_SIZE, "Number of HSA signals created at a time, the first batch on first use.  Signals are precious resource so manage carefully");
+
+    GET_ENV_INT(HCC_DEVICE_MEMORY_CACHE, "Sub-allocate device memory for arrays from a per-device cache.  0=allocate every buffer from the HSA memory pool");
+    GET_ENV_INT(HCC_DEVICE_MEMORY_CACHE_LIMIT, "Max device memory (in MB) kept cached once freed, per device");
+    GET_ENV_INT(HCC_ASYNC_UPLOADS, "Upload array and array_view kernel arguments asynchronously through pinned staging memory.  0=blocking copy per argument");
+    GET_ENV_INT(HCC_ASYNC_UPLOAD_LIMIT, "Max size (in MB) of an async upload, and of the staging memory kept cached per device");
 
     GET_ENV_INT(HCC_UNPINNED_COPY_MODE, "Select algorithm for unpinned copies. 0=ChooseBest(see thresholds), 1=PinInPlace, 2=StagingBuffer, 3=Memcpy");
 
@@ -3781,6 +4995,7 @@ void HSAContext::ReadHccEnv()
 
     // Enable printf support
     GET_ENV_INT (HCC_ENABLE_PRINTF, "Enable hc::printf");
+    GET_ENV_INT (HCC_PRINTF_DRAIN_INTERVAL, "Interval (in us) at which hc::printf output is drained while kernels run.  0=only when the host flushes");
 
     GET_ENV_INT    (HCC_PROFILE,         "Enable HCC kernel and data profiling.  1=summary, 2=trace");
     GET_ENV_INT    (HCC_PROFILE_VERBOSE, "Bitmark to control profile verbosity and format. 0x1=default, 0x2=show begin/end, 0x4=show barrier");
@@ -3804,7 +5019,7 @@ void HSAContext::ReadHccEnv()
 
 HSADevice::HSADevice(hsa_agent_t a, hsa_agent_t host, int x_accSeqNum) : 
                                KalmarDevice(get_access_type(a)),
-                               agent(a), programs(), max_tile_static_size(0),
+                               agent(a), kernelIndex(), sharedObjectKernelsOnce(), programsLoaded(false), max_tile_static_size(0),
                                queue_size(0), queues(), queues_mutex(),
                                rocrQueues(/*empty*/), rocrQueuesMutex(),
                                ri(),
@@ -3812,7 +5027,8 @@ HSADevice::HSADevice(hsa_agent_t a, hsa_agent_t host, int x_accSeqNum) :
                                kernargPool(), kernargPoolFlag(), kernargCursor(0), kernargPoolMutex(),
                                executables(),
                                path(), description(), hostAgent(host),
-                               versionMajor(0), versionMinor(0), accSeqNum(x_accSeqNum), queueSeqNums(0) {
+                               versionMajor(0), versionMinor(0), accSeqNum(x_accSeqNum), queueSeqNums(0),
+                               pinnedBytes(0) {
     DBOUT(DB_INIT, "HSADevice::HSADevice()\n");
 
     hsa_status_t status = HSA_STATUS_SUCCESS;
@@ -3893,12 +5109,7 @@ HSADevice::HSADevice(hsa_agent_t a, hsa_agent_t host, int x_accSeqNum) :
     }
     useCoarseGrainedRegion = result;
 
-    /// pre-allocate a pool of kernarg buffers in case:
-    /// - kernarg region is available
-    /// - compile-time macro KERNARG_POOL_SIZE is larger than 0
-#if KERNARG_POOL_SIZE > 0
-    growKernargBuffer();
-#endif
+    /// the kernarg pool, copy engines and signals are allocated on first use
 
     // Setup AM pool.
     ri._am_memory_pool = (ri._found_local_memory_pool)
@@ -3913,6 +5124,17 @@ HSADevice::HSADevice(hsa_agent_t a, hsa_agent_t host, int x_accSeqNum) :
                                   ? ri._finegrained_system_memory_pool
                                   : ri._coarsegrained_system_memory_pool;
 
+    if (HCC_DEVICE_MEMORY_CACHE && ri._found_local_memory_pool) {
+        memoryCache.reset(new MemoryCache<HSAMemoryPoolTraits>(HSAMemoryPool{ri._am_memory_pool, agent},
+                                                               size_t(HCC_DEVICE_MEMORY_CACHE_LIMIT) << 20));
+    }
+
+    if (HCC_ASYNC_UPLOADS && !is_unified() &&
+        (ri._found_coarsegrained_system_memory_pool || ri._found_finegrained_system_memory_pool)) {
+        stagingCache = std::make_shared<MemoryCache<HSAMemoryPoolTraits>>(HSAMemoryPool{ri._am_host_memory_pool, agent},
+                                                                          size_t(HCC_ASYNC_UPLOAD_LIMIT) << 20);
+    }
+
     /// Query the maximum number of work-items in a workgroup
     status = hsa_agent_get_info(agent, HSA_AGENT_INFO_WORKGROUP_MAX_SIZE, &workgroup_max_size);
     STATUS_CHECK(status, __LINE__);
@@ -3946,30 +5168,10 @@ HSADevice::HSADevice(hsa_agent_t a, hsa_agent_t host, int x_accSeqNum) :
             this->copy_mode = UnpinnedCopyEngine::ChooseBest;
     };
 
-    HCC_H2D_STAGING_THRESHOLD    *= 1024;
-    HCC_H2D_PININPLACE_THRESHOLD *= 1024;
-    HCC_D2H_PININPLACE_THRESHOLD *= 1024;
-
-    static const size_t stagingSize = HCC_STAGING_BUFFER_SIZE * 1024;
-
     // FIXME: Disable optimizated data copies on large bar system for now due to stability issues
     //this->cpu_accessible_am = hasAccess(hostAgent, ri._am_memory_pool);
     this->cpu_accessible_am = false;
 
-    hsa_amd_memory_pool_t hostPool = (getHSAAMHostRegion());
-    copy_engine[0] = new UnpinnedCopyEngine(agent, hostAgent, stagingSize, 2/*staging buffers*/,
-                                            this->cpu_accessible_am,
-                                            HCC_H2D_STAGING_THRESHOLD,
-                                            HCC_H2D_PININPLACE_THRESHOLD,
-                                            HCC_D2H_PININPLACE_THRESHOLD);
-
-    copy_engine[1] = new UnpinnedCopyEngine(agent, hostAgent, stagingSize, 2/*staging Buffers*/,
-                                            this->cpu_accessible_am,
-                                            HCC_H2D_STAGING_THRESHOLD,
-                                            HCC_H2D_PININPLACE_THRESHOLD,
-                                            HCC_D2H_PININPLACE_THRESHOLD);
-
-
     if (HCC_CHECK_COPY && !this->cpu_accessible_am) {
         throw Kalmar::runtime_exception("HCC_CHECK_COPY can only be used on machines where accelerator memory is visible to CPU (ie large-bar systems)", 0);
     }
@@ -3979,6 +5181,21 @@ HSADevice::HSADevice(hsa_agent_t a, hsa_agent_t host, int x_accSeqNum) :
 
 }
 
+void
+HSADevice::ReportProgramLoad(uint64_t durationNs, size_t codeObjects) {
+    DBOUTL(DB_INIT, "loaded " << codeObjects << " code objects on agent " << agent.handle
+                    << " in " << durationNs / 1000 << " us");
+    if (HCC_PROFILE) {
+        std::wstring path = get_path();
+        std::stringstream sstream;
+        sstream << "profile: " << std::setw(7) << "load" << ";\t"
+                << std::setw(40) << std::string(path.begin(), path.end())
+                << ";\t" << std::fixed << std::setw(6) << std::setprecision(1) << durationNs / 1000.0 << " us;"
+                << "\t" << codeObjects << " code objects;\n";
+        ctx.getHccProfileStream() << sstream.str();
+    }
+}
+
 inline void*
 HSADevice::getHSAAgent() override {
     return static_cast<void*>(&getAgent());
@@ -4015,9 +5232,21 @@ std::ostream& operator<<(std::ostream& os, const HSAQueue & hav)
 HSAQueue::HSAQueue(KalmarDevice* pDev, hsa_agent_t agent, execute_order order, queue_priority priority) :
     KalmarQueue(pDev, queuing_mode_automatic, order, priority),
     rocrQueue(nullptr),
-    asyncOps(), drainingQueue_(false),
-    valid(true), _nextSyncNeedsSysRelease(false), _nextKernelNeedsSysAcquire(false), bufferKernelMap(), kernelBufferMap()
+    asyncOps(MAX_INFLIGHT_COMMANDS_PER_QUEUE), asyncOpStats(), drainingQueue_(false),
+    valid(true), _nextSyncNeedsSysRelease(false), _nextKernelNeedsSysAcquire(false), bufferKernelMap(), kernelBufferMap(),
+    bufferLastUse(),
+    kernargRing(nullptr),
+    opPool(std::make_shared<HSAOpPool>()),
+    batchDepth(0), batchHwQueue(nullptr), batchWriteIndex(0), batchHeaders(), batchPendingCount(0),
+    captureGraph(),
+    waitSpins{ {uint64_t(HCC_WAIT_SPIN_MAX) * 1000}, {uint64_t(HCC_WAIT_SPIN_MAX) * 1000}, {uint64_t(HCC_WAIT_SPIN_MAX) * 1000} }
 {
+    if ((HCC_WAIT_MODE >= hcWaitModeBlocked) && (HCC_WAIT_MODE <= hcWaitModeAdaptive)) {
+        setDefaultWaitMode(static_cast<hcWaitMode>(HCC_WAIT_MODE));
+    } else {
+        setDefaultWaitMode(hcWaitModeAdaptive);
+    }
+
     {
         // Protect the HSA queue we can steal it.
         DBOUT(DB_LOCK, " ptr:" << this << " create lock_guard...\n");
@@ -4026,6 +5255,8 @@ HSAQueue::HSAQueue(KalmarDevice* pDev, hsa_agent_t agent, execute_order order, q
 
         auto device = static_cast<Kalmar::HSADevice*>(this->getDev());
         device->createOrstealRocrQueue(this, priority);
+
+        kernargRing = device->acquireKernargRing();
     }
 
 
@@ -4051,8 +5282,13 @@ void HSAQueue::dispose() override {
         std::lock_guard<std::mutex> rl(device->rocrQueuesMutex);
         std::lock_guard<std::recursive_mutex> l(this->qmutex);
 
+        // drop an unfinished capture
+        captureGraph.reset();
+
         // wait on all existing kernel dispatches and barriers to complete
         wait();
+        asyncOps.clear();
+        copyPositions.clear();
 
         this->valid = false;
 
@@ -4068,10 +5304,31 @@ void HSAQueue::dispose() override {
         }
         kernelBufferMap.clear();
 
+        {
+            std::lock_guard<std::recursive_mutex> lg(qmutex);
+            bufferLastUse.clear();
+        }
+
         if (this->rocrQueue != nullptr) {
             device->removeRocrQueue(rocrQueue);
             rocrQueue = nullptr;
         }
+
+        if (kernargRing != nullptr) {
+            const KernargRing::Stats &stats = kernargRing->getStats();
+            DBOUTL(DB_RESOURCE, *this << " kernarg ring: allocs=" << stats.allocs[0] << "/" << stats.allocs[1] << "/" << stats.allocs[2]
+                                << " grows=" << stats.grows << " fallbacks=" << stats.fallbacks
+                                << " fallbackBytes=" << stats.fallbackBytes);
+            device->releaseKernargRing(kernargRing);
+            kernargRing = nullptr;
+        }
+
+        DBOUTL(DB_RESOURCE, *this << " in-flight ops: reaped=" << asyncOpStats.reaped
+                            << " backPressureWaits=" << asyncOpStats.backPressureWaits
+                            << " drains=" << asyncOpStats.drains);
+
+        HSAOpPool::Stats opStats = opPool->getStats();
+        DBOUTL(DB_RESOURCE, *this << " op pool: hits=" << opStats.hits << " misses=" << opStats.misses);
     }
 
     status = hsa_signal_destroy(sync_copy_signal);
@@ -4105,6 +5362,178 @@ void HSAQueue::releaseLockedRocrQueue()
     this->qmutex.unlock();
 }
 
+uint64_t HSAQueue::reservePacketSlot(hsa_queue_t *lockedHsaQueue)
+{
+    uint64_t index = batchHeaders.empty() ? hsa_queue_load_write_index_relaxed(lockedHsaQueue) : batchWriteIndex;
+    uint64_t nextIndex = index + 1;
+    if (nextIndex - hsa_queue_load_read_index_scacquire(lockedHsaQueue) >= lockedHsaQueue->size) {
+        if (!batchHeaders.empty()) {
+            // the packet processor can't drain packets which haven't been published yet
+            flushDispatchBatch();
+        }
+        if (nextIndex - hsa_queue_load_read_index_scacquire(lockedHsaQueue) >= lockedHsaQueue->size) {
+            checkHCCRuntimeStatus(Kalmar::HCCRuntimeStatus::HCCRT_STATUS_ERROR_COMMAND_QUEUE_OVERFLOW, __LINE__, lockedHsaQueue);
+        }
+    }
+    return index;
+}
+
+void HSAQueue::publishPacket(hsa_queue_t *lockedHsaQueue, uint16_t *packetHeader, uint16_t header, uint64_t index)
+{
+    if (batchDepth > 0) {
+        // keep the slot invalid until the batch is flushed
+        __atomic_store_n(packetHeader, (uint16_t)(HSA_PACKET_TYPE_INVALID << HSA_PACKET_HEADER_TYPE), __ATOMIC_RELAXED);
+        batchHwQueue = lockedHsaQueue;
+        batchHeaders.emplace_back(packetHeader, header);
+        batchWriteIndex = index + 1;
+        batchPendingCount.store(batchHeaders.size(), std::memory_order_release);
+    } else {
+        // Set header last:
+        __atomic_store_n(packetHeader, header, __ATOMIC_RELEASE);
+
+        // Increment write index and ring doorbell to dispatch the packet
+        hsa_queue_store_write_index_relaxed(lockedHsaQueue, index + 1);
+        hsa_signal_store_relaxed(lockedHsaQueue->doorbell_signal, index);
+    }
+}
+
+// Publish every packet held back by the open batch: headers in queue order,
+// then a single write index update and a single doorbell.
+void HSAQueue::flushDispatchBatch()
+{
+    if (batchHeaders.empty()) {
+        return;
+    }
+
+    for (auto &h : batchHeaders) {
+        __atomic_store_n(h.first, h.second, __ATOMIC_RELEASE);
+    }
+
+    hsa_queue_store_write_index_relaxed(batchHwQueue, batchWriteIndex);
+    hsa_signal_store_relaxed(batchHwQueue->doorbell_signal, batchWriteIndex - 1);
+
+    DBOUTL(DB_AQL, *this << " flushed dispatch batch of " << batchHeaders.size() << " packets (hwq=" << batchHwQueue << ")");
+
+    batchHeaders.clear();
+    batchPendingCount.store(0, std::memory_order_release);
+}
+
+void HSAQueue::beginDispatchBatch()
+{
+    std::lock_guard<std::recursive_mutex> l(qmutex);
+    ++batchDepth;
+}
+
+void HSAQueue::endDispatchBatch()
+{
+    std::lock_guard<std::recursive_mutex> l(qmutex);
+    if (batchDepth > 0 && --batchDepth == 0) {
+        flushDispatchBatch();
+    }
+}
+
+void HSAQueue::flush()
+{
+    std::lock_guard<std::recursive_mutex> l(qmutex);
+    flushDispatchBatch();
+}
+
+void HSAQueue::beginCapture()
+{
+    std::lock_guard<std::recursive_mutex> l(qmutex);
+    if (captureGraph) {
+        throw Kalmar::runtime_exception("accelerator_view is already capturing a command_graph", 0);
+    }
+    captureGraph = std::make_shared<HSAGraph>(getHSADev());
+}
+
+std::shared_ptr<KalmarGraph> HSAQueue::endCapture()
+{
+    std::lock_guard<std::recursive_mutex> l(qmutex);
+    if (!captureGraph) {
+        throw Kalmar::runtime_exception("accelerator_view is not capturing a command_graph", 0);
+    }
+    DBOUTL(DB_CMD, *this << " captured command_graph of " << captureGraph->size() << " commands");
+    return std::move(captureGraph);
+}
+
+// Submit the commands of a graph in one dispatch batch.  Kernels are written straight
+// from the recorded packet and kernargs, skipping kernel lookup and argument
+// serialization, and only the first command looks at what is already in the queue.
+std::shared_ptr<KalmarAsyncOp> HSAQueue::replayGraph(const std::shared_ptr<KalmarGraph>& kGraph)
+{
+    const HSAGraph *graph = static_cast<const HSAGraph*> (kGraph.get());
+    Kalmar::HSADevice *device = getHSADev();
+    if (graph->getDevice() != device) {
+        throw Kalmar::runtime_exception("command_graph replayed on another accelerator than it was captured on", 0);
+    }
+
+    std::lock_guard<std::recursive_mutex> l(qmutex);
+    if (captureGraph) {
+        throw Kalmar::runtime_exception("command_graph replayed while capturing", 0);
+    }
+
+    std::shared_ptr<KalmarAsyncOp> prev;
+
+    beginDispatchBatch();
+    try {
+        for (size_t i = 0; i < graph->size(); i++) {
+            const HSAGraph::Node &node = graph->getNode(i);
+
+            std::shared_ptr<KalmarAsyncOp> depOp;
+            if (!isComputeQueueCommand(node.kind)) {
+                // copies find their dependency themselves
+            } else if (i == 0) {
+                depOp = detectStreamDeps(node.kind, nullptr);
+            } else if (node.dependsOnPrevious) {
+                depOp = prev;
+            }
+
+            if (node.kind == hcCommandKernel) {
+                const HSAGraph::KernelNode &k = graph->getKernel(node);
+
+                std::shared_ptr<HSADispatch> dispatch = makeOp<HSADispatch>(device, this, k.kernel, &k.aql);
+                if (k.name) {
+                    dispatch->setKernelName(k.name);
+                }
+                if (HCC_OPT_FLUSH) {
+                    dispatch->overrideAcquireFenceIfNeeded();
+                }
+                if (depOp) {
+                    addStreamDependency(dispatch.get(), depOp);
+                }
+                pushAsyncOp(dispatch);
+
+                hsa_status_t status = dispatch->dispatchKernelAsync(k.args.data(), k.args.size(), true);
+                STATUS_CHECK(status, __LINE__);
+
+                // a view dropped while the kernel is in flight is released after it
+                for (void *buffer : k.buffers) {
+                    recordBufferUse(buffer, dispatch);
+                }
+
+                prev = dispatch;
+            } else if (node.kind == hcCommandMarker) {
+                prev = EnqueueMarkerWithDependency(depOp ? 1 : 0, &depOp, node.scope);
+            } else {
+                const HSAGraph::CopyNode &c = graph->getCopy(node);
+                hc::AmPointerInfo srcInfo = c.srcInfo;
+                hc::AmPointerInfo dstInfo = c.dstInfo;
+                if (!HSAGraph::refreshPointerInfo(&srcInfo, c.src) || !HSAGraph::refreshPointerInfo(&dstInfo, c.dst)) {
+                    throw Kalmar::runtime_exception("command_graph replayed after memory used by a copy in it was freed", 0);
+                }
+                prev = EnqueueAsyncCopyExt(c.src, c.dst, c.sizeBytes, node.kind, srcInfo, dstInfo, c.copyDevice);
+            }
+        }
+    } catch (...) {
+        endDispatchBatch();
+        throw;
+    }
+    endDispatchBatch();
+
+    return prev ? prev : capturedOpPlaceholder();
+}
+
 inline void*
 HSAQueue::getHSAAgent() override {
     return static_cast<void*>(&(static_cast<HSADevice*>(getDev())->getAgent()));
@@ -4136,7 +5565,7 @@ void HSAQueue::copy_ext(const void *src, void *dst, size_t size_bytes, hc::hcCom
               const Kalmar::KalmarDevice *copyDevice, bool forceUnpinnedCopy) override {
     // wait for all previous async commands in this queue to finish
     // TODO - can remove this synchronization, copy is tail-synchronous not required on front end.
-    this->wait();
+    this->wait(getDefaultWaitMode());
 
 
     const Kalmar::HSADevice *copyDeviceHsa = static_cast<const Kalmar::HSADevice*> (copyDevice);
@@ -4171,7 +5600,7 @@ void HSAQueue::copy_ext(const void *src, void *dst, size_t size_bytes, hc::hcCom
 }
 
 void HSAQueue::copy2d_ext(const void *src, void *dst, size_t width, size_t height, size_t srcPitch, size_t dstPitch, hc::hcCommandKind copyDir, const hc::AmPointerInfo &srcPtrInfo, const hc::AmPointerInfo &dstPtrInfo, const Kalmar::KalmarDevice *copyDevice, bool forceUnpinnedCopy) { 
-    this->wait();
+    this->wait(getDefaultWaitMode());
 
 
     const Kalmar::HSADevice *copyDeviceHsa = static_cast<const Kalmar::HSADevice*> (copyDevice);
@@ -4191,9 +5620,17 @@ std::shared_ptr<KalmarAsyncOp> HSAQueue::EnqueueAsyncCopyExt(const void* src, vo
 
     hsa_status_t status = HSA_STATUS_SUCCESS;
 
-    // create shared_ptr instance
     const Kalmar::HSADevice *copyDeviceHsa = static_cast<const Kalmar::HSADevice*> (copyDevice);
-    std::shared_ptr<HSACopy> copyCommand = std::make_shared<HSACopy>(this, src, dst, size_bytes);
+
+    if (HSAGraph *graph = capturingGraph()) {
+        // the copy direction is worked out from the pointer info, like HSACopy does
+        graph->appendCopy(resolveMemcpyDirection(srcPtrInfo._isInDeviceMem, dstPtrInfo._isInDeviceMem),
+                          src, dst, size_bytes, srcPtrInfo, dstPtrInfo, copyDeviceHsa);
+        return capturedOpPlaceholder();
+    }
+
+    // create shared_ptr instance
+    std::shared_ptr<HSACopy> copyCommand = makeOp<HSACopy>(this, src, dst, size_bytes);
 
     // euqueue the async copy command
     status = copyCommand.get()->enqueueAsyncCopyCommand(copyDeviceHsa, srcPtrInfo, dstPtrInfo);
@@ -4205,6 +5642,41 @@ std::shared_ptr<KalmarAsyncOp> HSAQueue::EnqueueAsyncCopyExt(const void* src, vo
     return copyCommand;
 };
 
+bool HSAQueue::writeAsync(void* device, const void* src, size_t count, size_t offset) {
+    HSADevice* hsaDevice = static_cast<HSADevice*>(getDev());
+    std::shared_ptr<MemoryCache<HSAMemoryPoolTraits>> staging = hsaDevice->getStagingCache();
+
+    // Uploads on an any-order queue are not ordered before the kernel, and
+    // nothing recorded into a graph may run now.
+    if (!staging || (count > (size_t(HCC_ASYNC_UPLOAD_LIMIT) << 20)) ||
+        (get_execute_order() != execute_in_order) || capturingGraph()) {
+        return false;
+    }
+
+    void* buffer = staging->allocate(count);
+    if (buffer == nullptr) {
+        return false;
+    }
+    std::shared_ptr<void> stagingBuffer(buffer, [staging] (void* ptr) { staging->release(ptr); });
+    memcpy(buffer, src, count);
+
+    // The copy waits for the youngest command of this queue, so unlike a
+    // blocking write there is no need to wait for the kernels writing device.
+    DBOUT(DB_COPY, "writeAsync(" << device << "," << src << "," << count << "," << offset
+                   << "): staged in " << buffer << "\n");
+
+    hc::accelerator acc;
+    hc::AmPointerInfo srcPtrInfo(buffer, buffer, buffer, count, acc, false, false);
+    hc::AmPointerInfo dstPtrInfo(nullptr, device, device, count, acc, true, false);
+    std::shared_ptr<KalmarAsyncOp> op = EnqueueAsyncCopyExt(buffer, static_cast<char*>(device) + offset, count,
+                                                            hcMemcpyHostToDevice, srcPtrInfo, dstPtrInfo, hsaDevice);
+    std::static_pointer_cast<HSACopy>(op)->adoptStagingBuffer(std::move(stagingBuffer));
+
+    std::lock_guard<std::recursive_mutex> lg(qmutex);
+    recordBufferUse(device, op);
+    return true;
+}
+
 std::shared_ptr<KalmarAsyncOp> HSAQueue::EnqueueAsyncCopy2dExt(const void* src, void* dst, size_t width, size_t height, size_t srcPitch, size_t dstPitch,
                                                    hcCommandKind copyDir, const hc::AmPointerInfo &srcPtrInfo, const hc::AmPointerInfo &dstPtrInfo,
                                                    const Kalmar::KalmarDevice *copyDevice) override {
@@ -4212,9 +5684,13 @@ std::shared_ptr<KalmarAsyncOp> HSAQueue::EnqueueAsyncCopy2dExt(const void* src,
 
     hsa_status_t status = HSA_STATUS_SUCCESS;
 
+    if (capturingGraph()) {
+        throw Kalmar::runtime_exception("2D copies can't be recorded into a command_graph", 0);
+    }
+
     //create shared_ptr instance
     const Kalmar::HSADevice *copy2dDeviceHsa = static_cast<const Kalmar::HSADevice*> (copyDevice);
-    std::shared_ptr<HSACopy> copy2dCommand = std::make_shared<HSACopy>(this, src, dst, width*height);
+    std::shared_ptr<HSACopy> copy2dCommand = makeOp<HSACopy>(this, src, dst, width*height);
 
     //euqueue the async copy command
     status = copy2dCommand.get()->enqueueAsyncCopy2dCommand(width, height, srcPitch, dstPitch, copy2dDeviceHsa, srcPtrInfo, dstPtrInfo);
@@ -4228,12 +5704,6 @@ std::shared_ptr<KalmarAsyncOp> HSAQueue::EnqueueAsyncCopy2dExt(const void* src,
 
 // enqueue an async copy command
 std::shared_ptr<KalmarAsyncOp> HSAQueue::EnqueueAsyncCopy(const void *src, void *dst, size_t size_bytes) override {
-    hsa_status_t status = HSA_STATUS_SUCCESS;
-
-    // create shared_ptr instance
-    std::shared_ptr<HSACopy> copyCommand = std::make_shared<HSACopy>(this, src, dst, size_bytes);
-
-
     hc::accelerator acc;
     hc::AmPointerInfo srcPtrInfo(NULL, NULL, NULL, 0, acc, 0, 0);
     hc::AmPointerInfo dstPtrInfo(NULL, NULL, NULL, 0, acc, 0, 0);
@@ -4266,14 +5736,9 @@ std::shared_ptr<KalmarAsyncOp> HSAQueue::EnqueueAsyncCopy(const void *src, void
         copyDevice = nullptr; // H2H
     }
 
-    // enqueue the async copy command
-    status = copyCommand.get()->enqueueAsyncCopyCommand(copyDevice, srcPtrInfo, dstPtrInfo);
-    STATUS_CHECK(status, __LINE__);
-
-    // associate the async copy command with this queue
-    pushAsyncOp(copyCommand);
-
-    return copyCommand;
+    return EnqueueAsyncCopyExt(src, dst, size_bytes,
+                               resolveMemcpyDirection(srcPtrInfo._isInDeviceMem, dstPtrInfo._isInDeviceMem),
+                               srcPtrInfo, dstPtrInfo, copyDevice);
 }
 
 
@@ -4298,9 +5763,17 @@ HSAQueue::dispatch_hsa_kernel(const hsa_kernel_dispatch_packet_t *aql,
     }
 
 
+    if (HSAGraph *graph = capturingGraph()) {
+        graph->appendKernel(nullptr, kernelName, *aql, args, argSize);
+        if (cf) {
+            *cf = hc::completion_future(capturedOpPlaceholder());
+        }
+        return;
+    }
+
     Kalmar::HSADevice* device = static_cast<Kalmar::HSADevice*>(this->getDev());
 
-    std::shared_ptr<HSADispatch> sp_dispatch = std::make_shared<HSADispatch>(device, this/*queue*/, nullptr, aql);
+    std::shared_ptr<HSADispatch> sp_dispatch = makeOp<HSADispatch>(device, this/*queue*/, nullptr, aql);
     if (HCC_OPT_FLUSH) {
         sp_dispatch->overrideAcquireFenceIfNeeded();
     }
@@ -4334,16 +5807,18 @@ HSAQueue::dispatch_hsa_kernel(const hsa_kernel_dispatch_packet_t *aql,
 // member function implementation of HSADispatch
 // ----------------------------------------------------------------------
 
-HSADispatch::HSADispatch(Kalmar::HSADevice* _device, Kalmar::KalmarQueue *queue, HSAKernel* _kernel,
+HSADispatch::HSADispatch(Kalmar::HSADevice* _device, Kalmar::KalmarQueue *queue, const HSAKernel* _kernel,
                          const hsa_kernel_dispatch_packet_t *aql) :
     HSAOp(hc::HSA_OP_ID_DISPATCH, queue, Kalmar::hcCommandKernel),
     device(_device),
     kernel_name(nullptr),
     kernel(_kernel),
     isDispatched(false),
-    waitMode(HSA_WAIT_STATE_BLOCKED),
-    future(nullptr),
-    kernargMemory(nullptr)
+    argData(argInline),
+    argSize(0),
+    argCapacity(KERNARG_BUFFER_SIZE),
+    kernargMemory(nullptr),
+    kernargSlot(nullptr)
 {
     if (aql) {
         this->aql = *aql;
@@ -4351,6 +5826,31 @@ HSADispatch::HSADispatch(Kalmar::HSADevice* _device, Kalmar::KalmarQueue *queue,
     clearArgs();
 }
 
+hsa_status_t
+HSADispatch::pushArgBytes(const void *val, size_t size, size_t align) {
+    /* add padding if necessary */
+    size_t padding_size = (argSize % align) ? (align - (argSize % align)) : 0;
+    DBOUT(DB_KERNARG, "push " << (size + padding_size) << " bytes into kernarg: ");
+
+    reserveArgs(argSize + padding_size + size);
+    memset(argData + argSize, 0, padding_size);
+    for (size_t i = 0; i < padding_size; ++i) {
+        DBOUT(DB_KERNARG, std::hex << std::setw(2) << std::setfill('0') << 0x00 << " ");
+    }
+    argSize += padding_size;
+
+    const uint8_t* ptr = static_cast<const uint8_t*>(val);
+    memcpy(argData + argSize, ptr, size);
+    for (size_t i = 0; i < size; ++i) {
+        DBOUT(DB_KERNARG, std::hex << std::setw(2) << std::setfill('0') << +ptr[i] << " ");
+    }
+    argSize += size;
+    DBOUT(DB_KERNARG, std::endl);
+
+    arg_count++;
+    return HSA_STATUS_SUCCESS;
+}
+
 
 
 
@@ -4487,10 +5987,17 @@ HSADispatch::dispatchKernel(hsa_queue_t* lockedHsaQueue, const void *hostKernarg
     //printf("hostKernargSize size: %d in bytesn", hostKernargSize);
 
     if (hostKernargSize > 0) {
-        hsa_amd_memory_pool_t kernarg_region = device->getHSAKernargRegion();
-        std::pair<void*, int> ret = device->getKernargBuffer(hostKernargSize);
-        kernargMemory = ret.first;
-        kernargMemoryIndex = ret.second;
+        // caller holds the queue lock, so we are the only producer on the kernarg ring
+        KernargRing *ring = hsaQueue()->getKernargRing();
+        kernargMemory = ring ? ring->allocate(hostKernargSize, &kernargSlot) : nullptr;
+        if (kernargMemory == nullptr) {
+            if (ring) {
+                ring->recordFallback(hostKernargSize);
+            }
+            std::pair<void*, int> ret = device->getKernargBuffer(hostKernargSize);
+            kernargMemory = ret.first;
+            kernargMemoryIndex = ret.second;
+        }
         //std::cerr << "op #" << getSeqNum() << " allocated kernarg cursor=" << kernargMemoryIndex << "\n";
 
         // as kernarg buffers are fine-grained, we can directly use memcpy
@@ -4504,12 +6011,7 @@ HSADispatch::dispatchKernel(hsa_queue_t* lockedHsaQueue, const void *hostKernarg
 
     // write packet
     uint32_t queueMask = lockedHsaQueue->size - 1;
-    // TODO: Need to check if package write is correct.
-    uint64_t index = hsa_queue_load_write_index_relaxed(lockedHsaQueue);
-    uint64_t nextIndex = index + 1;
-    if (nextIndex - hsa_queue_load_read_index_scacquire(lockedHsaQueue) >= lockedHsaQueue->size) {
-      checkHCCRuntimeStatus(Kalmar::HCCRuntimeStatus::HCCRT_STATUS_ERROR_COMMAND_QUEUE_OVERFLOW, __LINE__, lockedHsaQueue);
-    }
+    uint64_t index = hsaQueue()->reservePacketSlot(lockedHsaQueue);
 
 
     hsa_kernel_dispatch_packet_t* q_aql =
@@ -4532,10 +6034,9 @@ HSADispatch::dispatchKernel(hsa_queue_t* lockedHsaQueue, const void *hostKernarg
         _signalIndex = -1;
     }
 
-    // Lastly copy in the header:
-    q_aql->header = header;
+    // Lastly copy in the header and ring the doorbell (deferred if a dispatch batch is open)
+    hsaQueue()->publishPacket(lockedHsaQueue, &q_aql->header, header, index);
 
-    hsa_queue_store_write_index_relaxed(lockedHsaQueue, index + 1);
     DBOUTL(DB_AQL, " dispatch_aql " << *this << "(hwq=" << lockedHsaQueue << ") kernargs=" << hostKernargSize << " " << *q_aql );
     DBOUTL(DB_AQL2, rawAql(*q_aql));
 
@@ -4543,10 +6044,6 @@ HSADispatch::dispatchKernel(hsa_queue_t* lockedHsaQueue, const void *hostKernarg
         printKernarg(q_aql->kernarg_address, hostKernargSize);
     }
 
-
-    // Ring door bell
-    hsa_signal_store_relaxed(lockedHsaQueue->doorbell_signal, index);
-
     isDispatched = true;
 
     return status;
@@ -4556,7 +6053,7 @@ HSADispatch::dispatchKernel(hsa_queue_t* lockedHsaQueue, const void *hostKernarg
 
 // wait for the kernel to finish execution
 inline hsa_status_t
-HSADispatch::waitComplete() {
+HSADispatch::waitComplete(Kalmar::hcWaitMode mode) {
     hsa_status_t status = HSA_STATUS_SUCCESS;
     if (!isDispatched)  {
         return HSA_STATUS_ERROR_INVALID_ARGUMENT;
@@ -4564,11 +6061,16 @@ HSADispatch::waitComplete() {
 
 
 
+    if (this->hsaQueue() != nullptr) {
+        this->hsaQueue()->flushPendingPackets();
+    }
+
     if (_signal.handle) {
-        DBOUT(DB_MISC, "wait for kernel dispatch op#" << *this  << " completion with wait flag: " << waitMode << "  signal="<< std::hex  << _signal.handle << std::dec << "\n");
+        DBOUT(DB_MISC, "wait for kernel dispatch op#" << *this  << " completion with wait mode: " << mode << "  signal="<< std::hex  << _signal.handle << std::dec << "\n");
 
-        // wait for completion
-        if (hsa_signal_wait_scacquire(_signal, HSA_SIGNAL_CONDITION_LT, 1, uint64_t(-1), waitMode)!=0) {
+        // wait for completion; the signal only drops below 0 if the dispatch failed
+        waitSignal(mode);
+        if (hsa_signal_load_scacquire(_signal) != 0) {
             throw Kalmar::runtime_exception("Signal wait returned unexpected value\n", 0);
         }
 
@@ -4611,14 +6113,14 @@ HSADispatch::dispatchKernelWaitComplete() {
         hsa_queue_t* rocrQueue = hsaQueue()->acquireLockedRocrQueue();
 
         // dispatch kernel
-        status = dispatchKernel(rocrQueue, arg_vec.data(), arg_vec.size(), true);
+        status = dispatchKernel(rocrQueue, argData, argSize, true);
         STATUS_CHECK(status, __LINE__);
 
         hsaQueue()->releaseLockedRocrQueue();
     }
 
     // wait for completion
-    status = waitComplete();
+    status = waitComplete(_waitMode);
     STATUS_CHECK(status, __LINE__);
 
     return status;
@@ -4630,7 +6132,7 @@ HSADispatch::dispatchKernelWaitComplete() {
 inline hsa_status_t
 HSADispatch::dispatchKernelAsyncFromOp()
 {
-    return dispatchKernelAsync(arg_vec.data(), arg_vec.size(), true);
+    return dispatchKernelAsync(argData, argSize, true);
 }
 
 inline hsa_status_t
@@ -4662,13 +6164,10 @@ HSADispatch::dispatchKernelAsync(const void *hostKernarg, int hostKernargSize, b
     }
 
 
-    // dynamically allocate a std::shared_future<void> object
-    future = new std::shared_future<void>(std::async(std::launch::deferred, [&] {
-        waitComplete();
-    }).share());
+    setWaitable();
 
     if (HCC_SERIALIZE_KERNEL & 0x2) {
-        status = waitComplete();
+        status = waitComplete(_waitMode);
         STATUS_CHECK(status, __LINE__);
     };
 
@@ -4681,12 +6180,16 @@ HSADispatch::dispose() {
     hsa_status_t status;
     if (kernargMemory != nullptr) {
       //std::cerr << "op#" << getSeqNum() << " releasing kernal arg buffer index=" << kernargMemoryIndex<< "\n";
-      device->releaseKernargBuffer(kernargMemory, kernargMemoryIndex);
+      if (kernargSlot) {
+          KernargRing::release(kernargSlot);
+          kernargSlot = nullptr;
+      } else {
+          device->releaseKernargBuffer(kernargMemory, kernargMemoryIndex);
+      }
       kernargMemory = nullptr;
     }
 
     clearArgs();
-    std::vector<uint8_t>().swap(arg_vec);
 
     if (HCC_PROFILE & HCC_PROFILE_TRACE) {
         uint64_t start = getBeginTimestamp();
@@ -4697,11 +6200,6 @@ HSADispatch::dispose() {
     }
     _activity_prof.callback(getCommandKind(), getBeginTimestamp(), getEndTimestamp());
     Kalmar::ctx.releaseSignal(_signal, _signalIndex);
-
-    if (future != nullptr) {
-      delete future;
-      future = nullptr;
-    }
 }
 
 inline uint64_t
@@ -4881,16 +6379,20 @@ HSADispatch::setLaunchConfiguration(const int dims, size_t *globalDims, size_t *
 
 // wait for the barrier to complete
 inline hsa_status_t
-HSABarrier::waitComplete() {
+HSABarrier::waitComplete(Kalmar::hcWaitMode mode) {
     hsa_status_t status = HSA_STATUS_SUCCESS;
     if (!isDispatched)  {
         return HSA_STATUS_ERROR_INVALID_ARGUMENT;
     }
 
-    DBOUT(DB_WAIT,  "  wait for barrier " << *this << " completion with wait flag: " << waitMode << "  signal="<< std::hex  << _signal.handle << std::dec <<"...\n");
+    if (this->hsaQueue() != nullptr) {
+        this->hsaQueue()->flushPendingPackets();
+    }
+
+    DBOUT(DB_WAIT,  "  wait for barrier " << *this << " completion with wait mode: " << mode << "  signal="<< std::hex  << _signal.handle << std::dec <<"...\n");
 
     // Wait on completion signal until the barrier is finished
-    hsa_signal_wait_scacquire(_signal, HSA_SIGNAL_CONDITION_EQ, 0, UINT64_MAX, waitMode);
+    waitSignal(mode);
 
 
     // unregister this async operation from HSAQueue
@@ -4971,12 +6473,8 @@ HSABarrier::enqueueAsync(hc::memory_scope fenceScope) {
         hsa_queue_t* rocrQueue = hsaQueue()->acquireLockedRocrQueue();
 
         // Obtain the write index for the command queue
-        uint64_t index = hsa_queue_load_write_index_relaxed(rocrQueue);
+        uint64_t index = hsaQueue()->reservePacketSlot(rocrQueue);
         const uint32_t queueMask = rocrQueue->size - 1;
-        uint64_t nextIndex = index + 1;
-        if (nextIndex - hsa_queue_load_read_index_scacquire(rocrQueue) >= rocrQueue->size) {
-          checkHCCRuntimeStatus(Kalmar::HCCRuntimeStatus::HCCRT_STATUS_ERROR_COMMAND_QUEUE_OVERFLOW, __LINE__, rocrQueue);
-        }
 
         // Define the barrier packet to be at the calculated queue index address
         hsa_barrier_and_packet_t* barrier = &(((hsa_barrier_and_packet_t*)(rocrQueue->base_address))[index&queueMask]);
@@ -4992,17 +6490,12 @@ HSABarrier::enqueueAsync(hc::memory_scope fenceScope) {
 
         barrier->completion_signal = _signal;
 
-        // Set header last:
-        barrier->header = header;
+        // Set header last, increment write index and ring doorbell
+        hsaQueue()->publishPacket(rocrQueue, &barrier->header, header, index);
 
         DBOUTL(DB_AQL, " barrier_aql " << *this << " "<< *barrier );
         DBOUTL(DB_AQL2, rawAql(*barrier));
 
-
-        // Increment write index and ring doorbell to dispatch the kernel
-        hsa_queue_store_write_index_relaxed(rocrQueue, nextIndex);
-        hsa_signal_store_relaxed(rocrQueue->doorbell_signal, index);
-
         hsaQueue()->releaseLockedRocrQueue();
     }
 
@@ -5012,10 +6505,7 @@ HSABarrier::enqueueAsync(hc::memory_scope fenceScope) {
     _barrierNextKernelNeedsSysAcquire = hsaQueue()->nextKernelNeedsSysAcquire();
     _barrierNextSyncNeedsSysRelease   = hsaQueue()->nextSyncNeedsSysRelease();
 
-    // dynamically allocate a std::shared_future<void> object
-    future = new std::shared_future<void>(std::async(std::launch::deferred, [&] {
-        waitComplete();
-    }).share());
+    setWaitable();
 
 
     return HSA_STATUS_SUCCESS;
@@ -5060,11 +6550,6 @@ HSABarrier::dispose() {
     for (int i=0; i<depCount; i++) {
         depAsyncOps[i] = nullptr;
     }
-
-    if (future != nullptr) {
-      delete future;
-      future = nullptr;
-    }
 }
 
 inline uint64_t
@@ -5092,7 +6577,9 @@ HSAOpCoord::HSAOpCoord(Kalmar::HSAQueue *queue) :
 HSAOp::HSAOp(hc::HSAOpId id, Kalmar::KalmarQueue *queue, hc::hcCommandKind commandKind) :
     KalmarAsyncOp(queue, commandKind),
     _opCoord(static_cast<Kalmar::HSAQueue*> (queue)),
-    _asyncOpsIndex(-1),
+    _asyncOpsIndex(uint64_t(-1)),
+    _waitable(false),
+    _waitMode(queue->getDefaultWaitMode()),
 
     _signalIndex(-1),
     _agent(static_cast<Kalmar::HSADevice*>(hsaQueue()->getDev())->getAgent()),
@@ -5110,7 +6597,156 @@ Kalmar::HSAQueue *HSAOp::hsaQueue() const
     return static_cast<Kalmar::HSAQueue *> (this->getQueue()); 
 };
 
+void HSAOp::wait(Kalmar::hcWaitMode mode)
+{
+    if (_waitable) {
+        std::call_once(_waitOnce, [this, mode]() { waitComplete(mode); });
+    }
+}
+
+// Completion signal of an op, as Kalmar::waitSignal expects it.
+struct HSACompletionSignal {
+    hsa_signal_t signal;
+
+    bool done() { return hsa_signal_load_scacquire(signal) < 1; }
+
+    bool wait(bool active, uint64_t timeoutNs) {
+        // HSA timeouts are in system ticks
+        static const double ticksPerNs = Kalmar::ctx.getSystemTickFrequency() / 1e9;
+        uint64_t timeout = UINT64_MAX;
+        if (timeoutNs != Kalmar::WAIT_FOREVER) {
+            timeout = uint64_t(std::min(timeoutNs * ticksPerNs, double(UINT64_MAX - 1)));
+        }
+        return hsa_signal_wait_scacquire(signal, HSA_SIGNAL_CONDITION_LT, 1, timeout,
+                                         active ? HSA_WAIT_STATE_ACTIVE : HSA_WAIT_STATE_BLOCKED) < 1;
+    }
+};
+
+bool HSAOp::waitSignal(Kalmar::hcWaitMode mode, uint64_t timeoutNs)
+{
+    Kalmar::WaitStrategy strategy = Kalmar::WaitStrategy::Block;
+    switch (mode) {
+        case Kalmar::hcWaitModeBlocked:
+            strategy = Kalmar::WaitStrategy::Block;
+            break;
+        case Kalmar::hcWaitModeActive:
+            strategy = Kalmar::WaitStrategy::Spin;
+            break;
+        case Kalmar::hcWaitModeAdaptive:
+            strategy = Kalmar::WaitStrategy::SpinThenBlock;
+            break;
+    }
+
+    // ops left without a queue share one history
+    static Kalmar::AdaptiveSpin orphanSpin(uint64_t(HCC_WAIT_SPIN_MAX) * 1000);
+    Kalmar::AdaptiveSpin* spin = hsaQueue() ? &hsaQueue()->waitSpin(getCommandKind()) : &orphanSpin;
+
+    HSACompletionSignal signal = { _signal };
+    return Kalmar::waitSignal(signal, strategy, spin, timeoutNs);
+}
+
+bool HSAOp::waitFor(std::chrono::nanoseconds timeout)
+{
+    // nothing to wait for on the signal, so wait() does not block either
+    if (!_waitable || (_signal.handle == 0) || (timeout == std::chrono::nanoseconds::max())) {
+        wait();
+        return true;
+    }
+
+    if (hsaQueue()) {
+        // the signal would not fire while the packet is held back by a dispatch batch
+        hsaQueue()->flushPendingPackets();
+    }
+
+    if (!waitSignal(_waitMode, std::max<int64_t>(timeout.count(), 0))) {
+        DBOUT(DB_WAIT, "  wait for " << *this << " timed out after " << timeout.count() << "ns\n");
+        return false;
+    }
+
+    // unregisters the op; the signal has fired so this does not block
+    wait();
+    return true;
+}
+
+// Runs on the HSA runtime's signal handler thread, so it only hands the callback
+// over to the callback workers.  Returning false unregisters the handler.
+static bool HSAOpCallbackHandler(hsa_signal_value_t value, void* arg)
+{
+    std::function<void()>* callback = static_cast<std::function<void()>*> (arg);
+    Kalmar::CLAMP::EnqueueCallback(std::move(*callback));
+    delete callback;
+    return false;
+}
+
+void HSAOp::setCallback(std::function<void()> callback)
+{
+    if (hsaQueue()) {
+        // the signal would not fire while the packet is held back by a dispatch batch
+        hsaQueue()->flushPendingPackets();
+    }
+
+    // not submitted yet: fall back to a worker waiting on the op
+    if (!_waitable || (_signal.handle == 0)) {
+        KalmarAsyncOp::setCallback(std::move(callback));
+        return;
+    }
+
+    std::function<void()>* arg = new std::function<void()>(std::move(callback));
+    hsa_status_t status = hsa_amd_signal_async_handler(_signal, HSA_SIGNAL_CONDITION_EQ, 0,
+                                                       HSAOpCallbackHandler, arg);
+    if (status != HSA_STATUS_SUCCESS) {
+        DBOUT(DB_WAIT, "hsa_amd_signal_async_handler failed for " << *this << ", waiting on a callback worker\n");
+        KalmarAsyncOp::setCallback(std::move(*arg));
+        delete arg;
+    }
+}
+
+// Argument of HSAOpCompletionFdHandler.  Holds the op as well as the descriptor, so the op,
+// and with it the signal the handler is registered on, is not recycled before the handler ran.
+struct HSAOpCompletionFdArg {
+    std::shared_ptr<Kalmar::CompletionFd> fd;
+    std::shared_ptr<Kalmar::KalmarAsyncOp> op;
+};
+
+// Runs on the HSA runtime's signal handler thread; writing the eventfd does not block.
+// Dropping the last reference to the op would dispose of it on this thread, which must not
+// block, so that is left to the callback workers.
+static bool HSAOpCompletionFdHandler(hsa_signal_value_t value, void* arg)
+{
+    HSAOpCompletionFdArg* notify = static_cast<HSAOpCompletionFdArg*> (arg);
+    notify->fd->signal();
+    std::shared_ptr<Kalmar::KalmarAsyncOp> op = std::move(notify->op);
+    delete notify;
+    Kalmar::CLAMP::EnqueueCallback([op]() {});
+    return false;
+}
+
+void HSAOp::notifyOnCompletion(const std::shared_ptr<Kalmar::CompletionFd>& fd,
+                               const std::shared_ptr<Kalmar::KalmarAsyncOp>& self)
+{
+    if (hsaQueue()) {
+        // the signal would not fire while the packet is held back by a dispatch batch
+        hsaQueue()->flushPendingPackets();
+    }
+
+    if (_waitable && (_signal.handle != 0)) {
+        HSAOpCompletionFdArg* arg = new HSAOpCompletionFdArg{ fd, self };
+        hsa_status_t status = hsa_amd_signal_async_handler(_signal, HSA_SIGNAL_CONDITION_EQ, 0,
+                                                           HSAOpCompletionFdHandler, arg);
+        if (status == HSA_STATUS_SUCCESS) {
+            return;
+        }
+        DBOUT(DB_WAIT, "hsa_amd_signal_async_handler failed for " << *this << ", signalling completion fd from a callback worker\n");
+        delete arg;
+    }
+    KalmarAsyncOp::notifyOnCompletion(fd, self);
+}
+
 bool HSAOp::isReady() override {
+    if (hsaQueue()) {
+        hsaQueue()->flushPendingPackets();
+    }
+
     bool ready = (hsa_signal_load_scacquire(_signal) == 0);
     if (ready && hsaQueue()) {
         hsaQueue()->removeAsyncOp(this);
@@ -5120,16 +6756,61 @@ bool HSAOp::isReady() override {
 }
 
 
+// Enqueue a barrier packet which holds back later packets until depSignal reaches 0.
+// See HSAQueue::waitForStreamDeps.
+void
+Kalmar::HSAQueue::enqueueDependencyPacket(hsa_signal_t depSignal, hc::memory_scope fenceScope)
+{
+    hsa_fence_scope_t scope = HSA_FENCE_SCOPE_NONE;
+    switch (fenceScope) {
+        case hc::no_scope:
+            scope = HSA_FENCE_SCOPE_NONE;
+            break;
+        case hc::accelerator_scope:
+            scope = HSA_FENCE_SCOPE_AGENT;
+            break;
+        case hc::system_scope:
+            scope = HSA_FENCE_SCOPE_SYSTEM;
+            setNextSyncNeedsSysRelease(false);
+            break;
+        default:
+            STATUS_CHECK(HSA_STATUS_ERROR_INVALID_ARGUMENT, __LINE__);
+    }
+
+    uint16_t header = HSA_PACKET_TYPE_BARRIER_AND << HSA_PACKET_HEADER_TYPE;
+#ifndef AMD_HSA
+    header |= (1 << HSA_PACKET_HEADER_BARRIER);
+#endif
+    header |= (scope << HSA_PACKET_HEADER_ACQUIRE_FENCE_SCOPE);
+    header |= (scope << HSA_PACKET_HEADER_RELEASE_FENCE_SCOPE);
+
+    hsa_queue_t* rocrQueue = acquireLockedRocrQueue();
+
+    uint64_t index = reservePacketSlot(rocrQueue);
+    const uint32_t queueMask = rocrQueue->size - 1;
+
+    hsa_barrier_and_packet_t* barrier = &(((hsa_barrier_and_packet_t*)(rocrQueue->base_address))[index&queueMask]);
+    memset(barrier, 0, sizeof(hsa_barrier_and_packet_t));
+    barrier->dep_signal[0] = depSignal;
+
+    publishPacket(rocrQueue, &barrier->header, header, index);
+
+    DBOUTL(DB_AQL, " dependency barrier_aql on signal " << std::hex << depSignal.handle << std::dec << " " << *barrier);
+    DBOUTL(DB_AQL2, rawAql(*barrier));
+
+    releaseLockedRocrQueue();
+}
+
+
 // ----------------------------------------------------------------------
 // member function implementation of HSACopy
 // ----------------------------------------------------------------------
 //
 // Copy mode will be set later on.
-// HSA signals would be waited in HSA_WAIT_STATE_ACTIVE by default for HSACopy instances
 HSACopy::HSACopy(Kalmar::KalmarQueue *queue, const void* src_, void* dst_, size_t sizeBytes_) : HSAOp(hc::HSA_OP_ID_COPY, queue, Kalmar::hcCommandInvalid),
-    isSubmitted(false), isAsync(false), isSingleStepCopy(false), isPeerToPeer(false), future(nullptr), depAsyncOp(nullptr), copyDevice(nullptr), waitMode(HSA_WAIT_STATE_ACTIVE),
+    isSubmitted(false), isAsync(false), isSingleStepCopy(false), isPeerToPeer(false), depAsyncOp(nullptr), copyDevice(nullptr),
     src(src_), dst(dst_),
-    sizeBytes(sizeBytes_)
+    sizeBytes(sizeBytes_), stagingBuffer()
 {
 
 
@@ -5138,7 +6819,7 @@ HSACopy::HSACopy(Kalmar::KalmarQueue *queue, const void* src_, void* dst_, size_
 
 // wait for the async copy to complete
 inline hsa_status_t
-HSACopy::waitComplete() {
+HSACopy::waitComplete(Kalmar::hcWaitMode mode) {
     hsa_status_t status = HSA_STATUS_SUCCESS;
     if (!isSubmitted)  {
         return HSA_STATUS_ERROR_INVALID_ARGUMENT;
@@ -5146,17 +6827,22 @@ HSACopy::waitComplete() {
 
 
 
+    // the copy may depend on kernels still held back by a dispatch batch
+    if (this->hsaQueue() != nullptr) {
+        this->hsaQueue()->flushPendingPackets();
+    }
+
     // Wait on completion signal until the async copy is finishedS
     if (DBFLAG(DB_WAIT)) {
         hsa_signal_value_t v = -1000;
         if (_signal.handle) {
             hsa_signal_load_scacquire(_signal);
         }
-        DBOUT(DB_WAIT, "  wait for copy op#" << getSeqNum() << " completion with wait flag: " << waitMode << "signal="<< std::hex  << _signal.handle << std::dec <<" currentVal=" << v << "...\n");
+        DBOUT(DB_WAIT, "  wait for copy op#" << getSeqNum() << " completion with wait mode: " << mode << "signal="<< std::hex  << _signal.handle << std::dec <<" currentVal=" << v << "...\n");
     }
 
     // Wait on completion signal until the async copy is finished
-    hsa_signal_wait_scacquire(_signal, HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, waitMode);
+    waitSignal(mode);
 
 
     // unregister this async operation from HSAQueue
@@ -5482,13 +7168,10 @@ HSACopy::enqueueAsyncCopyCommand(const Kalmar::HSADevice *copyDevice, const hc::
 
     STATUS_CHECK(status, __LINE__);
 
-    // dynamically allocate a std::shared_future<void> object
-    future = new std::shared_future<void>(std::async(std::launch::deferred, [&] {
-        waitComplete();
-    }).share());
+    setWaitable();
 
     if (HCC_SERIALIZE_COPY & 0x2) {
-        status = waitComplete();
+        status = waitComplete(_waitMode);
         STATUS_CHECK(status, __LINE__);
     };
 
@@ -5552,13 +7235,10 @@ HSACopy::enqueueAsyncCopy2dCommand(size_t width, size_t height, size_t srcPitch,
 
     STATUS_CHECK(status, __LINE__);
 
-    //dynamically allocate a std::shared_future<void> object
-    future = new std::shared_future<void>(std::async(std::launch::deferred, [&] {
-             waitComplete();
-             }).share());
+    setWaitable();
 
     if (HCC_SERIALIZE_COPY & 0x2) {
-        status = waitComplete();
+        status = waitComplete(_waitMode);
         STATUS_CHECK(status, __LINE__);
     };
 
@@ -5571,6 +7251,7 @@ HSACopy::dispose() {
     // clear reference counts for dependent ops.
     depAsyncOp = nullptr;
 
+    stagingBuffer.reset();
 
     // HSA signal may not necessarily be allocated by HSACopy instance
     // only release the signal if it was really allocated (signalIndex >= 0)
@@ -5594,11 +7275,6 @@ HSACopy::dispose() {
         }
         _activity_prof.callback(getCommandKind(), apiStartTick, Kalmar::ctx.getSystemTicks(), sizeBytes);
     }
-
-    if (future != nullptr) {
-        delete future;
-        future = nullptr;
-    }
 }
 
 inline uint64_t
@@ -5643,7 +7319,7 @@ HSACopy::syncCopyExt(hc::hcCommandKind copyDir, const hc::AmPointerInfo &srcPtrI
             if (!srcInTracker || forceUnpinnedCopy) {
                 DBOUT(DB_COPY,"HSACopy::syncCopyExt(), invoke UnpinnedCopyEngine::CopyHostToDevice()\n");
 
-                copyDevice->copy_engine[0]->CopyHostToDevice(copyDevice->copy_mode, dst, src, sizeBytes, depSignalCnt ? &depSignal : NULL);
+                copyDevice->getCopyEngine(0)->CopyHostToDevice(copyDevice->copy_mode, dst, src, sizeBytes, depSignalCnt ? &depSignal : NULL);
                 useFastCopy = false;
             }
             break;
@@ -5657,7 +7333,7 @@ HSACopy::syncCopyExt(hc::hcCommandKind copyDir, const hc::AmPointerInfo &srcPtrI
                     // override since D2H does not support Memcpy
                     d2hCopyMode = UnpinnedCopyEngine::ChooseBest;
                 }
-                copyDevice->copy_engine[1]->CopyDeviceToHost(d2hCopyMode, dst, src, sizeBytes, depSignalCnt ? &depSignal : NULL);
+                copyDevice->getCopyEngine(1)->CopyDeviceToHost(d2hCopyMode, dst, src, sizeBytes, depSignalCnt ? &depSignal : NULL);
                 useFastCopy = false;
             };
             break;
@@ -5681,7 +7357,7 @@ HSACopy::syncCopyExt(hc::hcCommandKind copyDir, const hc::AmPointerInfo &srcPtrI
                 isPeerToPeer = true;
 
                 // TODO, which staging buffer should we use for this to be optimal?
-                copyDevice->copy_engine[1]->CopyPeerToPeer(dst, dstAgent, src, srcAgent, sizeBytes, depSignalCnt ? &depSignal : NULL);
+                copyDevice->getCopyEngine(1)->CopyPeerToPeer(dst, dstAgent, src, srcAgent, sizeBytes, depSignalCnt ? &depSignal : NULL);
 
                 useFastCopy = false;
             }
@@ -5716,7 +7392,7 @@ HSACopy::syncCopyExt(hc::hcCommandKind copyDir, const hc::AmPointerInfo &srcPtrI
 
         if (hsa_status == HSA_STATUS_SUCCESS) {
             DBOUT(DB_COPY, "HSACopy::syncCopyExt(), wait for completion...");
-            hsa_signal_wait_relaxed(_signal, HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, waitMode);
+            waitSignal(_waitMode);
 
             DBOUT(DB_COPY,"done!\n");
         } else {
@@ -5753,7 +7429,7 @@ void HSACopy::syncCopy2DExt(hc::hcCommandKind copyDir,
     hsa_status_t hsa_status = hcc_memory_async_copy_rect(copyDir, copyDevice, dstPtrInfo, srcPtrInfo, width, height, srcPitch, dstPitch, depSignalCnt, depSignalCnt ? &depSignal:NULL, _signal);
     if (hsa_status == HSA_STATUS_SUCCESS) {
         DBOUT(DB_COPY, "HSACopy::syncCopy2DExt(), wait for completion...");
-        hsa_signal_wait_relaxed(_signal, HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, waitMode);
+        waitSignal(_waitMode);
         DBOUT(DB_COPY,"done!\n");
     } else {
         DBOUT(DB_COPY, "HSACopy::syncCopy2DExt(), hcc_amd_memory_async_copy_rect() returns: 0x" << std::hex << hsa_status << std::dec <<"\n");
@@ -5828,28 +7504,11 @@ extern "C" void *GetContextImpl() {
   return &Kalmar::ctx;
 }
 
-extern "C" void PushArgImpl(void *ker, int idx, size_t sz, const void *v) {
+extern "C" void PushArgImpl(void *ker, int idx, size_t sz, size_t align, const void *v) {
   //std::cerr << "pushing:" << ker << " of size " << sz << "\n";
   HSADispatch *dispatch =
       reinterpret_cast<HSADispatch*>(ker);
-  void *val = const_cast<void*>(v);
-  switch (sz) {
-    case sizeof(double):
-      dispatch->pushDoubleArg(*reinterpret_cast<double*>(val));
-      break;
-    case sizeof(short):
-      dispatch->pushShortArg(*reinterpret_cast<short*>(val));
-      break;
-    case sizeof(int):
-      dispatch->pushIntArg(*reinterpret_cast<int*>(val));
-      //std::cerr << "(int) value = " << *reinterpret_cast<int*>(val) <<"\n";
-      break;
-    case sizeof(unsigned char):
-      dispatch->pushBooleanArg(*reinterpret_cast<unsigned char*>(val));
-      break;
-    default:
-      assert(0 && "Unsupported kernel argument size");
-  }
+  dispatch->pushArgBytes(v, sz, align);
 }
 
 extern "C" void PushArgPtrImpl(void *ker, int idx, size_t sz, const void *v) {
@@ -5860,6 +7519,14 @@ extern "C" void PushArgPtrImpl(void *ker, int idx, size_t sz, const void *v) {
   dispatch->pushPointerArg(val);
 }
 
+extern "C" void PushArgsImpl(void *ker, const void *image, size_t sz) {
+  HSADispatch *dispatch =
+      reinterpret_cast<HSADispatch*>(ker);
+  // the image is laid out from the start of the kernarg segment, so keep it
+  // at the largest alignment of any argument in it; the segment is 16-byte aligned
+  dispatch->pushArgBytes(image, sz, 16);
+}
+
 
 // op printer
 std::ostream& operator<<(std::ostream& os, const HSAOp & op)
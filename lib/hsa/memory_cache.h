@@ -0,0 +1,379 @@
+//===----------------------------------------------------------------------===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+//-------------------------------------------------------------------------------------------------
+// Caching sub-allocator used by HSADevice::create and am_alloc for device memory.
+//
+// Memory is requested from the backing pool in big chunks and kept after it is freed:
+//  - blocks up to the chunk size are carved out of chunks with a binary buddy allocator.
+//    Block sizes are powers of two from 1 << MIN_BLOCK_ORDER up; a freed block is merged with
+//    its buddy when that is free too, so a chunk whose blocks are all freed is whole again.
+//  - bigger blocks get a pool allocation of their own, rounded up to one of four size
+//    classes per power of two, and are kept in per-class bins when freed.
+// Whole free chunks and binned blocks are "cached": they are handed out again without
+// visiting the pool, and returned to it by trim(), when the cache holds more than its
+// limit, or when the pool runs out of memory.
+//
+// PoolTraits abstracts the real HSA memory pool so the cache can be tested against a
+// host memory stand-in.  It must provide:
+//    typedef ... pool_type;
+//    static void *allocate(pool_type &, size_t);   // nullptr if out of memory
+//    static void free(pool_type &, void *);
+//
+// Pointers returned by the cache other than those of binned blocks point into a pool
+// allocation; allocationBase() returns the start of that allocation, which is what the
+// pool expects for operations applying to a whole allocation (e.g. access control).
+template <typename PoolTraits>
+class MemoryCache {
+public:
+    typedef typename PoolTraits::pool_type pool_type;
+
+    static const int MIN_BLOCK_ORDER = 8;     // 256 bytes
+    static const int DEFAULT_CHUNK_ORDER = 21; // 2 MB
+
+    struct Stats {
+        size_t   reservedBytes;     // bytes currently allocated from the pool
+        size_t   allocatedBytes;    // bytes in blocks handed out, rounded up to the block size
+        size_t   requestedBytes;    // bytes asked for by the live allocations
+        size_t   cachedBytes;       // bytes in whole free chunks and binned blocks
+        size_t   largestFreeBlock;  // largest block which can be handed out without the pool
+        uint64_t hits;              // allocations serviced without visiting the pool
+        uint64_t misses;            // allocations which had to allocate from the pool
+    };
+
+    MemoryCache(const pool_type &pool, size_t maxCachedBytes, int chunkOrder = DEFAULT_CHUNK_ORDER)
+        : pool(pool), chunkOrder(chunkOrder), maxCachedBytes(maxCachedBytes),
+          freeBlocks(chunkOrder - MIN_BLOCK_ORDER + 1),
+          reservedBytes(0), allocatedBytes(0), requestedBytes(0), cachedBytes(0),
+          hits(0), misses(0) {}
+
+    ~MemoryCache() {
+        releaseAll();
+    }
+
+    void *allocate(size_t size) {
+        if (size == 0) {
+            return nullptr;
+        }
+
+        std::lock_guard<std::mutex> l(mutex);
+        if (size > chunkSize()) {
+            return allocateBinned(size);
+        }
+        return allocateBlock(size);
+    }
+
+    // Return a block to the cache.  Returns false if ptr was not handed out by allocate.
+    bool release(void *ptr) {
+        std::lock_guard<std::mutex> l(mutex);
+
+        auto iter = liveBlocks.find(reinterpret_cast<uintptr_t>(ptr));
+        if (iter == liveBlocks.end()) {
+            return false;
+        }
+        LiveBlock live = iter->second;
+        liveBlocks.erase(iter);
+
+        size_t blockSize = live.order ? (size_t(1) << live.order) : live.binSize;
+        allocatedBytes -= blockSize;
+        requestedBytes -= live.requested;
+
+        if (live.order) {
+            releaseBlock(reinterpret_cast<uintptr_t>(ptr), live.order);
+        } else {
+            bins[live.binSize].push_back(ptr);
+            cachedBytes += live.binSize;
+        }
+
+        if (cachedBytes > maxCachedBytes) {
+            releaseCached(maxCachedBytes);
+        }
+        return true;
+    }
+
+    // Start of the pool allocation holding ptr, or nullptr if ptr does not point into
+    // memory of the cache.
+    void *allocationBase(const void *ptr) {
+        std::lock_guard<std::mutex> l(mutex);
+
+        uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+        auto chunk = chunkOf(addr);
+        if (chunk != chunks.end()) {
+            return reinterpret_cast<void*>(chunk->first);
+        }
+        auto live = liveBlocks.find(addr);
+        if (live != liveBlocks.end() && live->second.order == 0) {
+            return const_cast<void*>(ptr);
+        }
+        return nullptr;
+    }
+
+    // Return cached memory to the pool until at most keepBytes are cached.  Returns the
+    // number of bytes released.
+    size_t trim(size_t keepBytes) {
+        std::lock_guard<std::mutex> l(mutex);
+        return releaseCached(keepBytes);
+    }
+
+    void setMaxCachedBytes(size_t bytes) {
+        std::lock_guard<std::mutex> l(mutex);
+        maxCachedBytes = bytes;
+        if (cachedBytes > maxCachedBytes) {
+            releaseCached(maxCachedBytes);
+        }
+    }
+
+    Stats getStats() {
+        std::lock_guard<std::mutex> l(mutex);
+
+        Stats st;
+        st.reservedBytes    = reservedBytes;
+        st.allocatedBytes   = allocatedBytes;
+        st.requestedBytes   = requestedBytes;
+        st.cachedBytes      = cachedBytes;
+        st.largestFreeBlock = 0;
+        st.hits             = hits;
+        st.misses           = misses;
+
+        for (int order = chunkOrder; order >= MIN_BLOCK_ORDER; --order) {
+            if (!freeList(order).empty()) {
+                st.largestFreeBlock = size_t(1) << order;
+                break;
+            }
+        }
+        if (!bins.empty()) {
+            auto bin = bins.end();
+            do {
+                --bin;
+                if (!bin->second.empty()) {
+                    if (bin->first > st.largestFreeBlock) {
+                        st.largestFreeBlock = bin->first;
+                    }
+                    break;
+                }
+            } while (bin != bins.begin());
+        }
+        return st;
+    }
+
+    // Return every chunk and binned block to the pool, including those still handed out.
+    void releaseAll() {
+        std::lock_guard<std::mutex> l(mutex);
+
+        for (auto &chunk : chunks) {
+            PoolTraits::free(pool, reinterpret_cast<void*>(chunk.first));
+        }
+        for (auto &bin : bins) {
+            for (auto ptr : bin.second) {
+                PoolTraits::free(pool, ptr);
+            }
+        }
+        for (auto &live : liveBlocks) {
+            if (live.second.order == 0) {
+                PoolTraits::free(pool, reinterpret_cast<void*>(live.first));
+            }
+        }
+
+        chunks.clear();
+        bins.clear();
+        liveBlocks.clear();
+        for (auto &list : freeBlocks) {
+            list.clear();
+        }
+        reservedBytes = allocatedBytes = requestedBytes = cachedBytes = 0;
+    }
+
+private:
+    struct LiveBlock {
+        int    order;      // block order, 0 for binned blocks
+        size_t binSize;    // size class of binned blocks
+        size_t requested;
+    };
+
+    size_t chunkSize() const { return size_t(1) << chunkOrder; }
+
+    std::set<uintptr_t> &freeList(int order) { return freeBlocks[order - MIN_BLOCK_ORDER]; }
+
+    static int orderOf(size_t size) {
+        int order = MIN_BLOCK_ORDER;
+        while ((size_t(1) << order) < size) {
+            ++order;
+        }
+        return order;
+    }
+
+    // Round sizes above the chunk size up to a multiple of a quarter of their power of two.
+    static size_t binSizeOf(size_t size) {
+        size_t step = size_t(1) << (orderOf(size) - 3);
+        return (size + step - 1) & ~(step - 1);
+    }
+
+    std::map<uintptr_t, size_t>::iterator chunkOf(uintptr_t addr) {
+        auto iter = chunks.upper_bound(addr);
+        if (iter == chunks.begin()) {
+            return chunks.end();
+        }
+        --iter;
+        return (addr < iter->first + chunkSize()) ? iter : chunks.end();
+    }
+
+    // The following are called with mutex held.
+
+    // Allocate from the pool, releasing the cache and retrying if it is out of memory.
+    void *poolAllocate(size_t size) {
+        void *ptr = PoolTraits::allocate(pool, size);
+        if ((ptr == nullptr) && (releaseCached(0) != 0)) {
+            ptr = PoolTraits::allocate(pool, size);
+        }
+        if (ptr != nullptr) {
+            reservedBytes += size;
+        }
+        return ptr;
+    }
+
+    void *allocateBlock(size_t size) {
+        int order = orderOf(size);
+
+        int from = order;
+        while ((from <= chunkOrder) && freeList(from).empty()) {
+            ++from;
+        }
+
+        uintptr_t addr;
+        if (from > chunkOrder) {
+            void *chunk = poolAllocate(chunkSize());
+            if (chunk == nullptr) {
+                return nullptr;
+            }
+            ++misses;
+            addr = reinterpret_cast<uintptr_t>(chunk);
+            chunks.emplace(addr, 0);
+            from = chunkOrder;
+        } else {
+            ++hits;
+            auto first = freeList(from).begin();
+            addr = *first;
+            freeList(from).erase(first);
+            if (from == chunkOrder) {
+                cachedBytes -= chunkSize();
+            }
+        }
+
+        // split, keeping the lower half and freeing the upper one
+        while (from > order) {
+            --from;
+            freeList(from).insert(addr + (size_t(1) << from));
+        }
+
+        chunkOf(addr)->second += size_t(1) << order;
+        liveBlocks[addr] = LiveBlock{order, 0, size};
+        allocatedBytes += size_t(1) << order;
+        requestedBytes += size;
+        return reinterpret_cast<void*>(addr);
+    }
+
+    void releaseBlock(uintptr_t addr, int order) {
+        auto chunk = chunkOf(addr);
+        chunk->second -= size_t(1) << order;
+
+        uintptr_t base = chunk->first;
+        uintptr_t offset = addr - base;
+        while (order < chunkOrder) {
+            uintptr_t buddy = base + (offset ^ (uintptr_t(1) << order));
+            if (freeList(order).erase(buddy) == 0) {
+                break;
+            }
+            offset &= ~(uintptr_t(1) << order);
+            ++order;
+        }
+        freeList(order).insert(base + offset);
+        if (order == chunkOrder) {
+            cachedBytes += chunkSize();
+        }
+    }
+
+    void *allocateBinned(size_t size) {
+        size_t binSize = binSizeOf(size);
+
+        void *ptr = nullptr;
+        auto bin = bins.find(binSize);
+        if (bin != bins.end() && !bin->second.empty()) {
+            ++hits;
+            ptr = bin->second.back();
+            bin->second.pop_back();
+            cachedBytes -= binSize;
+        } else {
+            ptr = poolAllocate(binSize);
+            if (ptr == nullptr) {
+                return nullptr;
+            }
+            ++misses;
+        }
+
+        liveBlocks[reinterpret_cast<uintptr_t>(ptr)] = LiveBlock{0, binSize, size};
+        allocatedBytes += binSize;
+        requestedBytes += size;
+        return ptr;
+    }
+
+    // Release binned blocks, largest first, then whole free chunks until at most keepBytes
+    // are cached.  Returns the number of bytes released.
+    size_t releaseCached(size_t keepBytes) {
+        size_t released = 0;
+
+        for (auto bin = bins.rbegin(); (bin != bins.rend()) && (cachedBytes > keepBytes); ++bin) {
+            while (!bin->second.empty() && (cachedBytes > keepBytes)) {
+                PoolTraits::free(pool, bin->second.back());
+                bin->second.pop_back();
+                cachedBytes -= bin->first;
+                reservedBytes -= bin->first;
+                released += bin->first;
+            }
+        }
+
+        auto &wholeChunks = freeList(chunkOrder);
+        while (!wholeChunks.empty() && (cachedBytes > keepBytes)) {
+            auto last = std::prev(wholeChunks.end());
+            PoolTraits::free(pool, reinterpret_cast<void*>(*last));
+            chunks.erase(*last);
+            wholeChunks.erase(last);
+            cachedBytes -= chunkSize();
+            reservedBytes -= chunkSize();
+            released += chunkSize();
+        }
+        return released;
+    }
+
+    pool_type pool;
+    int       chunkOrder;
+    size_t    maxCachedBytes;
+
+    std::mutex mutex;
+
+    std::map<uintptr_t, size_t>              chunks;      // chunk base -> bytes handed out
+    std::vector<std::set<uintptr_t>>         freeBlocks;  // free buddy blocks by order
+    std::map<size_t, std::vector<void*>>     bins;        // free binned blocks by size class
+    std::unordered_map<uintptr_t, LiveBlock> liveBlocks;
+
+    size_t   reservedBytes;
+    size_t   allocatedBytes;
+    size_t   requestedBytes;
+    size_t   cachedBytes;
+    uint64_t hits;
+    uint64_t misses;
+};
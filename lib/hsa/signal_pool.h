@@ -0,0 +1,350 @@
+//===----------------------------------------------------------------------===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <utility>
+#include <vector>
+
+//-------------------------------------------------------------------------------------------------
+// Completion signal allocator used by HSAContext::getSignal / releaseSignal.
+//
+// Layout follows the classic "magazine" design:
+//  - every host thread owns two small magazines (loaded + previous) and services
+//    acquire/release out of them with no lock and no atomic RMW.
+//  - when both magazines are exhausted (or both full on release) the thread trades a
+//    whole magazine with the global depot under depotMutex.  This happens at most once
+//    per MAGAZINE_SIZE operations, so the depot lock is effectively uncontended.
+//  - when the depot has no loaded magazines the pool grows by a batch of signals.  The
+//    signals are created outside the depot lock so other threads can keep trading.
+//
+// SignalTraits abstracts the real HSA signal so the pool can be benchmarked against a
+// stub implementation.  It must provide:
+//    typedef ... signal_type;
+//    static void create(signal_type *);   // create a signal with initial value 1
+//    static void destroy(signal_type);
+//    static void reset(signal_type);      // restore initial value 1 before reuse
+//
+// Signals released from a thread other than the one which acquired them are fine; they
+// simply land in the releasing thread's magazine.
+template <typename SignalTraits>
+class SignalPool {
+public:
+    typedef typename SignalTraits::signal_type signal_type;
+
+    // Number of signals carried by a per-thread magazine.
+    static const int MAGAZINE_SIZE = 32;
+
+    struct Stats {
+        uint64_t hits;      // acquires serviced from the per-thread magazines
+        uint64_t misses;    // acquires which had to visit the depot
+        uint64_t grows;     // number of times the pool created a new batch of signals
+        size_t   size;      // total signals owned by the pool
+    };
+
+    SignalPool() : growBatch(MAGAZINE_SIZE), poolId(nextPoolId().fetch_add(1)),
+                   hits(0), misses(0), grows(0) {
+        std::lock_guard<std::mutex> l(registryMutex());
+        livePools().insert(poolId);
+    }
+
+    ~SignalPool() {
+        {
+            std::lock_guard<std::mutex> l(registryMutex());
+            livePools().erase(poolId);
+        }
+
+        // Drop the calling thread's cache if it points at this pool; magazines cached by
+        // other (still running) threads are released with the pool below.
+        ThreadCache &tc = cache();
+        if (tc.pool == this && tc.poolId == poolId) {
+            tc.detach();
+        }
+
+        destroyAll();
+
+        for (auto m : allMagazines) {
+            delete m;
+        }
+        allMagazines.clear();
+    }
+
+    // Destroy every signal created by the pool.  Must be called before the underlying
+    // runtime shuts down; the pool must not be used afterwards.
+    void destroyAll() {
+        std::lock_guard<std::mutex> l(growMutex);
+        for (auto &s : allSignals) {
+            SignalTraits::destroy(s);
+        }
+        allSignals.clear();
+    }
+
+    // Create the first `count' signals and size subsequent growth to the same batch.
+    void init(int count) {
+        setGrowBatch(count);
+        grow();
+    }
+
+    // Size growth to batches of `count' signals without creating any yet; the first
+    // acquire creates the first batch.  Must be called before the pool is used.
+    void setGrowBatch(int count) {
+        growBatch = (count < MAGAZINE_SIZE) ? MAGAZINE_SIZE : count;
+    }
+
+    std::pair<signal_type, int> acquire() {
+        ThreadCache &tc = bind();
+
+        if (tc.loaded->count == 0) {
+            if (tc.previous->count > 0) {
+                std::swap(tc.loaded, tc.previous);
+                ++tc.hits;
+            } else {
+                refill(tc);
+            }
+        } else {
+            ++tc.hits;
+        }
+
+        Slot s = tc.loaded->slots[--tc.loaded->count];
+        return std::make_pair(s.signal, s.index);
+    }
+
+    void release(signal_type signal, int index) {
+        SignalTraits::reset(signal);
+
+        ThreadCache &tc = bind();
+
+        if (tc.loaded->count == MAGAZINE_SIZE) {
+            if (tc.previous->count < MAGAZINE_SIZE) {
+                std::swap(tc.loaded, tc.previous);
+            } else {
+                spill(tc);
+            }
+        }
+
+        Slot &s = tc.loaded->slots[tc.loaded->count++];
+        s.signal = signal;
+        s.index  = index;
+    }
+
+    Stats getStats() {
+        ThreadCache &tc = cache();
+        if (tc.pool == this && tc.poolId == poolId) {
+            flushHits(tc);
+        }
+
+        Stats st;
+        st.hits   = hits.load(std::memory_order_relaxed);
+        st.misses = misses.load(std::memory_order_relaxed);
+        st.grows  = grows.load(std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> l(growMutex);
+            st.size = allSignals.size();
+        }
+        return st;
+    }
+
+private:
+    struct Slot {
+        signal_type signal;
+        int         index;
+    };
+
+    struct Magazine {
+        int  count;
+        Slot slots[MAGAZINE_SIZE];
+        Magazine() : count(0) {}
+    };
+
+    // Per-thread cache.  One instance per thread per SignalTraits; it is re-bound if the
+    // thread touches a different pool instance.
+    struct ThreadCache {
+        SignalPool *pool;
+        uint64_t    poolId;
+        Magazine   *loaded;
+        Magazine   *previous;
+        uint64_t    hits;
+
+        ThreadCache() : pool(nullptr), poolId(0), loaded(nullptr), previous(nullptr), hits(0) {}
+
+        // Return magazines to the owning pool on thread exit so signals are not stranded.
+        ~ThreadCache() {
+            release();
+        }
+
+        void release() {
+            if (pool) {
+                std::lock_guard<std::mutex> l(registryMutex());
+                if (livePools().count(poolId)) {
+                    pool->unbind(*this);
+                }
+                detach();
+            }
+        }
+
+        void detach() {
+            pool = nullptr;
+            loaded = previous = nullptr;
+            hits = 0;
+        }
+    };
+
+    static ThreadCache &cache() {
+        static thread_local ThreadCache tc;
+        return tc;
+    }
+
+    static std::atomic<uint64_t> &nextPoolId() {
+        static std::atomic<uint64_t> id(1);
+        return id;
+    }
+
+    // Ids of pools which have not been destroyed yet.  Only consulted when a thread cache
+    // is re-bound or torn down, so a thread never hands magazines to a dead pool.
+    static std::mutex &registryMutex() {
+        static std::mutex m;
+        return m;
+    }
+
+    static std::set<uint64_t> &livePools() {
+        static std::set<uint64_t> s;
+        return s;
+    }
+
+    ThreadCache &bind() {
+        ThreadCache &tc = cache();
+        if (tc.pool != this || tc.poolId != poolId) {
+            tc.release();
+            std::lock_guard<std::mutex> l(depotMutex);
+            tc.pool     = this;
+            tc.poolId   = poolId;
+            tc.loaded   = takeEmptyLocked();
+            tc.previous = takeEmptyLocked();
+        }
+        return tc;
+    }
+
+    void unbind(ThreadCache &tc) {
+        flushHits(tc);
+        std::lock_guard<std::mutex> l(depotMutex);
+        putLocked(tc.loaded);
+        putLocked(tc.previous);
+        tc.detach();
+    }
+
+    void flushHits(ThreadCache &tc) {
+        if (tc.hits) {
+            hits.fetch_add(tc.hits, std::memory_order_relaxed);
+            tc.hits = 0;
+        }
+    }
+
+    // Both magazines are empty: swap the previous one for a loaded magazine from the depot.
+    void refill(ThreadCache &tc) {
+        misses.fetch_add(1, std::memory_order_relaxed);
+        flushHits(tc);
+
+        for (;;) {
+            {
+                std::lock_guard<std::mutex> l(depotMutex);
+                if (!full.empty()) {
+                    emptyMagazines.push_back(tc.previous);
+                    tc.previous = tc.loaded;
+                    tc.loaded = full.back();
+                    full.pop_back();
+                    return;
+                }
+            }
+            grow();
+        }
+    }
+
+    // Both magazines are full: hand the previous one to the depot and start a fresh one.
+    void spill(ThreadCache &tc) {
+        std::lock_guard<std::mutex> l(depotMutex);
+        full.push_back(tc.previous);
+        tc.previous = tc.loaded;
+        tc.loaded = takeEmptyLocked();
+    }
+
+    Magazine *takeEmptyLocked() {
+        if (!emptyMagazines.empty()) {
+            Magazine *m = emptyMagazines.back();
+            emptyMagazines.pop_back();
+            return m;
+        }
+        Magazine *m = new Magazine;
+        allMagazines.push_back(m);
+        return m;
+    }
+
+    void putLocked(Magazine *m) {
+        if (m == nullptr) {
+            return;
+        }
+        if (m->count) {
+            full.push_back(m);
+        } else {
+            emptyMagazines.push_back(m);
+        }
+    }
+
+    // Create another batch of signals and publish it to the depot as loaded magazines.
+    // Serialized on growMutex so concurrent misses don't over-allocate; a thread which
+    // waited here re-checks the depot before creating anything.
+    void grow() {
+        std::lock_guard<std::mutex> g(growMutex);
+        {
+            std::lock_guard<std::mutex> l(depotMutex);
+            if (!full.empty()) {
+                return;
+            }
+        }
+
+        std::vector<Magazine*> batch;
+        Magazine *m = nullptr;
+        for (int i = 0; i < growBatch; ++i) {
+            if (m == nullptr || m->count == MAGAZINE_SIZE) {
+                m = new Magazine;
+                batch.push_back(m);
+            }
+            Slot &s = m->slots[m->count++];
+            SignalTraits::create(&s.signal);
+            s.index = allSignals.size();
+            allSignals.push_back(s.signal);
+        }
+        grows.fetch_add(1, std::memory_order_relaxed);
+
+        std::lock_guard<std::mutex> l(depotMutex);
+        for (auto b : batch) {
+            allMagazines.push_back(b);
+            full.push_back(b);
+        }
+    }
+
+    int      growBatch;
+    uint64_t poolId;
+
+    // depot: magazines which are not cached by any thread
+    std::mutex             depotMutex;
+    std::vector<Magazine*> full;            // magazines holding at least one signal
+    std::vector<Magazine*> emptyMagazines;
+    std::vector<Magazine*> allMagazines;
+
+    // every signal ever created, for destruction.  Guarded by growMutex.
+    std::mutex               growMutex;
+    std::vector<signal_type> allSignals;
+
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> grows;
+};
@@ -15,10 +15,16 @@
 #include <cassert>
 #include <cstddef>
 #include <tuple>
+#include <deque>
+#include <chrono>
+#include <future>
+#include <map>
 
 #include <mutex>
 
 #include <dlfcn.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 // Kernel bundle
 extern "C" char * kernel_bundle_source[] asm ("_binary_kernel_bundle_start") __attribute__((visibility("default")));
@@ -30,6 +36,7 @@ struct RuntimeImpl {
     m_RuntimeHandle(nullptr),
     m_PushArgImpl(nullptr),
     m_PushArgPtrImpl(nullptr),
+    m_PushArgsImpl(nullptr),
     m_GetContextImpl(nullptr),
     m_InitActivityCallbackImpl(nullptr),
     m_EnableActivityCallbackImpl(nullptr),
@@ -54,6 +61,7 @@ struct RuntimeImpl {
   void LoadSymbols() {
     m_PushArgImpl = (PushArgImpl_t) dlsym(m_RuntimeHandle, "PushArgImpl");
     m_PushArgPtrImpl = (PushArgPtrImpl_t) dlsym(m_RuntimeHandle, "PushArgPtrImpl");
+    m_PushArgsImpl = (PushArgsImpl_t) dlsym(m_RuntimeHandle, "PushArgsImpl");
     m_GetContextImpl= (GetContextImpl_t) dlsym(m_RuntimeHandle, "GetContextImpl");
     m_InitActivityCallbackImpl = (InitActivityCallbackImpl_t) dlsym(m_RuntimeHandle, "InitActivityCallbackImpl");
     m_EnableActivityCallbackImpl = (EnableActivityCallbackImpl_t) dlsym(m_RuntimeHandle, "EnableActivityCallbackImpl");
@@ -67,6 +75,7 @@ struct RuntimeImpl {
   void* m_RuntimeHandle;
   PushArgImpl_t m_PushArgImpl;
   PushArgPtrImpl_t m_PushArgPtrImpl;
+  PushArgsImpl_t m_PushArgsImpl;
   GetContextImpl_t m_GetContextImpl;
 
   // Activity profiling routines
@@ -329,17 +338,184 @@ static void read_code_bundles(std::vector<_code_bundle>& bundles) {
   }
 }
 
-void LoadInMemoryProgram(KalmarQueue* pQueue) {
-
+static const std::vector<_code_bundle>& code_bundles() {
   static std::vector<_code_bundle> bundles;
   static std::once_flag f;
   std::call_once(f, [&](){ read_code_bundles(bundles); });
+  return bundles;
+}
+
+/**
+ * \brief When the embedded programs are loaded, from HCC_LAZYINIT
+ *
+ * - eager (default): on every device at startup
+ * - lazy (ON, or any other non-zero value): when the first kernel of a device
+ *   is created
+ * - hybrid (HYBRID or 2): in the background when the first queue of a device
+ *   is created, so only devices the process uses are loaded
+ */
+enum LoadMode {
+  load_eager,
+  load_lazy,
+  load_hybrid
+};
+
+static LoadMode GetLoadMode() {
+  static const LoadMode mode = [] {
+    char* lazyinit_env = getenv("HCC_LAZYINIT");
+    if (lazyinit_env == nullptr) {
+      return load_eager;
+    }
+    if (std::string("HYBRID") == lazyinit_env || strtol(lazyinit_env, nullptr, 0) == 2) {
+      return load_hybrid;
+    }
+    if (std::string("ON") == lazyinit_env || strtol(lazyinit_env, nullptr, 0)) {
+      return load_lazy;
+    }
+    return load_eager;
+  }();
+  return mode;
+}
+
+/**
+ * \brief Bounded pool of threads loading the embedded programs on devices
+ *
+ * Each device is loaded once, by one of up to HCC_LOAD_THREADS workers
+ * (default: the number of hardware threads, at most 8), so devices load
+ * concurrently.  Errors are kept with the device and rethrown to everyone
+ * waiting for it.
+ */
+class ProgramLoader {
+public:
+  ProgramLoader() : maxWorkers(1), idleWorkers(0) {
+    unsigned int hwThreads = std::thread::hardware_concurrency();
+    maxWorkers = std::max(1u, std::min(8u, hwThreads));
+    char* threads_env = getenv("HCC_LOAD_THREADS");
+    if (threads_env != nullptr && strtol(threads_env, nullptr, 0) > 0) {
+      maxWorkers = strtol(threads_env, nullptr, 0);
+    }
+  }
+
+  // start loading the programs of pDev unless already started
+  std::shared_future<void> start(KalmarDevice* pDev) {
+    std::lock_guard<std::mutex> lk(mutex);
+    auto it = loads.find(pDev);
+    if (it != loads.end()) {
+      return it->second;
+    }
+
+    std::packaged_task<void()> task([pDev] { load(pDev); });
+    std::shared_future<void> done = task.get_future().share();
+    loads.emplace(pDev, done);
+    tasks.push_back(std::move(task));
+    if (idleWorkers == 0 && workers.size() < maxWorkers) {
+      workers.emplace_back(&ProgramLoader::run, this);
+    } else {
+      cv.notify_one();
+    }
+    return done;
+  }
+
+  // load the programs of all devices, and report every device which failed
+  // in one exception
+  void load_all(const std::vector<KalmarDevice*>& devices) {
+    std::vector<std::shared_future<void>> pending;
+    for (auto dev : devices) {
+      pending.push_back(start(dev));
+    }
+
+    std::string errors;
+    for (size_t i = 0; i < devices.size(); ++i) {
+      try {
+        pending[i].get();
+      } catch (const std::exception& e) {
+        std::wstring path = devices[i]->get_path();
+        errors += "\n  " + std::string(path.begin(), path.end()) + ": " + e.what();
+      }
+    }
+    if (!errors.empty()) {
+      throw runtime_exception(("failed to load programs on devices:" + errors).c_str(), E_FAIL);
+    }
+  }
+
+  // wait for a load of pDev started earlier, if any, and forget it; errors
+  // are dropped, the device is going away
+  void finish(KalmarDevice* pDev) {
+    std::shared_future<void> done;
+    {
+      std::lock_guard<std::mutex> lk(mutex);
+      auto it = loads.find(pDev);
+      if (it == loads.end()) {
+        return;
+      }
+      done = it->second;
+      loads.erase(it);
+    }
+    done.wait();
+  }
+
+private:
+  static void load(KalmarDevice* pDev) {
+    auto begin = std::chrono::steady_clock::now();
+    size_t loaded = 0;
+    for (auto&& b : code_bundles()) {
+      if (pDev->IsCompatibleKernel((void*) b.size, (void*) b.device_binary)) {
+        pDev->BuildProgram((void*) b.size, (void*) b.device_binary);
+        ++loaded;
+      }
+    }
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - begin).count();
+    pDev->ReportProgramLoad(ns, loaded);
+  }
 
-  for (auto&& b : bundles) {
-    if (pQueue->getDev()->IsCompatibleKernel((void*) b.size, (void*) b.device_binary)) {
-      pQueue->getDev()->BuildProgram((void*) b.size, (void*) b.device_binary);
+  void run() {
+    std::unique_lock<std::mutex> lk(mutex);
+    for (;;) {
+      ++idleWorkers;
+      cv.wait(lk, [this] { return !tasks.empty(); });
+      --idleWorkers;
+
+      std::packaged_task<void()> task = std::move(tasks.front());
+      tasks.pop_front();
+
+      lk.unlock();
+      task();
+      lk.lock();
     }
   }
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<std::packaged_task<void()>> tasks;
+  std::vector<std::thread> workers;
+  std::map<KalmarDevice*, std::shared_future<void>> loads;
+  size_t maxWorkers;
+  size_t idleWorkers;
+};
+
+// Never destroyed, like the callback pool.
+static ProgramLoader* GetProgramLoader() {
+  static ProgramLoader* loader = new ProgramLoader;
+  return loader;
+}
+
+void LoadInMemoryProgram(KalmarDevice* pDev) {
+  GetProgramLoader()->start(pDev).get();
+}
+
+void LoadInMemoryPrograms(const std::vector<KalmarDevice*>& devices) {
+  GetProgramLoader()->load_all(devices);
+}
+
+void PrefetchProgram(KalmarDevice* pDev) {
+  if (GetLoadMode() == load_hybrid) {
+    GetProgramLoader()->start(pDev);
+  }
+}
+
+void FinishProgramLoad(KalmarDevice* pDev) {
+  GetProgramLoader()->finish(pDev);
 }
 
 // used in parallel_for_each.h
@@ -348,12 +524,19 @@ void *CreateKernel(std::string s, KalmarQueue* pQueue) {
   return pQueue->getDev()->CreateKernel(s.c_str(), pQueue);
 }
 
-void PushArg(void *k_, int idx, size_t sz, const void *s) {
-  GetOrInitRuntime()->m_PushArgImpl(k_, idx, sz, s);
+void *CreateKernel(const char* name, KalmarQueue* pQueue) {
+  return pQueue->getDev()->CreateKernel(name, pQueue);
+}
+
+void PushArg(void *k_, int idx, size_t sz, size_t align, const void *s) {
+  GetOrInitRuntime()->m_PushArgImpl(k_, idx, sz, align, s);
 }
 void PushArgPtr(void *k_, int idx, size_t sz, const void *s) {
   GetOrInitRuntime()->m_PushArgPtrImpl(k_, idx, sz, s);
 }
+void PushArgs(void *k_, const void *image, size_t sz) {
+  GetOrInitRuntime()->m_PushArgsImpl(k_, image, sz);
+}
 
 // Activity profiling routines
 void InitActivityCallback(void* id_callback, void* op_callback, void* arg) {
@@ -366,8 +549,122 @@ const char* GetCmdName(uint32_t id) {
   return GetOrInitRuntime()->m_GetCmdNameImpl(id);
 }
 
+/**
+ * \brief Bounded pool of threads running completion callbacks
+ *
+ * Workers are started on demand, up to HCC_CALLBACK_THREADS (default: the
+ * number of hardware threads, at most 4).
+ */
+class CallbackPool {
+public:
+  CallbackPool() : maxWorkers(1), idleWorkers(0), callbacks(0), totalLatencyNs(0), maxLatencyNs(0) {
+    unsigned int hwThreads = std::thread::hardware_concurrency();
+    maxWorkers = std::max(1u, std::min(4u, hwThreads));
+    char* threads_env = getenv("HCC_CALLBACK_THREADS");
+    if (threads_env != nullptr && strtol(threads_env, nullptr, 0) > 0) {
+      maxWorkers = strtol(threads_env, nullptr, 0);
+    }
+  }
+
+  void enqueue(std::function<void()> func) {
+    std::lock_guard<std::mutex> lk(mutex);
+    tasks.push_back(Task{std::move(func), std::chrono::steady_clock::now()});
+    if (idleWorkers == 0 && workers.size() < maxWorkers) {
+      workers.emplace_back(&CallbackPool::run, this);
+    } else {
+      cv.notify_one();
+    }
+  }
+
+  CallbackStats stats() {
+    std::lock_guard<std::mutex> lk(mutex);
+    return CallbackStats{callbacks, totalLatencyNs, maxLatencyNs};
+  }
+
+private:
+  struct Task {
+    std::function<void()> func;
+    std::chrono::steady_clock::time_point enqueued;
+  };
+
+  void run() {
+    std::unique_lock<std::mutex> lk(mutex);
+    for (;;) {
+      ++idleWorkers;
+      cv.wait(lk, [this] { return !tasks.empty(); });
+      --idleWorkers;
+
+      Task task = std::move(tasks.front());
+      tasks.pop_front();
+
+      uint64_t latency = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - task.enqueued).count();
+      ++callbacks;
+      totalLatencyNs += latency;
+      maxLatencyNs = std::max(maxLatencyNs, latency);
+
+      lk.unlock();
+      task.func();
+      lk.lock();
+    }
+  }
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<Task> tasks;
+  std::vector<std::thread> workers;
+  size_t maxWorkers;
+  size_t idleWorkers;
+
+  uint64_t callbacks;
+  uint64_t totalLatencyNs;
+  uint64_t maxLatencyNs;
+};
+
+// Never destroyed: workers may still be blocked in a callback at exit.
+static CallbackPool* GetCallbackPool() {
+  static CallbackPool* pool = new CallbackPool;
+  return pool;
+}
+
+void EnqueueCallback(std::function<void()> func) {
+  GetCallbackPool()->enqueue(std::move(func));
+}
+
+CallbackStats GetCallbackStats() {
+  return GetCallbackPool()->stats();
+}
+
 } // namespace CLAMP
 
+CompletionFd::~CompletionFd() {
+  close(fd);
+}
+
+void CompletionFd::signal() {
+  uint64_t one = 1;
+  ssize_t written = write(fd, &one, sizeof(one));
+  (void)written;
+}
+
+int KalmarAsyncOp::getCompletionFd(const std::shared_ptr<KalmarAsyncOp>& op) {
+  std::call_once(op->completionFdOnce, [&op]() {
+    int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd >= 0) {
+      op->completionFd = std::make_shared<CompletionFd>(fd);
+      op->notifyOnCompletion(op->completionFd, op);
+    }
+  });
+  return op->completionFd ? op->completionFd->get() : -1;
+}
+
+void KalmarAsyncOp::notifyOnCompletion(const std::shared_ptr<CompletionFd>& fd,
+                                       const std::shared_ptr<KalmarAsyncOp>& self) {
+  std::shared_ptr<CompletionFd> notify = fd;
+  std::shared_ptr<KalmarAsyncOp> op = self;
+  setCallback([notify, op]() { notify->signal(); });
+}
+
 KalmarContext *getContext() {
   return static_cast<KalmarContext*>(CLAMP::GetOrInitRuntime()->m_GetContextImpl());
 }
@@ -378,17 +675,7 @@ private:
   RuntimeImpl* runtime;
 public:
   KalmarBootstrap() : runtime(nullptr) {
-    bool to_init = true;
-    char* lazyinit_env = getenv("HCC_LAZYINIT");
-    if (lazyinit_env != nullptr) {
-      if (std::string("ON") == lazyinit_env) {
-        to_init = false;
-      } else if (strtol(lazyinit_env, nullptr, 0)) {
-        to_init = false;
-      }
-    }
-
-    if (to_init) {
+    if (CLAMP::GetLoadMode() == CLAMP::load_eager) {
       // initialize runtime
       runtime = CLAMP::GetOrInitRuntime();
 
@@ -397,14 +684,11 @@ public:
 
       const std::vector<KalmarDevice*> devices = context->getDevices();
 
-      // load kernels on the default queue for each device
-      for (auto dev = devices.begin(); dev != devices.end(); dev++) {
-
-        // get default queue on the device
-        std::shared_ptr<KalmarQueue> queue = (*dev)->get_default_queue();
-
-        // load kernels on the default queue for the device
-        CLAMP::LoadInMemoryProgram(queue.get());
+      // load kernels on all devices at once
+      try {
+        CLAMP::LoadInMemoryPrograms(devices);
+      } catch (const std::exception& e) {
+        RUNTIME_ERROR(-1, e.what(), __LINE__);
       }
     }
   }
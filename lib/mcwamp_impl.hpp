@@ -2,8 +2,9 @@
 
 #include<string>
 
-typedef void* (*PushArgImpl_t)(void *, int, size_t, const void *);
+typedef void* (*PushArgImpl_t)(void *, int, size_t, size_t, const void *);
 typedef void* (*PushArgPtrImpl_t)(void *, int, size_t, const void *);
+typedef void* (*PushArgsImpl_t)(void *, const void *, size_t);
 typedef void* (*GetContextImpl_t)();
 
 // Activity profiling routines
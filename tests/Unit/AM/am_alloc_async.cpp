@@ -0,0 +1,74 @@
+// RUN: %hc %s -lhc_am -o %t.out && %t.out
+
+#include <hc.hpp>
+#include <hc_am.hpp>
+
+#include <cstdio>
+
+#define N (64 * 1024)
+#define ITERATIONS (32)
+
+// A test which allocates and frees a temporary buffer for every kernel with
+// am_alloc_async / am_free_async, without waiting in between.  Checks the
+// buffer is reused right away on the accelerator_view it was freed on,
+// reused by another accelerator_view once the commands before the free have
+// completed, and released by am_pool_trim.
+int main() {
+  bool ret = true;
+
+  hc::accelerator acc;
+  hc::accelerator_view av = acc.create_view();
+  hc::accelerator_view other = acc.create_view();
+
+  int* result = (int*) hc::am_alloc(sizeof(int) * ITERATIONS, acc, amHostPinned);
+
+  void* first = nullptr;
+  for (int it = 0; it < ITERATIONS; ++it) {
+    int* tmp = (int*) hc::am_alloc_async(sizeof(int) * N, av);
+    if (it == 0) {
+      first = tmp;
+    }
+    ret &= (tmp == first);
+
+    hc::parallel_for_each(av, hc::extent<1>(N), [=](hc::index<1> idx) [[hc]] {
+      tmp[idx[0]] = idx[0] + it;
+    });
+    hc::parallel_for_each(av, hc::extent<1>(1), [=](hc::index<1> idx) [[hc]] {
+      result[it] = tmp[N - 1];
+    });
+
+    ret &= (hc::am_free_async(tmp, av) == AM_SUCCESS);
+  }
+  ret &= (hc::am_pool_get_cached_size(acc) >= sizeof(int) * N);
+
+  av.wait();
+  for (int it = 0; it < ITERATIONS; ++it) {
+    if (result[it] != N - 1 + it) {
+      printf("iteration %d: %d != %d\n", it, result[it], N - 1 + it);
+      ret = false;
+    }
+  }
+
+  // the block is no longer in use once av has drained
+  int* tmp = (int*) hc::am_alloc_async(sizeof(int) * N, other);
+  ret &= (tmp == first);
+  ret &= (hc::am_pool_get_cached_size(acc) == 0);
+  ret &= (hc::am_free_async(tmp, other) == AM_SUCCESS);
+  other.wait();
+
+  ret &= (hc::am_pool_trim(acc) >= sizeof(int) * N);
+  ret &= (hc::am_pool_get_cached_size(acc) == 0);
+  ret &= (hc::am_memtracker_getinfo(nullptr, tmp) != AM_SUCCESS);
+
+  // memory from am_alloc is released after the commands enqueued before the free
+  int* plain = (int*) hc::am_alloc(sizeof(int) * N, acc, 0);
+  hc::parallel_for_each(av, hc::extent<1>(N), [=](hc::index<1> idx) [[hc]] {
+    plain[idx[0]] = idx[0];
+  });
+  ret &= (hc::am_free_async(plain, av) == AM_SUCCESS);
+  av.wait();
+
+  hc::am_free(result);
+
+  return !(ret == true);
+}
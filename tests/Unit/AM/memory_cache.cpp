@@ -0,0 +1,117 @@
+// RUN: %hc %s -I%S/../../../lib/hsa -o %t.out && %t.out
+
+// Exercises the device memory cache behind HSADevice::create
+// (lib/hsa/memory_cache.h) against a host memory stand-in pool with a
+// capacity limit, so no HSA runtime is needed.
+
+#include "memory_cache.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <vector>
+
+#define CHUNK_ORDER (16)
+#define CHUNK_SIZE (1 << CHUNK_ORDER)
+
+struct HostPool {
+  size_t capacity;
+  size_t used;
+  std::map<void*, size_t>* live;  // pool allocations and their sizes
+};
+
+struct HostPoolTraits {
+  typedef HostPool pool_type;
+  static void* allocate(HostPool& pool, size_t size) {
+    if (pool.used + size > pool.capacity) {
+      return nullptr;
+    }
+    void* ptr = aligned_alloc(4096, size);
+    pool.used += size;
+    pool.live->emplace(ptr, size);
+    return ptr;
+  }
+  static void free(HostPool& pool, void* ptr) {
+    // only whole pool allocations may come back
+    auto iter = pool.live->find(ptr);
+    if (iter == pool.live->end()) {
+      printf("bad free %p\n", ptr);
+      exit(1);
+    }
+    pool.used -= iter->second;
+    pool.live->erase(iter);
+    ::free(ptr);
+  }
+};
+
+typedef MemoryCache<HostPoolTraits> HostMemoryCache;
+
+int main() {
+  bool ret = true;
+
+  std::map<void*, size_t> live;
+  HostPool pool{8 * CHUNK_SIZE, 0, &live};
+  HostMemoryCache cache(pool, 4 * CHUNK_SIZE, CHUNK_ORDER);
+
+  // small blocks are carved out of one chunk and do not overlap
+  std::vector<char*> blocks;
+  for (int i = 0; i < 64; ++i) {
+    char* p = (char*) cache.allocate(100 + i * 10);
+    memset(p, i, 100 + i * 10);
+    blocks.push_back(p);
+  }
+  for (int i = 0; i < 64; ++i) {
+    for (int j = 0; j < 100 + i * 10; ++j) {
+      ret &= (blocks[i][j] == (char)i);
+    }
+    ret &= (cache.allocationBase(blocks[i] + 5) == live.begin()->first);
+  }
+  ret &= (live.size() == 1);
+
+  HostMemoryCache::Stats st = cache.getStats();
+  ret &= (st.misses == 1) && (st.hits == 63);
+  ret &= (st.reservedBytes == CHUNK_SIZE);
+  ret &= (st.requestedBytes < st.allocatedBytes);
+
+  // freeing every block merges the chunk back, and reuses it
+  for (auto p : blocks) {
+    ret &= cache.release(p);
+  }
+  ret &= !cache.release(blocks[0]);
+  st = cache.getStats();
+  ret &= (st.cachedBytes == CHUNK_SIZE) && (st.largestFreeBlock == CHUNK_SIZE);
+  ret &= (st.allocatedBytes == 0);
+
+  void* whole = cache.allocate(CHUNK_SIZE);
+  ret &= (whole == live.begin()->first);
+  ret &= cache.release(whole);
+
+  // big blocks are binned by size class and reused for a similar size
+  void* big = cache.allocate(CHUNK_SIZE + 1);
+  ret &= cache.allocationBase(big) == big;
+  ret &= cache.release(big);
+  ret &= (cache.allocate(CHUNK_SIZE + 100) == big);
+  ret &= cache.release(big);
+
+  // running out of pool memory releases the cache and retries
+  std::vector<void*> bigs;
+  for (int i = 0; i < 4; ++i) {
+    bigs.push_back(cache.allocate(2 * CHUNK_SIZE));
+    ret &= (bigs.back() != nullptr);
+  }
+  ret &= (cache.allocate(CHUNK_SIZE) == nullptr);
+  for (auto p : bigs) {
+    ret &= cache.release(p);
+  }
+
+  // at most the limit is kept cached
+  st = cache.getStats();
+  ret &= (st.cachedBytes <= 4 * CHUNK_SIZE);
+
+  ret &= (cache.trim(0) == st.cachedBytes);
+  ret &= live.empty();
+  ret &= (cache.getStats().reservedBytes == 0);
+
+  return !(ret == true);
+}
@@ -0,0 +1,62 @@
+// RUN: %hc %s -o %t.out -lhc_am && %t.out
+//
+// Test ordering of asynchronous copies and kernels in one accelerator_view
+// without any host synchronization in between: upload, compute, download,
+// several times over.  Every phase change needs a dependency on the previous
+// command, which is either passed to the copy engine or put in front of the
+// kernel.
+
+#include <hc.hpp>
+#include <hc_am.hpp>
+
+#include <cstdio>
+#include <vector>
+
+#define N (1024 * 1024)
+#define ITERATIONS (64)
+
+int main() {
+  bool ret = true;
+
+  hc::accelerator acc;
+  hc::accelerator_view av = acc.create_view();
+
+  int* in = (int*) hc::am_alloc(sizeof(int) * N, acc, 0);
+  int* out = (int*) hc::am_alloc(sizeof(int) * N, acc, 0);
+  int* hostIn = (int*) hc::am_alloc(sizeof(int) * N * ITERATIONS, acc, amHostPinned);
+  int* hostOut = (int*) hc::am_alloc(sizeof(int) * N * ITERATIONS, acc, amHostPinned);
+
+  for (int it = 0; it < ITERATIONS; ++it) {
+    for (int i = 0; i < N; ++i) {
+      hostIn[it * N + i] = it * 7 + i;
+    }
+  }
+
+  hc::completion_future last;
+  for (int it = 0; it < ITERATIONS; ++it) {
+    av.copy_async(hostIn + it * N, in, sizeof(int) * N);
+    hc::parallel_for_each(av, hc::extent<1>(N), [=](hc::index<1> idx) [[hc]] {
+      out[idx[0]] = in[idx[0]] * 2 + 1;
+    });
+    last = av.copy_async(out, hostOut + it * N, sizeof(int) * N);
+  }
+  last.wait();
+  av.wait();
+
+  for (int it = 0; it < ITERATIONS && ret; ++it) {
+    for (int i = 0; i < N; ++i) {
+      if (hostOut[it * N + i] != (it * 7 + i) * 2 + 1) {
+        printf("iteration %d, i=%d: %d != %d\n", it, i, hostOut[it * N + i], (it * 7 + i) * 2 + 1);
+        ret = false;
+        break;
+      }
+    }
+  }
+
+  hc::am_free(in);
+  hc::am_free(out);
+  hc::am_free(hostIn);
+  hc::am_free(hostOut);
+
+  return !(ret == true);
+}
@@ -0,0 +1,70 @@
+// RUN: %hc %s -o %t.out && %t.out
+
+#include <hc.hpp>
+
+#include <atomic>
+#include <iostream>
+#include <vector>
+
+#define N (64)
+#define DISPATCH_COUNT (2000)
+
+// A test which attaches completion callbacks to many kernels, far more than
+// there are callback workers, and chains a second continuation on each of them.
+// Checks every callback runs once, after the kernel it is attached to, and that
+// the continuation of a continuation runs after the first one.
+int main() {
+  bool ret = true;
+
+  hc::array_view<int, 1> av(N);
+  for (int i = 0; i < N; ++i) av[i] = 0;
+
+  std::atomic<int> first(0);
+  std::atomic<int> second(0);
+  std::atomic<int> outOfOrder(0);
+
+  std::vector<hc::completion_future> chained;
+  for (int k = 0; k < DISPATCH_COUNT; ++k) {
+    hc::completion_future fut = hc::parallel_for_each(hc::extent<1>(N), [=](hc::index<1> idx) [[hc]] {
+      av[idx] += 1;
+    });
+
+    std::atomic<bool>* ran = new std::atomic<bool>(false);
+    hc::completion_future next = fut.then([&, fut, ran]() mutable {
+      if (!fut.is_ready()) outOfOrder++;
+      ran->store(true);
+      first++;
+    });
+    chained.push_back(next.then([&, ran]() {
+      if (!ran->load()) outOfOrder++;
+      delete ran;
+      second++;
+    }));
+  }
+
+  for (auto& f : chained) {
+    f.wait();
+  }
+
+  ret &= (first == DISPATCH_COUNT);
+  ret &= (second == DISPATCH_COUNT);
+  ret &= (outOfOrder == 0);
+
+  hc::callback_stats stats = hc::get_callback_stats();
+  std::cout << "callbacks: " << stats.count
+            << ", average dispatch latency: " << (stats.count ? stats.total_latency_ns / stats.count : 0) << "ns"
+            << ", max: " << stats.max_latency_ns << "ns\n";
+  ret &= (stats.count >= 2 * DISPATCH_COUNT);
+
+  // then() on an invalid completion_future does not run the callback
+  hc::completion_future empty;
+  hc::completion_future emptyNext = empty.then([&]() { outOfOrder++; });
+  ret &= !emptyNext.valid();
+  ret &= (outOfOrder == 0);
+
+  for (int i = 0; i < N; ++i) {
+    ret &= (av[i] == DISPATCH_COUNT);
+  }
+
+  return !(ret == true);
+}
@@ -83,6 +83,7 @@ int main() {
   ret &= test(false);
   ret &= test(true, hc::hcWaitModeBlocked);
   ret &= test(true, hc::hcWaitModeActive);
+  ret &= test(true, hc::hcWaitModeAdaptive);
 
   return !(ret == true);
 }
@@ -0,0 +1,98 @@
+// RUN: %hc %s -o %t.out && %t.out
+
+#include <hc.hpp>
+
+#include <chrono>
+#include <iostream>
+#include <random>
+
+#define LOOP_COUNT (1024 * 64)
+
+#define TEST_DEBUG (0)
+
+/// test which checks the behavior of:
+/// completion_future::wait_for() and wait_until(), which time out rather than
+/// report the op as deferred, and the default wait mode of accelerator_view
+template<size_t grid_size, size_t tile_size>
+hc::completion_future execute(hc::accelerator_view& acc_view,
+                              hc::array_view<const int, 1>& av1,
+                              hc::array_view<const int, 1>& av2,
+                              hc::array_view<int, 1>& av3) {
+  // run HC parallel_for_each
+  return hc::parallel_for_each(acc_view, hc::tiled_extent<1>(grid_size, tile_size), [=](hc::tiled_index<1>& idx) [[hc]] {
+    for (int i = 0; i < LOOP_COUNT; ++i) {
+      av3(idx) = av1(idx) + av2(idx);
+    }
+  });
+}
+
+template<size_t grid_size>
+bool verify(hc::array_view<const int, 1>& av1,
+            hc::array_view<const int, 1>& av2,
+            hc::array_view<int, 1>& av3) {
+  for (int i = 0; i < grid_size; ++i) {
+    if (av3[i] != av1[i] + av2[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool test(hc::accelerator_view& acc_view, hc::hcWaitMode mode) {
+  bool ret = true;
+
+  std::random_device rd;
+  std::uniform_int_distribution<int32_t> int_dist;
+
+  // initialize test data
+  std::vector<int> table1(1024);
+  std::vector<int> table2(1024);
+  std::vector<int> table3(1024);
+  for (int i = 0; i < 1024; ++i) {
+    table1[i] = int_dist(rd);
+    table2[i] = int_dist(rd);
+  }
+  hc::array_view<const int, 1> av1(1024, table1);
+  hc::array_view<const int, 1> av2(1024, table2);
+  hc::array_view<int, 1> av3(1024, table3);
+
+  acc_view.set_default_wait_mode(mode);
+  ret &= (acc_view.get_default_wait_mode() == mode);
+
+  hc::completion_future fut = execute<1024, 16>(acc_view, av1, av2, av3);
+
+  // the kernel may or may not have finished, but the wait is not deferred
+  std::future_status status = fut.wait_for(std::chrono::seconds(0));
+  ret &= (status == std::future_status::timeout || status == std::future_status::ready);
+#if TEST_DEBUG
+  std::cout << "wait_for(0): " << (status == std::future_status::ready ? "ready" : "timeout") << "\n";
+#endif
+
+  ret &= (fut.wait_until(std::chrono::steady_clock::now() + std::chrono::seconds(60)) == std::future_status::ready);
+  ret &= fut.is_ready();
+
+  // a completed op is ready without waiting
+  ret &= (fut.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+  ret &= (fut.wait_for(std::chrono::hours::max()) == std::future_status::ready);
+
+  // verify computation result
+  ret &= verify<1024>(av1, av2, av3);
+
+  return ret;
+}
+
+int main() {
+  bool ret = true;
+
+  hc::accelerator acc;
+  hc::accelerator_view acc_view = acc.create_view();
+
+  ret &= test(acc_view, hc::hcWaitModeBlocked);
+  ret &= test(acc_view, hc::hcWaitModeActive);
+  ret &= test(acc_view, hc::hcWaitModeAdaptive);
+
+  // the default mode also applies to waits on the view
+  acc_view.wait();
+
+  return !(ret == true);
+}
@@ -0,0 +1,83 @@
+// RUN: %hc %s -o %t.out && %t.out
+
+#include <hc.hpp>
+
+#include <cstdio>
+#include <vector>
+
+#define ROWS (64)
+#define COLS (256)
+
+// A test which accesses sections of an array_view on the host in between
+// kernels that use the whole view.  Checks the rows touched on the host make
+// it back to the accelerator, the other rows are not overwritten with stale
+// host data, and synchronize_async works after the section it was called on
+// is gone.  Synchronizing a section copies only its bytes to the host, so the
+// rows outside of it keep their old contents in the host vector.
+bool check(const std::vector<int>& v, int row, int add) {
+  for (int j = 0; j < COLS; ++j) {
+    int expected = (j == 0 && row == 2) ? -1 + add : row * COLS + j + add;
+    if (v[row * COLS + j] != expected) {
+      printf("row %d, col %d: %d != %d\n", row, j, v[row * COLS + j], expected);
+      return false;
+    }
+  }
+  return true;
+}
+
+int main() {
+  bool ret = true;
+
+  std::vector<int> v(ROWS * COLS, 0);
+  hc::array_view<int, 2> av(ROWS, COLS, v);
+
+  hc::parallel_for_each(av.get_extent(), [=](hc::index<2> idx) [[hc]] {
+    av[idx] = idx[0] * COLS + idx[1];
+  });
+
+  // only rows 2 and 3 are needed on the host
+  hc::array_view<int, 2> rows = av.section(hc::index<2>(2, 0), hc::extent<2>(2, COLS));
+  rows.synchronize();
+  for (int j = 0; j < COLS; ++j) {
+    ret &= (v[2 * COLS + j] == 2 * COLS + j);
+    ret &= (v[3 * COLS + j] == 3 * COLS + j);
+  }
+  for (int i = 0; i < ROWS; ++i) {
+    for (int j = 0; j < COLS && i != 2 && i != 3; ++j) {
+      ret &= (v[i * COLS + j] == 0);
+    }
+  }
+
+  // modify one element through the section, then use the whole view again
+  rows(0, 0) = -1;
+  hc::parallel_for_each(av.get_extent(), [=](hc::index<2> idx) [[hc]] {
+    av[idx] += 1;
+  });
+
+  // synchronize a section asynchronously, without keeping it around
+  hc::completion_future fut;
+  {
+    hc::array_view<int, 2> last = av.section(hc::index<2>(ROWS - 1, 0), hc::extent<2>(1, COLS));
+    fut = last.synchronize_async();
+  }
+  fut.wait();
+  ret &= check(v, ROWS - 1, 1);
+  ret &= check(v, 2, 0);
+  for (int j = 0; j < COLS; ++j) {
+    ret &= (v[COLS + j] == 0);
+  }
+
+  av.synchronize();
+  for (int i = 0; i < ROWS; ++i) {
+    ret &= check(v, i, 1);
+  }
+
+  // a read-only section of a single column
+  hc::array_view<const int, 2> cav(av);
+  hc::array_view<const int, 2> col = cav.section(hc::index<2>(0, 5), hc::extent<2>(ROWS, 1));
+  for (int i = 0; i < ROWS; ++i) {
+    ret &= (col(i, 0) == i * COLS + 5 + 1);
+  }
+
+  return !(ret == true);
+}
@@ -0,0 +1,62 @@
+// RUN: %hc %s -lhc_am -o %t.out && %t.out
+
+#include <hc.hpp>
+#include <hc_am.hpp>
+
+#include <cstdio>
+#include <numeric>
+#include <vector>
+
+#define N (4096)
+
+// A test which destroys an array while a kernel using it is still waiting for
+// the host.  Destroying the array must not wait for the kernel, which would
+// never finish, and its memory must stay valid until the kernel is done.
+int main() {
+  bool ret = true;
+
+  hc::accelerator acc;
+  hc::accelerator_view av = acc.get_default_view();
+
+  int* go = (int*) hc::am_alloc(sizeof(int), acc, amHostPinned);
+  *go = 0;
+
+  hc::array<int, 1> out(N, av);
+  hc::completion_future done;
+  {
+    std::vector<int> init(N);
+    std::iota(init.begin(), init.end(), 0);
+    hc::array<int, 1> tmp(N, init.begin(), av);
+
+    hc::array<int, 1>& t = tmp;
+    hc::array<int, 1>& o = out;
+    done = hc::parallel_for_each(av, hc::extent<1>(N), [=, &t, &o](hc::index<1> idx) [[hc]] {
+      while (__atomic_load_n(go, __ATOMIC_ACQUIRE) == 0) {}
+      o[idx] = t[idx] * 2;
+    });
+  }
+  ret &= !done.is_ready();
+
+  // a new buffer of the same size does not get the one still in use
+  {
+    hc::array<int, 1> other(N, av);
+    std::vector<int> fill(N, -1);
+    hc::copy(fill.begin(), fill.end(), other);
+  }
+
+  __atomic_store_n(go, 1, __ATOMIC_RELEASE);
+  done.wait();
+
+  std::vector<int> result = out;
+  for (int i = 0; i < N; ++i) {
+    if (result[i] != 2 * i) {
+      printf("%d: %d != %d\n", i, result[i], 2 * i);
+      ret = false;
+      break;
+    }
+  }
+
+  hc::am_free(go);
+
+  return !(ret == true);
+}
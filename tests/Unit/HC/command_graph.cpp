@@ -0,0 +1,168 @@
+// RUN: %hc %s -lhc_am -o %t.out && %t.out
+
+#include <hc.hpp>
+#include <hc_am.hpp>
+
+#include <cstdio>
+#include <vector>
+
+#define N (1024)
+#define REPLAYS (8)
+
+// scalars the test patches in the captured kernel, picked so that they do not
+// show up anywhere else in its arguments
+#define SCALE0 (0x10203)
+#define SCALE1 (0x30201)
+
+// A test which captures an upload, a kernel, a download and a marker into a
+// command_graph, checks nothing runs while capturing, then replays the graph
+// several times, pointing the kernel at another input buffer and changing a
+// scalar argument in between.
+int main() {
+  bool ret = true;
+
+  hc::accelerator acc;
+  hc::accelerator_view av = acc.create_view();
+
+  int* inA = (int*) hc::am_alloc(sizeof(int) * N, acc, 0);
+  int* inB = (int*) hc::am_alloc(sizeof(int) * N, acc, 0);
+  int* out = (int*) hc::am_alloc(sizeof(int) * N, acc, 0);
+  int* hostIn = (int*) hc::am_alloc(sizeof(int) * N, acc, amHostPinned);
+  int* hostOut = (int*) hc::am_alloc(sizeof(int) * N, acc, amHostPinned);
+
+  std::vector<int> init(N);
+  for (int i = 0; i < N; ++i) {
+    init[i] = 2 * i + 1;
+    hostOut[i] = -1;
+  }
+  av.copy(init.data(), inB, sizeof(int) * N);
+
+  int scale = SCALE0;
+  av.begin_capture();
+  hc::completion_future upload = av.copy_async(hostIn, inA, sizeof(int) * N);
+  hc::parallel_for_each(av, hc::extent<1>(N), [=](hc::index<1> idx) [[hc]] {
+    out[idx[0]] = inA[idx[0]] * scale;
+  });
+  av.copy_async(out, hostOut, sizeof(int) * N);
+  av.create_marker();
+
+  // commands which synchronize with the host are refused
+  bool threw = false;
+  try {
+    av.wait();
+  } catch (hc::runtime_exception&) {
+    threw = true;
+  }
+  ret &= threw;
+
+  hc::command_graph graph = av.end_capture();
+
+  ret &= upload.is_ready();
+  ret &= (graph.size() == 4);
+  ret &= (graph.get_node_kind(0) == hc::hcMemcpyHostToDevice);
+  ret &= (graph.get_node_kind(1) == hc::hcCommandKernel);
+  ret &= (graph.get_node_kind(2) == hc::hcMemcpyDeviceToHost);
+  ret &= (graph.get_node_kind(3) == hc::hcCommandMarker);
+  ret &= (graph.get_kernel_arg_size(0) == 0);
+  ret &= (graph.get_kernel_arg_size(1) > 0);
+
+  // nothing ran
+  for (int i = 0; i < N; ++i) {
+    ret &= (hostOut[i] == -1);
+  }
+
+  int* in = inA;
+  for (int r = 0; r < REPLAYS && ret; ++r) {
+    for (int i = 0; i < N; ++i) {
+      hostIn[i] = r * N + i;
+    }
+
+    // odd replays read the buffer which is not uploaded to, with the other scale
+    int* nextIn = (r % 2) ? inB : inA;
+    int nextScale = (r % 2) ? SCALE1 : SCALE0;
+    if (nextIn != in) {
+      ret &= (graph.replace_kernel_arg(1, in, nextIn) == 1);
+      ret &= (graph.replace_kernel_arg(1, scale, nextScale) == 1);
+      in = nextIn;
+      scale = nextScale;
+    }
+
+    av.replay(graph).wait();
+
+    for (int i = 0; i < N; ++i) {
+      int expected = ((r % 2) ? init[i] : (r * N + i)) * scale;
+      if (hostOut[i] != expected) {
+        printf("replay %d, i=%d: %d != %d\n", r, i, hostOut[i], expected);
+        ret = false;
+        break;
+      }
+    }
+  }
+
+  // kernels reading an array_view can be captured, kernels writing one can't
+  {
+    std::vector<int> table(N, 3);
+    hc::array_view<const int, 1> view(N, table);
+    hc::array_view<int, 1> written(N, init);
+
+    av.begin_capture();
+    hc::parallel_for_each(av, hc::extent<1>(N), [=](hc::index<1> idx) [[hc]] {
+      out[idx[0]] = view[idx];
+    });
+    threw = false;
+    try {
+      hc::parallel_for_each(av, hc::extent<1>(N), [=](hc::index<1> idx) [[hc]] {
+        written[idx] = 0;
+      });
+    } catch (hc::runtime_exception&) {
+      threw = true;
+    }
+    ret &= threw;
+    hc::command_graph readGraph = av.end_capture();
+    ret &= (readGraph.size() == 1);
+
+    av.replay(readGraph).wait();
+    av.copy(out, hostOut, sizeof(int) * N);
+    for (int i = 0; i < N; ++i) {
+      ret &= (hostOut[i] == 3);
+    }
+  }
+
+  // the data of a read-only array_view dropped while replayed kernels read it
+  // is released after they completed
+  {
+    hc::command_graph readGraph;
+    hc::completion_future last;
+    {
+      std::vector<int> table(N, 5);
+      hc::array_view<const int, 1> view(N, table);
+
+      av.begin_capture();
+      hc::parallel_for_each(av, hc::extent<1>(N), [=](hc::index<1> idx) [[hc]] {
+        int sum = 0;
+        for (int i = 0; i < N; ++i) {
+          sum += view[(idx[0] + i) % N];
+        }
+        out[idx[0]] = sum / N;
+      });
+      readGraph = av.end_capture();
+
+      for (int r = 0; r < REPLAYS; ++r) {
+        last = av.replay(readGraph);
+      }
+    }
+    last.wait();
+    av.copy(out, hostOut, sizeof(int) * N);
+    for (int i = 0; i < N; ++i) {
+      ret &= (hostOut[i] == 5);
+    }
+  }
+
+  hc::am_free(inA);
+  hc::am_free(inB);
+  hc::am_free(out);
+  hc::am_free(hostIn);
+  hc::am_free(hostOut);
+
+  return !(ret == true);
+}
@@ -0,0 +1,115 @@
+// RUN: %hc %s -o %t.out && %t.out
+
+#include <hc.hpp>
+
+#include <poll.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <memory>
+#include <random>
+
+// loop to deliberately slow down kernel execution
+#define LOOP_COUNT (1024)
+
+#define TEST_DEBUG (0)
+
+// wait for fd to become readable, for at most 60s
+bool readable(int fd) {
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  bool ret = (epfd >= 0) && (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0);
+
+  epoll_event out;
+  ret &= (epoll_wait(epfd, &out, 1, 60 * 1000) == 1) && (out.data.fd == fd);
+  close(epfd);
+  return ret;
+}
+
+// An example which waits for a kernel and a marker through
+// completion_future::get_completion_fd() and epoll
+bool test() {
+  bool ret = true;
+
+  // define inputs and output
+  const int vecSize = 2048;
+
+  hc::array_view<int, 1> table_a(vecSize);
+  hc::array_view<int, 1> table_b(vecSize);
+  hc::array_view<int, 1> table_c(vecSize);
+
+  // initialize test data
+  std::random_device rd;
+  std::uniform_int_distribution<int32_t> int_dist;
+  for (int i = 0; i < vecSize; ++i) {
+    table_a[i] = int_dist(rd);
+    table_b[i] = int_dist(rd);
+  }
+
+  // launch kernel
+  hc::extent<1> e(vecSize);
+  hc::completion_future fut = hc::parallel_for_each(
+    e,
+    [=](hc::index<1> idx) __HC__ {
+      for (int i = 0; i < LOOP_COUNT; ++i)
+        table_c(idx) = table_a(idx) + table_b(idx);
+  });
+
+  int fd = fut.get_completion_fd();
+  ret &= (fd >= 0);
+
+  // copies of the future share the descriptor
+  hc::completion_future copy = fut;
+  ret &= (copy.get_completion_fd() == fd);
+
+  ret &= readable(fd);
+  ret &= fut.is_ready();
+  uint64_t count = 0;
+  ret &= (read(fd, &count, sizeof(count)) == sizeof(count)) && (count == 1);
+  fut.wait();
+
+  // verify computation result
+  for (int i = 0; i < vecSize; ++i) {
+    ret &= (table_c[i] == table_a[i] + table_b[i]);
+  }
+
+  // markers, and ops which completed before the descriptor was asked for
+  hc::accelerator_view av = hc::accelerator().get_default_view();
+  hc::completion_future marker = av.create_marker();
+  marker.wait();
+  ret &= readable(marker.get_completion_fd());
+
+  // an invalid future has no descriptor
+  ret &= (hc::completion_future().get_completion_fd() == -1);
+
+  return ret;
+}
+
+// the same through a host op, as completion_future::then() returns
+bool test_host_op() {
+  bool ret = true;
+
+  auto op = std::make_shared<Kalmar::KalmarHostOp>();
+  int fd = Kalmar::KalmarAsyncOp::getCompletionFd(op);
+  ret &= (fd >= 0);
+
+  pollfd p = { fd, POLLIN, 0 };
+  ret &= (poll(&p, 1, 0) == 0);
+
+  op->complete();
+  ret &= readable(fd);
+
+  return ret;
+}
+
+int main() {
+  bool ret = true;
+
+  ret &= test();
+  ret &= test_host_op();
+
+  return !(ret == true);
+}
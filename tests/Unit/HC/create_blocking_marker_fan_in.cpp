@@ -0,0 +1,167 @@
+// RUN: %hc %s -lhc_am -o %t.out && %t.out
+
+#include <hc.hpp>
+#include <hc_am.hpp>
+
+#include <vector>
+
+// loop to deliberately slow down kernel execution
+#define LOOP_COUNT (1024)
+
+#define N (256)
+
+// upper bound of the iterations of the kernel blocking a queue, in case the
+// host never opens the gate
+#define SPIN_LIMIT (1L << 32)
+
+// A test which joins kernels running on many accelerator_views, more than a
+// single barrier packet can hold, with
+// accelerator_view::create_blocking_marker(std::vector<completion_future>&),
+// then runs a kernel ordered after the marker which reads all of their results.
+bool test(int producerCount) {
+  bool ret = true;
+
+  hc::accelerator acc;
+  hc::accelerator_view consumer = acc.create_view();
+  std::vector<hc::accelerator_view> producers;
+  for (int q = 0; q < producerCount; ++q) {
+    producers.push_back(acc.create_view());
+  }
+
+  int* p = (int*) hc::am_alloc(sizeof(int) * N * producerCount, acc, 0);
+  int* sum = (int*) hc::am_alloc(sizeof(int) * N, acc, 0);
+
+  std::vector<hc::completion_future> futures;
+  for (int q = 0; q < producerCount; ++q) {
+    futures.push_back(hc::parallel_for_each(producers[q], hc::extent<1>(N), [=](hc::index<1> idx) [[hc]] {
+      int v = 0;
+      for (int i = 0; i < LOOP_COUNT; ++i) {
+        v = (v + idx[0] + q) % 1000;
+      }
+      p[q * N + idx[0]] = v + 1;
+    }));
+  }
+  // a duplicate dependency is accepted too.  It is not dropped: only compute
+  // commands of the marker's own in-order queue, and ops whose signal is
+  // already 0, are implied, and it is on another queue and may still run.
+  futures.push_back(hc::completion_future(futures[0]));
+
+  hc::completion_future marker = consumer.create_blocking_marker(futures, hc::accelerator_scope);
+
+  hc::parallel_for_each(consumer, hc::extent<1>(N), [=](hc::index<1> idx) [[hc]] {
+    int s = 0;
+    for (int q = 0; q < producerCount; ++q) {
+      s += p[q * N + idx[0]];
+    }
+    sum[idx[0]] = s;
+  });
+  consumer.wait();
+
+  ret &= marker.is_ready();
+  for (auto& f : futures) {
+    ret &= f.is_ready();
+  }
+
+  std::vector<int> host(N * producerCount);
+  std::vector<int> hostSum(N);
+  consumer.copy(p, host.data(), sizeof(int) * N * producerCount);
+  consumer.copy(sum, hostSum.data(), sizeof(int) * N);
+  for (int i = 0; i < N; ++i) {
+    int s = 0;
+    for (int q = 0; q < producerCount; ++q) {
+      s += host[q * N + i];
+    }
+    ret &= (s == hostSum[i]);
+  }
+
+  hc::am_free(p);
+  hc::am_free(sum);
+
+  return ret;
+}
+
+// a kernel which keeps av busy until the host opens *gate, so that the
+// packets enqueued behind it stay pending and can be counted
+hc::completion_future block(hc::accelerator_view& av, int* gate) {
+  return hc::parallel_for_each(av, hc::extent<1>(1), [=](hc::index<1> idx) [[hc]] {
+    for (long i = 0; i < SPIN_LIMIT && hc::atomic_fetch_add(gate, 0) == 0; ++i) {}
+  });
+}
+
+// A test which passes more dependencies than a single barrier packet can hold,
+// which are either kernels of the marker's own in-order queue or kernels which
+// have already completed.  Neither needs a slot in a barrier packet, so each
+// marker is a single packet, and it still completes after all of them.
+bool test_implied(int depCount) {
+  bool ret = true;
+
+  hc::accelerator acc;
+  hc::accelerator_view av = acc.create_view();
+  hc::accelerator_view other = acc.create_view();
+
+  int* gate = (int*) hc::am_alloc(sizeof(int), acc, amHostCoherent);
+  int* p = (int*) hc::am_alloc(sizeof(int) * N * depCount * 2, acc, 0);
+  *gate = 0;
+
+  // already completed, on another queue
+  std::vector<hc::completion_future> done;
+  for (int q = 0; q < depCount; ++q) {
+    done.push_back(hc::parallel_for_each(other, hc::extent<1>(N), [=](hc::index<1> idx) [[hc]] {
+      p[q * N + idx[0]] = q + 1;
+    }));
+  }
+  other.wait();
+
+  // on the marker's queue, behind a kernel waiting for the gate
+  hc::completion_future blocker = block(av, gate);
+  std::vector<hc::completion_future> same;
+  for (int q = 0; q < depCount; ++q) {
+    same.push_back(hc::parallel_for_each(av, hc::extent<1>(N), [=](hc::index<1> idx) [[hc]] {
+      p[(depCount + q) * N + idx[0]] = p[q * N + idx[0]] * 2;
+    }));
+  }
+
+  int pending = av.get_pending_async_ops();
+  hc::completion_future sameMarker = av.create_blocking_marker(same, hc::accelerator_scope);
+  ret &= (av.get_pending_async_ops() == pending + 1);
+  hc::completion_future doneMarker = av.create_blocking_marker(done, hc::accelerator_scope);
+  ret &= (av.get_pending_async_ops() == pending + 2);
+  ret &= !sameMarker.is_ready();
+
+  __atomic_store_n(gate, 1, __ATOMIC_RELEASE);
+  doneMarker.wait();
+
+  ret &= sameMarker.is_ready();
+  ret &= blocker.is_ready();
+  for (auto& f : same) {
+    ret &= f.is_ready();
+  }
+
+  std::vector<int> host(N * depCount * 2);
+  av.copy(p, host.data(), sizeof(int) * N * depCount * 2);
+  for (int q = 0; q < depCount; ++q) {
+    for (int i = 0; i < N; ++i) {
+      ret &= (host[q * N + i] == q + 1);
+      ret &= (host[(depCount + q) * N + i] == (q + 1) * 2);
+    }
+  }
+
+  hc::am_free(gate);
+  hc::am_free(p);
+
+  return ret;
+}
+
+int main() {
+  bool ret = true;
+
+  ret &= test(1);
+  ret &= test(5);
+  ret &= test(16);
+  ret &= test(64);
+
+  ret &= test_implied(1);
+  ret &= test_implied(16);
+
+  return !(ret == true);
+}
@@ -0,0 +1,93 @@
+// RUN: %hc %s -lhc_am -o %t.out && %t.out
+
+#include <hc.hpp>
+#include <hc_am.hpp>
+
+#define N (1024)
+#define KERNEL_COUNT (100)
+
+// A test which enqueues a chain of dependent kernels inside a dispatch batch
+// and verifies they all execute, in order, once the batch is closed.
+// Also checks that waiting on a command of an open batch submits the batch.
+bool test_scoped() {
+  bool ret = true;
+
+  hc::accelerator acc;
+  hc::accelerator_view av = acc.get_default_view();
+  int *p = (int*) hc::am_alloc(sizeof(int) * N, acc, 0);
+  int *host = new int[N];
+  for (int i = 0; i < N; ++i) host[i] = 0;
+  av.copy(host, p, sizeof(int) * N);
+
+  hc::completion_future fut;
+  {
+    hc::dispatch_batch batch(av);
+    for (int k = 0; k < KERNEL_COUNT; ++k) {
+      fut = hc::parallel_for_each(av, hc::extent<1>(N), [=](hc::index<1> idx) [[hc]] {
+        // every kernel depends on the result of the previous one
+        p[idx[0]] = p[idx[0]] + 1;
+      });
+    }
+  }
+  fut.wait();
+
+  av.copy(p, host, sizeof(int) * N);
+  for (int i = 0; i < N; ++i) {
+    ret &= (host[i] == KERNEL_COUNT);
+  }
+
+  // wait on a kernel while its batch is still open
+  {
+    hc::dispatch_batch batch(av);
+    fut = hc::parallel_for_each(av, hc::extent<1>(N), [=](hc::index<1> idx) [[hc]] {
+      p[idx[0]] = -1;
+    });
+    fut.wait();
+    ret &= fut.is_ready();
+  }
+
+  av.copy(p, host, sizeof(int) * N);
+  for (int i = 0; i < N; ++i) {
+    ret &= (host[i] == -1);
+  }
+
+  delete [] host;
+  hc::am_free(p);
+  return ret;
+}
+
+// A test which uses nested begin/end calls and accelerator_view::wait()
+bool test_nested() {
+  bool ret = true;
+
+  hc::array_view<int, 1> a(N);
+  for (int i = 0; i < N; ++i) a[i] = i;
+
+  hc::accelerator_view av = hc::accelerator().get_default_view();
+  av.begin_dispatch_batch();
+  av.begin_dispatch_batch();
+  hc::parallel_for_each(av, hc::extent<1>(N), [=](hc::index<1> idx) [[hc]] {
+    a[idx] += 1;
+  });
+  av.end_dispatch_batch();
+  hc::parallel_for_each(av, hc::extent<1>(N), [=](hc::index<1> idx) [[hc]] {
+    a[idx] *= 2;
+  });
+  av.end_dispatch_batch();
+  av.wait();
+
+  for (int i = 0; i < N; ++i) {
+    ret &= (a[i] == (i + 1) * 2);
+  }
+
+  return ret;
+}
+
+int main() {
+  bool ret = true;
+
+  ret &= test_scoped();
+  ret &= test_nested();
+
+  return !(ret == true);
+}
@@ -0,0 +1,56 @@
+// RUN: %hc %s -lhc_am -o %t.out && %t.out
+
+#include <hc.hpp>
+#include <hc_am.hpp>
+
+#include <vector>
+
+// A test which streams several times more kernels into a queue than it can
+// hold in flight (MAX_INFLIGHT_COMMANDS_PER_QUEUE, 16K) without waiting,
+// while keeping some completion_futures alive, and checks every kernel ran
+// in order.
+
+#define N (64)
+#define DISPATCH_COUNT (3 * 16384 + 123)
+
+int main() {
+  bool ret = true;
+
+  hc::accelerator acc;
+  hc::accelerator_view av = acc.get_default_view();
+  int* p = (int*) hc::am_alloc(sizeof(int) * N, acc, 0);
+  int host[N];
+  for (int i = 0; i < N; ++i) host[i] = 0;
+  av.copy(host, p, sizeof(int) * N);
+
+  std::vector<hc::completion_future> kept;
+  for (int k = 0; k < DISPATCH_COUNT; ++k) {
+    hc::completion_future fut = hc::parallel_for_each(av, hc::extent<1>(N), [=](hc::index<1> idx) [[hc]] {
+      p[idx[0]] = p[idx[0]] * 3 % 1000003 + 1;
+    });
+    if (k % 5000 == 0) {
+      kept.push_back(fut);
+    }
+  }
+
+  // futures of ops retired from the ring can still be waited on
+  for (auto& f : kept) {
+    f.wait();
+    ret &= f.is_ready();
+  }
+  av.wait();
+
+  int expected = 0;
+  for (int k = 0; k < DISPATCH_COUNT; ++k) {
+    expected = expected * 3 % 1000003 + 1;
+  }
+
+  av.copy(p, host, sizeof(int) * N);
+  for (int i = 0; i < N; ++i) {
+    ret &= (host[i] == expected);
+  }
+
+  hc::am_free(p);
+
+  return !(ret == true);
+}
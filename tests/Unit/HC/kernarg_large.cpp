@@ -0,0 +1,54 @@
+// RUN: %hc %s -o %t.out && %t.out
+#include <hc.hpp>
+
+#include <vector>
+
+// a test which dispatches kernels whose kernarg block is larger than
+// the default kernarg buffer size (512 bytes), many more times than
+// a single chunk of the per-queue kernarg ring can hold, so that larger
+// size classes are used, recycled and grown
+
+#define N (16)
+
+bool test(int iterations) {
+  std::vector<hc::array_view<int, 1>> v;
+  for (int i = 0; i < 24; ++i) {
+    v.push_back(hc::array_view<int, 1>(N));
+    for (int j = 0; j < N; ++j) v[i][j] = i;
+  }
+  hc::array_view<int, 1> out(N);
+
+  auto v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3], v4 = v[4], v5 = v[5];
+  auto v6 = v[6], v7 = v[7], v8 = v[8], v9 = v[9], v10 = v[10], v11 = v[11];
+  auto v12 = v[12], v13 = v[13], v14 = v[14], v15 = v[15], v16 = v[16], v17 = v[17];
+  auto v18 = v[18], v19 = v[19], v20 = v[20], v21 = v[21], v22 = v[22], v23 = v[23];
+
+  for (int it = 0; it < iterations; ++it) {
+    hc::parallel_for_each(hc::accelerator().get_default_view(),
+                          hc::extent<1>(N),
+                          [=](hc::index<1> idx) [[hc]] {
+      out(idx) = v0(idx) + v1(idx) + v2(idx) + v3(idx) + v4(idx) + v5(idx) +
+                 v6(idx) + v7(idx) + v8(idx) + v9(idx) + v10(idx) + v11(idx) +
+                 v12(idx) + v13(idx) + v14(idx) + v15(idx) + v16(idx) + v17(idx) +
+                 v18(idx) + v19(idx) + v20(idx) + v21(idx) + v22(idx) + v23(idx) + it;
+    });
+  }
+  hc::accelerator().get_default_view().wait();
+
+  bool ret = true;
+  // 0 + 1 + ... + 23 == 276
+  for (int j = 0; j < N; ++j) {
+    ret &= (out[j] == 276 + iterations - 1);
+  }
+  return ret;
+}
+
+int main() {
+  bool ret = true;
+
+  ret &= test(1);
+  ret &= test(100);
+  ret &= test(1000);
+
+  return !(ret == true);
+}
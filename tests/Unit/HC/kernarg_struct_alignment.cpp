@@ -0,0 +1,60 @@
+// RUN: %hc %s -o %t.out && %t.out
+#include <hc.hpp>
+
+#include <cstdio>
+
+// a test which captures structs whose sizes are not powers of two, or whose
+// size is larger than their alignment, each followed by a scalar, so that
+// every argument after them is misplaced unless the kernel arguments are
+// laid out with the alignment of their types
+
+struct S6 {
+  short a, b, c;
+};
+
+struct S12 {
+  int a, b, c;
+};
+
+struct S16 {
+  int a, b, c, d;
+};
+
+#define N (9)
+
+int main() {
+  bool ret = true;
+
+  S6 s6 = { 1, 2, 3 };
+  char c0 = 4;
+  S12 s12 = { 5, 6, 7 };
+  short h0 = 8;
+  S16 s16 = { 9, 10, 11, 12 };
+  int i0 = 13;
+  char c1 = 14;
+  S12 s12b = { 15, 16, 17 };
+  double d0 = 18.0;
+
+  hc::array_view<int, 1> out(N);
+  hc::parallel_for_each(hc::extent<1>(1), [=](hc::index<1> idx) [[hc]] {
+    out[0] = s6.a + s6.b + s6.c;
+    out[1] = c0;
+    out[2] = s12.a + s12.b + s12.c;
+    out[3] = h0;
+    out[4] = s16.a + s16.b + s16.c + s16.d;
+    out[5] = i0;
+    out[6] = c1;
+    out[7] = s12b.a + s12b.b + s12b.c;
+    out[8] = (int)d0;
+  }).wait();
+
+  const int expected[N] = { 6, 4, 18, 8, 42, 13, 14, 48, 18 };
+  for (int i = 0; i < N; ++i) {
+    if (out[i] != expected[i]) {
+      printf("out[%d]: %d != %d\n", i, out[i], expected[i]);
+      ret = false;
+    }
+  }
+
+  return !(ret == true);
+}
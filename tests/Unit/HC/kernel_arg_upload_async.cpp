@@ -0,0 +1,60 @@
+// RUN: %hc %s -o %t.out && %t.out
+
+#include <hc.hpp>
+
+#include <cstdio>
+#include <vector>
+
+#define N (1024 * 64)
+
+// loop to deliberately slow down kernel execution
+#define LOOP_COUNT (256)
+
+// A test which overwrites the host data of an array_view right after a kernel
+// using it was launched.  The upload of the kernel argument is asynchronous,
+// so it must have taken its copy of the host data by the time the launch
+// returns: the kernel sees the old data, and a later read of the array_view
+// the kernel wrote sees the kernel's results.
+int main() {
+  bool ret = true;
+
+  hc::accelerator_view av = hc::accelerator().get_default_view();
+
+  for (int round = 0; round < 4 && ret; ++round) {
+    std::vector<int> input(N);
+    std::vector<int> output(N, -1);
+    for (int i = 0; i < N; ++i) {
+      input[i] = round * N + i;
+    }
+
+    hc::array_view<const int, 1> in(N, input);
+    hc::array_view<int, 1> out(N, output);
+    out.discard_data();
+
+    hc::completion_future fut = hc::parallel_for_each(av, hc::extent<1>(N), [=](hc::index<1> idx) [[hc]] {
+      int sum = 0;
+      for (int i = 0; i < LOOP_COUNT; ++i) {
+        sum += in[idx];
+      }
+      out[idx] = sum;
+    });
+
+    // overwrite the source of the upload while the kernel may still be queued
+    for (int i = 0; i < N; ++i) {
+      input[i] = -1;
+    }
+
+    fut.wait();
+
+    for (int i = 0; i < N; ++i) {
+      int expected = (round * N + i) * LOOP_COUNT;
+      if (out[i] != expected) {
+        printf("round %d, i=%d: %d != %d\n", round, i, out[i], expected);
+        ret = false;
+        break;
+      }
+    }
+  }
+
+  return !(ret == true);
+}
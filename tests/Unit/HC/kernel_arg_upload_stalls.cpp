@@ -0,0 +1,126 @@
+// RUN: %hc %s -o %t.out && %t.out
+
+#include <hc.hpp>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#define N (1024)
+#define VIEWS (6)
+#define LAUNCHES (4)
+
+// A test which serializes the array_view arguments of a kernel against a stub
+// device, the way a kernel launch does, and counts how often the host would
+// stall per launch.  Uploading stale arguments must not use blocking writes
+// or wait for the queue, and arguments already on the device are not copied.
+
+class StubQueue : public Kalmar::KalmarQueue {
+public:
+  int blockingWrites;
+  int asyncWrites;
+  int reads;
+  int waits;
+
+  StubQueue(Kalmar::KalmarDevice* dev)
+    : KalmarQueue(dev), blockingWrites(0), asyncWrites(0), reads(0), waits(0) {}
+
+  void wait(Kalmar::hcWaitMode mode = Kalmar::hcWaitModeBlocked) override { ++waits; }
+
+  void read(void* device, void* dst, size_t count, size_t offset) override {
+    ++reads;
+    memcpy(dst, (char*)device + offset, count);
+  }
+
+  void write(void* device, const void* src, size_t count, size_t offset, bool blocking) override {
+    ++(blocking ? blockingWrites : asyncWrites);
+    memcpy((char*)device + offset, src, count);
+  }
+
+  void copy(void* src, void* dst, size_t count, size_t src_offset, size_t dst_offset, bool blocking) override {
+    memcpy((char*)dst + dst_offset, (char*)src + src_offset, count);
+  }
+
+  void* map(void* device, size_t count, size_t offset, bool modify) override { return (char*)device + offset; }
+
+  void unmap(void* device, void* addr, size_t count, size_t offset, bool modify) override {}
+
+  void Push(void* kernel, int idx, void* device, bool modify) override {}
+};
+
+class StubDevice : public Kalmar::KalmarDevice {
+public:
+  std::wstring get_path() const override { return L"stub"; }
+  std::wstring get_description() const override { return L"stub device"; }
+  size_t get_mem() const override { return 0; }
+  bool is_double() const override { return true; }
+  bool is_lim_double() const override { return true; }
+  bool is_unified() const override { return false; }
+  bool is_emulated() const override { return true; }
+  uint32_t get_version() const override { return 0; }
+
+  void* create(size_t count, struct Kalmar::rw_info* key) override { return malloc(count); }
+  void release(void* ptr, struct Kalmar::rw_info* key) override { free(ptr); }
+
+  std::shared_ptr<Kalmar::KalmarQueue> createQueue(Kalmar::execute_order order = Kalmar::execute_in_order,
+                                                   Kalmar::queue_priority priority = Kalmar::priority_normal) override {
+    return std::make_shared<StubQueue>(this);
+  }
+};
+
+// what a kernel launch does with the array_views it captures
+template <typename View>
+void serialize_arguments(std::shared_ptr<Kalmar::KalmarQueue> queue, std::vector<View>& views) {
+  Kalmar::BufferArgumentsAppender appender(queue, nullptr);
+  Kalmar::Serialize s(&appender);
+  for (auto& view : views) {
+    view.internal().__cxxamp_serialize(s);
+  }
+}
+
+int main() {
+  bool ret = true;
+
+  StubDevice dev;
+  std::shared_ptr<Kalmar::KalmarQueue> queue = dev.get_default_queue();
+  StubQueue* stub = static_cast<StubQueue*>(queue.get());
+
+  std::vector<std::vector<int>> inputs(VIEWS, std::vector<int>(N, 1));
+  std::vector<hc::array_view<const int, 1>> views;
+  for (int i = 0; i < VIEWS; ++i) {
+    views.push_back(hc::array_view<const int, 1>(N, inputs[i]));
+  }
+
+  for (int launch = 0; launch < LAUNCHES; ++launch) {
+    stub->blockingWrites = stub->asyncWrites = stub->waits = 0;
+    serialize_arguments(queue, views);
+
+    int stalls = stub->blockingWrites + stub->waits;
+    int expectedWrites = (launch == 0) ? VIEWS : 0;
+    printf("launch %d: %d uploads, %d host stalls\n", launch, stub->asyncWrites, stalls);
+    ret &= (stalls == 0);
+    ret &= (stub->asyncWrites == expectedWrites);
+  }
+
+  // a view written by a kernel is read back once on the host, and only the
+  // part written on the host is uploaded again
+  std::vector<int> data(N, 0);
+  {
+    std::vector<hc::array_view<int, 1>> out(1, hc::array_view<int, 1>(N, data));
+    serialize_arguments(queue, out);
+    ret &= (stub->reads == 0);
+
+    hc::array_view<int, 1> head = out[0].section(0, 16);
+    head[0] = 42;
+    ret &= (stub->reads == 1);
+
+    stub->blockingWrites = stub->asyncWrites = stub->waits = 0;
+    serialize_arguments(queue, out);
+    ret &= (stub->blockingWrites + stub->waits == 0);
+    ret &= (stub->asyncWrites == 1);
+  }
+  ret &= (data[0] == 42);
+
+  return !(ret == true);
+}
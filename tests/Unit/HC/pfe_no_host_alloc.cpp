@@ -0,0 +1,70 @@
+// RUN: %hc %s -lhc_am -o %t.out && %t.out
+
+#include <hc.hpp>
+#include <hc_am.hpp>
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+// A test which counts host heap allocations made while enqueuing kernels
+// in steady state.  Once the runtime has warmed up (kernel looked up, op
+// storage, signals and kernarg buffers pooled), a parallel_for_each on
+// raw device pointers is expected to do no heap allocation at all.
+
+#define N (1024)
+#define DISPATCH_COUNT (1000)
+
+static std::atomic<long> allocCount(0);
+
+void* operator new(std::size_t sz) {
+  allocCount++;
+  void* p = std::malloc(sz ? sz : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+void run(hc::accelerator_view& av, int* p) {
+  for (int i = 0; i < DISPATCH_COUNT; ++i) {
+    hc::parallel_for_each(av, hc::extent<1>(N), [=](hc::index<1> idx) [[hc]] {
+      p[idx[0]] += 1;
+    });
+  }
+  av.wait();
+}
+
+int main() {
+  bool ret = true;
+
+  hc::accelerator acc;
+  hc::accelerator_view av = acc.get_default_view();
+  int* p = (int*) hc::am_alloc(sizeof(int) * N, acc, 0);
+  int* host = new int[N];
+  for (int i = 0; i < N; ++i) host[i] = 0;
+  av.copy(host, p, sizeof(int) * N);
+
+  // warm up
+  run(av, p);
+
+  long before = allocCount.load();
+  run(av, p);
+  long allocs = allocCount.load() - before;
+
+  std::cout << "heap allocations for " << DISPATCH_COUNT << " dispatches: " << allocs << "\n";
+  ret &= (allocs == 0);
+
+  av.copy(p, host, sizeof(int) * N);
+  for (int i = 0; i < N; ++i) {
+    ret &= (host[i] == 2 * DISPATCH_COUNT);
+  }
+
+  delete [] host;
+  hc::am_free(p);
+
+  return !(ret == true);
+}
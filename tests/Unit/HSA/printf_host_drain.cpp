@@ -0,0 +1,204 @@
+// RUN: %hc %s -o %t.out && %t.out
+
+// Exercises the host side of the printf buffer without an accelerator: records
+// are written with hc::printf on host threads and consumed by hc::PrintfDrainer.
+
+#include <hc_printf.hpp>
+
+#include <atomic>
+#include <cstdio>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#define WRITERS (4)
+#define LINES (2000)
+
+struct Buffer {
+  std::vector<hc::PrintfPacket> packets;
+  std::vector<char> strings;
+  Buffer(unsigned int size) : packets(size), strings(size * 12) {
+    hc::setupPrintfBuffer(packets.data(), size, strings.data(), strings.size());
+  }
+  hc::PrintfPacket* data() { return packets.data(); }
+};
+
+std::string contents(FILE* f) {
+  std::string s;
+  char chunk[4096];
+  std::rewind(f);
+  size_t n;
+  while ((n = std::fread(chunk, 1, sizeof(chunk), f)) > 0) {
+    s.append(chunk, n);
+  }
+  return s;
+}
+
+bool test_parse() {
+  hc::PrintfFormat format;
+  hc::parsePrintfFormat("x %-8.3lu y %% z %q%", format);
+  return format.specifiers.size() == 1 &&
+         format.specifiers[0].literal == "x " &&
+         format.specifiers[0].raw == "%-8.3lu" &&
+         format.specifiers[0].spec32 == "%-8.3u" &&
+         format.specifiers[0].spec64 == "%-8.3llu" &&
+         format.tail == " y % z %q%";
+}
+
+bool test_format() {
+  Buffer buffer(256);
+  FILE* out = std::tmpfile();
+  hc::PrintfDrainer drainer(out);
+
+  hc::printf(buffer.data(), "%d %5.2f %s %x %lld|%c\n", -1, 3.14159, "str", -1, (long long)-5, 'z');
+  hc::printf(buffer.data(), "missing %d %d\n", 7);
+  hc::printf(buffer.data(), "extra\n", 1, 2);
+  unsigned int written = drainer.drain(buffer.data());
+
+  char expected[256];
+  std::snprintf(expected, sizeof(expected), "%d %5.2f %s %x %lld|%c\nmissing 7 %%d\nextra\n",
+                -1, 3.14159, "str", -1, -5LL, 'z');
+  bool ret = (written == 3) && (contents(out) == expected);
+
+  // the buffer is rewound once consumed
+  ret &= (buffer.data()[hc::PRINTF_OFFSETS].data.uia[0] == hc::PRINTF_HEADER_SIZE);
+
+  std::fclose(out);
+  return ret;
+}
+
+// a record which reserved its space where the unsigned arguments of a
+// consumed record were is not mistaken as published
+bool test_stale_arguments() {
+  Buffer buffer(256);
+  FILE* out = std::tmpfile();
+  hc::PrintfDrainer drainer(out);
+  hc::PrintfPacket* packets = buffer.data();
+
+  hc::printf(packets, "a %u %u %u\n", 1u, 2u, 3u);
+  bool ret = (drainer.drain(packets) == 1);
+  hc::printf(packets, "b\n");
+
+  // reserve two packets as a kernel would, without publishing them yet
+  hc::PrintfPacketData offsets, reserved;
+  offsets.uli = packets[hc::PRINTF_OFFSETS].data.ali.load();
+  reserved.uia[0] = offsets.uia[0] + 2;
+  reserved.uia[1] = offsets.uia[1];
+  packets[hc::PRINTF_OFFSETS].data.ali.store(reserved.uli);
+  const unsigned int poffset = offsets.uia[0];
+
+  ret &= (drainer.drain(packets) == 1);
+  ret &= (packets[hc::PRINTF_OFFSETS].data.uia[0] == reserved.uia[0]);
+
+  packets[poffset + 1].set("c\n");
+  packets[poffset].data.ui = 1;
+  __atomic_store_n(&packets[poffset].type, hc::PRINTF_RECORD, __ATOMIC_RELEASE);
+
+  ret &= (drainer.drain(packets) == 1);
+  ret &= (contents(out) == "a 1 2 3\nb\nc\n");
+  ret &= (packets[hc::PRINTF_OFFSETS].data.uia[0] == hc::PRINTF_HEADER_SIZE);
+
+  std::fclose(out);
+  return ret;
+}
+
+// records of different lengths with unsigned arguments, drained while they
+// are written: every line comes out exactly once
+bool test_mixed_records() {
+  Buffer buffer(64);
+  FILE* out = std::tmpfile();
+  hc::PrintfDrainer drainer(out);
+  drainer.start(buffer.data(), std::chrono::microseconds(50));
+
+  std::vector<std::thread> writers;
+  for (int t = 0; t < WRITERS; ++t) {
+    writers.emplace_back([&buffer, t] {
+      for (unsigned int i = 0; i < LINES; ++i) {
+        hc::PrintfError err;
+        do {
+          if (i % 3 == 0)
+            err = hc::printf(buffer.data(), "writer %d line %u\n", t, i);
+          else if (i % 3 == 1)
+            err = hc::printf(buffer.data(), "writer %d line %u %u %u\n", t, i, i, i);
+          else
+            err = hc::printf(buffer.data(), "writer %d line %u %u %u %u %u %u\n", t, i, i, i, i, i, i);
+          if (err != hc::PRINTF_SUCCESS)
+            std::this_thread::yield();
+        } while (err != hc::PRINTF_SUCCESS);
+      }
+    });
+  }
+  for (auto& w : writers) w.join();
+  drainer.stop();
+  drainer.drain(buffer.data());
+
+  std::set<std::pair<int, unsigned int>> seen;
+  bool ret = true;
+  std::string s = contents(out);
+  for (size_t pos = 0; pos < s.size(); ) {
+    size_t eol = s.find('\n', pos);
+    int t = -1;
+    unsigned int i = 0;
+    ret &= (std::sscanf(s.c_str() + pos, "writer %d line %u", &t, &i) == 2);
+    ret &= seen.insert(std::make_pair(t, i)).second;
+    pos = eol + 1;
+  }
+  ret &= (seen.size() == WRITERS * LINES);
+  ret &= (drainer.getStats().dropped == 0);
+
+  std::fclose(out);
+  return ret;
+}
+
+// writers fill a small buffer while the background thread drains it: every
+// line which was accepted comes out exactly once
+bool test_background_drain() {
+  Buffer buffer(256);
+  FILE* out = std::tmpfile();
+  hc::PrintfDrainer drainer(out);
+  drainer.start(buffer.data(), std::chrono::microseconds(100));
+
+  std::vector<std::thread> writers;
+  for (int t = 0; t < WRITERS; ++t) {
+    writers.emplace_back([&buffer, t] {
+      for (int i = 0; i < LINES; ++i) {
+        while (hc::printf(buffer.data(), "writer %d line %d\n", t, i) != hc::PRINTF_SUCCESS) {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  for (auto& w : writers) w.join();
+  drainer.stop();
+  drainer.drain(buffer.data());
+
+  std::set<std::pair<int, int>> seen;
+  bool ret = true;
+  std::string s = contents(out);
+  for (size_t pos = 0; pos < s.size(); ) {
+    size_t eol = s.find('\n', pos);
+    int t = -1, i = -1;
+    ret &= (std::sscanf(s.c_str() + pos, "writer %d line %d", &t, &i) == 2);
+    ret &= seen.insert(std::make_pair(t, i)).second;
+    pos = eol + 1;
+  }
+  ret &= (seen.size() == WRITERS * LINES);
+  ret &= (drainer.getStats().records == WRITERS * LINES);
+
+  std::fclose(out);
+  return ret;
+}
+
+int main() {
+  bool ret = true;
+
+  ret &= test_parse();
+  ret &= test_format();
+  ret &= test_stale_arguments();
+  ret &= test_background_drain();
+  ret &= test_mixed_records();
+
+  return !(ret == true);
+}